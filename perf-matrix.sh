@@ -0,0 +1,178 @@
+#!/bin/bash
+
+# Builds the library with combinations of options, in parallel, each
+# in its own directory under bin/perf, runs the fixed terminal workload
+# of bin/ptyload against each build, one at a time, and prints a table
+# of the results, compared against perf-baseline
+#
+# Usage: ./perf-matrix.sh [-a] [-u] [-j JOBS] [-r ROUNDS]
+#
+#   -a  Use every combination of options, as test-all-options.sh does,
+#       rather than only the options that change how input is handled
+#       and drawn, with the other editing options all on or all off
+#   -u  Write the results to perf-baseline rather than comparing
+#   -j  The number of builds to run at the same time, nproc by default
+#   -r  The number of times the workload is run for the latency
+#
+# The bytes written and the locked memory are the same from run to
+# run, so any increase is reported as a regression. The system calls
+# can vary by one or two with the strength meter, depending on when
+# it replies, so more than 1 % more is a regression. The latency is
+# noisy and depends on the machine, so the median is only a regression
+# if it is more than twice the baseline and 100 µs more, and the 95th
+# percentile, which is noisier still, is never one.
+# The exit status is 1 if a configuration regresses.
+
+all=0
+update=0
+jobs=$(nproc)
+rounds=5
+while getopts auj:r: opt; do
+    case $opt in
+	a) all=1;;
+	u) update=1;;
+	j) jobs="$OPTARG";;
+	r) rounds="$OPTARG";;
+	*) exit 2;;
+    esac
+done
+
+configurations=()
+editing="PASSPHRASE_REALLOC PASSPHRASE_INSERT PASSPHRASE_OVERRIDE PASSPHRASE_DELETE PASSPHRASE_CONTROL PASSPHRASE_DEDICATED DEFAULT_INSERT"
+for a in PASSPHRASE_ECHO PASSPHRASE_STAR PASSPHRASE_TEXT ""; do
+    for c in PASSPHRASE_MOVE ""; do
+	for j in PASSPHRASE_METER ""; do
+	    if [ $all = 0 ]; then
+		configurations+=("$a $c $j" "$a $c $editing $j")
+		continue
+	    fi
+	    for b in PASSPHRASE_REALLOC ""; do
+		for d in PASSPHRASE_INSERT ""; do
+		    for e in PASSPHRASE_OVERRIDE ""; do
+			for f in PASSPHRASE_DELETE ""; do
+			    for g in PASSPHRASE_CONTROL ""; do
+				for h in PASSPHRASE_DEDICATED ""; do
+				    for i in DEFAULT_INSERT ""; do
+					configurations+=("$a $b $c $d $e $f $g $h $i $j")
+				    done
+				done
+			    done
+			done
+		    done
+		done
+	    done
+	done
+    done
+done
+
+# The options of a configuration, sorted, so that they can be compared
+normalise () {
+    tr ' ' '\n' <<< "$*" | sed '/^$/d' | sort | tr '\n' ' ' | sed 's/ $//'
+}
+
+# The build directory of a configuration, the build is
+# reused if the sources have not changed since it was made
+builddir () {
+    echo "bin/perf/$(printf '%s' "$(normalise "$@")" | cksum | cut -d ' ' -f 1)"
+}
+
+build () {
+    local dir="$(builddir "$1")"
+    mkdir -p "$dir"
+    ln -sfn ../../../src "$dir/src"
+    ln -sf ../../../Makefile "$dir/Makefile"
+    make -s -C "$dir" bin/ptyload bin/meterstub OPTIONS="$1" > "$dir/build.log" 2>&1 ||
+	{ echo "$0: build failed: $1, see $dir/build.log" >&2; return 1; }
+}
+
+# The builds are run in parallel, but the workload is not,
+# so that the builds do not disturb the latency
+running=0
+failed=0
+for o in "${configurations[@]}"; do
+    if [ $running -ge $jobs ]; then
+	wait -n || failed=1
+	running=$(( running - 1 ))
+    fi
+    build "$o" &
+    running=$(( running + 1 ))
+done
+while [ $running -gt 0 ]; do
+    wait -n || failed=1
+    running=$(( running - 1 ))
+done
+[ $failed = 0 ] || exit 2
+
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+for o in "${configurations[@]}"; do
+    dir="$(builddir "$o")"
+    line=$(cd "$dir" && LIBPASSPHRASE_METER=bin/meterstub bin/ptyload -r "$rounds") ||
+	{ echo "$0: the workload failed: $o" >&2; exit 2; }
+    echo "$line $(normalise "$o")" >> "$results"
+done
+
+if [ $update = 1 ]; then
+    {
+	echo "# Results of ./perf-matrix.sh, updated with ./perf-matrix.sh -u"
+	echo "#"
+	echo "# LATENCY-MEDIAN  LATENCY-95%  SYSCALLS  BYTES  LOCKED  [OPTION]..."
+	cat "$results"
+    } > perf-baseline
+fi
+
+baseline=perf-baseline
+[ -f "$baseline" ] || baseline=/dev/null
+awk -v update=$update '
+    FILENAME == ARGV[1] {
+	if ($0 !~ /^#/ && NF >= 5) {
+	    key = ""
+	    for (i = 6; i <= NF; i++)
+		key = key " " $i
+	    base[key] = $0
+	}
+	next
+    }
+    function cell(value, old, regressed) {
+	if (old == "")
+	    return sprintf("%8s %-7s", value, "")
+	return sprintf("%8s %-7s", value, sprintf("%s%+d", regressed ? "!" : "", value - old))
+    }
+    FNR == 1 {
+	printf "%-16s %-16s %-16s %-16s %-16s %s\n", "median/us", "95%/us", "syscalls", "bytes", "locked/kB", "options"
+    }
+    {
+	key = ""
+	options = ""
+	for (i = 6; i <= NF; i++) {
+	    key = key " " $i
+	    options = options " " $i
+	}
+	known = key in base
+	split((update || !known) ? "" : base[key], old, " ")
+	bad = 0
+	line = ""
+	for (i = 1; i <= 5; i++) {
+	    if (i == 1)
+		regressed = (old[i] != "") && ($i > 2 * old[i]) && ($i > old[i] + 100)
+	    else if (i == 2)
+		regressed = 0
+	    else if (i == 3)
+		regressed = (old[i] != "") && ($i > old[i] * 1.01)
+	    else
+		regressed = (old[i] != "") && ($i > old[i])
+	    bad = bad || regressed
+	    line = line cell($i, old[i], regressed) " "
+	}
+	regressions += bad
+	printf "%s%s%s\n", line, options == "" ? "(none)" : substr(options, 2), \
+	    (update || known) ? "" : "  (not in baseline)"
+    }
+    END {
+	if (regressions) {
+	    printf "%i configurations regressed\n", regressions
+	    exit 1
+	}
+    }
+' "$baseline" "$results" | tee bin/perf/matrix
+exit ${PIPESTATUS[0]}
@@ -0,0 +1,296 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "passphrase.h"
+#include "agent.h"
+
+
+
+/**
+ * Connect to the passphrase agent, if one has been configured; the
+ * environment is ignored in set-user-ID and set-group-ID programs,
+ * as the invoking user could otherwise supply the passphrase
+ * 
+ * @return  The connected socket, -1 on error
+ */
+int passphrase_agent_connect__(void)
+{
+  const char* path = secure_getenv("LIBPASSPHRASE_AGENT");
+  if ((path == NULL) || !*path)
+    return errno = ENOENT, -1;
+  /* The agent is trusted like a meter daemon, by the same rules */
+  return passphrase_meter_connect__(path);
+}
+
+
+/**
+ * Wait for the reply from the passphrase agent
+ * 
+ * @param   fd        The socket
+ * @param   reply     Output parameter for the reply, `AGENT_REPLY_SIZE` bytes
+ * @param   deadline  See `passphrase_read4`
+ * @param   cancelfd  See `passphrase_read4`
+ * @return            The memfd that came with the reply, -1 if none came,
+ *                    -2 on error
+ */
+static int receive_reply(int fd, unsigned char* reply, const struct timespec* deadline, int cancelfd)
+{
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct pollfd fds[2];
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  struct iovec iov;
+  size_t have = 0;
+  ssize_t r;
+  int memfd = -1, timeout, extra;
+  
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = cancelfd;
+  fds[1].events = POLLIN;
+  
+  while (have < AGENT_REPLY_SIZE)
+    {
+      timeout = passphrase_meter_time_left__(deadline);
+      if (timeout == 0)
+	{
+	  errno = ETIMEDOUT;
+	  goto fail;
+	}
+      fds[1].revents = 0;
+      if (poll(fds, cancelfd >= 0 ? 2 : 1, timeout) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  goto fail;
+	}
+      if (fds[1].revents)
+	{
+	  errno = ECANCELED;
+	  goto fail;
+	}
+      if (!fds[0].revents)
+	continue;
+  
+      memset(&msg, 0, sizeof(msg));
+      iov.iov_base = reply + have;
+      iov.iov_len = AGENT_REPLY_SIZE - have;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+      if (r < 0)
+	{
+	  if ((errno == EINTR) || (errno == EAGAIN))
+	    continue;
+	  goto fail;
+	}
+      for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) &&
+	    (cmsg->cmsg_len == CMSG_LEN(sizeof(int))))
+	  {
+	    memcpy(&extra, CMSG_DATA(cmsg), sizeof(int));
+	    if (memfd >= 0)
+	      close(memfd);
+	    memfd = extra;
+	  }
+      if ((r == 0) || (msg.msg_flags & MSG_CTRUNC))
+	{
+	  /* The agent died, or sent more than was asked for */
+	  errno = r ? EBADMSG : EPIPE;
+	  goto fail;
+	}
+      have += (size_t)r;
+    }
+  
+  return memfd;
+ fail:
+  if (memfd >= 0)
+    close(memfd);
+  return -2;
+}
+
+
+/**
+ * Let the passphrase agent read a passphrase
+ * 
+ * @param   fd        The socket from `passphrase_agent_connect__`, it is closed
+ * @param   flags     Settings, see `passphrase_read2`
+ * @param   deadline  See `passphrase_read4`
+ * @param   cancelfd  See `passphrase_read4`
+ * @param   strength  Output parameter for the strength of the passphrase,
+ *                    `NULL` if not wanted; only set on success
+ * @return            The memfd with the passphrase, -1 on error
+ */
+int passphrase_agent_ask__(int fd, int flags, const struct timespec* deadline, int cancelfd,
+			   struct passphrase_strength* strength)
+{
+  unsigned char request[AGENT_REQUEST_SIZE];
+  unsigned char reply[AGENT_REPLY_SIZE];
+  const char* colour;
+  int memfd = -1, error, seals;
+  struct stat attr;
+  
+  if (strength)
+    flags |= PASSPHRASE_READ_STRENGTH;
+  memcpy(request, AGENT_MAGIC, 4);
+  request[4] = (unsigned char)((unsigned)flags >> 24);
+  request[5] = (unsigned char)((unsigned)flags >> 16);
+  request[6] = (unsigned char)((unsigned)flags >> 8);
+  request[7] = (unsigned char)((unsigned)flags);
+  if (send(fd, request, sizeof(request), MSG_NOSIGNAL) != (ssize_t)sizeof(request))
+    goto fail;
+  
+  /* Closing the socket is what tells the agent that we gave up */
+  memfd = receive_reply(fd, reply, deadline, cancelfd);
+  if (memfd == -2)
+    goto fail;
+  close(fd);
+  fd = -1;
+  
+  error = (int)passphrase_meter_get_be__(reply, 4);
+  if (error)
+    {
+      errno = error;
+      goto fail;
+    }
+  
+  /* Without the seals, the agent could change the passphrase under us */
+  seals = memfd < 0 ? -1 : fcntl(memfd, F_GET_SEALS);
+  if ((seals < 0) || ((seals & AGENT_SEALS) != AGENT_SEALS) ||
+      fstat(memfd, &attr) || (attr.st_size < 0) || (attr.st_size > AGENT_MAX_LENGTH))
+    {
+      errno = EBADMSG;
+      goto fail;
+    }
+  
+  if (strength)
+    {
+      strength->current = !!passphrase_meter_get_be__(reply + 4, 4);
+      strength->rating.tier = (int)(int32_t)(uint32_t)passphrase_meter_get_be__(reply + 8, 4);
+      strength->rating.score = passphrase_meter_get_be__(reply + 12, 8);
+      strength->rating.description = NULL;
+      if (passphrase_meter_tier_at__(strength->rating.tier, &colour, &(strength->rating.description)))
+	strength->rating.tier = -1;
+    }
+  return memfd;
+  
+ fail:
+  error = errno;
+  if (fd >= 0)
+    close(fd);
+  if (memfd >= 0)
+    close(memfd);
+  errno = error;
+  return -1;
+}
+
+
+/**
+ * Encode a reply to a client of the passphrase agent
+ * 
+ * @param  reply     Output parameter for the reply, `AGENT_REPLY_SIZE` bytes
+ * @param  error     The error number, zero on success
+ * @param  strength  The strength of the passphrase, ignored unless `error` is zero
+ */
+void passphrase_agent_reply__(unsigned char* reply, int error, const struct passphrase_strength* strength)
+{
+  unsigned long long int values[4];
+  size_t i, j, at = 0;
+  
+  values[0] = (uint32_t)error;
+  values[1] = error ? 0 : (uint32_t)!!(strength->current);
+  values[2] = (uint32_t)(error ? -1 : strength->rating.tier);
+  values[3] = error ? 0 : strength->rating.score;
+  for (i = 0; i < 4; i++)
+    for (j = (i == 3 ? 8 : 4); j--;)
+      reply[at++] = (unsigned char)(values[i] >> (8 * j));
+}
+
+
+/**
+ * Copy the passphrase out of a memfd from `passphrase_agent_ask__`
+ * 
+ * @param   memfd  The memfd, it is closed
+ * @param   len    Output parameter for the length of the passphrase
+ * @param   size   Output parameter for the size of the allocation
+ * @return         The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+char* passphrase_agent_take__(int memfd, size_t* len, size_t* size)
+{
+  struct stat attr;
+  char* rc = NULL;
+  size_t have = 0;
+  ssize_t r;
+  int saved_errno;
+  
+  if (fstat(memfd, &attr))
+    goto fail;
+  *size = (size_t)(attr.st_size) + 1;
+  rc = malloc(*size);
+  if (rc == NULL)
+    goto fail;
+  mlock(rc, *size);
+  
+  while (have + 1 < *size)
+    {
+      r = pread(memfd, rc + have, *size - 1 - have, (off_t)have);
+      if (r <= 0)
+	{
+	  if (r == 0)
+	    errno = EBADMSG;
+	  else if (errno == EINTR)
+	    continue;
+	  goto fail;
+	}
+      have += (size_t)r;
+    }
+  rc[have] = '\0';
+  /* NUL bytes are never part of a passphrase that has been read */
+  *len = strlen(rc);
+  close(memfd);
+  return rc;
+  
+ fail:
+  saved_errno = errno;
+  if (rc)
+    {
+      passphrase_wipe(rc, have);
+      free(rc);
+    }
+  close(memfd);
+  errno = saved_errno;
+  return NULL;
+}
+
@@ -0,0 +1,130 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef AGENT_H
+#define AGENT_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "passphrase.h"
+#include "meter.h"
+
+
+
+/* Functions shared between `passphrase_read4` and the passphrase
+ * agent, `passagentd`. They are not part of the public API. */
+
+
+
+/* Agent protocol
+ * 
+ * When `LIBPASSPHRASE_AGENT` is set to the pathname of the socket of
+ * a passphrase agent, passphrases are read by the agent rather than
+ * by each process. The client connects, and sends a request: the four
+ * bytes `AGENT_MAGIC` followed by the flags it would have read the
+ * passphrase with. The agent replies when the passphrase has been
+ * read, or reading has failed, with `AGENT_REPLY_SIZE` bytes: the
+ * error number, zero on success, four bytes; whether the strength is
+ * for the final passphrase, four bytes; the strength tier, four bytes;
+ * and the score, eight bytes. Integers are big-endian, and the tier
+ * is -1 if the passphrase was not rated.
+ * 
+ * On success, the reply carries a memfd, as `SCM_RIGHTS`, that holds
+ * the passphrase and nothing else. It is sealed so that it cannot be
+ * changed after the client has received it, and the passphrase never
+ * passes through the socket itself. The client closes the connection
+ * to give up, which the agent may take as a cancellation.
+ */
+
+#define AGENT_MAGIC  "PPA1"
+
+/**
+ * The size of a request
+ */
+#define AGENT_REQUEST_SIZE  8
+
+/**
+ * The size of a reply, excluding the memfd
+ */
+#define AGENT_REPLY_SIZE  20
+
+/**
+ * The longest passphrase that is accepted from an agent
+ */
+#define AGENT_MAX_LENGTH  (64 << 10)
+
+/**
+ * The seals the memfd must have
+ */
+#define AGENT_SEALS  (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+
+
+/**
+ * Connect to the passphrase agent, if one has been configured
+ * with `LIBPASSPHRASE_AGENT`, which is ignored in set-user-ID and
+ * set-group-ID programs. The agent must be run by root or by the
+ * real user, as it is trusted with passphrases.
+ * 
+ * @return  The connected socket, -1 on error; `errno` is set to
+ *          `ENOENT` if no agent has been configured
+ */
+METER_INTERNAL
+int passphrase_agent_connect__(void);
+
+/**
+ * Let the passphrase agent read a passphrase
+ * 
+ * @param   fd        The socket from `passphrase_agent_connect__`, it is closed
+ * @param   flags     Settings, see `passphrase_read2`
+ * @param   deadline  See `passphrase_read4`
+ * @param   cancelfd  See `passphrase_read4`
+ * @param   strength  Output parameter for the strength of the passphrase,
+ *                    `NULL` if not wanted; only set on success
+ * @return            The memfd with the passphrase, -1 on error
+ */
+METER_INTERNAL
+int passphrase_agent_ask__(int fd, int flags, const struct timespec* deadline, int cancelfd,
+			   struct passphrase_strength* strength);
+
+/**
+ * Encode a reply to a client of the passphrase agent
+ * 
+ * @param  reply     Output parameter for the reply, `AGENT_REPLY_SIZE` bytes
+ * @param  error     The error number, zero on success
+ * @param  strength  The strength of the passphrase, ignored unless `error` is zero
+ */
+METER_INTERNAL
+void passphrase_agent_reply__(unsigned char* reply, int error, const struct passphrase_strength* strength);
+
+/**
+ * Copy the passphrase out of a memfd from `passphrase_agent_ask__`
+ * 
+ * @param   memfd  The memfd, it is closed
+ * @param   len    Output parameter for the length of the passphrase
+ * @param   size   Output parameter for the size of the allocation
+ * @return         The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+METER_INTERNAL
+char* passphrase_agent_take__(int memfd, size_t* len, size_t* size);
+
+
+
+#endif
+
@@ -22,6 +22,7 @@
 #define PASSPHRASE_USE_DEPRECATED
 #include "passphrase.h"
 #include "passphrase_helper.h"
+#include "echoes.h"
 
 
 
@@ -40,6 +41,9 @@
  * The original TTY settings
  */
 static struct termios saved_stty;
+# define SAVED_STTY  (&saved_stty)
+#else /* NEED_TERMIOS */
+# define SAVED_STTY  NULL
 #endif /* NEED_TERMIOS */
 
 
@@ -76,37 +80,72 @@ void passphrase_reenable_echo(void)
 __attribute__((const))
 #endif /* __GNUC__ && !NEED_TERMIOS */
 void passphrase_disable_echo1(int fdin)
+{
+  passphrase_disable_echo2__(fdin, SAVED_STTY);
+}
+
+
+/**
+ * Undo the actions of `passphrase_disable_echo1`
+ * 
+ * @param  fdin  File descriptor for input
+ */
+#if defined(__GNUC__) && !defined(NEED_TERMIOS)
+__attribute__((const))
+#endif /* __GNUC__ && !NEED_TERMIOS */
+void passphrase_reenable_echo1(int fdin)
+{
+  passphrase_reenable_echo2__(fdin, SAVED_STTY);
+}
+
+
+/**
+ * Disable echoing and do anything else to the terminal
+ * settings `passphrase_read2` requires, and let the
+ * caller keep the original settings
+ * 
+ * @param  fdin   File descriptor for input
+ * @param  saved  Output parameter for the original settings
+ */
+#if defined(__GNUC__) && !defined(NEED_TERMIOS)
+__attribute__((const))
+#endif /* __GNUC__ && !NEED_TERMIOS */
+void passphrase_disable_echo2__(int fdin, struct termios* saved)
 {
 #if defined(NEED_TERMIOS)
   struct termios stty;
   
   tcgetattr(fdin, &stty);
-  saved_stty = stty;
+  *saved = stty;
   stty.c_lflag &= (tcflag_t)~ECHO;
-# if defined(PASSPHRASE_STAR) || defined(PASSPHRASE_TEXT) || defined(PASSPHRASE_MOVE) || defined(PASSPHRASE_METER)
+# if defined(PASSPHRASE_STAR) || defined(PASSPHRASE_TEXT) || defined(PASSPHRASE_MOVE) || \
+     defined(PASSPHRASE_METER) || defined(PASSPHRASE_TINY)
   stty.c_lflag &= (tcflag_t)~ICANON;
-# endif /* PASSPHRASE_STAR || PASSPHRASE_TEXT || PASSPHRASE_MOVE || PASSPHRASE_METER */
+# endif /* PASSPHRASE_STAR || PASSPHRASE_TEXT || PASSPHRASE_MOVE || PASSPHRASE_METER || PASSPHRASE_TINY */
   tcsetattr(fdin, TCSAFLUSH, &stty);
 #else /* NEED_TERMIOS */
   (void) fdin;
+  (void) saved;
 #endif /* NEED_TERMIOS */
 }
 
 
 /**
- * Undo the actions of `passphrase_disable_echo1`
+ * Undo the actions of `passphrase_disable_echo2__`
  * 
- * @param  fdin  File descriptor for input
+ * @param  fdin   File descriptor for input
+ * @param  saved  The original settings
  */
 #if defined(__GNUC__) && !defined(NEED_TERMIOS)
 __attribute__((const))
 #endif /* __GNUC__ && !NEED_TERMIOS */
-void passphrase_reenable_echo1(int fdin)
+void passphrase_reenable_echo2__(int fdin, const struct termios* saved)
 {
 #if defined(NEED_TERMIOS)
-  tcsetattr(fdin, TCSAFLUSH, &saved_stty);
+  tcsetattr(fdin, TCSAFLUSH, saved);
 #else /* NEED_TERMIOS */
   (void) fdin;
+  (void) saved;
 #endif /* NEED_TERMIOS */
 }
 
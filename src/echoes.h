@@ -0,0 +1,56 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ECHOES_H
+#define ECHOES_H
+
+#include <termios.h>
+
+#include "meter.h"
+
+
+
+/* Like `passphrase_disable_echo1` and `passphrase_reenable_echo1`,
+ * but the original settings are kept by the caller, so that several
+ * terminals can be used at the same time. They are not part of the
+ * public API. */
+
+
+/**
+ * Disable echoing and do anything else to the terminal settings
+ * `passphrase_read2` requires
+ * 
+ * @param  fdin   File descriptor for input
+ * @param  saved  Output parameter for the original settings
+ */
+METER_INTERNAL
+void passphrase_disable_echo2__(int fdin, struct termios* saved);
+
+/**
+ * Undo the actions of `passphrase_disable_echo2__`
+ * 
+ * @param  fdin   File descriptor for input
+ * @param  saved  The original settings
+ */
+METER_INTERNAL
+void passphrase_reenable_echo2__(int fdin, const struct termios* saved);
+
+
+
+#endif
+
@@ -0,0 +1,393 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+
+#include "keytrace.h"
+
+
+
+/*
+ * keyreplay — replay a keystroke timing trace against a program
+ * 
+ * Usage: keyreplay [-s SPEED] TRACE COMMAND [ARGUMENT]...
+ * 
+ * Runs COMMAND in a new pseudoterminal and types synthetic keys
+ * matching the classes and timings in TRACE, as recorded with
+ * `LIBPASSPHRASE_KEYTRACE`. SPEED multiplies the typing speed,
+ * 0 types as fast as possible. For each key, the latency until
+ * the program writes anything to the terminal is measured, and
+ * a summary is printed to stderr when the program exits.
+ */
+
+
+
+/**
+ * The longest time to wait for the program to react to a key, in microseconds,
+ * after the last key of the trace
+ */
+#ifndef MAX_LATENCY
+# define MAX_LATENCY  1000000LL
+#endif
+
+
+/**
+ * The bytes to type for each key class
+ */
+static const char* keyclass_bytes[] =
+  {
+#define X(CLASS, NAME, BYTES)  BYTES,
+    LIST_KEYCLASSES
+#undef X
+  };
+
+/**
+ * The name of each key class
+ */
+static const char* keyclass_names[] =
+  {
+#define X(CLASS, NAME, BYTES)  NAME,
+    LIST_KEYCLASSES
+#undef X
+  };
+
+
+/**
+ * `argv[0]` from `main`
+ */
+static const char* argv0;
+
+/**
+ * Measured latencies, in microseconds
+ */
+static long long int* latencies = NULL;
+static size_t latency_count = 0;
+
+/**
+ * The number of keys the program did not react to
+ */
+static size_t unanswered = 0;
+
+/**
+ * The number of typed keys per class
+ */
+static size_t class_count[KEYCLASS_COUNT];
+
+/**
+ * The number of bytes the program wrote to the terminal
+ */
+static unsigned long long int output_bytes = 0;
+
+
+
+/**
+ * Get the current time
+ * 
+ * @return  The current time, in microseconds
+ */
+static long long int now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long int)(ts.tv_sec) * 1000000LL + (long long int)(ts.tv_nsec / 1000L);
+}
+
+
+/**
+ * Compare two latencies, for `qsort`
+ * 
+ * @param   a  One of the latencies
+ * @param   b  The other latency
+ * @return     Negative if `a` is smaller, positive if `b` is smaller, zero otherwise
+ */
+static int cmp_latency(const void* a, const void* b)
+{
+  long long int x = *(const long long int*)a;
+  long long int y = *(const long long int*)b;
+  return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Read from the terminal until a deadline
+ * 
+ * @param   master    The master side of the terminal
+ * @param   until     The deadline, in microseconds
+ * @param   sent      When the last key was typed, -1 if it has
+ *                    already been answered
+ * @return            Zero on success, -1 if the program has closed the terminal
+ */
+static int drain(int master, long long int until, long long int* sent)
+{
+  char buf[4096];
+  struct pollfd pfd;
+  long long int t;
+  ssize_t n;
+  int r;
+  
+  pfd.fd = master;
+  pfd.events = POLLIN;
+  for (;;)
+    {
+      t = now();
+      if (t >= until)
+	return 0;
+      r = poll(&pfd, 1, (int)((until - t + 999) / 1000));
+      if (r < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      if (r == 0)
+	continue;
+      n = read(master, buf, sizeof(buf));
+      if (n <= 0)
+	{
+	  if ((n < 0) && (errno == EINTR))
+	    continue;
+	  return -1;
+	}
+      output_bytes += (unsigned long long int)n;
+      if (*sent >= 0)
+	{
+	  latencies[latency_count++] = now() - *sent;
+	  *sent = -1;
+	}
+    }
+}
+
+
+/**
+ * Read a LEB128 encoded integer
+ * 
+ * @param   f    The trace file
+ * @param   out  Output parameter for the integer
+ * @return       Zero on success, -1 on error
+ */
+static int read_leb128(FILE* f, unsigned long long int* out)
+{
+  int c, shift = 0;
+  *out = 0;
+  do
+    {
+      c = getc(f);
+      if ((c == EOF) || (shift > 63))
+	return -1;
+      *out |= (unsigned long long int)(c & 0x7F) << shift;
+      shift += 7;
+    }
+  while (c & 0x80);
+  return 0;
+}
+
+
+/**
+ * Print the summary of the replay
+ */
+static void summarise(void)
+{
+  size_t i;
+  if (latency_count)
+    qsort(latencies, latency_count, sizeof(*latencies), cmp_latency);
+  fprintf(stderr, "keys:");
+  for (i = 0; i < KEYCLASS_COUNT; i++)
+    if (class_count[i])
+      fprintf(stderr, " %s=%zu", keyclass_names[i], class_count[i]);
+  fprintf(stderr, "\noutput bytes: %llu\n", output_bytes);
+  fprintf(stderr, "unanswered keys: %zu\n", unanswered);
+  if (latency_count == 0)
+    return;
+  fprintf(stderr, "latency (us): min %lli, median %lli, p90 %lli, p99 %lli, max %lli\n",
+	  latencies[0],
+	  latencies[latency_count / 2],
+	  latencies[latency_count * 9 / 10],
+	  latencies[latency_count * 99 / 100],
+	  latencies[latency_count - 1]);
+}
+
+
+/**
+ * Start the program in a new pseudoterminal
+ * 
+ * @param   argv  The command line of the program
+ * @param   pid   Output parameter for the process ID of the program
+ * @return        The master side of the terminal, -1 on error
+ */
+static int spawn(char** argv, pid_t* pid)
+{
+  struct winsize ws = { .ws_row = 24, .ws_col = 80, .ws_xpixel = 0, .ws_ypixel = 0 };
+  int master, slave;
+  const char* name;
+  
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if ((master == -1) || grantpt(master) || unlockpt(master) || !(name = ptsname(master)))
+    return -1;
+  ioctl(master, TIOCSWINSZ, &ws);
+  
+  *pid = fork();
+  if (*pid == -1)
+    return -1;
+  if (*pid)
+    return master;
+  
+  setsid();
+  slave = open(name, O_RDWR);
+  if (slave == -1)
+    _exit(127);
+  ioctl(slave, TIOCSCTTY, 0);
+  dup2(slave, STDIN_FILENO);
+  dup2(slave, STDOUT_FILENO);
+  dup2(slave, STDERR_FILENO);
+  if (slave > STDERR_FILENO)
+    close(slave);
+  execvp(*argv, argv);
+  perror(argv0);
+  _exit(127);
+}
+
+
+/**
+ * Print usage information and exit
+ */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+static void usage(void)
+{
+  fprintf(stderr, "usage: %s [-s SPEED] TRACE COMMAND [ARGUMENT]...\n", argv0);
+  exit(2);
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        The exit status of the program, 1 or 2 on error
+ */
+int main(int argc, char** argv)
+{
+  char magic[sizeof(KEYTRACE_MAGIC) - 1];
+  unsigned long long int delay;
+  long long int when, sent = -1;
+  double speed = 1;
+  size_t capacity = 0;
+  const char* bytes;
+  void* new;
+  FILE* f;
+  pid_t pid;
+  int master, c, opt, status, corrupt = 0;
+  
+  argv0 = argc ? *argv : "keyreplay";
+  while ((opt = getopt(argc, argv, "+s:")) != -1)
+    if (opt == 's')
+      speed = atof(optarg);
+    else
+      usage();
+  if ((optind + 2 > argc) || (speed < 0))
+    usage();
+  
+  f = fopen(argv[optind], "rb");
+  if (f == NULL)
+    goto fail;
+  master = spawn(argv + optind + 1, &pid);
+  if (master == -1)
+    goto fail;
+  
+  /* Let the program start and print its prompt */
+  when = now();
+  if (drain(master, when + 200000LL, &sent))
+    goto done;
+  
+  while ((c = getc(f)) != EOF)
+    {
+      if (c == *KEYTRACE_MAGIC)
+	{
+	  if ((fread(magic + 1, 1, sizeof(magic) - 1, f) != sizeof(magic) - 1) ||
+	      memcmp(magic + 1, KEYTRACE_MAGIC + 1, sizeof(magic) - 1) ||
+	      (getc(f) != KEYTRACE_VERSION))
+	    goto corrupt;
+	  continue;
+	}
+      if ((c >= KEYCLASS_COUNT) || read_leb128(f, &delay))
+	goto corrupt;
+  
+      /* Wait, while measuring the latency of the previous key */
+      when += speed > 0 ? (long long int)((double)delay / speed) : 0;
+      if (drain(master, when, &sent))
+	goto done;
+      if (sent >= 0)
+	unanswered++, sent = -1;
+  
+      bytes = keyclass_bytes[c];
+      class_count[c]++;
+      if (!*bytes)
+	continue;
+      if (latency_count == capacity)
+	{
+	  capacity = capacity ? capacity << 1 : 64;
+	  new = realloc(latencies, capacity * sizeof(*latencies));
+	  if (new == NULL)
+	    goto fail;
+	  latencies = new;
+	}
+      if (write(master, bytes, strlen(bytes)) < 0)
+	goto done;
+      sent = now();
+      if (when < sent)
+	when = sent;
+    }
+  
+  drain(master, now() + MAX_LATENCY, &sent);
+  if (sent >= 0)
+    unanswered++;
+  
+ done:
+  close(master);
+  fclose(f);
+  while ((waitpid(pid, &status, 0) == -1) && (errno == EINTR));
+  if (corrupt)
+    {
+      fprintf(stderr, "%s: %s: invalid trace\n", argv0, argv[optind]);
+      free(latencies);
+      return 1;
+    }
+  summarise();
+  free(latencies);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+  
+ corrupt:
+  corrupt = 1;
+  goto done;
+ fail:
+  perror(argv0);
+  return 1;
+}
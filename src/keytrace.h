@@ -0,0 +1,82 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KEYTRACE_H
+#define KEYTRACE_H
+
+
+
+/* Keystroke timing traces
+ * 
+ * A trace file is a sequence of sessions, one per prompt. Each
+ * session starts with the four bytes `KEYTRACE_MAGIC` followed by
+ * the byte `KEYTRACE_VERSION`, and is followed by one record per
+ * keystroke. A record is one byte with the key class, and the
+ * number of microseconds since the previous record, or since the
+ * start of the prompt for the first record, as an unsigned LEB128
+ * integer. The content of the passphrase is never recorded. */
+
+
+/**
+ * The first bytes of each session in a trace
+ */
+#define KEYTRACE_MAGIC  "PPKT"
+
+/**
+ * The version of the trace format
+ */
+#define KEYTRACE_VERSION  1
+
+/**
+ * Printable keys arriving within this many microseconds
+ * of the previous key are recorded as a paste
+ */
+#ifndef KEYTRACE_PASTE_THRESHOLD
+# define KEYTRACE_PASTE_THRESHOLD  1000
+#endif
+
+
+/**
+ * Key classes
+ */
+#define LIST_KEYCLASSES						\
+  X(KEYCLASS_PRINTABLE, "printable", "a")			\
+  X(KEYCLASS_PASTE,     "paste",     "a")			\
+  X(KEYCLASS_ERASE,     "erase",     "\177")			\
+  X(KEYCLASS_DELETE,    "delete",    "\033[3~")			\
+  X(KEYCLASS_LEFT,      "left",      "\033[D")			\
+  X(KEYCLASS_RIGHT,     "right",     "\033[C")			\
+  X(KEYCLASS_HOME,      "home",      "\033OH")			\
+  X(KEYCLASS_END,       "end",       "\033OF")			\
+  X(KEYCLASS_INSERT,    "insert",    "\033[2~")			\
+  X(KEYCLASS_OTHER,     "other",     "\007")			\
+  X(KEYCLASS_ENTER,     "enter",     "\r")			\
+  X(KEYCLASS_EOF,       "eof",       "")
+
+enum keyclass
+  {
+#define X(CLASS, NAME, BYTES)  CLASS,
+    LIST_KEYCLASSES
+#undef X
+    KEYCLASS_COUNT
+  };
+
+
+
+#endif
+
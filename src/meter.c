@@ -0,0 +1,560 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PASSPHRASE_USE_DEPRECATED
+#include "passphrase.h"
+#include "passphrase_helper.h"
+#include "meter.h"
+
+
+
+/* The minimal build has no strength meter, only the estimate */
+#ifndef PASSPHRASE_TINY
+
+/**
+ * States for `passphrase_meter_parse__`
+ */
+#define REPLY_START   0
+#define REPLY_DIGITS  1
+#define REPLY_JUNK    2
+#define REPLY_SKIP    3
+#define REPLY_ESCAPE  4
+
+
+
+/**
+ * Get the strength meter command to use
+ * 
+ * @return  The value of `LIBPASSPHRASE_METER`, or the default meter
+ */
+const char* passphrase_meter_command__(void)
+{
+  const char* command = getenv("LIBPASSPHRASE_METER");
+  if (!command || !*command)
+    command = DEFAULT_PASSPHRASE_METER;
+  return command;
+}
+
+
+/**
+ * Start a strength meter process, `command -r`; the real user and
+ * group IDs are used, and the meter has no standard error
+ * 
+ * @param   command  The command to start
+ * @param   fds      Output parameter for the file descriptor to read
+ *                   from, and the file descriptor to write to
+ * @return           The process ID of the meter, -1 on error
+ */
+pid_t passphrase_meter_spawn__(const char* command, int fds[2])
+{
+  int pipe_rw[2] = { -1, -1 };
+  int exec_rw[2] = { -1, -1 };
+  pid_t pid;
+  ssize_t n;
+  int i = 0, status, saved_errno;
+  
+  /* The pipes are close-on-exec so that other meters
+     started by the process do not inherit them. */
+  fds[0] = fds[1] = -1;
+  if (pipe2(fds, O_CLOEXEC) || pipe2(pipe_rw, O_CLOEXEC) || pipe2(exec_rw, O_CLOEXEC))
+    goto fail;
+  /* ‘Their integer values shall be the two lowest available at the time of the pipe() call’ [man 3p pipe]
+   * This guarantees (unless the application is doing something stupid) that the file desriptors
+   * in exec_rw[1] is not stdin, stdout, stderr, or 0 (required by FD_CLOEXEC to take affect), assuming
+   * stdin, stdout, and stderr are 0, 1, and 2, respectively, as specified in `man 3p stdin`. */
+  
+  pid = fork();
+  if (pid == -1)
+    goto fail;
+  
+  close(exec_rw[!!pid]), exec_rw[!!pid] = -1;
+  close(fds[!!pid]), fds[!!pid] = -1;
+  close(pipe_rw[!pid]), pipe_rw[!pid] = -1;
+  fds[!!pid] = pipe_rw[!!pid], pipe_rw[!!pid] = -1;
+  
+  if (pid == 0)
+    {
+      gid_t gid = getgid(), egid = getegid();
+      uid_t uid = getuid(), euid = geteuid();
+      int fd;
+      
+      if ((fds[0] != STDIN_FILENO) && (fds[1] == STDIN_FILENO))
+	{
+	  fd = dup(fds[1]);
+	  if (fd == -1)
+	    goto child_fail;
+	  fds[1] = fd;
+	}
+      for (i = 0; i <= 1; i++)
+	if (fds[i] == i)
+	  {
+	    if (fcntl(i, F_SETFD, 0) == -1)
+	      goto child_fail;
+	  }
+	else
+	  {
+	    close(i);
+	    fd = dup2(fds[i], i);
+	    if (fd == -1)
+	      goto child_fail;
+	    close(fds[i]);
+	    fds[i] = fd;
+	  }
+      
+      close(STDERR_FILENO);
+      
+      if (egid != gid)
+	if (setregid(gid, gid) && gid)
+	  goto child_fail;
+      if (euid != uid)
+	if (setreuid(uid, uid) && uid)
+	  goto child_fail;
+      
+      execlp(command, command, "-r", NULL);
+    child_fail:
+      i = errno;
+      n = write(exec_rw[1], &i, sizeof(i));
+      _exit(!!n);
+    }
+  
+ rewait:
+  n = read(exec_rw[0], &i, sizeof(i));
+  if ((n < 0) && (errno == EINTR))
+    goto rewait;
+  if (n)
+    {
+    rereap:
+      if ((waitpid(pid, &status, 0) == -1) && (errno == EINTR))
+	goto rereap;
+      errno = n == (ssize_t)sizeof(i) ? i : ENOEXEC;
+      goto fail;
+    }
+  
+  close(exec_rw[0]);
+  return pid;
+  
+ fail:
+  saved_errno = errno;
+  if (fds[0] >= 0)  close(fds[0]);
+  if (fds[1] >= 0)  close(fds[1]);
+  if (pipe_rw[0] >= 0)  close(pipe_rw[0]);
+  if (pipe_rw[1] >= 0)  close(pipe_rw[1]);
+  if (exec_rw[0] >= 0)  close(exec_rw[0]);
+  if (exec_rw[1] >= 0)  close(exec_rw[1]);
+  fds[0] = fds[1] = -1;
+  errno = saved_errno;
+  return -1;
+}
+
+
+/**
+ * Connect to a strength meter daemon, such as `passcheckd`. The
+ * daemon must be run by root or by the real user, as passphrases
+ * are sent to it.
+ * 
+ * @param   path  The pathname of the daemon's socket
+ * @return        The connected socket, -1 on error
+ */
+int passphrase_meter_connect__(const char* path)
+{
+  struct sockaddr_un addr;
+  struct ucred cred;
+  socklen_t credlen = sizeof(cred);
+  int fd, saved_errno;
+  
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return errno = ENAMETOOLONG, -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  
+  fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (connect(fd, (const struct sockaddr*)&addr, (socklen_t)sizeof(addr)))
+    goto fail;
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen))
+    goto fail;
+  if (cred.uid && (cred.uid != getuid()))
+    {
+      errno = EACCES;
+      goto fail;
+    }
+  
+  return fd;
+ fail:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
+
+/**
+ * Parse a part of the output of a strength meter. A reply is a line
+ * starting with the score, which may be preceded by one escape
+ * sequence, anything after the score is ignored.
+ * 
+ * @param   reply  The parser state, `reply->state` shall be zero for new parsers
+ * @param   buf    The output
+ * @param   n      The number of bytes in `buf`
+ * @return         The number of bytes consumed if a reply was completed,
+ *                 `reply->value` is set to the score, zero otherwise,
+ *                 in which case all of `buf` was consumed
+ */
+size_t passphrase_meter_parse__(struct meter_reply* reply, const char* buf, size_t n)
+{
+  unsigned long long int digit;
+  size_t i;
+  char c;
+  
+  for (i = 0; i < n;)
+    {
+      c = buf[i++];
+      if (c == '\n')
+	{
+	  if (reply->state == REPLY_START)
+	    reply->value = 0;
+	  reply->state = REPLY_START;
+	  return i;
+	}
+      switch (reply->state)
+	{
+	case REPLY_START:
+	  reply->value = 0;
+	  reply->state = REPLY_DIGITS;
+	  /* The score may be coloured */
+	  if (c == '\033')
+	    {
+	      reply->state = REPLY_ESCAPE;
+	      break;
+	    }
+	  /* fall through */
+	case REPLY_DIGITS:
+	  if (('0' <= c) && (c <= '9'))
+	    {
+	      digit = (unsigned long long int)(c - '0');
+	      if (reply->value > (ULLONG_MAX - digit) / 10)
+		reply->value = ULLONG_MAX;
+	      else
+		reply->value = reply->value * 10 + digit;
+	      break;
+	    }
+	  reply->state = REPLY_JUNK;
+	  /* fall through */
+	case REPLY_JUNK:
+	  if (c && strchr(" \t\r\f\v", c))
+	    reply->state = REPLY_SKIP;
+	  break;
+	case REPLY_ESCAPE:
+	  if (('@' <= c) && (c <= '~') && (c != '['))
+	    reply->state = REPLY_DIGITS;
+	  break;
+	default:
+	  break;
+	}
+    }
+  return 0;
+}
+
+
+/**
+ * Parse a part of the reply to `METER_BINARY_HELLO`
+ * 
+ * @param   reply     The parser state, `reply->have` shall be zero for new parsers
+ * @param   buf       The output of the meter
+ * @param   n         The number of bytes in `buf`
+ * @param   consumed  Output parameter for the number of bytes consumed
+ * @return            1 if the meter uses binary framing, 0 if it uses
+ *                    text, -1 if the reply is not complete, in which
+ *                    case all of `buf` was consumed
+ */
+int passphrase_meter_parse_hello__(struct meter_reply* reply, const char* buf, size_t n, size_t* consumed)
+{
+  const char* nl = memchr(buf, '\n', n);
+  size_t len = nl ? (size_t)(nl - buf) + 1 : n;
+  size_t copy = len < sizeof(reply->frame) - reply->have ? len : sizeof(reply->frame) - reply->have;
+  int binary;
+  
+  /* The text meter may echo the hello, but it is no secret, and
+     anything longer than the acknowledgement is not it anyway */
+  memcpy(reply->frame + reply->have, buf, copy);
+  reply->have += copy;
+  *consumed = len;
+  if (nl == NULL)
+    return -1;
+  binary = (reply->have == sizeof(METER_BINARY_ACK) - 1) &&
+           !memcmp(reply->frame, METER_BINARY_ACK, sizeof(METER_BINARY_ACK) - 1);
+  reply->have = 0;
+  return binary;
+}
+
+
+/**
+ * Parse a part of a sequence of binary frames; control
+ * characters in the hint are replaced with spaces
+ * 
+ * @param   reply  The parser state, `reply->have` shall be zero for new parsers
+ * @param   buf    The output
+ * @param   n      The number of bytes in `buf`
+ * @param   type   The expected frame type
+ * @param   max    The longest payload that is accepted
+ * @return         The number of bytes consumed if a frame was completed,
+ *                 zero otherwise, in which case all of `buf` was consumed,
+ *                 or `reply->state` is `METER_PROTOCOL_ERROR` if the frame
+ *                 is malformed. For replies the fields in `reply` are set,
+ *                 for other frames the payload is not kept, but the ID is.
+ */
+size_t passphrase_meter_parse_frame__(struct meter_reply* reply, const char* buf, size_t n, int type, size_t max)
+{
+  const unsigned char* frame = reply->frame;
+  size_t i = 0, len, keep, hint, copy;
+  int flags;
+  
+  if (reply->state == METER_PROTOCOL_ERROR)
+    return 0;
+  
+  if (reply->have < METER_FRAME_HEADER)
+    {
+      copy = n < METER_FRAME_HEADER - reply->have ? n : METER_FRAME_HEADER - reply->have;
+      memcpy(reply->frame + reply->have, buf, copy);
+      reply->have += copy;
+      i += copy;
+      if (reply->have < METER_FRAME_HEADER)
+	return 0;
+      if ((frame[0] != type) || frame[2] || frame[3] || (passphrase_meter_get_be__(frame + 8, 4) > max))
+	{
+	  reply->state = METER_PROTOCOL_ERROR;
+	  return 0;
+	}
+    }
+  
+  /* The start of a reply's payload is kept in `reply->frame`, the rest
+     of the payload is skipped, and `reply->state` counts skipped bytes */
+  len = (size_t)passphrase_meter_get_be__(frame + 8, 4);
+  keep = type != METER_FRAME_REPLY ? 0 : len < METER_REPLY_MAX - METER_FRAME_HEADER ? len : METER_REPLY_MAX - METER_FRAME_HEADER;
+  copy = n - i < METER_FRAME_HEADER + keep - reply->have ? n - i : METER_FRAME_HEADER + keep - reply->have;
+  memcpy(reply->frame + reply->have, buf + i, copy);
+  reply->have += copy;
+  i += copy;
+  copy = n - i < len - keep - (size_t)(reply->state) ? n - i : len - keep - (size_t)(reply->state);
+  reply->state += (int)copy;
+  i += copy;
+  if ((reply->have < METER_FRAME_HEADER + keep) || ((size_t)(reply->state) < len - keep))
+    return 0;
+  
+  reply->id = (uint32_t)passphrase_meter_get_be__(frame + 4, 4);
+  reply->have = 0;
+  reply->state = 0;
+  if (type != METER_FRAME_REPLY)
+    return i;
+  
+  flags = frame[1];
+  if ((keep < 8) || ((flags & METER_FLAG_TIER) && (keep < 9)))
+    {
+      reply->state = METER_PROTOCOL_ERROR;
+      return 0;
+    }
+  /* Without a tier, the kept payload has room for one byte too many */
+  hint = (flags & METER_FLAG_HINT) ? keep - 8 - !!(flags & METER_FLAG_TIER) : 0;
+  hint = hint < METER_HINT_MAX ? hint : METER_HINT_MAX;
+  reply->value = passphrase_meter_get_be__(frame + METER_FRAME_HEADER, 8);
+  reply->tier = (flags & METER_FLAG_TIER) ? frame[METER_FRAME_HEADER + 8] : -1;
+  memcpy(reply->hint, frame + METER_FRAME_HEADER + 8 + !!(flags & METER_FLAG_TIER), hint);
+  reply->hint[hint] = '\0';
+  for (copy = 0; copy < hint; copy++)
+    if (((unsigned char)(reply->hint[copy]) < ' ') || (reply->hint[copy] == '\177'))
+      reply->hint[copy] = ' ';
+  return i;
+}
+
+
+/**
+ * Encode a frame header
+ * 
+ * @param  buf    Output buffer, `METER_FRAME_HEADER` bytes
+ * @param  type   The frame type
+ * @param  flags  The frame's flags
+ * @param  id     The request ID
+ * @param  len    The length of the payload
+ */
+void passphrase_meter_frame__(unsigned char* buf, int type, int flags, uint32_t id, size_t len)
+{
+  int i;
+  buf[0] = (unsigned char)type;
+  buf[1] = (unsigned char)flags;
+  buf[2] = buf[3] = 0;
+  for (i = 0; i < 4; i++)
+    {
+      buf[4 + i] = (unsigned char)(id >> (24 - 8 * i));
+      buf[8 + i] = (unsigned char)(len >> (24 - 8 * i));
+    }
+}
+#endif /* !PASSPHRASE_TINY */
+
+
+/**
+ * Look up a tier in `LIST_PASSPHRASE_STRENGTH_LIMITS` by its index
+ * 
+ * @param   tier    The index of the tier
+ * @param   colour  Output parameter for the colour of the tier
+ * @param   desc    Output parameter for the description of the tier
+ * @return          Zero on success, -1 if there is no such tier
+ */
+int passphrase_meter_tier_at__(int tier, const char** colour, const char** desc)
+{
+  int i = 0;
+  
+  if (0);
+#define X(COND, COLOUR, DESC)  else if (i++ == tier)  return *colour = COLOUR, *desc = DESC, 0;
+  LIST_PASSPHRASE_STRENGTH_LIMITS(0)
+#undef X
+  
+  return -1;
+}
+
+
+/**
+ * Look up a score in `LIST_PASSPHRASE_STRENGTH_LIMITS`
+ * 
+ * @param   value   The score
+ * @param   colour  Output parameter for the colour of the tier, may be `NULL`
+ * @param   desc    Output parameter for the description of the tier, may be `NULL`
+ * @return          The index of the tier in the table
+ */
+int passphrase_meter_tier__(unsigned long long int value, const char** colour, const char** desc)
+{
+  const char* colour_ = NULL;
+  const char* desc_ = NULL;
+  int tier = 0;
+  
+  if (0);
+#define X(COND, COLOUR, DESC)  else if (tier++, (COND))  colour_ = COLOUR, desc_ = DESC;
+  LIST_PASSPHRASE_STRENGTH_LIMITS(value)
+#undef X
+  
+  if (colour)  *colour = colour_;
+  if (desc)    *desc = desc_;
+  return tier - 1;
+}
+
+
+
+/**
+ * Estimate the strength of a passphrase without a strength meter,
+ * from the size of the alphabet it is drawn from; characters that
+ * repeat or continue a sequence from the previous character add
+ * almost nothing. The estimate is crude, and only displayed until
+ * the meter has answered.
+ * 
+ * @param   passphrase  The passphrase
+ * @param   len         The length of the passphrase
+ * @return              The estimated score, on the same
+ *                      scale as the score from the meter
+ */
+unsigned long long int passphrase_meter_estimate__(const char* passphrase, size_t len)
+{
+  unsigned long long int bits = 0;
+  unsigned int pool = 0, per, k;
+  int classes = 0, prev = -1, c;
+  size_t i;
+  
+  for (i = 0; i < len; i++)
+    {
+      c = (unsigned char)(passphrase[i]);
+      if      (('a' <= c) && (c <= 'z'))  classes |= 1;
+      else if (('A' <= c) && (c <= 'Z'))  classes |= 2;
+      else if (('0' <= c) && (c <= '9'))  classes |= 4;
+      else if (c < 0x80)                  classes |= 8;
+      else                                classes |= 16;
+    }
+  if (classes & 1)   pool += 26;
+  if (classes & 2)   pool += 26;
+  if (classes & 4)   pool += 10;
+  if (classes & 8)   pool += 33;
+  if (classes & 16)  pool += 100;
+  
+  /* log2(pool), in sixteenths of a bit, interpolated linearly */
+  for (k = 0; (2U << k) <= pool; k++);
+  per = pool ? 16 * k + 16 * (pool - (1U << k)) / (1U << k) : 0;
+  
+  for (i = 0; i < len; i++)
+    {
+      c = (unsigned char)(passphrase[i]);
+      if ((c & 0xC0) == 0x80)
+	continue;
+      bits += ((c == prev) || (c == prev + 1) || (c == prev - 1)) ? 16 : per;
+      prev = c;
+    }
+  
+  /* The meter's scores are about four times the number of bits, and
+     0 is reserved for passphrases that are known to be common */
+  return (len && (bits < 4)) ? 1 : bits / 4;
+}
+
+
+
+/**
+ * Read a big-endian integer, as in frames and agent replies
+ * 
+ * @param   buf  The integer
+ * @param   n    The size of the integer
+ * @return       The integer
+ */
+unsigned long long int passphrase_meter_get_be__(const unsigned char* buf, size_t n)
+{
+  unsigned long long int value = 0;
+  while (n--)
+    value = (value << 8) | *buf++;
+  return value;
+}
+
+
+/**
+ * Get the time left until a deadline
+ * 
+ * @param   deadline  The deadline, on `CLOCK_MONOTONIC`, `NULL` for none
+ * @return            The time left, in milliseconds, rounded up, for
+ *                    `poll`, -1 if there is no deadline, 0 if it has passed
+ */
+int passphrase_meter_time_left__(const struct timespec* deadline)
+{
+  struct timespec now;
+  long long int timeout;
+  
+  if (deadline == NULL)
+    return -1;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timeout  = (long long int)(deadline->tv_sec - now.tv_sec) * 1000LL;
+  timeout += (long long int)(deadline->tv_nsec - now.tv_nsec + 999999L) / 1000000LL;
+  if (timeout <= 0)
+    return 0;
+  return timeout > INT_MAX ? INT_MAX : (int)timeout;
+}
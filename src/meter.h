@@ -0,0 +1,298 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef METER_H
+#define METER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+
+
+/* Functions shared between the interactive strength meter,
+ * `passphrase_score_batch`, and the passphrase agent client.
+ * They are not part of the public API. */
+
+#if defined(__GNUC__)
+# define METER_INTERNAL  __attribute__((visibility("hidden")))
+#else
+# define METER_INTERNAL  /* ignore */
+#endif
+
+
+#ifndef DEFAULT_PASSPHRASE_METER
+# define DEFAULT_PASSPHRASE_METER  "passcheck"
+#endif
+#ifndef PASSPHRASE_METER_SOCKET_PREFIX
+# define PASSPHRASE_METER_SOCKET_PREFIX  "unix:"
+#endif
+
+
+
+/* Binary framing
+ * 
+ * A text meter reads one passphrase per line, and replies to each
+ * with a line starting with its score. To use binary framing instead,
+ * the line `METER_BINARY_HELLO` is sent before the first passphrase.
+ * A text meter rates it like any other passphrase, so text is used.
+ * A meter that supports binary framing replies with the line
+ * `METER_BINARY_ACK`, and after that all messages in both directions
+ * are frames: a `METER_FRAME_HEADER` byte header followed by a payload.
+ * 
+ * The header is the frame type, one byte; flags, one byte; two zero
+ * bytes; the request ID, four bytes; and the length of the payload,
+ * four bytes. Integers are big-endian. The payload of a query,
+ * `METER_FRAME_QUERY`, is the passphrase. A reply, `METER_FRAME_REPLY`,
+ * has the same request ID as its query, and its payload is the score,
+ * eight bytes, followed by the tier, one byte, if `METER_FLAG_TIER`
+ * is set, followed by a hint, the rest of the payload, if
+ * `METER_FLAG_HINT` is set. The tier is an index in
+ * `LIST_PASSPHRASE_STRENGTH_LIMITS`, and the hint is a short text
+ * that is displayed after the strength. Queries may be sent before
+ * earlier queries have been answered, and replies to queries older
+ * than the last displayed reply are discarded. */
+
+#define METER_BINARY_HELLO  "\033libpassphrase binary 1\n"
+#define METER_BINARY_ACK    "binary 1\n"
+
+#define METER_FRAME_HEADER  12
+#define METER_FRAME_QUERY   1
+#define METER_FRAME_REPLY   2
+#define METER_FLAG_TIER     1
+#define METER_FLAG_HINT     2
+
+/**
+ * The longest hint that is displayed, longer hints are truncated
+ */
+#ifndef METER_HINT_MAX
+# define METER_HINT_MAX  80
+#endif
+
+/**
+ * The largest reply frame
+ */
+#define METER_REPLY_MAX  (METER_FRAME_HEADER + 8 + 1 + METER_HINT_MAX)
+
+/**
+ * The longest reply payload that is accepted, hints are
+ * truncated to `METER_HINT_MAX` bytes, but may be longer
+ */
+#define METER_MAX_PAYLOAD  4096
+
+/**
+ * The protocols a strength meter can use; it is not
+ * known which until it has replied to `METER_BINARY_HELLO`
+ */
+#define METER_MODE_HELLO   0
+#define METER_MODE_TEXT    1
+#define METER_MODE_BINARY  2
+
+/**
+ * `reply->state` after a malformed frame
+ */
+#define METER_PROTOCOL_ERROR  (-1)
+
+
+/**
+ * Parser state for a reply from a strength meter
+ */
+struct meter_reply
+{
+  /**
+   * The score, valid when a reply is complete
+   */
+  unsigned long long int value;
+  
+  /**
+   * Internal parser state, zero when waiting for a new reply
+   */
+  int state;
+  
+  /**
+   * For binary replies: the request ID, the tier, -1 if the meter
+   * did not send one, and the hint, NUL-terminated, empty if the
+   * meter did not send one, valid when a reply is complete
+   */
+  uint32_t id;
+  int tier;
+  char hint[METER_HINT_MAX + 1];
+  
+  /**
+   * For binary replies: the part of the current
+   * frame, or of the reply to `METER_BINARY_HELLO`,
+   * that has been read, and its length
+   */
+  unsigned char frame[METER_REPLY_MAX];
+  size_t have;
+};
+
+
+
+/**
+ * Get the strength meter command to use
+ * 
+ * @return  The value of `LIBPASSPHRASE_METER`, or the default meter
+ */
+METER_INTERNAL
+const char* passphrase_meter_command__(void);
+
+/**
+ * Start a strength meter process, `command -r`; the real user and
+ * group IDs are used, and the meter has no standard error
+ * 
+ * @param   command  The command to start
+ * @param   fds      Output parameter for the file descriptor to read
+ *                   from, and the file descriptor to write to
+ * @return           The process ID of the meter, -1 on error
+ */
+METER_INTERNAL
+pid_t passphrase_meter_spawn__(const char* command, int fds[2]);
+
+/**
+ * Connect to a strength meter daemon, such as `passcheckd`. The
+ * daemon must be run by root or by the real user, as passphrases
+ * are sent to it.
+ * 
+ * @param   path  The pathname of the daemon's socket
+ * @return        The connected socket, -1 on error
+ */
+METER_INTERNAL
+int passphrase_meter_connect__(const char* path);
+
+/**
+ * Parse a part of the output of a strength meter. A reply is a line
+ * starting with the score, anything after the score is ignored.
+ * 
+ * @param   reply  The parser state, `reply->state` shall be zero for new parsers
+ * @param   buf    The output
+ * @param   n      The number of bytes in `buf`
+ * @return         The number of bytes consumed if a reply was completed,
+ *                 `reply->value` is set to the score, zero otherwise,
+ *                 in which case all of `buf` was consumed
+ */
+METER_INTERNAL
+size_t passphrase_meter_parse__(struct meter_reply* reply, const char* buf, size_t n);
+
+/**
+ * Parse a part of the reply to `METER_BINARY_HELLO`
+ * 
+ * @param   reply     The parser state, `reply->have` shall be zero for new parsers
+ * @param   buf       The output of the meter
+ * @param   n         The number of bytes in `buf`
+ * @param   consumed  Output parameter for the number of bytes consumed
+ * @return            1 if the meter uses binary framing, 0 if it uses
+ *                    text, -1 if the reply is not complete, in which
+ *                    case all of `buf` was consumed
+ */
+METER_INTERNAL
+int passphrase_meter_parse_hello__(struct meter_reply* reply, const char* buf, size_t n, size_t* consumed);
+
+/**
+ * Parse a part of a sequence of binary frames; control
+ * characters in the hint are replaced with spaces
+ * 
+ * @param   reply  The parser state, `reply->have` shall be zero for new parsers
+ * @param   buf    The output
+ * @param   n      The number of bytes in `buf`
+ * @param   type   The expected frame type
+ * @param   max    The longest payload that is accepted
+ * @return         The number of bytes consumed if a frame was completed,
+ *                 zero otherwise, in which case all of `buf` was consumed,
+ *                 or `reply->state` is `METER_PROTOCOL_ERROR` if the frame
+ *                 is malformed. For replies the fields in `reply` are set,
+ *                 for other frames the payload is not kept, but the ID is.
+ */
+METER_INTERNAL
+size_t passphrase_meter_parse_frame__(struct meter_reply* reply, const char* buf, size_t n, int type, size_t max);
+
+/**
+ * Encode a frame header
+ * 
+ * @param  buf    Output buffer, `METER_FRAME_HEADER` bytes
+ * @param  type   The frame type
+ * @param  flags  The frame's flags
+ * @param  id     The request ID
+ * @param  len    The length of the payload
+ */
+METER_INTERNAL
+void passphrase_meter_frame__(unsigned char* buf, int type, int flags, uint32_t id, size_t len);
+
+/**
+ * Look up a tier in `LIST_PASSPHRASE_STRENGTH_LIMITS` by its index
+ * 
+ * @param   tier    The index of the tier
+ * @param   colour  Output parameter for the colour of the tier
+ * @param   desc    Output parameter for the description of the tier
+ * @return          Zero on success, -1 if there is no such tier
+ */
+METER_INTERNAL
+int passphrase_meter_tier_at__(int tier, const char** colour, const char** desc);
+
+/**
+ * Look up a score in `LIST_PASSPHRASE_STRENGTH_LIMITS`
+ * 
+ * @param   value   The score
+ * @param   colour  Output parameter for the colour of the tier, may be `NULL`
+ * @param   desc    Output parameter for the description of the tier, may be `NULL`
+ * @return          The index of the tier in the table
+ */
+METER_INTERNAL
+int passphrase_meter_tier__(unsigned long long int value, const char** colour, const char** desc);
+
+/**
+ * Estimate the strength of a passphrase without a strength meter
+ * 
+ * @param   passphrase  The passphrase
+ * @param   len         The length of the passphrase
+ * @return              The estimated score
+ */
+METER_INTERNAL
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+unsigned long long int passphrase_meter_estimate__(const char* passphrase, size_t len);
+
+/**
+ * Read a big-endian integer, as in frames and agent replies
+ * 
+ * @param   buf  The integer
+ * @param   n    The size of the integer
+ * @return       The integer
+ */
+METER_INTERNAL
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+unsigned long long int passphrase_meter_get_be__(const unsigned char* buf, size_t n);
+
+/**
+ * Get the time left until a deadline
+ * 
+ * @param   deadline  The deadline, on `CLOCK_MONOTONIC`, `NULL` for none
+ * @return            The time left, in milliseconds, rounded up, for
+ *                    `poll`, -1 if there is no deadline, 0 if it has passed
+ */
+METER_INTERNAL
+int passphrase_meter_time_left__(const struct timespec* deadline);
+
+
+
+#endif
+
@@ -0,0 +1,435 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "passphrase.h"
+
+
+
+/*
+ * meterbench — measure the strength meter path
+ * 
+ * Usage: meterbench [-m METER] [-r ROUNDS] [-k KEYS] [-b BURST]
+ * 
+ * Reads passphrases from a pseudoterminal, with the strength meter
+ * selected by `LIBPASSPHRASE_METER`, `bin/meterstub` unless -m is
+ * used, under each of the stub's delivery modes: text replies, text
+ * replies that start with an escape sequence, text replies written
+ * a few bytes at a time, and binary framing. For each mode it prints
+ * 
+ *   start     the time `passphrase_session_start` takes, which
+ *             includes starting the meter
+ *   first     the time until the first key is rated, which
+ *             includes the meter's start up and the negotiation
+ *   rtt       the time from a key until the passphrase is rated,
+ *             median and 99th percentile, for KEYS keys, 16 by default
+ *   teardown  the time from the passphrase being entered until
+ *             `passphrase_session_finish` has returned, the meter
+ *             is reaped afterwards, see `passphrase_reap_meters`
+ *   keys/s    the number of keys, BURST of them, 64 by default,
+ *             typed at once, per second until the final passphrase
+ *             has been rated and the session finished
+ * 
+ * averaged over ROUNDS rounds, 20 by default. The stub's latency,
+ * `METERSTUB_LATENCY`, is taken from the environment; by default it
+ * has none, so that the cost of the meter path itself is measured;
+ * with `METERSTUB_EXIT_DELAY`, the cost of a meter that is slow to
+ * exit shows in the teardown time if it is waited for.
+ * The library must be built with `PASSPHRASE_METER`.
+ */
+
+
+
+/**
+ * The number of milliseconds to wait for the meter before giving up
+ */
+#define BENCH_TIMEOUT  5000
+
+/**
+ * The label of the strength meter, which is looked for in the
+ * output to see when the passphrase has been rated
+ */
+#define BENCH_LABEL  "@rated@"
+
+
+
+/**
+ * A delivery mode of the stub meter
+ */
+struct mode
+{
+  const char* name;
+  const char* binary;
+  const char* escape;
+  const char* partial;
+};
+
+static const struct mode modes[] =
+  {
+    { "text",    "0", "0", "0" },
+    { "escape",  "0", "1", "0" },
+    { "partial", "0", "1", "3" },
+    { "binary",  "1", "0", "0" },
+  };
+
+
+/**
+ * The master side of the pseudoterminal, and the
+ * number of ratings that have been drawn on it
+ */
+static int master;
+static size_t ratings = 0;
+
+/**
+ * The end of the output that has been read, in case
+ * the label is split between two reads
+ */
+static char tail[sizeof(BENCH_LABEL)];
+static size_t tail_len = 0;
+
+static const char* argv0;
+
+
+
+/**
+ * Get the current time
+ * 
+ * @return  The current time on `CLOCK_MONOTONIC`, in microseconds
+ */
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)(ts.tv_sec) * 1000000 + (double)(ts.tv_nsec) / 1000;
+}
+
+
+/**
+ * Read the output drawn on the pseudoterminal, and
+ * count the ratings of the passphrase in it
+ */
+static void drain(void)
+{
+  char buf[4096 + sizeof(tail)];
+  const char* p;
+  ssize_t got;
+  size_t n;
+  
+  memcpy(buf, tail, tail_len);
+  while ((got = read(master, buf + tail_len, sizeof(buf) - sizeof(tail))) > 0)
+    {
+      n = tail_len + (size_t)got;
+      for (p = buf; (p = memmem(p, n - (size_t)(p - buf), BENCH_LABEL, sizeof(BENCH_LABEL) - 1)); p++)
+	ratings++;
+      tail_len = n < sizeof(BENCH_LABEL) - 1 ? n : sizeof(BENCH_LABEL) - 2;
+      memmove(buf, buf + n - tail_len, tail_len);
+    }
+  memcpy(tail, buf, tail_len);
+}
+
+
+/**
+ * Type on the pseudoterminal
+ * 
+ * @param  keys  The keys
+ * @param  n     The number of keys
+ */
+static void type(const char* keys, size_t n)
+{
+  ssize_t wrote;
+  while (n)
+    {
+      wrote = write(master, keys, n);
+      if (wrote < 0)
+	{
+	  if (errno != EAGAIN)
+	    break;
+	  drain();
+	  continue;
+	}
+      keys += (size_t)wrote;
+      n -= (size_t)wrote;
+    }
+}
+
+
+/**
+ * Run a session until the passphrase has been rated a number of
+ * times, or until it is complete
+ * 
+ * @param   s       The session
+ * @param   target  The number of ratings to wait for,
+ *                  0 to wait for the passphrase to be complete
+ * @return          1 if the passphrase is complete, 0 if it has been
+ *                  rated, -1 on error or if the meter did not answer
+ */
+static int run(struct passphrase_session* s, size_t target)
+{
+  struct pollfd fds[PASSPHRASE_SESSION_FDS + 1];
+  double deadline = now() + BENCH_TIMEOUT * 1000;
+  nfds_t n;
+  int r;
+  
+  for (;;)
+    {
+      drain();
+      if (target && (ratings >= target))
+	return 0;
+      if (now() > deadline)
+	return errno = ETIMEDOUT, -1;
+      n = (nfds_t)passphrase_session_fds(s, fds);
+      fds[n].fd = master;
+      fds[n].events = POLLIN;
+      fds[n++].revents = 0;
+      if ((poll(fds, n, 100) < 0) && (errno != EINTR))
+	return -1;
+      r = passphrase_session_step(s);
+      if (r)
+	return r;
+    }
+}
+
+
+/**
+ * End a session, and discard the passphrase
+ * 
+ * @param  s  The session
+ */
+static void finish(struct passphrase_session* s)
+{
+  char* passphrase = passphrase_session_finish(s);
+  if (passphrase)
+    passphrase_wipe1(passphrase);
+  free(passphrase);
+}
+
+
+/**
+ * Compare two doubles, for `qsort`
+ */
+static int cmp_double(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Read a passphrase one key at a time, and measure each step
+ * 
+ * @param   keys   The number of keys to type
+ * @param   times  Output parameter for the start, first rating,
+ *                 and teardown times, in microseconds
+ * @param   rtt    Output parameter for the round trip of each key
+ *                 after the first, `keys - 1` elements
+ * @return         Zero on success, -1 on error
+ */
+static int measure_keys(size_t keys, double* times, double* rtt)
+{
+  struct passphrase_session* s;
+  double t;
+  size_t i;
+  
+  t = now();
+  s = passphrase_session_start(STDERR_FILENO, PASSPHRASE_READ_NEW | PASSPHRASE_READ_SCREEN_FREE);
+  if (s == NULL)
+    return -1;
+  times[0] = now() - t;
+  
+  for (i = 0; i < keys; i++)
+    {
+      t = now();
+      type("a", 1);
+      if (run(s, ratings + 1))
+	goto fail;
+      if (i)
+	rtt[i - 1] = now() - t;
+      else
+	times[1] = now() - t;
+    }
+  
+  t = now();
+  type("\n", 1);
+  if (run(s, 0) != 1)
+    goto fail;
+  finish(s);
+  times[2] = now() - t;
+  /* So that the next round does not run while the meter exits */
+  passphrase_reap_meters(1);
+  return 0;
+  
+ fail:
+  finish(s);
+  return -1;
+}
+
+
+/**
+ * Read a passphrase typed all at once
+ * 
+ * @param   burst  The number of keys to type
+ * @param   rate   Output parameter for the number of keys per second
+ * @return         Zero on success, -1 on error
+ */
+static int measure_burst(size_t burst, double* rate)
+{
+  struct passphrase_session* s;
+  char keys[1024];
+  double t;
+  
+  if (burst >= sizeof(keys))
+    burst = sizeof(keys) - 1;
+  memset(keys, 'b', burst);
+  keys[burst] = '\n';
+  
+  t = now();
+  s = passphrase_session_start(STDERR_FILENO, PASSPHRASE_READ_NEW | PASSPHRASE_READ_SCREEN_FREE);
+  if (s == NULL)
+    return -1;
+  type(keys, burst + 1);
+  if (run(s, 0) != 1)
+    {
+      finish(s);
+      return -1;
+    }
+  finish(s);
+  *rate = (double)burst * 1000000 / (now() - t);
+  passphrase_reap_meters(1);
+  return 0;
+}
+
+
+/**
+ * Print usage information and exit
+ */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+static void usage(void)
+{
+  fprintf(stderr, "usage: %s [-m METER] [-r ROUNDS] [-k KEYS] [-b BURST]\n", argv0);
+  exit(2);
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        Zero on success
+ */
+int main(int argc, char** argv)
+{
+  const char* meter = "bin/meterstub";
+  size_t rounds = 20, keys = 16, burst = 64, i, j;
+  double times[3], sum[3], rate, rate_sum;
+  double* rtt;
+  FILE* out = NULL;
+  int opt, slave;
+  
+  argv0 = argc ? *argv : "meterbench";
+  while ((opt = getopt(argc, argv, "m:r:k:b:")) != -1)
+    switch (opt)
+      {
+      case 'm':
+	meter = optarg;
+	break;
+      case 'r':
+	rounds = (size_t)atol(optarg);
+	break;
+      case 'k':
+	keys = (size_t)atol(optarg);
+	break;
+      case 'b':
+	burst = (size_t)atol(optarg);
+	break;
+      default:
+	usage();
+      }
+  if ((optind != argc) || !rounds || (keys < 2) || !burst)
+    usage();
+  
+  rtt = malloc(rounds * (keys - 1) * sizeof(double));
+  if (rtt == NULL)
+    goto fail;
+  
+  /* The passphrase is read from, and drawn on, the pseudoterminal,
+     which becomes the standard error; results go to the standard output */
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if ((master < 0) || grantpt(master) || unlockpt(master))
+    goto fail;
+  slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (slave < 0)
+    goto fail;
+  out = fdopen(dup(STDERR_FILENO), "w");
+  if ((out == NULL) || (dup2(slave, STDERR_FILENO) < 0))
+    goto fail;
+  close(slave);
+  passphrase_disable_echo1(STDERR_FILENO);
+  
+  setenv("LIBPASSPHRASE_METER", meter, 1);
+  setenv("LIBPASSPHRASE_METER_BUDGET", "0", 1);
+  setenv("LIBPASSPHRASE_STRENGTH_LABEL", BENCH_LABEL, 1);
+  
+  printf("%-8s %10s %10s %10s %10s %10s %10s\n",
+	 "mode", "start", "first", "rtt", "rtt p99", "teardown", "keys/s");
+  for (i = 0; i < sizeof(modes) / sizeof(*modes); i++)
+    {
+      setenv("METERSTUB_BINARY", modes[i].binary, 1);
+      setenv("METERSTUB_ESCAPE", modes[i].escape, 1);
+      setenv("METERSTUB_PARTIAL", modes[i].partial, 1);
+      sum[0] = sum[1] = sum[2] = rate_sum = 0;
+      for (j = 0; j < rounds; j++)
+	{
+	  if (measure_keys(keys, times, rtt + j * (keys - 1)) || measure_burst(burst, &rate))
+	    {
+	      fprintf(out, "%s: %s: %s\n", argv0, modes[i].name, strerror(errno));
+	      free(rtt);
+	      return 1;
+	    }
+	  sum[0] += times[0], sum[1] += times[1], sum[2] += times[2];
+	  rate_sum += rate;
+	}
+      qsort(rtt, rounds * (keys - 1), sizeof(double), cmp_double);
+      printf("%-8s %8.1fus %8.1fus %8.1fus %8.1fus %8.1fus %10.0f\n", modes[i].name,
+	     sum[0] / (double)rounds, sum[1] / (double)rounds,
+	     rtt[rounds * (keys - 1) / 2], rtt[rounds * (keys - 1) * 99 / 100],
+	     sum[2] / (double)rounds, rate_sum / (double)rounds);
+      fflush(stdout);
+    }
+  
+  passphrase_reenable_echo1(STDERR_FILENO);
+  free(rtt);
+  return 0;
+  
+ fail:
+  fprintf(out ? out : stderr, "%s: %s\n", argv0, strerror(errno));
+  free(rtt);
+  return 1;
+}
+
@@ -0,0 +1,403 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+
+#include "passphrase.h"
+#include "meter.h"
+
+
+
+/*
+ * meterstub — passphrase strength meter with configurable behaviour
+ * 
+ * Usage: LIBPASSPHRASE_METER=bin/meterstub
+ * 
+ * Speaks the same protocol as `passcheck -r`, and binary framing if
+ * asked to, but rates passphrases with the estimate libpassphrase
+ * displays while the real meter is slow, so that the strength meter
+ * path can be exercised and benchmarked without installing passcheck,
+ * and without depending on the size of its dictionaries. Because
+ * `LIBPASSPHRASE_METER` is one argument, the behaviour is selected
+ * with environment variables:
+ * 
+ * METERSTUB_LATENCY     The time each query takes, in milliseconds:
+ *                       `fixed:MS`, `uniform:MIN:MAX`, `exp:MEAN`,
+ *                       or `pareto:MIN:ALPHA`. No latency by default.
+ * METERSTUB_BINARY      If set to 1, accept binary framing.
+ * METERSTUB_ESCAPE      If set to 1, colour text replies, so that
+ *                       they start with an escape sequence.
+ * METERSTUB_PARTIAL     Write replies in writes of at most this
+ *                       number of bytes, 100 microseconds apart.
+ * METERSTUB_CRASH_AFTER Kill the meter at this query, counted from 1.
+ * METERSTUB_CRASH_RATE  The percentage of queries that kill the meter.
+ * METERSTUB_EXIT_DELAY  The time, in milliseconds, to linger before
+ *                       exiting once the input has been closed.
+ * METERSTUB_SEED        Seed for the latencies and crashes.
+ * 
+ * The -r flag is accepted and ignored, the stub never discards input.
+ */
+
+
+
+/**
+ * The longest passphrase, longer queries are rated by their beginning
+ */
+#define MAX_QUERY  4096
+
+
+
+/**
+ * The latency distribution
+ */
+static enum
+  {
+    LATENCY_NONE,
+    LATENCY_FIXED,
+    LATENCY_UNIFORM,
+    LATENCY_EXP,
+    LATENCY_PARETO
+  }
+  latency = LATENCY_NONE;
+
+/**
+ * The parameters of the latency distribution, in milliseconds,
+ * except for the shape of the Pareto distribution
+ */
+static double latency_a = 0;
+static double latency_b = 0;
+
+/**
+ * Whether binary framing is accepted, whether text replies
+ * are coloured, and the largest write, 0 for unlimited
+ */
+static int binary = 0;
+static int escape = 0;
+static size_t partial = 0;
+
+/**
+ * The query to crash at, 0 for none, the percentage of
+ * queries to crash at, and the number of queries so far
+ */
+static unsigned long int crash_after = 0;
+static double crash_rate = 0;
+static unsigned long int queries = 0;
+
+/**
+ * The number of milliseconds to linger before exiting
+ */
+static long int exit_delay = 0;
+
+/**
+ * State for the pseudorandom number generator
+ */
+static unsigned long long int rng_state;
+
+/**
+ * Input that has not been processed
+ */
+static char buf[MAX_QUERY + METER_FRAME_HEADER + 1];
+static size_t buf_len = 0;
+
+
+
+/**
+ * Get a pseudorandom number
+ * 
+ * @return  A number in (0, 1]
+ */
+static double uniform(void)
+{
+  /* xorshift64* */
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (double)(((rng_state * 0x2545F4914F6CDD1DULL) >> 11) + 1) / (double)(1ULL << 53);
+}
+
+
+/**
+ * Parse `METERSTUB_LATENCY`
+ * 
+ * @param   spec  The value of the variable
+ * @return        Zero on success, -1 if it is malformed
+ */
+static int parse_latency(const char* spec)
+{
+  char* end;
+  
+  if (!strncmp(spec, "fixed:", 6))
+    latency = LATENCY_FIXED, spec += 6;
+  else if (!strncmp(spec, "uniform:", 8))
+    latency = LATENCY_UNIFORM, spec += 8;
+  else if (!strncmp(spec, "exp:", 4))
+    latency = LATENCY_EXP, spec += 4;
+  else if (!strncmp(spec, "pareto:", 7))
+    latency = LATENCY_PARETO, spec += 7;
+  else
+    return -1;
+  
+  latency_a = strtod(spec, &end);
+  if ((end == spec) || (latency_a < 0))
+    return -1;
+  if ((latency == LATENCY_UNIFORM) || (latency == LATENCY_PARETO))
+    {
+      if (*end++ != ':')
+	return -1;
+      latency_b = strtod(spec = end, &end);
+      if ((end == spec) || (latency_b <= 0))
+	return -1;
+    }
+  return *end ? -1 : 0;
+}
+
+
+/**
+ * Wait as long as a query takes
+ */
+static void delay(void)
+{
+  struct timespec ts;
+  double ms = 0;
+  
+  switch (latency)
+    {
+    case LATENCY_FIXED:
+      ms = latency_a;
+      break;
+    case LATENCY_UNIFORM:
+      ms = latency_a + (latency_b - latency_a) * uniform();
+      break;
+    case LATENCY_EXP:
+      ms = -latency_a * log(uniform());
+      break;
+    case LATENCY_PARETO:
+      ms = latency_a / pow(uniform(), 1 / latency_b);
+      break;
+    default:
+      return;
+    }
+  
+  ts.tv_sec = (time_t)(ms / 1000);
+  ts.tv_nsec = (long int)((ms - (double)(ts.tv_sec) * 1000) * 1000000);
+  while (nanosleep(&ts, &ts) && (errno == EINTR));
+}
+
+
+/**
+ * Write a reply, in parts if `METERSTUB_PARTIAL` is set
+ * 
+ * @param   data  The reply
+ * @param   n     The length of the reply
+ * @return        Zero on success, -1 on error
+ */
+static int send_reply(const char* data, size_t n)
+{
+  static const struct timespec pause = { .tv_sec = 0, .tv_nsec = 100000L };
+  ssize_t wrote;
+  size_t part;
+  
+  while (n)
+    {
+      part = (partial && (n > partial)) ? partial : n;
+      wrote = write(STDOUT_FILENO, data, part);
+      if (wrote < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      data += (size_t)wrote;
+      n -= (size_t)wrote;
+      if (n && partial)
+	nanosleep(&pause, NULL);
+    }
+  return 0;
+}
+
+
+/**
+ * Rate a passphrase and reply
+ * 
+ * @param   passphrase  The passphrase
+ * @param   len         The length of the passphrase
+ * @param   id          The request ID, if binary framing is used
+ * @return              Zero on success, -1 on error
+ */
+static int rate(const char* passphrase, size_t len, uint32_t id)
+{
+  unsigned char frame[METER_FRAME_HEADER + 8 + 1];
+  char line[64];
+  unsigned long long int score;
+  const char* colour;
+  const char* desc;
+  int tier, i, n;
+  
+  queries++;
+  if ((crash_after && (queries == crash_after)) || ((crash_rate > 0) && (uniform() * 100 <= crash_rate)))
+    kill(getpid(), SIGKILL);
+  delay();
+  
+  score = passphrase_meter_estimate__(passphrase, len);
+  tier = passphrase_meter_tier__(score, &colour, &desc);
+  
+  if (binary > 0)
+    {
+      passphrase_meter_frame__(frame, METER_FRAME_REPLY, METER_FLAG_TIER, id, 9);
+      for (i = 0; i < 8; i++)
+	frame[METER_FRAME_HEADER + i] = (unsigned char)(score >> (56 - 8 * i));
+      frame[METER_FRAME_HEADER + 8] = (unsigned char)tier;
+      return send_reply((const char*)frame, sizeof(frame));
+    }
+  
+  if (escape)
+    n = snprintf(line, sizeof(line), "\033[%sm%llu\033[m %s\n", colour, score, desc);
+  else
+    n = snprintf(line, sizeof(line), "%llu\n", score);
+  return send_reply(line, (size_t)n);
+}
+
+
+/**
+ * Process the complete queries in the input buffer
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int process(void)
+{
+  const unsigned char* header = (const unsigned char*)buf;
+  size_t n, used;
+  char* nl;
+  int r;
+  
+  for (;;)
+    {
+      if (binary > 0)
+	{
+	  if (buf_len < METER_FRAME_HEADER)
+	    return 0;
+	  n = (size_t)header[8] << 24 | (size_t)header[9] << 16 | (size_t)header[10] << 8 | (size_t)header[11];
+	  if ((header[0] != METER_FRAME_QUERY) || (n > MAX_QUERY))
+	    return errno = EBADMSG, -1;
+	  if (buf_len < METER_FRAME_HEADER + n)
+	    return 0;
+	  r = rate(buf + METER_FRAME_HEADER, n,
+		   (uint32_t)header[4] << 24 | (uint32_t)header[5] << 16 | (uint32_t)header[6] << 8 | header[7]);
+	  used = METER_FRAME_HEADER + n;
+	}
+      else
+	{
+	  nl = memchr(buf, '\n', buf_len);
+	  if (nl == NULL)
+	    {
+	      /* An overlong line is rated by its beginning */
+	      if (buf_len < sizeof(buf))
+		return 0;
+	      nl = buf + buf_len - 1;
+	    }
+	  used = (size_t)(nl - buf) + 1;
+	  if ((binary == 0) && (used == sizeof(METER_BINARY_HELLO) - 1) && !memcmp(buf, METER_BINARY_HELLO, used))
+	    {
+	      binary = 1;
+	      r = send_reply(METER_BINARY_ACK, sizeof(METER_BINARY_ACK) - 1);
+	    }
+	  else
+	    r = rate(buf, used - 1, 0);
+	  if (binary == 0)
+	    binary = -1;
+	}
+      passphrase_wipe(buf, used);
+      memmove(buf, buf + used, buf_len -= used);
+      if (r)
+	return -1;
+    }
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        Zero on success
+ */
+int main(int argc, char** argv)
+{
+  struct timespec ts;
+  const char* env;
+  ssize_t got;
+  
+  if ((env = getenv("METERSTUB_LATENCY")) && *env && parse_latency(env))
+    {
+      fprintf(stderr, "%s: invalid METERSTUB_LATENCY: %s\n", argc ? *argv : "meterstub", env);
+      return 2;
+    }
+  binary = ((env = getenv("METERSTUB_BINARY")) && !strcmp(env, "1")) ? 0 : -1;
+  escape = (env = getenv("METERSTUB_ESCAPE")) && !strcmp(env, "1");
+  if ((env = getenv("METERSTUB_PARTIAL")))
+    partial = (size_t)atol(env);
+  if ((env = getenv("METERSTUB_CRASH_AFTER")))
+    crash_after = (unsigned long int)atol(env);
+  if ((env = getenv("METERSTUB_CRASH_RATE")))
+    crash_rate = atof(env);
+  if ((env = getenv("METERSTUB_EXIT_DELAY")))
+    exit_delay = atol(env);
+  if ((env = getenv("METERSTUB_SEED")) && *env)
+    rng_state = (unsigned long long int)atoll(env);
+  else
+    rng_state = (unsigned long long int)time(NULL) ^ ((unsigned long long int)getpid() << 32);
+  if (rng_state == 0)
+    rng_state = 1;
+  
+  /* Queries contain passphrases, keep them out of swap */
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+  
+  for (;;)
+    {
+      got = read(STDIN_FILENO, buf + buf_len, sizeof(buf) - buf_len);
+      if (got < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+      if (got == 0)
+	{
+	  ts.tv_sec = (time_t)(exit_delay / 1000);
+	  ts.tv_nsec = exit_delay % 1000 * 1000000L;
+	  if (exit_delay > 0)
+	    while (nanosleep(&ts, &ts) && (errno == EINTR));
+	  return 0;
+	}
+      buf_len += (size_t)got;
+      if (process())
+	break;
+    }
+  passphrase_wipe(buf, sizeof(buf));
+  return 1;
+}
+
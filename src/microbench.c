@@ -0,0 +1,460 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "passphrase.h"
+
+
+
+/*
+ * Microbenchmark for the editing macros in `passphrase_helper.h`
+ * 
+ * The macros work on the local variables of `passphrase_read2`,
+ * here each macro is wrapped in a function that loads those
+ * variables from a `struct kernel_state`, runs the macro, and
+ * stores the variables back. This is the internal test API for
+ * the macros; it is compiled with the same `OPTIONS` as the
+ * library, so it measures the macros as they are configured.
+ * 
+ * For each kernel, buffer length, cursor position and content,
+ * the time per operation and the number of bytes the macro
+ * copies (or scans, for the point movement macros) per operation
+ * are printed. Output to the terminal is sent to /dev/null.
+ */
+
+
+
+/**
+ * The continuation bytes of the multibyte character being
+ * written by `override_char`, instead of reading the terminal
+ */
+#define next_byte()  ((int)(unsigned char)*(st->pending++))
+
+#include "passphrase_helper.h"
+
+
+#ifndef MIN_BENCH_LENGTH
+# define MIN_BENCH_LENGTH  32
+#endif
+#ifndef MAX_BENCH_LENGTH
+# define MAX_BENCH_LENGTH  (1L << 20)
+#endif
+#ifndef MIN_BENCH_TIME
+# define MIN_BENCH_TIME  2000000L
+#endif
+
+
+
+/**
+ * The state the editing macros work on
+ */
+struct kernel_state
+{
+  char* rc;
+  size_t len;
+  size_t point;
+  size_t size;
+  size_t printed_len;
+  int c;
+  const char* pending;
+};
+
+
+/**
+ * A character to fill the passphrase with and to edit with
+ */
+struct content
+{
+  const char* name;
+  const char* bytes;
+  size_t width;
+};
+
+
+/**
+ * Where in the passphrase the point is placed
+ */
+enum position
+{
+  POSITION_START,
+  POSITION_MIDDLE,
+  POSITION_END
+};
+
+
+
+#if defined(PASSPHRASE_MOVE) && !defined(PASSPHRASE_REALLOC)
+static char* xrealloc(char* array, size_t cur_size, size_t new_size)
+{
+  char* rc = malloc(new_size * sizeof(char));
+  if (rc)
+    memcpy(rc, array, cur_size);
+  passphrase_wipe(array, cur_size);
+  free(array);
+  return rc;
+}
+#elif defined(PASSPHRASE_MOVE) /* PASSPHRASE_MOVE && !PASSPHRASE_REALLOC */
+# define xrealloc(array, _cur_size, new_size)  realloc(array, (new_size) * sizeof(char))
+#endif /* PASSPHRASE_MOVE && !PASSPHRASE_REALLOC */
+
+
+
+/**
+ * Define a function that runs an editing macro on a `struct kernel_state`
+ * 
+ * @param  NAME  The name of the function
+ * @param  ...   The macro invocation
+ */
+#define KERNEL(NAME, ...)				\
+  static char* NAME(struct kernel_state* st)		\
+  {							\
+    char* rc = st->rc;					\
+    size_t len = st->len;				\
+    size_t point = st->point;				\
+    size_t size = st->size;				\
+    size_t printed_len = st->printed_len;		\
+    size_t i = 0;					\
+    int c = st->c;					\
+    __VA_ARGS__;					\
+    st->rc = rc;					\
+    st->len = len;					\
+    st->point = point;					\
+    st->size = size;					\
+    st->printed_len = printed_len;			\
+    st->c = c;						\
+    return rc;						\
+    (void) i;						\
+  }
+
+KERNEL(kernel_append_char, append_char())
+KERNEL(kernel_erase_prev, erase_prev())
+#ifdef PASSPHRASE_MOVE
+KERNEL(kernel_insert_char, insert_char())
+KERNEL(kernel_override_char, override_char())
+KERNEL(kernel_delete_next, delete_next())
+KERNEL(kernel_move_left, move_left())
+KERNEL(kernel_move_right, move_right())
+KERNEL(kernel_move_home, move_home())
+KERNEL(kernel_move_end, move_end())
+KERNEL(kernel_print_delete, print_delete())
+#endif /* PASSPHRASE_MOVE */
+#ifdef print_erase
+KERNEL(kernel_print_erase, print_erase())
+#endif /* print_erase */
+
+
+
+/**
+ * A benchmarked kernel
+ */
+struct kernel
+{
+  /**
+   * The name of the kernel
+   */
+  const char* name;
+  
+  /**
+   * The kernel
+   */
+  char* (*function)(struct kernel_state*);
+  
+  /**
+   * Whether the kernel is invoked once per byte
+   * rather than once per character
+   */
+  int per_byte;
+  
+  /**
+   * Whether the kernel requires a character before the point
+   */
+  int needs_before;
+  
+  /**
+   * Whether the kernel requires a character after the point
+   */
+  int needs_after;
+  
+  /**
+   * Whether the kernel can only be used at the end of the passphrase
+   */
+  int end_only;
+  
+  /**
+   * Calculate the number of bytes the kernel copies or scans
+   * 
+   * @param   len    The length of the passphrase, in bytes
+   * @param   point  The position of the point, in bytes
+   * @param   width  The number of bytes per character
+   * @return         The number of bytes copied or scanned
+   */
+  size_t (*bytes)(size_t, size_t, size_t);
+};
+
+
+static size_t bytes_append(size_t len, size_t point, size_t width)
+{
+  return width;
+  (void) len, (void) point;
+}
+
+#ifdef PASSPHRASE_MOVE
+static size_t bytes_insert(size_t len, size_t point, size_t width)
+{
+  return width * (len - point) + width;
+}
+
+static size_t bytes_override(size_t len, size_t point, size_t width)
+{
+  return 2 * (len - point - width) + width;
+}
+#endif /* PASSPHRASE_MOVE */
+
+static size_t bytes_erase(size_t len, size_t point, size_t width)
+{
+#ifdef PASSPHRASE_MOVE
+  return width * (len - point + 1);
+#else
+  return width;
+  (void) len, (void) point;
+#endif
+}
+
+#if defined(PASSPHRASE_MOVE) || defined(print_erase)
+static size_t bytes_none(size_t len, size_t point, size_t width)
+{
+  return 0;
+  (void) len, (void) point, (void) width;
+}
+#endif /* PASSPHRASE_MOVE || print_erase */
+
+#ifdef PASSPHRASE_MOVE
+static size_t bytes_delete(size_t len, size_t point, size_t width)
+{
+  return width * (len - point);
+}
+
+static size_t bytes_step(size_t len, size_t point, size_t width)
+{
+  return width;
+  (void) len, (void) point;
+}
+
+static size_t bytes_home(size_t len, size_t point, size_t width)
+{
+# ifdef PASSPHRASE_TEXT
+  return 0;
+  (void) point;
+# else
+  return point;
+# endif
+  (void) len, (void) width;
+}
+
+static size_t bytes_end(size_t len, size_t point, size_t width)
+{
+# ifdef PASSPHRASE_TEXT
+  return 0;
+  (void) len, (void) point;
+# else
+  return len - point;
+# endif
+  (void) width;
+}
+#endif /* PASSPHRASE_MOVE */
+
+
+static const struct kernel kernels[] =
+  {
+    { "append_char",   kernel_append_char,   1, 0, 0, 1, bytes_append },
+#ifdef PASSPHRASE_MOVE
+    { "insert_char",   kernel_insert_char,   1, 0, 0, 0, bytes_insert },
+    { "override_char", kernel_override_char, 0, 0, 1, 0, bytes_override },
+    { "erase_prev",    kernel_erase_prev,    0, 1, 0, 0, bytes_erase },
+    { "delete_next",   kernel_delete_next,   0, 0, 1, 0, bytes_delete },
+#else /* PASSPHRASE_MOVE */
+    { "erase_prev",    kernel_erase_prev,    1, 1, 0, 1, bytes_erase },
+#endif /* PASSPHRASE_MOVE */
+#ifdef PASSPHRASE_MOVE
+    { "move_left",     kernel_move_left,     0, 1, 0, 0, bytes_step },
+    { "move_right",    kernel_move_right,    0, 0, 1, 0, bytes_step },
+    { "move_home",     kernel_move_home,     0, 1, 0, 0, bytes_home },
+    { "move_end",      kernel_move_end,      0, 0, 1, 0, bytes_end },
+    { "print_delete",  kernel_print_delete,  0, 0, 0, 0, bytes_none },
+#endif /* PASSPHRASE_MOVE */
+#ifdef print_erase
+    { "print_erase",   kernel_print_erase,   0, 0, 0, 0, bytes_none },
+#endif /* print_erase */
+  };
+
+
+static const struct content contents[] =
+  {
+    { "ascii", "a",        1 },
+    { "utf-8", "\xC3\xA9", 2 }
+  };
+
+
+static const char* position_names[] = { "start", "middle", "end" };
+
+
+
+/**
+ * Get the current time
+ * 
+ * @return  The current time, in nanoseconds
+ */
+static long long int now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long int)(ts.tv_sec) * 1000000000LL + (long long int)(ts.tv_nsec);
+}
+
+
+/**
+ * Run a kernel once at a specific point, and restore
+ * the length and point afterwards
+ * 
+ * @param   k       The kernel
+ * @param   st      The state
+ * @param   cont    The content
+ * @param   len     The length of the passphrase
+ * @param   point   The point
+ * @return          Zero on success, -1 on error
+ */
+static int run_once(const struct kernel* k, struct kernel_state* st,
+		    const struct content* cont, size_t len, size_t point)
+{
+  size_t j;
+  st->len = len;
+  st->point = point;
+  if (k->per_byte)
+    for (j = 0; j < cont->width; j++)
+      {
+	st->c = (int)(unsigned char)(cont->bytes[j]);
+	if (k->function(st) == NULL)
+	  return -1;
+      }
+  else
+    {
+      st->c = (int)(unsigned char)(cont->bytes[0]);
+      st->pending = cont->bytes + 1;
+      if (k->function(st) == NULL)
+	return -1;
+    }
+  return 0;
+}
+
+
+/**
+ * Benchmark a kernel for one buffer length, position and content
+ * 
+ * @param   k     The kernel
+ * @param   cont  The content
+ * @param   len   The length of the passphrase, in bytes
+ * @param   pos   The position of the point
+ * @return        Zero on success, -1 on error
+ */
+static int bench(const struct kernel* k, const struct content* cont, size_t len, enum position pos)
+{
+  struct kernel_state st;
+  size_t point, j;
+  long long int start, elapsed;
+  unsigned long long int iterations, n;
+  
+  if (k->end_only && (pos != POSITION_END))
+    return 0;
+  point = pos == POSITION_START ? 0 : pos == POSITION_END ? len : (len / cont->width / 2) * cont->width;
+  if ((k->needs_before && (point == 0)) || (k->needs_after && (point == len)))
+    return 0;
+  
+  /* The whole allocation is filled with the content, so that the
+     content is unchanged by the operation after the length and
+     point has been restored. The margin gives the operation room
+     to grow the passphrase without reallocating. */
+  memset(&st, 0, sizeof(st));
+  st.size = len + 64;
+  st.rc = malloc(st.size);
+  if (st.rc == NULL)
+    return -1;
+  for (j = 0; j + cont->width <= st.size; j += cont->width)
+    memcpy(st.rc + j, cont->bytes, cont->width);
+  
+  for (iterations = 1;; iterations <<= 1)
+    {
+      start = now();
+      for (n = 0; n < iterations; n++)
+	if (run_once(k, &st, cont, len, point))
+	  goto fail;
+      elapsed = now() - start;
+      if (elapsed >= MIN_BENCH_TIME)
+	break;
+    }
+  
+  printf("%-14s %-6s %8zu %-7s %12.1f %12zu\n", k->name, cont->name, len, position_names[pos],
+	 (double)elapsed / (double)iterations, k->bytes(len, point, cont->width));
+  free(st.rc);
+  return 0;
+ fail:
+  free(st.rc);
+  return -1;
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        Zero on success
+ */
+int main(int argc, char** argv)
+{
+  size_t k, cont, len;
+  int pos, fd;
+  
+  /* Output to the terminal is part of the kernels, but it should not be seen */
+  fd = open("/dev/null", O_WRONLY);
+  if ((fd == -1) || (dup2(fd, STDERR_FILENO) == -1))
+    {
+      perror(*argv);
+      return 1;
+    }
+  close(fd);
+  
+  printf("%-14s %-6s %8s %-7s %12s %12s\n", "kernel", "text", "length", "point", "ns/op", "bytes/op");
+  for (k = 0; k < sizeof(kernels) / sizeof(*kernels); k++)
+    for (cont = 0; cont < sizeof(contents) / sizeof(*contents); cont++)
+      for (len = MIN_BENCH_LENGTH; len <= MAX_BENCH_LENGTH; len <<= 3)
+	for (pos = POSITION_START; pos <= POSITION_END; pos++)
+	  if (bench(kernels + k, contents + cont, len, (enum position)pos))
+	    {
+	      perror(*argv);
+	      return 1;
+	    }
+  
+  return 0;
+  (void) argc;
+}
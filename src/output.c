@@ -0,0 +1,372 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "passphrase.h"
+#include "output.h"
+#include "wipe.h"
+
+
+
+/**
+ * Write output to the terminal
+ * 
+ * @param   fd     The terminal
+ * @param   buf    The output
+ * @param   n      The number of bytes in `buf`
+ * @param   block  Whether to wait for the terminal if it is not writable
+ * @return         The number of bytes that were written, or that will never
+ *                 be written because the terminal has failed
+ */
+static size_t output_send(int fd, const char* buf, size_t n, int block)
+{
+  struct pollfd pfd;
+  size_t done = 0;
+  ssize_t wrote;
+  
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  while (done < n)
+    {
+      wrote = write(fd, buf + done, n - done);
+      if (wrote >= 0)
+	done += (size_t)wrote;
+      else if (errno == EINTR)
+	continue;
+      else if (errno != EAGAIN)
+	/* The terminal is gone, so there is nothing to draw on */
+	return n;
+      else if (!block)
+	break;
+      else if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+	return n;
+    }
+  return done;
+}
+
+
+/**
+ * Write queued output, and forget the frames that have been written
+ * 
+ * @param  queue  The output queue
+ * @param  block  Whether to wait for the terminal if it is not writable
+ */
+static void output_flush(struct output_queue* queue, int block)
+{
+  size_t popped = 0;
+  size_t before = queue->head;
+  
+  queue->head += output_send(queue->fd, queue->buf + queue->head, queue->tail - queue->head, block);
+  
+  while ((popped < queue->frames) && (queue->ends[popped] <= queue->head))
+    queue->written = queue->marks[popped++];
+  if (popped)
+    {
+      queue->begun = queue->head > queue->ends[popped - 1];
+      queue->frames -= popped;
+      memmove(queue->ends, queue->ends + popped, queue->frames * sizeof(*(queue->ends)));
+      memmove(queue->marks, queue->marks + popped, queue->frames * sizeof(*(queue->marks)));
+    }
+  else if (queue->head > before)
+    queue->begun = 1;
+  
+  /* Echoed passphrases are not kept longer than necessary */
+  if (queue->head == queue->tail)
+    {
+      passphrase_wipe(queue->buf, queue->tail);
+      queue->head = queue->tail = 0;
+    }
+}
+
+
+/**
+ * Make the frame being drawn be displayed at once, if it is marked as
+ * atomic and the terminal supports synchronized output, by enclosing
+ * it in the sequences that begin and end a synchronized update
+ * 
+ * @param  queue  The output queue
+ */
+static void output_atomic(struct output_queue* queue)
+{
+  static const char begin[] = "\033[?2026h";
+  static const char end[] = "\033[?2026l";
+  size_t start, n = sizeof(begin) - 1;
+  int atomic = queue->atomic;
+  
+  queue->atomic = 0;
+  if (!atomic || !(queue->sync))
+    return;
+  
+  /* A frame that has been partially written cannot be enclosed */
+  if (queue->frames)
+    start = queue->ends[queue->frames - 1];
+  else if (queue->begun)
+    return;
+  else
+    start = queue->head;
+  if ((start == queue->tail) || (queue->tail + 2 * n > OUTPUT_QUEUE_SIZE))
+    return;
+  
+  memmove(queue->buf + start + n, queue->buf + start, queue->tail - start);
+  memcpy(queue->buf + start, begin, n);
+  memcpy(queue->buf + queue->tail + n, end, n);
+  queue->tail += 2 * n;
+}
+
+
+/**
+ * Queue output written to the stream
+ * 
+ * @param   cookie  The output queue
+ * @param   buf     The output
+ * @param   size    The number of bytes in `buf`
+ * @return          `size`
+ */
+static ssize_t output_cookie_write(void* cookie, const char* buf, size_t size)
+{
+  struct output_queue* queue = cookie;
+  size_t i;
+  
+  if ((queue->tail + size > OUTPUT_QUEUE_SIZE) && queue->head)
+    {
+      /* Move the unwritten output to the beginning of the buffer */
+      memmove(queue->buf, queue->buf + queue->head, queue->tail - queue->head);
+      for (i = 0; i < queue->frames; i++)
+	queue->ends[i] -= queue->head;
+      queue->tail -= queue->head;
+      passphrase_wipe(queue->buf + queue->tail, queue->head);
+      queue->head = 0;
+    }
+  if (queue->tail + size > OUTPUT_QUEUE_SIZE)
+    passphrase_output_sync__(queue);
+  if (size > OUTPUT_QUEUE_SIZE)
+    {
+      /* Too much to queue, so it is written as if it was not queued */
+      output_send(queue->fd, buf, size, 1);
+      queue->begun = 1;
+      return (ssize_t)size;
+    }
+  memcpy(queue->buf + queue->tail, buf, size);
+  queue->tail += size;
+  return (ssize_t)size;
+}
+
+
+/**
+ * Start queueing output, if it is drawn on a terminal
+ * 
+ * @param  queue   The output queue
+ * @param  tty     The stream for the terminal, usually `stderr`
+ * @param  redraw  Function that redraws the display, `NULL` if frames may not be dropped
+ * @param  data    The argument for `redraw`
+ */
+void passphrase_output_start__(struct output_queue* queue, FILE* tty, output_redraw_t* redraw, void* data)
+{
+  cookie_io_functions_t io;
+  const char* name;
+  
+  queue->stream = queue->tty = tty;
+  queue->fd = -1;
+  queue->buf = NULL;
+  queue->head = queue->tail = 0;
+  queue->frames = 0;
+  queue->begun = 0;
+  queue->written = 0;
+  queue->redraw = redraw;
+  queue->data = data;
+  queue->sync = 0;
+  queue->atomic = 0;
+  
+  /* A file descriptor of our own is opened, so that it can be
+     non-blocking without affecting those of the application */
+  if (!isatty(fileno(tty)) || !(name = ttyname(fileno(tty))))
+    return;
+  queue->fd = open(name, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if (queue->fd < 0)
+    return;
+  
+  if ((queue->buf = passphrase_secret_alloc__(OUTPUT_QUEUE_SIZE)) == NULL)
+    goto fail;
+  
+  memset(&io, 0, sizeof(io));
+  io.write = output_cookie_write;
+  if ((queue->stream = fopencookie(queue, "w", io)) == NULL)
+    goto fail;
+  setvbuf(queue->stream, NULL, _IONBF, 0);
+  
+  /* Output that is already buffered goes before the queued output */
+  fflush(tty);
+  return;
+  
+ fail:
+  passphrase_secret_free__(queue->buf, OUTPUT_QUEUE_SIZE);
+  queue->buf = NULL;
+  close(queue->fd);
+  queue->fd = -1;
+  queue->stream = tty;
+}
+
+
+/**
+ * End the frame being drawn, and write as much as possible without blocking
+ * 
+ * @param  queue  The output queue
+ * @param  mark   Value describing the state of the display after the frame,
+ *                it is passed to the redraw function if frames are dropped
+ */
+void passphrase_output_frame__(struct output_queue* queue, size_t mark)
+{
+  size_t keep, from;
+  
+  if (queue->fd < 0)
+    return;
+  if (queue->frames == OUTPUT_QUEUE_FRAMES)
+    {
+      /* Merge the frames that nothing has been written of, no output
+	 is lost, and the merged frame leaves the display as the last did */
+      keep = queue->begun ? 1 : 0;
+      queue->ends[keep] = queue->ends[queue->frames - 1];
+      queue->marks[keep] = queue->marks[queue->frames - 1];
+      queue->frames = keep + 1;
+    }
+  if ((queue->frames == 0) && (queue->head == queue->tail))
+    {
+      /* Everything that was drawn has been written */
+      if (queue->begun)
+	queue->written = mark;
+      queue->begun = 0;
+      queue->atomic = 0;
+      return;
+    }
+  output_atomic(queue);
+  queue->ends[queue->frames] = queue->tail;
+  queue->marks[queue->frames++] = mark;
+  output_flush(queue, 0);
+  
+  /* Replace frames that nothing has been written of
+     with one frame that draws the current state */
+  keep = queue->begun ? 1 : 0;
+  if ((queue->redraw == NULL) || (queue->frames < keep + 2))
+    return;
+  from = keep ? queue->marks[0] : queue->written;
+  passphrase_wipe(queue->buf + (keep ? queue->ends[0] : queue->head),
+		  queue->tail - (keep ? queue->ends[0] : queue->head));
+  queue->tail = keep ? queue->ends[0] : queue->head;
+  queue->frames = keep;
+  queue->redraw(queue->data, from);
+  queue->atomic = 1;
+  output_atomic(queue);
+  if (queue->frames < OUTPUT_QUEUE_FRAMES)
+    {
+      queue->ends[queue->frames] = queue->tail;
+      queue->marks[queue->frames++] = mark;
+    }
+  output_flush(queue, 0);
+}
+
+
+/**
+ * Take back output that has not been written yet, if the queued output ends with it
+ * 
+ * @param   queue  The output queue
+ * @param   buf    The output to take back
+ * @param   n      The number of bytes in `buf`
+ * @return         Whether the output was taken back
+ */
+int passphrase_output_retract__(struct output_queue* queue, const char* buf, size_t n)
+{
+  size_t i;
+  
+  /* If frames can be redrawn, their marks must describe what they draw */
+  if ((queue->fd < 0) || queue->redraw)
+    return 0;
+  if ((queue->tail - queue->head < n) || memcmp(queue->buf + queue->tail - n, buf, n))
+    return 0;
+  
+  queue->tail -= n;
+  passphrase_wipe(queue->buf + queue->tail, n);
+  /* Frames that end in what was taken back now end where it began */
+  for (i = queue->frames; i-- && (queue->ends[i] > queue->tail);)
+    queue->ends[i] = queue->tail;
+  return 1;
+}
+
+
+/**
+ * Write as much as possible without blocking, once the terminal is writable
+ * 
+ * @param  queue  The output queue
+ */
+void passphrase_output_write__(struct output_queue* queue)
+{
+  if (queue->fd >= 0)
+    output_flush(queue, 0);
+}
+
+
+/**
+ * Check whether the queue is waiting for the terminal to become writable
+ * 
+ * @param   queue  The output queue
+ * @return         Whether `queue->fd` shall be polled for `POLLOUT`
+ */
+int passphrase_output_pending__(const struct output_queue* queue)
+{
+  return (queue->fd >= 0) && (queue->head < queue->tail);
+}
+
+
+/**
+ * Write everything that has been queued, blocking if necessary
+ * 
+ * @param  queue  The output queue
+ */
+void passphrase_output_sync__(struct output_queue* queue)
+{
+  if (queue->fd >= 0)
+    output_flush(queue, 1);
+}
+
+
+/**
+ * Write everything that has been queued, and stop queueing
+ * output; this may be called more than once
+ * 
+ * @param  queue  The output queue
+ */
+void passphrase_output_stop__(struct output_queue* queue)
+{
+  if (queue->fd < 0)
+    return;
+  passphrase_output_sync__(queue);
+  fclose(queue->stream);
+  close(queue->fd);
+  passphrase_secret_free__(queue->buf, OUTPUT_QUEUE_SIZE);
+  queue->buf = NULL;
+  queue->fd = -1;
+  queue->stream = queue->tty;
+}
+
@@ -0,0 +1,213 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "meter.h"
+
+
+
+/* Queue for what is drawn while a passphrase is read. The queue is
+ * written without blocking whenever the terminal can take more, so
+ * that input and the strength meter are handled even while output
+ * is stalled, for example by flow control or a congested connection.
+ * 
+ * The output is divided into frames, each taking the display from
+ * one consistent state to the next. While output is stalled, the
+ * frames that nothing has been written of yet are replaced by one
+ * frame that redraws the current state, so the queue does not grow
+ * with the number of edits. If the display cannot be redrawn, such
+ * frames are merged instead, and output that would be undone, such
+ * as a star that is erased, can be taken back before it is written.
+ * Frames that are marked as atomic, and frames that redraw the
+ * display, are displayed at once by terminals that support
+ * synchronized output. These functions are not part of the public
+ * API. */
+
+
+/**
+ * The number of bytes that can be queued, output that does
+ * not fit is written synchronously, as if it was not queued
+ */
+#ifndef OUTPUT_QUEUE_SIZE
+# define OUTPUT_QUEUE_SIZE  4096
+#endif
+
+/**
+ * The number of frames that can be queued, before
+ * the frames that have not begun to be written are merged
+ */
+#ifndef OUTPUT_QUEUE_FRAMES
+# define OUTPUT_QUEUE_FRAMES  16
+#endif
+
+
+/**
+ * Draw the current state of the display, instead of frames that have been dropped
+ * 
+ * @param  data  The data given to `passphrase_output_start__`
+ * @param  from  The mark of the last frame that was, or will be, written in
+ *               full, which describes the state the display was left in
+ */
+typedef void output_redraw_t(void* data, size_t from);
+
+
+/**
+ * Output queue for one passphrase
+ */
+struct output_queue
+{
+  /**
+   * The stream to draw to, `tty` if the output is not queued
+   */
+  FILE* stream;
+  
+  /**
+   * The stream for the terminal, usually `stderr`
+   */
+  FILE* tty;
+  
+  /**
+   * A file descriptor for the terminal, that is non-blocking
+   * without affecting any other file descriptor for it,
+   * -1 if the output is not queued
+   */
+  int fd;
+  
+  /**
+   * The queued output, bytes before `head` have been
+   * written, and the frame being drawn ends at `tail`
+   */
+  char* buf;
+  size_t head;
+  size_t tail;
+  
+  /**
+   * The end of each complete frame that has not been written in
+   * full, and the mark it was ended with, oldest frame first
+   */
+  size_t ends[OUTPUT_QUEUE_FRAMES];
+  size_t marks[OUTPUT_QUEUE_FRAMES];
+  size_t frames;
+  
+  /**
+   * Whether a part of the oldest frame has been written
+   */
+  int begun;
+  
+  /**
+   * The mark of the last frame that has been written in full
+   */
+  size_t written;
+  
+  /**
+   * Function that redraws the display, `NULL` if the
+   * display cannot be redrawn, and its argument
+   */
+  output_redraw_t* redraw;
+  void* data;
+  
+  /**
+   * Whether the terminal supports synchronized output, and
+   * whether the frame being drawn shall be displayed at once,
+   * because it draws more than the edit of the passphrase
+   */
+  int sync;
+  int atomic;
+};
+
+
+
+/**
+ * Start queueing output, if it is drawn on a terminal
+ * 
+ * @param  queue   The output queue
+ * @param  tty     The stream for the terminal, usually `stderr`
+ * @param  redraw  Function that redraws the display, `NULL` if frames may not be dropped
+ * @param  data    The argument for `redraw`
+ */
+METER_INTERNAL
+void passphrase_output_start__(struct output_queue* queue, FILE* tty, output_redraw_t* redraw, void* data);
+
+/**
+ * End the frame being drawn, and write as much as possible without blocking
+ * 
+ * @param  queue  The output queue
+ * @param  mark   Value describing the state of the display after the frame,
+ *                it is passed to the redraw function if frames are dropped
+ */
+METER_INTERNAL
+void passphrase_output_frame__(struct output_queue* queue, size_t mark);
+
+/**
+ * Take back output that has not been written yet, if the queued output ends
+ * with it; this is only done for queues whose frames are never redrawn
+ * 
+ * @param   queue  The output queue
+ * @param   buf    The output to take back
+ * @param   n      The number of bytes in `buf`
+ * @return         Whether the output was taken back
+ */
+METER_INTERNAL
+int passphrase_output_retract__(struct output_queue* queue, const char* buf, size_t n);
+
+/**
+ * Write as much as possible without blocking, once the terminal is writable
+ * 
+ * @param  queue  The output queue
+ */
+METER_INTERNAL
+void passphrase_output_write__(struct output_queue* queue);
+
+/**
+ * Check whether the queue is waiting for the terminal to become writable
+ * 
+ * @param   queue  The output queue
+ * @return         Whether `queue->fd` shall be polled for `POLLOUT`
+ */
+METER_INTERNAL
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+int passphrase_output_pending__(const struct output_queue* queue);
+
+/**
+ * Write everything that has been queued, blocking if necessary
+ * 
+ * @param  queue  The output queue
+ */
+METER_INTERNAL
+void passphrase_output_sync__(struct output_queue* queue);
+
+/**
+ * Write everything that has been queued, and stop queueing
+ * output; this may be called more than once
+ * 
+ * @param  queue  The output queue
+ */
+METER_INTERNAL
+void passphrase_output_stop__(struct output_queue* queue);
+
+
+
+#endif
+
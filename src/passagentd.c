@@ -0,0 +1,675 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "passphrase.h"
+#include "agent.h"
+
+
+
+/*
+ * passagentd — passphrase agent
+ * 
+ * Usage: passagentd [-a] [-u UID]... SOCKET
+ * 
+ * Reads passphrases on behalf of other processes, so that when many
+ * processes need the same passphrase, they do not each switch the
+ * mode of the terminal and start a strength meter, and fight over
+ * the terminal. Clients select it by setting `LIBPASSPHRASE_AGENT`
+ * to the pathname of the socket; it is then used by `passphrase_read2`
+ * and the other reading functions when they read from a terminal.
+ * 
+ * The agent reads the passphrases from its own terminal, its standard
+ * input, one at a time. Clients that wait at the same time and with
+ * the same flags are given the same passphrase, from one prompt. The
+ * passphrase is given in a sealed memfd, see agent.h. If all clients
+ * waiting for a prompt give up, the prompt is cancelled.
+ * 
+ * Only clients run by root, by the user running the agent, or by a
+ * user selected with -u are served, unless -a is used.
+ */
+
+
+
+#ifndef MAX_CLIENTS
+# define MAX_CLIENTS  1024
+#endif
+#ifndef MAX_ALLOWED_USERS
+# define MAX_ALLOWED_USERS  64
+#endif
+
+
+/**
+ * A connected client
+ */
+struct client
+{
+  /**
+   * The client's socket, -1 if the slot is unused
+   */
+  int fd;
+  
+  /**
+   * The client's process ID
+   */
+  pid_t pid;
+  
+  /**
+   * Incomplete request
+   */
+  unsigned char request[AGENT_REQUEST_SIZE];
+  
+  /**
+   * The number of bytes in `request`
+   */
+  size_t len;
+  
+  /**
+   * The flags the client wants the passphrase read with,
+   * only set once the request is complete
+   */
+  int flags;
+};
+
+
+
+/**
+ * `argv[0]` from `main`
+ */
+static const char* argv0;
+
+/**
+ * The pathname of the socket
+ */
+static const char* socket_path;
+
+/**
+ * Whether a termination signal has been received
+ */
+static volatile sig_atomic_t terminate = 0;
+
+/**
+ * Users, other than root and ourself, that may use the agent
+ */
+static uid_t allowed_users[MAX_ALLOWED_USERS];
+
+/**
+ * The number of elements in `allowed_users`, -1 if all users are allowed
+ */
+static long allowed_count = 0;
+
+/**
+ * The clients
+ */
+static struct client clients[MAX_CLIENTS];
+
+/**
+ * The prompt that is being answered, `NULL` if none
+ */
+static struct passphrase_session* session = NULL;
+
+/**
+ * The flags `session` was started with
+ */
+static int session_flags;
+
+
+
+/**
+ * Set `terminate`
+ * 
+ * @param  signo  The received signal
+ */
+static void on_terminate(int signo)
+{
+  terminate = 1;
+  (void) signo;
+}
+
+
+/**
+ * Check whether a client may use the agent
+ * 
+ * @param   fd   The client's socket
+ * @param   pid  Output parameter for the client's process ID
+ * @return       Whether the client may use the agent
+ */
+static int is_allowed(int fd, pid_t* pid)
+{
+  struct ucred cred;
+  socklen_t credlen = sizeof(cred);
+  long i;
+  
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen))
+    return 0;
+  *pid = cred.pid;
+  if ((allowed_count < 0) || (cred.uid == 0) || (cred.uid == getuid()))
+    return 1;
+  for (i = 0; i < allowed_count; i++)
+    if (cred.uid == allowed_users[i])
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Accept a new client
+ * 
+ * @param  sock  The listening socket
+ */
+static void accept_client(int sock)
+{
+  int fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  size_t i;
+  pid_t pid;
+  
+  if (fd == -1)
+    return;
+  if (!is_allowed(fd, &pid))
+    goto drop;
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (clients[i].fd == -1)
+      break;
+  if (i == MAX_CLIENTS)
+    goto drop;
+  
+  clients[i].fd = fd;
+  clients[i].pid = pid;
+  clients[i].len = 0;
+  return;
+  
+ drop:
+  close(fd);
+}
+
+
+/**
+ * Disconnect a client
+ * 
+ * @param  i  The index of the client
+ */
+static void drop_client(size_t i)
+{
+  close(clients[i].fd);
+  clients[i].fd = -1;
+  clients[i].len = 0;
+}
+
+
+/**
+ * Check whether a client is waiting for a passphrase
+ * 
+ * @param   i  The index of the client
+ * @return     Whether the client has sent a complete request
+ */
+static int is_waiting(size_t i)
+{
+  return (clients[i].fd != -1) && (clients[i].len == AGENT_REQUEST_SIZE);
+}
+
+
+/**
+ * Check whether any client is waiting for the prompt that is being answered
+ * 
+ * @return  Whether a client is waiting for `session`
+ */
+static int session_wanted(void)
+{
+  size_t i;
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (is_waiting(i) && (clients[i].flags == session_flags))
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Give up the prompt that is being answered
+ */
+static void cancel_prompt(void)
+{
+  char* passphrase = passphrase_session_finish(session);
+  if (passphrase)
+    {
+      passphrase_wipe1(passphrase);
+      free(passphrase);
+    }
+  session = NULL;
+  passphrase_reenable_echo1(STDIN_FILENO);
+}
+
+
+/**
+ * Read from a client, which is only expected
+ * to send its request, and then nothing more
+ * 
+ * @param  i  The index of the client
+ */
+static void read_client(size_t i)
+{
+  struct client* c = clients + i;
+  const unsigned char* req = c->request;
+  unsigned char byte;
+  ssize_t r;
+  
+  if (c->len == AGENT_REQUEST_SIZE)
+    r = read(c->fd, &byte, 1);
+  else
+    r = read(c->fd, c->request + c->len, AGENT_REQUEST_SIZE - c->len);
+  if ((r < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+    return;
+  if ((r <= 0) || (c->len == AGENT_REQUEST_SIZE))
+    {
+      /* The client gave up, the prompt is given up
+	 too if no one else is waiting for it */
+      drop_client(i);
+      if (session && !session_wanted())
+	cancel_prompt();
+      return;
+    }
+  
+  c->len += (size_t)r;
+  if (c->len < AGENT_REQUEST_SIZE)
+    return;
+  if (memcmp(req, AGENT_MAGIC, 4))
+    {
+      drop_client(i);
+      return;
+    }
+  c->flags = (int)((unsigned)req[4] << 24 | (unsigned)req[5] << 16 | (unsigned)req[6] << 8 | req[7]);
+}
+
+
+/**
+ * Get the name of a process, for the prompt
+ * 
+ * @param  pid   The process ID
+ * @param  name  Output parameter for the name, with control characters replaced
+ * @param  n     The size of `name`
+ */
+static void process_name(pid_t pid, char* name, size_t n)
+{
+  char path[sizeof("/proc//comm") + 3 * sizeof(pid_t)];
+  ssize_t r = -1;
+  size_t i;
+  int fd;
+  
+  sprintf(path, "/proc/%ji/comm", (intmax_t)pid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+    {
+      r = read(fd, name, n - 1);
+      close(fd);
+    }
+  if (r <= 0)
+    {
+      snprintf(name, n, "?");
+      return;
+    }
+  name[r] = '\0';
+  if (name[r - 1] == '\n')
+    name[r - 1] = '\0';
+  for (i = 0; name[i]; i++)
+    if ((unsigned char)(name[i]) < ' ')
+      name[i] = ' ';
+}
+
+
+/**
+ * Start the prompt for the longest waiting client, if any is waiting
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int start_prompt(void)
+{
+  char name[64];
+  size_t i;
+  
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (is_waiting(i))
+      break;
+  if (i == MAX_CLIENTS)
+    return 0;
+  
+  process_name(clients[i].pid, name, sizeof(name));
+  session_flags = clients[i].flags;
+  fprintf(stderr, "%s for %s (pid %ji): ",
+	  (session_flags & PASSPHRASE_READ_NEW) ? "New passphrase" : "Passphrase",
+	  name, (intmax_t)(clients[i].pid));
+  fflush(stderr);
+  passphrase_disable_echo1(STDIN_FILENO);
+  session = passphrase_session_start(STDIN_FILENO, session_flags);
+  if (session == NULL)
+    {
+      passphrase_reenable_echo1(STDIN_FILENO);
+      return -1;
+    }
+  return 0;
+}
+
+
+/**
+ * Put a passphrase in a sealed memfd
+ * 
+ * @param   passphrase  The passphrase
+ * @return              The memfd, -1 on error
+ */
+static int seal_passphrase(const char* passphrase)
+{
+  size_t n = strlen(passphrase);
+  ssize_t r;
+  int fd, saved_errno;
+  
+  fd = memfd_create("passphrase", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return -1;
+  while (n)
+    {
+      r = write(fd, passphrase, n);
+      if (r < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  goto fail;
+	}
+      passphrase += (size_t)r;
+      n -= (size_t)r;
+    }
+  if (fcntl(fd, F_ADD_SEALS, AGENT_SEALS | F_SEAL_SEAL))
+    goto fail;
+  return fd;
+  
+ fail:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
+
+/**
+ * Send a reply to a client
+ * 
+ * @param   fd     The client's socket
+ * @param   reply  The reply, `AGENT_REPLY_SIZE` bytes
+ * @param   memfd  The memfd with the passphrase, -1 if none
+ * @return         Zero on success, -1 on error
+ */
+static int send_reply(int fd, unsigned char* reply, int memfd)
+{
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct cmsghdr* cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  iov.iov_base = reply;
+  iov.iov_len = AGENT_REPLY_SIZE;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (memfd >= 0)
+    {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    }
+  return sendmsg(fd, &msg, MSG_NOSIGNAL) == AGENT_REPLY_SIZE ? 0 : -1;
+}
+
+
+/**
+ * End the prompt that has been answered, and give the
+ * passphrase to every client that is waiting for it
+ */
+static void finish_prompt(void)
+{
+  struct passphrase_strength strength;
+  unsigned char reply[AGENT_REPLY_SIZE];
+  char* passphrase;
+  int memfd = -1, error = 0;
+  size_t i;
+  
+  passphrase = passphrase_session_finish2(session, &strength);
+  session = NULL;
+  passphrase_reenable_echo1(STDIN_FILENO);
+  if (passphrase == NULL)
+    error = errno;
+  else if ((memfd = seal_passphrase(passphrase)) == -1)
+    error = errno;
+  if (passphrase)
+    {
+      passphrase_wipe1(passphrase);
+      free(passphrase);
+    }
+  
+  passphrase_agent_reply__(reply, error, &strength);
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (is_waiting(i) && (clients[i].flags == session_flags))
+      {
+	send_reply(clients[i].fd, reply, memfd);
+	drop_client(i);
+      }
+  if (memfd >= 0)
+    close(memfd);
+}
+
+
+/**
+ * Create the listening socket
+ * 
+ * @return  The socket, -1 on error
+ */
+static int create_socket(void)
+{
+  struct sockaddr_un addr;
+  int fd;
+  
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+    return errno = ENAMETOOLONG, -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  
+  fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  unlink(socket_path);
+  if (bind(fd, (const struct sockaddr*)&addr, (socklen_t)sizeof(addr)) ||
+      chmod(socket_path, 0666) ||
+      listen(fd, SOMAXCONN))
+    {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+/**
+ * Print usage information and exit
+ */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+static void usage(void)
+{
+  fprintf(stderr, "usage: %s [-a] [-u UID]... SOCKET\n", argv0);
+  exit(2);
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        Zero on success
+ */
+int main(int argc, char** argv)
+{
+  static struct pollfd fds[MAX_CLIENTS + 1 + PASSPHRASE_SESSION_FDS];
+  static size_t fd_client[MAX_CLIENTS + 1];
+  unsigned char reply[AGENT_REPLY_SIZE];
+  struct sigaction sa;
+  size_t i, n, nfds;
+  int sock, opt, timeout, rc = 1;
+  
+  argv0 = argc ? *argv : "passagentd";
+  while ((opt = getopt(argc, argv, "au:")) != -1)
+    switch (opt)
+      {
+      case 'a':
+	allowed_count = -1;
+	break;
+      case 'u':
+	if (allowed_count < 0)
+	  break;
+	if (allowed_count == MAX_ALLOWED_USERS)
+	  usage();
+	allowed_users[allowed_count++] = (uid_t)atol(optarg);
+	break;
+      default:
+	usage();
+      }
+  if (optind + 1 != argc)
+    usage();
+  socket_path = argv[optind];
+  
+  if (!isatty(STDIN_FILENO) || !isatty(STDERR_FILENO))
+    {
+      fprintf(stderr, "%s: the standard input and error must be a terminal\n", argv0);
+      return 1;
+    }
+  
+  /* Keep passphrases out of swap */
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+  
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_terminate;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  
+  for (i = 0; i < MAX_CLIENTS; i++)
+    clients[i].fd = -1;
+  
+  sock = create_socket();
+  if (sock == -1)
+    {
+      perror(argv0);
+      return 1;
+    }
+  
+  while (!terminate)
+    {
+      if ((session == NULL) && start_prompt())
+	{
+	  perror(argv0);
+	  goto done;
+	}
+  
+      nfds = 0;
+      fds[nfds].fd = sock;
+      fds[nfds++].events = POLLIN;
+      for (i = 0; i < MAX_CLIENTS; i++)
+	if (clients[i].fd != -1)
+	  {
+	    fd_client[nfds] = i;
+	    fds[nfds].fd = clients[i].fd;
+	    fds[nfds++].events = POLLIN;
+	  }
+      n = session ? passphrase_session_fds(session, fds + nfds) : 0;
+      if (session && (n == 0))
+	{
+	  if (passphrase_session_step(session))
+	    finish_prompt();
+	  continue;
+	}
+      /* Once the passphrase has been entered, the meter's rating
+	 is only waited for until the session's time runs out */
+      timeout = session ? passphrase_session_timeout(session) : -1;
+      if (timeout == 0)
+	{
+	  finish_prompt();
+	  continue;
+	}
+  
+      if (poll(fds, (nfds_t)(nfds + n), timeout) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror(argv0);
+	  goto done;
+	}
+  
+      if (fds[0].revents & POLLIN)
+	accept_client(sock);
+      for (i = 1; i < nfds; i++)
+	if (fds[i].revents && (clients[fd_client[i]].fd == fds[i].fd))
+	  read_client(fd_client[i]);
+      /* A client may have cancelled the prompt */
+      if (session)
+	for (i = nfds; i < nfds + n; i++)
+	  if (fds[i].revents)
+	    {
+	      if (passphrase_session_step(session))
+		finish_prompt();
+	      break;
+	    }
+    }
+  rc = 0;
+  
+ done:
+  if (session)
+    cancel_prompt();
+  passphrase_agent_reply__(reply, ECANCELED, NULL);
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (clients[i].fd != -1)
+      {
+	if (is_waiting(i))
+	  send_reply(clients[i].fd, reply, -1);
+	drop_client(i);
+      }
+  close(sock);
+  unlink(socket_path);
+  return rc;
+}
+
@@ -0,0 +1,771 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "passphrase.h"
+#include "meter.h"
+
+
+
+/*
+ * passcheckd — shared passphrase strength meter daemon
+ * 
+ * Usage: passcheckd [-a] [-u UID]... [-m METER] SOCKET
+ * 
+ * Runs one passphrase strength meter, `passcheck -r` unless -m is
+ * used, so that its dictionaries and models are only loaded once, and
+ * lets any number of libpassphrase clients use it concurrently over a
+ * UNIX socket. Clients select it by setting `LIBPASSPHRASE_METER` to
+ * "unix:" followed by the pathname of the socket.
+ * 
+ * Only clients run by root, by the user running the daemon, or by a
+ * user selected with -u are served, unless -a is used. Each query is
+ * tagged with a request ID when forwarded to the meter, which answers
+ * in order, so that the reply is routed back to the right session and
+ * replies for sessions that have ended are discarded.
+ * 
+ * Clients may use binary framing, see meter.h, even though the meter
+ * uses text; they may then send queries without waiting for replies.
+ */
+
+
+
+#ifndef MAX_CLIENTS
+# define MAX_CLIENTS  1024
+#endif
+#ifndef MAX_IN_FLIGHT
+# define MAX_IN_FLIGHT  256
+#endif
+#ifndef MAX_QUERY
+# define MAX_QUERY  (64 << 10)
+#endif
+#ifndef MAX_ALLOWED_USERS
+# define MAX_ALLOWED_USERS  64
+#endif
+
+
+/**
+ * A connected client
+ */
+struct client
+{
+  /**
+   * The client's socket, -1 if the slot is unused
+   */
+  int fd;
+  
+  /**
+   * Incremented each time the slot is reused, so that
+   * replies to a closed session are not sent to another
+   */
+  unsigned long long int generation;
+  
+  /**
+   * Incomplete query
+   */
+  char* buf;
+  
+  /**
+   * The number of bytes in `buf`
+   */
+  size_t len;
+  
+  /**
+   * 1 if the client uses binary framing, -1 if it uses
+   * text, 0 if it has not sent anything yet
+   */
+  int binary;
+};
+
+
+/**
+ * A query that has been forwarded to the meter
+ */
+struct request
+{
+  /**
+   * The request's ID
+   */
+  unsigned long long int id;
+  
+  /**
+   * The index of the client that sent the query
+   */
+  size_t client;
+  
+  /**
+   * The generation of the client when the query was sent
+   */
+  unsigned long long int generation;
+  
+  /**
+   * The client's request ID, if it uses binary framing
+   */
+  uint32_t client_id;
+};
+
+
+
+/**
+ * `argv[0]` from `main`
+ */
+static const char* argv0;
+
+/**
+ * The meter command
+ */
+static const char* meter = "passcheck";
+
+/**
+ * The pathname of the socket
+ */
+static const char* socket_path;
+
+/**
+ * Whether a termination signal has been received
+ */
+static volatile sig_atomic_t terminate = 0;
+
+/**
+ * Users, other than root and ourself, that may use the daemon
+ */
+static uid_t allowed_users[MAX_ALLOWED_USERS];
+
+/**
+ * The number of elements in `allowed_users`, -1 if all users are allowed
+ */
+static long allowed_count = 0;
+
+/**
+ * The meter process, and pipes to and from it
+ */
+static pid_t meter_pid = -1;
+static int meter_in = -1;
+static int meter_out = -1;
+
+/**
+ * Buffer for a reply from the meter
+ */
+static char reply[256];
+static size_t reply_len = 0;
+
+/**
+ * The clients
+ */
+static struct client clients[MAX_CLIENTS];
+
+/**
+ * Ring buffer of forwarded queries, in the order they were sent
+ */
+static struct request queue[MAX_IN_FLIGHT];
+static size_t queue_head = 0;
+static size_t queue_len = 0;
+
+/**
+ * The ID of the next request
+ */
+static unsigned long long int next_id = 1;
+
+
+
+/**
+ * Set `terminate`
+ * 
+ * @param  signo  The received signal
+ */
+static void on_terminate(int signo)
+{
+  terminate = 1;
+  (void) signo;
+}
+
+
+/**
+ * Start the meter
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int start_meter(void)
+{
+  int in[2], out[2];
+  
+  if (pipe(in))
+    return -1;
+  if (pipe(out))
+    {
+      close(in[0]), close(in[1]);
+      return -1;
+    }
+  
+  meter_pid = fork();
+  if (meter_pid == -1)
+    {
+      close(in[0]), close(in[1]);
+      close(out[0]), close(out[1]);
+      return -1;
+    }
+  
+  if (meter_pid == 0)
+    {
+      if ((dup2(in[0], STDIN_FILENO) == -1) || (dup2(out[1], STDOUT_FILENO) == -1))
+	_exit(1);
+      close(in[0]), close(in[1]);
+      close(out[0]), close(out[1]);
+      execlp(meter, meter, "-r", NULL);
+      perror(argv0);
+      _exit(1);
+    }
+  
+  close(in[0]), close(out[1]);
+  meter_in = in[1];
+  meter_out = out[0];
+  fcntl(meter_in, F_SETFD, FD_CLOEXEC);
+  fcntl(meter_out, F_SETFD, FD_CLOEXEC);
+  reply_len = 0;
+  return 0;
+}
+
+
+/**
+ * Disconnect a client
+ * 
+ * @param  i  The index of the client
+ */
+static void drop_client(size_t i)
+{
+  close(clients[i].fd);
+  clients[i].fd = -1;
+  clients[i].generation++;
+  if (clients[i].buf)
+    {
+      passphrase_wipe(clients[i].buf, MAX_QUERY);
+      free(clients[i].buf);
+      clients[i].buf = NULL;
+    }
+  clients[i].len = 0;
+}
+
+
+/**
+ * Stop the meter and disconnect all clients that are
+ * waiting for a reply, the clients will fall back to
+ * their own meter or stop using the meter
+ */
+static void stop_meter(void)
+{
+  int status;
+  struct request* req;
+  
+  if (meter_pid == -1)
+    return;
+  
+  close(meter_in), meter_in = -1;
+  close(meter_out), meter_out = -1;
+  while ((waitpid(meter_pid, &status, 0) == -1) && (errno == EINTR));
+  meter_pid = -1;
+  
+  for (; queue_len; queue_len--, queue_head = (queue_head + 1) % MAX_IN_FLIGHT)
+    {
+      req = queue + queue_head;
+      if (clients[req->client].generation == req->generation)
+	drop_client(req->client);
+    }
+}
+
+
+/**
+ * Check whether a connecting user may use the daemon
+ * 
+ * @param   fd  The client's socket
+ * @return      1 if the client may use the daemon, 0 otherwise
+ */
+static int is_allowed(int fd)
+{
+  struct ucred cred;
+  socklen_t credlen = sizeof(cred);
+  long i;
+  
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen))
+    return 0;
+  if ((allowed_count < 0) || (cred.uid == 0) || (cred.uid == getuid()))
+    return 1;
+  for (i = 0; i < allowed_count; i++)
+    if (cred.uid == allowed_users[i])
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Accept a new client
+ * 
+ * @param  sock  The listening socket
+ */
+static void accept_client(int sock)
+{
+  int fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  size_t i;
+  
+  if (fd == -1)
+    return;
+  if (!is_allowed(fd))
+    goto drop;
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (clients[i].fd == -1)
+      break;
+  if (i == MAX_CLIENTS)
+    goto drop;
+  
+  clients[i].buf = malloc(MAX_QUERY);
+  if (clients[i].buf == NULL)
+    goto drop;
+  mlock(clients[i].buf, MAX_QUERY);
+  clients[i].fd = fd;
+  clients[i].len = 0;
+  clients[i].binary = 0;
+  return;
+  
+ drop:
+  close(fd);
+}
+
+
+/**
+ * Write a complete buffer to the meter
+ * 
+ * @param   buf  The buffer
+ * @param   n    The size of the buffer
+ * @return       Zero on success, -1 on error
+ */
+static int meter_write(const char* buf, size_t n)
+{
+  ssize_t r;
+  while (n)
+    {
+      r = write(meter_in, buf, n);
+      if (r < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      buf += (size_t)r;
+      n -= (size_t)r;
+    }
+  return 0;
+}
+
+
+/**
+ * Remove a message from the start of a client's buffer
+ * 
+ * @param  c  The client
+ * @param  n  The length of the message
+ */
+static void consume(struct client* c, size_t n)
+{
+  passphrase_wipe(c->buf, n);
+  memmove(c->buf, c->buf + n, c->len - n);
+  c->len -= n;
+  passphrase_wipe(c->buf + c->len, n);
+}
+
+
+/**
+ * Forward a query to the meter
+ * 
+ * @param   i      The index of the client
+ * @param   query  The passphrase
+ * @param   n      The length of `query`, including the line feed for text clients
+ * @param   id     The client's request ID
+ * @return         Zero on success, -1 if the client was dropped
+ */
+static int forward(size_t i, const char* query, size_t n, uint32_t id)
+{
+  struct request* req;
+  
+  if ((meter_pid == -1) || meter_write(query, n) || ((clients[i].binary > 0) && meter_write("\n", 1)))
+    {
+      stop_meter();
+      drop_client(i);
+      return -1;
+    }
+  
+  req = queue + (queue_head + queue_len++) % MAX_IN_FLIGHT;
+  req->id = next_id++;
+  req->client = i;
+  req->generation = clients[i].generation;
+  req->client_id = id;
+  return 0;
+}
+
+
+/**
+ * Forward the first query in a client's buffer to the meter
+ * 
+ * @param   i  The index of the client
+ * @return     1 if there is no complete query in the buffer,
+ *             -1 if the client was dropped, zero otherwise
+ */
+static int forward_query(size_t i)
+{
+  struct client* c = clients + i;
+  const unsigned char* header = (const unsigned char*)(c->buf);
+  size_t n;
+  char* nl;
+  
+  if (c->binary > 0)
+    {
+      if (c->len < METER_FRAME_HEADER)
+	return 1;
+      n = (size_t)header[8] << 24 | (size_t)header[9] << 16 | (size_t)header[10] << 8 | (size_t)header[11];
+      /* The meter reads lines, so a line feed would desynchronise it */
+      if ((header[0] != METER_FRAME_QUERY) || (n > MAX_QUERY - METER_FRAME_HEADER) ||
+	  ((c->len >= METER_FRAME_HEADER + n) && memchr(c->buf + METER_FRAME_HEADER, '\n', n)))
+	{
+	  drop_client(i);
+	  return -1;
+	}
+      if (c->len < METER_FRAME_HEADER + n)
+	return 1;
+      if (forward(i, c->buf + METER_FRAME_HEADER, n,
+		  (uint32_t)header[4] << 24 | (uint32_t)header[5] << 16 | (uint32_t)header[6] << 8 | header[7]))
+	return -1;
+      consume(c, METER_FRAME_HEADER + n);
+      return 0;
+    }
+  
+  nl = memchr(c->buf, '\n', c->len);
+  if (nl == NULL)
+    return 1;
+  n = (size_t)(nl - c->buf) + 1;
+  
+  /* Negotiate binary framing before the first query */
+  if (c->binary == 0)
+    {
+      c->binary = -1;
+      if ((n == sizeof(METER_BINARY_HELLO) - 1) && !memcmp(c->buf, METER_BINARY_HELLO, n))
+	{
+	  n = sizeof(METER_BINARY_ACK) - 1;
+	  if (send(c->fd, METER_BINARY_ACK, n, MSG_NOSIGNAL) != (ssize_t)n)
+	    {
+	      drop_client(i);
+	      return -1;
+	    }
+	  c->binary = 1;
+	  consume(c, sizeof(METER_BINARY_HELLO) - 1);
+	  return 0;
+	}
+    }
+  
+  /* Text clients wait for the reply before sending the next query */
+  if (forward(i, c->buf, n, 0))
+    return -1;
+  consume(c, n);
+  return 0;
+}
+
+
+/**
+ * Forward the complete queries in a client's
+ * buffer while too many are not in flight
+ * 
+ * @param  i  The index of the client
+ */
+static void forward_queries(size_t i)
+{
+  int r = 0;
+  while ((queue_len < MAX_IN_FLIGHT) && clients[i].len && !(r = forward_query(i)));
+  if ((r > 0) && (clients[i].len == MAX_QUERY))
+    drop_client(i);
+}
+
+
+/**
+ * Read from a client, and forward the queries
+ * to the meter once they have been read
+ * 
+ * @param  i  The index of the client
+ */
+static void read_client(size_t i)
+{
+  struct client* c = clients + i;
+  ssize_t r;
+  
+  r = read(c->fd, c->buf + c->len, MAX_QUERY - c->len);
+  if (r <= 0)
+    {
+      if ((r < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+	return;
+      drop_client(i);
+      return;
+    }
+  c->len += (size_t)r;
+  forward_queries(i);
+}
+
+
+/**
+ * Send a reply from the meter to a client
+ * 
+ * @param   req    The query
+ * @param   line   The reply
+ * @param   n      The length of `line`, including the line feed
+ * @return         Zero on success, -1 on error
+ */
+static int send_reply(const struct request* req, const char* line, size_t n)
+{
+  struct meter_reply parsed;
+  unsigned char frame[METER_FRAME_HEADER + 8];
+  int fd = clients[req->client].fd, i;
+  
+  if (clients[req->client].binary < 0)
+    return send(fd, line, n, MSG_NOSIGNAL) == (ssize_t)n ? 0 : -1;
+  
+  parsed.state = 0;
+  passphrase_meter_parse__(&parsed, line, n);
+  passphrase_meter_frame__(frame, METER_FRAME_REPLY, 0, req->client_id, 8);
+  for (i = 0; i < 8; i++)
+    frame[METER_FRAME_HEADER + i] = (unsigned char)(parsed.value >> (56 - 8 * i));
+  return send(fd, frame, sizeof(frame), MSG_NOSIGNAL) == (ssize_t)sizeof(frame) ? 0 : -1;
+}
+
+
+/**
+ * Read replies from the meter and route them
+ * to the clients that sent the queries
+ * 
+ * @return  Zero on success, -1 if the meter has died
+ */
+static int read_meter(void)
+{
+  struct request* req;
+  ssize_t r;
+  char* nl;
+  size_t n;
+  
+  r = read(meter_out, reply + reply_len, sizeof(reply) - reply_len);
+  if (r <= 0)
+    return ((r < 0) && (errno == EINTR)) ? 0 : -1;
+  reply_len += (size_t)r;
+  
+  while ((nl = memchr(reply, '\n', reply_len)))
+    {
+      n = (size_t)(nl - reply) + 1;
+      if (queue_len == 0)
+	return -1;
+      req = queue + queue_head;
+      queue_head = (queue_head + 1) % MAX_IN_FLIGHT;
+      queue_len--;
+      if (clients[req->client].generation == req->generation)
+	if (send_reply(req, reply, n))
+	  drop_client(req->client);
+      /* The meter may echo the passphrase */
+      passphrase_wipe(reply, n);
+      memmove(reply, reply + n, reply_len -= n);
+    }
+  
+  /* The meter may only send one line per query, but
+     the end of an overlong line is simply discarded */
+  if (reply_len == sizeof(reply))
+    reply_len = 0;
+  return 0;
+}
+
+
+/**
+ * Create the listening socket
+ * 
+ * @return  The socket, -1 on error
+ */
+static int create_socket(void)
+{
+  struct sockaddr_un addr;
+  int fd;
+  
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+    return errno = ENAMETOOLONG, -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  
+  fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  unlink(socket_path);
+  if (bind(fd, (const struct sockaddr*)&addr, (socklen_t)sizeof(addr)) ||
+      chmod(socket_path, 0666) ||
+      listen(fd, SOMAXCONN))
+    {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+/**
+ * Print usage information and exit
+ */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+static void usage(void)
+{
+  fprintf(stderr, "usage: %s [-a] [-u UID]... [-m METER] SOCKET\n", argv0);
+  exit(2);
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        Zero on success
+ */
+int main(int argc, char** argv)
+{
+  static struct pollfd fds[MAX_CLIENTS + 2];
+  static size_t fd_client[MAX_CLIENTS + 2];
+  struct sigaction sa;
+  size_t i, nfds;
+  int sock, opt, rc = 1;
+  
+  argv0 = argc ? *argv : "passcheckd";
+  while ((opt = getopt(argc, argv, "au:m:")) != -1)
+    switch (opt)
+      {
+      case 'a':
+	allowed_count = -1;
+	break;
+      case 'u':
+	if (allowed_count < 0)
+	  break;
+	if (allowed_count == MAX_ALLOWED_USERS)
+	  usage();
+	allowed_users[allowed_count++] = (uid_t)atol(optarg);
+	break;
+      case 'm':
+	meter = optarg;
+	break;
+      default:
+	usage();
+      }
+  if (optind + 1 != argc)
+    usage();
+  socket_path = argv[optind];
+  
+  /* Queries contain passphrases, keep them out of swap */
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+  
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_terminate;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  
+  for (i = 0; i < MAX_CLIENTS; i++)
+    clients[i].fd = -1;
+  
+  sock = create_socket();
+  if (sock == -1)
+    {
+      perror(argv0);
+      return 1;
+    }
+  if (start_meter())
+    {
+      perror(argv0);
+      goto done;
+    }
+  
+  while (!terminate)
+    {
+      if (meter_pid == -1)
+	if (start_meter())
+	  {
+	    perror(argv0);
+	    goto done;
+	  }
+  
+      nfds = 0;
+      fds[nfds].fd = meter_out;
+      fds[nfds++].events = POLLIN;
+      fds[nfds].fd = sock;
+      fds[nfds++].events = POLLIN;
+      /* Stop reading queries while too many are in flight,
+         so that the meter's pipes never fill up */
+      if (queue_len < MAX_IN_FLIGHT)
+	for (i = 0; i < MAX_CLIENTS; i++)
+	  if (clients[i].fd != -1)
+	    {
+	      fd_client[nfds] = i;
+	      fds[nfds].fd = clients[i].fd;
+	      fds[nfds++].events = POLLIN;
+	    }
+  
+      if (poll(fds, (nfds_t)nfds, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror(argv0);
+	  goto done;
+	}
+  
+      if (fds[0].revents)
+	if (read_meter())
+	  stop_meter();
+      /* Binary clients may have sent queries that
+         were not forwarded while too many were in flight */
+      for (i = 0; (i < MAX_CLIENTS) && (queue_len < MAX_IN_FLIGHT); i++)
+	if ((clients[i].fd != -1) && (clients[i].binary > 0) && clients[i].len)
+	  forward_queries(i);
+      if (fds[1].revents & POLLIN)
+	accept_client(sock);
+      for (i = 2; i < nfds; i++)
+	if (fds[i].revents && (clients[fd_client[i]].fd == fds[i].fd))
+	  if (queue_len < MAX_IN_FLIGHT)
+	    read_client(fd_client[i]);
+    }
+  rc = 0;
+  
+ done:
+  for (i = 0; i < MAX_CLIENTS; i++)
+    if (clients[i].fd != -1)
+      drop_client(i);
+  stop_meter();
+  close(sock);
+  unlink(socket_path);
+  return rc;
+}
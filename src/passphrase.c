@@ -16,6 +16,7 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -24,528 +25,3574 @@
 #include <errno.h>
 #include <limits.h>
 #include <termios.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* See `draw_directly` in passphrase_helper.h */
+#define draw_directly()  (direct)
+
+/* See `output_stream` in passphrase_helper.h */
+#define output_stream()  (s->output.stream)
+
+/* See `retract_output` in passphrase_helper.h */
+#define retract_output(STR)  passphrase_output_retract__(&(s->output), STR, sizeof(STR) - 1)
 
 #define PASSPHRASE_USE_DEPRECATED
 #include "passphrase.h"
 #include "passphrase_helper.h"
+#include "keytrace.h"
+#include "meter.h"
+#include "policy.h"
+#include "utf8.h"
+#include "wipe.h"
+#include "output.h"
+#include "probes.h"
+#include "agent.h"
+#include "echoes.h"
 
 
 #ifndef START_PASSPHRASE_LIMIT
 # define START_PASSPHRASE_LIMIT  32
 #endif
-#ifndef DEFAULT_PASSPHRASE_METER
-# define DEFAULT_PASSPHRASE_METER  "passcheck"
+#ifndef MAX_STREAM_PREALLOCATION
+# define MAX_STREAM_PREALLOCATION  (64L << 20)
+#endif
+
+/* Keys can be more than one byte long, see `key_length` */
+#if defined(PASSPHRASE_MOVE) && (defined(PASSPHRASE_DEDICATED) || defined(PASSPHRASE_OVERRIDE))
+# define MULTIBYTE_KEYS
 #endif
 
 
 
-#ifdef PASSPHRASE_METER
-struct passcheck_state
+#ifdef PASSPHRASE_VIEWPORT
+/**
+ * The part of the passphrase that is displayed. While the passphrase
+ * fits on the line, the editing macros draw their changes themselves;
+ * otherwise only a window around the point is drawn, with scroll
+ * markers at edges where characters are hidden.
+ */
+struct viewport
 {
-  const char* label;
-  int pipe_rw[2];
-  pid_t pid;
-  int flags;
+  /**
+   * The width of the terminal, 0 if not known
+   */
+  size_t columns;
+  
+  /**
+   * The column the passphrase starts at, not known until
+   * the terminal has answered the cursor position query
+   */
+  size_t start;
+  int start_known;
+  
+  /**
+   * The first displayed character, and the position of
+   * the cursor relative to the start of the passphrase
+   */
+  size_t offset;
+  size_t cursor;
+  
+  /**
+   * Whether the display is drawn by the renderer
+   */
+  int scrolled;
+  
+  /**
+   * The value of `winch_count` when `columns` was read
+   */
+  sig_atomic_t winch;
+  
+  /**
+   * Whether the SIGWINCH handler has been installed for the session
+   */
+  int watching;
+  
+  /**
+   * Whether the answer to the cursor position query is
+   * expected, and the part of it that has been read
+   */
+  int awaiting;
+  unsigned char report[16];
+  size_t reportlen;
 };
+#endif /* PASSPHRASE_VIEWPORT */
 
-static char* strength = NULL;
-static size_t strength_size = 0;
-#endif /* PASSPHRASE_METER */
 
+#ifdef PASSPHRASE_QUERY
+/**
+ * The terminal saves and restores the cursor with DECSC and DECRC,
+ * which are shorter than the ANSI sequences and, unlike them, not
+ * affected by left and right margins; assumed for every terminal
+ * that answers the primary device attributes query
+ */
+#define TERMINAL_DECSC  1
+
+/**
+ * The terminal supports synchronized output, DEC private mode 2026
+ */
+#define TERMINAL_SYNC  2
 
+/**
+ * The terminal supports bracketed paste, DEC private mode 2004,
+ * so the markers around pasted text are removed from the input,
+ * in case the application has enabled it
+ */
+#define TERMINAL_PASTE  4
 
-#ifndef PASSPHRASE_REALLOC
-static char* xrealloc(char* array, size_t cur_size, size_t new_size)
+/**
+ * What the terminal supports, learned by asking it when
+ * the first passphrase is read from it, see `terminal_query`
+ */
+struct terminal
 {
-  char* rc = malloc(new_size * sizeof(char));
-  size_t i;
-  if (rc)
-    for (i = 0; i < cur_size; i++)
-	*(rc + i) = *(array + i);
-  passphrase_wipe(array, cur_size);
-  free(array);
-  return rc;
-}
-#else /* !PASSPHRASE_REALLOC */
-# define xrealloc(array, _cur_size, new_size)  realloc(array, (new_size) * sizeof(char))
-#endif /* !PASSPHRASE_REALLOC */
+  /**
+   * The terminal device
+   */
+  dev_t device;
+  
+  /**
+   * What the terminal is known to support, `TERMINAL_*` or:ed together
+   */
+  int caps;
+  
+  /**
+   * Whether the terminal can be asked questions: it is the input,
+   * and neither echoes nor buffers its answers; not remembered
+   * with what the terminal supports, as it depends on the session
+   */
+  int answers;
+  
+  /**
+   * Whether the answers to the queries are expected, and the part
+   * of an answer, or of a bracketed paste marker, that has been read
+   */
+  int awaiting;
+  unsigned char report[64];
+  size_t reportlen;
+};
+#endif /* PASSPHRASE_QUERY */
+
+
+/**
+ * Recorder of keystroke timings, enabled by setting the environment
+ * variable `LIBPASSPHRASE_KEYTRACE` to the pathname of the trace file.
+ * Only the class of each key and the time between keys are recorded.
+ */
+struct keytrace
+{
+  const char* path;
+  struct timespec last;
+  size_t n;
+  unsigned char buf[512];
+};
 
 
 #ifdef PASSPHRASE_METER
-static void passcheck_start(struct passcheck_state* state, int flags)
+/**
+ * The number of queries that may be sent to a strength meter
+ * using binary framing before earlier queries have been answered
+ */
+#ifndef METER_PIPELINE
+# define METER_PIPELINE  4
+#endif
+
+/**
+ * The number of milliseconds to wait, after Enter is pressed, for
+ * the final passphrase to be rated when `PASSPHRASE_READ_STRENGTH`
+ * is used with `passphrase_read4`
+ */
+#ifndef METER_RATE_TIMEOUT
+# define METER_RATE_TIMEOUT  1000
+#endif
+
+/**
+ * The number of milliseconds the strength meter may take to rate
+ * the passphrase before an estimate is displayed in its place,
+ * unless `LIBPASSPHRASE_METER_BUDGET` is set; 0 for never
+ */
+#ifndef METER_LATENCY_BUDGET
+# define METER_LATENCY_BUDGET  250
+#endif
+
+/**
+ * The number of times a strength meter that dies is restarted,
+ * and the number of milliseconds to wait before the first restart,
+ * which is doubled for each restart
+ */
+#ifndef METER_MAX_RESTARTS
+# define METER_MAX_RESTARTS  5
+#endif
+#ifndef METER_RESTART_DELAY
+# define METER_RESTART_DELAY  100
+#endif
+
+/**
+ * The number of milliseconds a stopped strength meter is given
+ * to exit by itself before it is killed, and the number of
+ * stopped meters that can wait to be reaped; it is reaped
+ * by a later call, rather than waited for when it is stopped,
+ * and the oldest is killed when another does not fit
+ */
+#ifndef METER_GRACE_PERIOD
+# define METER_GRACE_PERIOD  1000
+#endif
+#ifndef METER_MAX_STOPPED
+# define METER_MAX_STOPPED  8
+#endif
+
+struct passcheck_state
 {
+  const char* label;
   const char* command;
-  int pipe_rw[2] = { -1, -1 };
-  int exec_rw[2] = { -1, -1 };
+  int pipe_rw[2];
   pid_t pid;
-  ssize_t n;
-  int i = 0;
   
-  state->pid = -1;
-  state->flags = (flags & PASSPHRASE_READ_NEW) ? (flags ^ PASSPHRASE_READ_NEW) : 0;
-  if (state->flags == 0)
-    return;
+  /**
+   * Process file descriptor for the meter, that becomes readable
+   * when it exits, -1 if the meter is not a child process or if
+   * process file descriptors are not supported
+   */
+  int pidfd;
   
-  if (state->flags & PASSPHRASE_READ_BELOW_FREE)
-    state->flags &= ~PASSPHRASE_READ_SCREEN_FREE;
+  int flags;
+  int is_socket;
   
-  command = getenv("LIBPASSPHRASE_METER");
-  if (!command || !*command)
-    command = DEFAULT_PASSPHRASE_METER;
+  /**
+   * `METER_MODE_HELLO`, `METER_MODE_TEXT`, or `METER_MODE_BINARY`
+   */
+  int mode;
   
-  state->label = getenv("LIBPASSPHRASE_STRENGTH_LABEL");
-  if (!(state->label) || !*(state->label))
-    state->label = PASSPHRASE_TEXT_STRENGTH;
+  /**
+   * The number of queries that have been sent but not answered
+   */
+  int outstanding;
   
-  xpipe(state->pipe_rw);
-  xpipe(pipe_rw);
-  xpipe(exec_rw);
-  /* ‘Their integer values shall be the two lowest available at the time of the pipe() call’ [man 3p pipe]
-   * This guarantees (unless the application is doing something stupid) that the file desriptors
-   * in exec_rw[1] is not stdin, stdout, stderr, or 0 (required by FD_CLOEXEC to take affect), assuming
-   * stdin, stdout, and stderr are 0, 1, and 2, respectively, as specified in `man 3p stdin`. */
+  /**
+   * Whether the passphrase has changed since the last query
+   */
+  int dirty;
   
-  if (fcntl(exec_rw[1], F_SETFD, FD_CLOEXEC) == -1)
-    goto fail;
+  /**
+   * The ID of the last query, and of the query whose
+   * reply is displayed, when binary framing is used
+   */
+  uint32_t last_id;
+  uint32_t shown_id;
   
-  pid = fork();
-  if (pid == -1)
-    {
-      state->flags = 0;
-      goto fail;
-    }
+  /**
+   * The newest strength the meter has given,
+   * and whether it has given any
+   */
+  int rated;
+  unsigned long long int score;
+  int tier;
+  const char* description;
+  char hint[METER_HINT_MAX + 1];
   
-  close(exec_rw[!!pid]), exec_rw[!!pid] = -1;
-  close(state->pipe_rw[!!pid]), state->pipe_rw[!!pid] = -1;
-  close(pipe_rw[!pid]), pipe_rw[!pid] = -1;
-  state->pipe_rw[!!pid] = pipe_rw[!!pid], pipe_rw[!!pid] = -1;
+  /**
+   * The stream the strength is drawn to, and where it is drawn,
+   * `PASSPHRASE_READ_SCREEN_FREE` or `PASSPHRASE_READ_BELOW_FREE`,
+   * which is remembered after the meter has stopped; 0 if the
+   * meter was never started
+   */
+  FILE* out;
+  int placement;
   
-  if (pid == 0)
-    {
-      gid_t gid = getgid(), egid = getegid();
-      uid_t uid = getuid(), euid = geteuid();
-      int fd;
-      
-      if ((state->pipe_rw[0] != STDIN_FILENO) && (state->pipe_rw[1] == STDIN_FILENO))
-	{
-	  fd = dup(state->pipe_rw[1]);
-	  if (fd == -1)
-	    goto child_fail;
-	  state->pipe_rw[1] = fd;
-	}
-      for (i = 0; i <= 1; i++)
-	if (state->pipe_rw[i] != i)
-	  {
-	    close(i);
-	    fd = dup2(state->pipe_rw[i], i);
-	    if (fd == -1)
-	      goto child_fail;
-	    close(state->pipe_rw[i]);
-	    state->pipe_rw[i] = fd;
-	  }
-      
-      close(STDERR_FILENO);
-      
-      if (egid != gid)
-	if (setregid(gid, gid) && gid)
-	  goto child_fail;
-      if (euid != uid)
-	if (setreuid(uid, uid) && uid)
-	  goto child_fail;
-      
-      execlp(command, command, "-r", NULL);
-    child_fail:
-      n = write(exec_rw[1], &i, sizeof(i));
-      _exit(!!n);
-    }
+  /**
+   * Timer for estimates and restarts, -1 if there is none,
+   * in which case a meter that dies is not restarted,
+   * and whether it is armed
+   */
+  int timer;
+  int armed;
   
- rewait:
-  n = read(exec_rw[0], &i, sizeof(i));
-  if ((n < 0) && (errno == EINTR))
-    goto rewait;
-  if (n)
-    {
-    rereap:
-      if ((waitpid(pid, &i, 0) == -1) && (errno == EINTR))
-	goto rereap;
-      goto fail;
-    }
+  /**
+   * The latency budget, in milliseconds, 0 if estimates are never
+   * displayed, and when the passphrase shall be estimated unless
+   * the meter has rated it, `due.tv_sec` is -1 if no estimate is due
+   */
+  long int budget;
+  struct timespec due;
   
-  if (state->flags & PASSPHRASE_READ_SCREEN_FREE)
-    {
-      struct termios stty;
-      struct termios saved_stty;
-      tcgetattr(STDERR_FILENO, &stty);
-      saved_stty = stty;
-      stty.c_oflag &= (tcflag_t)~ONLCR;
-      tcsetattr(STDERR_FILENO, TCSAFLUSH, &stty);
-      fprintf(stderr, "\n\033[A");
-      fflush(stderr);
-      tcsetattr(STDERR_FILENO, TCSAFLUSH, &saved_stty);
-    }
+  /**
+   * Whether the displayed strength is an estimate, and the estimate
+   */
+  int provisional;
+  unsigned long long int estimate;
   
-  close(exec_rw[0]);
-  state->pid = pid;
-  return;
- fail:
-  if (state->pipe_rw[0] >= 0)  close(state->pipe_rw[0]);
-  if (state->pipe_rw[1] >= 0)  close(state->pipe_rw[1]);
-  if (pipe_rw[0] >= 0)  close(pipe_rw[0]);
-  if (pipe_rw[1] >= 0)  close(pipe_rw[1]);
-  if (exec_rw[0] >= 0)  close(exec_rw[0]);
-  if (exec_rw[1] >= 0)  close(exec_rw[1]);
-  state->pid = -1;
-  state->flags = 0;
-}
+  /**
+   * Whether the meter has died and is waiting to be restarted,
+   * when it is restarted, and how many times it has been restarted
+   */
+  int down;
+  struct timespec restart_at;
+  unsigned int restarts;
+  
+  /**
+   * Whether the cursor is saved and restored with DECSC
+   * and DECRC rather than with the ANSI sequences
+   */
+  int decsc;
+  
+  struct meter_reply reply;
+};
+#endif /* PASSPHRASE_METER */
 
 
-static void passcheck_stop(struct passcheck_state* state)
+
+/**
+ * A passphrase being read
+ */
+struct passphrase_session
 {
-  int _status;
+  /**
+   * File descriptor for input
+   */
+  int fdin;
   
-  if (state->flags == 0)
-    return;
+  /**
+   * Settings, see `passphrase_read2`
+   */
+  int flags;
   
-  close(state->pipe_rw[0]);
-  close(state->pipe_rw[1]);
+  /**
+   * Whether `fdin` is non-blocking, otherwise
+   * `FIONREAD` is used to avoid blocking
+   */
+  int nonblocking;
   
-  free(strength), strength = NULL;
-  strength_size = 0;
+  /**
+   * Whether `fdin` is not a terminal, and whether it is seekable
+   */
+  int stream;
+  int seekable;
   
-rereap:
-  if ((waitpid(state->pid, &_status, 0) == -1) && (errno == EINTR))
-    goto rereap;
+  /**
+   * 1 when the passphrase is complete, -1 on error,
+   * in which case `error` is set, otherwise 0
+   */
+  int done;
+  int error;
   
-  if (state->flags & PASSPHRASE_READ_SCREEN_FREE)
-    fprintf(stderr, "\033[s\033[E\033[0K\033[u");
-  else
-    fprintf(stderr, "\033[B\033[0K\033[A");
-  fflush(stderr);
+  /**
+   * The passphrase, its allocation size, and its length
+   */
+  char* rc;
+  size_t size;
+  size_t len;
   
-  state->flags = 0;
-}
-
-
-static void passcheck_update(struct passcheck_state* state, const char* passphrase, size_t len)
-{
-  size_t strength_ptr = 0;
-  ssize_t n;
-  int i;
-  void* new;
-  char* p;
-  unsigned long long int value;
-  const char* desc;
+#ifdef PASSPHRASE_MOVE
+  /**
+   * The position of the point in the passphrase
+   */
+  size_t point;
+# if defined(PASSPHRASE_OVERRIDE) && defined(PASSPHRASE_INSERT)
+  char insert;
+# endif /* PASSPHRASE_OVERRIDE && PASSPHRASE_INSERT */
+#endif /* PASSPHRASE_MOVE */
   
-  if (state->flags == 0)
-    return;
+  /**
+   * The bytes read of the current key, a key is
+   * not processed until all of its bytes are read
+   */
+  unsigned char key[8];
+  size_t keylen;
   
-  for (i = 0; i < 2; i++, passphrase = "\n", len = 1)
-    while (len)
-      {
-	n = write(state->pipe_rw[1], passphrase, len);
-	if (n < 0)
-	  {
-	    if (errno == EINTR)
-	      continue;
-	    goto fail;
-	  }
-	passphrase += (size_t)n;
-	len -= (size_t)n;
-      }
+  /**
+   * When the first byte of the current key was read
+   */
+  struct timespec keytime;
   
- again:
-  if (strength_ptr == strength_size)
-    {
-      strength_size = strength_size ? (strength_size << 1) : 8;
-      new = realloc(strength, strength_size * sizeof(char));
-      if (new == NULL)
-	goto fail;
-      strength = new;
-    }
-  n = read(state->pipe_rw[0], strength + strength_ptr, strength_size - 1 - strength_ptr);
-  if (n <= 0)
-    {
-      if (n && (errno == EINTR))
-	goto again;
-      goto fail;
-    }
-  strength_ptr += (size_t)n;
-  strength[strength_ptr] = '\0';
-  p = strpbrk(strength, " \t\r\f\n\v");
-  if (p == NULL)
-    goto again;
-  if (*p == '\033')
-    {
-      p = strpbrk(strength, "QWERTYUIOPASDFGHJKLZXCVBNMqwertyuiopasdfghjklzxcvbnm~");
-      if (p == NULL)
-	goto fail;
-      p++;
-    }
-  else
-    p = strength;
-  *(strpbrk(p, " \t\r\f\n\v\033")) = '\0';
-  errno = 0;
-  value = strtoull(p, NULL, 10);
-  if ((value == 0) && errno)
-    {
-      if (errno != ERANGE)
-	goto fail;
-      value = ULLONG_MAX;
-    }
-  while (memchr(strength, '\n', strength_ptr) == NULL)
-    {
-      strength_ptr = 0;
-      n = read(state->pipe_rw[0], strength, strength_size);
-      if (n <= 0)
-	{
-	  if (n && (errno == EINTR))
-	    goto again;
-	  goto fail;
-	}
-      strength_ptr = (size_t)n;
-    }
-  strength_ptr = 0;
+  /**
+   * Whether Enter has been pressed, but the strength meter has
+   * not yet rated the final passphrase, and until when the rating is
+   * waited for by `passphrase_read4` and `passphrase_session_timeout`
+   */
+  int entered;
+  struct timespec rate_by;
   
-  if (0);
-#define X(COND, COLOUR, DESC)  else if (COND)  desc = COLOUR"m"DESC;
-  LIST_PASSPHRASE_STRENGTH_LIMITS(value)
-#undef X
-    
-  if (state->flags & PASSPHRASE_READ_SCREEN_FREE)
-    fprintf(stderr, "\033[s\033[E\033[0K%s \033[%s\033[m (%lli)\033[u", state->label, desc, value);
-  else
-    fprintf(stderr, "\033[B\033[s\033[0K\033[%s\033[m (%lli)\033[u\033[A", desc, value);
-  fflush(stderr);
+  /**
+   * Whether the input ended, or the terminal hung up,
+   * rather than Enter being pressed
+   */
+  int ended;
   
-  return;
- fail:
-  passcheck_stop(state);
-}
+#ifdef PASSPHRASE_METER
+  struct passcheck_state passcheck;
 #endif /* PASSPHRASE_METER */
+  struct keytrace keytrace;
+  struct policy_state policy;
+#ifdef PASSPHRASE_VIEWPORT
+  struct viewport view;
+#endif /* PASSPHRASE_VIEWPORT */
+#ifdef PASSPHRASE_QUERY
+  struct terminal term;
+#endif /* PASSPHRASE_QUERY */
+  struct output_queue output;
+};
 
 
-static int fdgetc(int fd)
+/**
+ * Allocate memory for a passphrase, and try to lock it into
+ * memory so it cannot be swapped out; failure to lock is
+ * ignored as `RLIMIT_MEMLOCK` may be very small
+ * 
+ * @param   size  The number of characters to allocate
+ * @return        The allocation, `NULL` on error
+ */
+static char* xmalloc(size_t size)
 {
-  unsigned char c;
-  if (read(fd, &c, sizeof(c)) <= 0)
-    return -1;
-  return (int)c;
+  char* rc = passphrase_secret_alloc__(size * sizeof(char));
+  if (rc)
+    *rc = 0; /* start as an empty string */
+  return rc;
 }
 
 
-#if defined(PASSPHRASE_DEDICATED) && defined(PASSPHRASE_MOVE)
-static int get_dedicated_control_key(int fdin)
+#ifndef PASSPHRASE_REALLOC
+static char* xrealloc(char* array, size_t cur_size, size_t new_size)
 {
-  int c = fdgetc(fdin);
-  if (c == 'O')
-    {
-      c = fdgetc(fdin);
-      if (c == 'H')  return KEY_HOME;
-      if (c == 'F')  return KEY_END;
-    }
-  else if (c == '[')
+  char* rc = passphrase_secret_alloc__(new_size * sizeof(char));
+  PROBE(buffer__grow, cur_size, new_size);
+  if (rc)
+    memcpy(rc, array, cur_size * sizeof(char));
+  passphrase_secret_free__(array, cur_size * sizeof(char));
+  return rc;
+}
+#else /* !PASSPHRASE_REALLOC */
+/* The old allocation is never unlocked, as its pages may
+   be shared with the new one, which is then locked anew */
+static char* xrealloc(char* array, size_t cur_size, size_t new_size)
+{
+  char* rc = realloc(array, new_size * sizeof(char));
+  PROBE(buffer__grow, cur_size, new_size);
+  if (rc)
+    mlock(rc, new_size * sizeof(char));
+  return rc;
+  (void) cur_size;
+}
+#endif /* !PASSPHRASE_REALLOC */
+
+
+#ifdef PASSPHRASE_METER
+/**
+ * Get the time some milliseconds from now
+ * 
+ * @param  deadline  Output parameter for the time, on `CLOCK_MONOTONIC`
+ * @param  ms        The number of milliseconds
+ */
+static void time_after(struct timespec* deadline, long int ms)
+{
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L)
     {
-      c = fdgetc(fdin);
-      if (c == 'C')  return KEY_RIGHT;
-      if (c == 'D')  return KEY_LEFT;
-      if (('1' <= c) && (c <= '4') && (fdgetc(fdin) == '~'))
-	return -(c - '0');
+      deadline->tv_sec += 1;
+      deadline->tv_nsec -= 1000000000L;
     }
-  return 0;
 }
-#endif /* PASSPHRASE_DEDICATED && PASSPHRASE_MOVE */
-
 
 
-#ifdef PASSPHRASE_MOVE
-static int get_key(int c, int fdin)
+/**
+ * Check whether one time is earlier than another
+ * 
+ * @param   a  The time that may be earlier
+ * @param   b  The time that may be later
+ * @return     Whether `a` is earlier than `b`
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static int time_before(const struct timespec* a, const struct timespec* b)
 {
-# ifdef PASSPHRASE_DEDICATED
-  if (c == '\033')             return get_dedicated_control_key(fdin);
-# else /* PASSPHRASE_DEDICATED */
-  (void) fdin;
-# endif /* PASSPHRASE_DEDICATED */
-  if ((c == 8) || (c == 127))  return KEY_ERASE;
-  if ((c < 0) || (c >= ' '))   return c & 255;
-# ifdef PASSPHRASE_CONTROL
-  if (c == 'A' - '@')          return KEY_HOME;
-  if (c == 'B' - '@')          return KEY_LEFT;
-  if (c == 'D' - '@')          return KEY_DELETE;
-  if (c == 'E' - '@')          return KEY_END;
-  if (c == 'F' - '@')          return KEY_RIGHT;
-# endif /* PASSPHRASE_CONTROL */
-  return 0;
+  return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
 }
-#endif /* PASSPHRASE_MOVE */
 
 
+static void passcheck_stop(struct passcheck_state* state);
+
 
 /**
- * Reads the passphrase from stdin
+ * Write to the strength meter, all buffers are written with one
+ * system call unless the meter does not read them all at once
  * 
- * @param   fdin   File descriptor for input
- * @param   flags  Settings, a combination of the constants:
- *                 * PASSPHRASE_READ_EXISTING
- *                 * PASSPHRASE_READ_NEW
- *                 * PASSPHRASE_READ_SCREEN_FREE
- *                 * PASSPHRASE_READ_BELOW_FREE
- *                 Invalid input is ignored, to make use the
- *                 application will work.
- * @return         The passphrase, should be wiped and `free`:ed, `NULL` on error
+ * @param   state   The strength meter
+ * @param   iov     The data to write, it is modified
+ * @param   iovcnt  The number of elements in `iov`
+ * @return          Zero on success, -1 on error
  */
-char* passphrase_read2(int fdin, int flags)
+static int passcheck_write(struct passcheck_state* state, struct iovec* iov, int iovcnt)
 {
-  char* rc = malloc(START_PASSPHRASE_LIMIT * sizeof(char));
-  size_t size = START_PASSPHRASE_LIMIT;
-  size_t len =  0;
-#ifdef PASSPHRASE_MOVE
-  size_t point = 0;
-  size_t i = 0;
-# if defined(PASSPHRASE_OVERRIDE) && defined(PASSPHRASE_INSERT)
-  char insert = DEFAULT_INSERT_VALUE;
-# endif /* PASSPHRASE_OVERRIDE && PASSPHRASE_INSERT */
-#endif /* PASSPHRASE_MOVE */
-#ifdef PASSPHRASE_TEXT
-  size_t printed_len = 0;
-#endif /* PASSPHRASE_TEXT */
-  int c;
-#ifdef PASSPHRASE_MOVE
-  int cc;
-#endif
-#ifdef PASSPHRASE_METER
-  struct passcheck_state passcheck;
-#endif /* PASSPHRASE_METER */
-  
-  if (rc == NULL)
-    return NULL;
-  
-#ifdef PASSPHRASE_METER
-  passcheck_start(&passcheck, flags);
-#endif /* PASSPHRASE_METER */
-  
-#ifdef PASSPHRASE_TEXT
-  xprintf("%s%zn", PASSPHRASE_TEXT_EMPTY, &printed_len);
-  if (printed_len)
-    xprintf("\e[%zuD", printed_len);
-#endif /* PASSPHRASE_TEXT */
+  static const struct timespec nowait = { .tv_sec = 0, .tv_nsec = 0 };
+  struct msghdr msg;
+  sigset_t sigpipe, pending, oldmask;
+  int blocked = 0, had_sigpipe = 0, saved_errno;
+  ssize_t n;
   
-  /* Read password until EOF or Enter, skip all \0 as that
-     is probably not a part of the passphrase (good luck typing
-     that in X.org) and can be echoed into stdin by the kernel. */
-  for (;;)
+  /* A meter that dies while we are writing to it shall not kill
+     us; a socket is written with MSG_NOSIGNAL instead, and if
+     SIGPIPE was already blocked, only the pending signal has
+     to be checked so that it is not discarded below. */
+  if (!(state->is_socket))
     {
-      c = fdgetc(fdin);
-      if ((c < 0) || (c == '\n'))
+      sigemptyset(&sigpipe);
+      sigaddset(&sigpipe, SIGPIPE);
+      sigprocmask(SIG_BLOCK, &sigpipe, &oldmask);
+      blocked = sigismember(&oldmask, SIGPIPE);
+      if (blocked)
 	{
-#ifdef PASSPHRASE_METER
-	  passcheck_stop(&passcheck);
+	  sigpending(&pending);
+	  had_sigpipe = sigismember(&pending, SIGPIPE);
+	}
+    }
+  
+  memset(&msg, 0, sizeof(msg));
+  while (iovcnt)
+    {
+      if (state->is_socket)
+	{
+	  msg.msg_iov = iov;
+	  msg.msg_iovlen = (size_t)iovcnt;
+	  n = sendmsg(state->pipe_rw[1], &msg, MSG_NOSIGNAL);
+	}
+      else
+	n = writev(state->pipe_rw[1], iov, iovcnt);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+      for (; iovcnt && ((size_t)n >= iov->iov_len); iov++, iovcnt--)
+	n -= (ssize_t)(iov->iov_len);
+      if (iovcnt)
+	{
+	  iov->iov_base = (char*)(iov->iov_base) + n;
+	  iov->iov_len -= (size_t)n;
+	}
+    }
+  
+  saved_errno = errno;
+  if (!(state->is_socket))
+    {
+      if (iovcnt && (errno == EPIPE) && !had_sigpipe)
+	while ((sigtimedwait(&sigpipe, NULL, &nowait) == -1) && (errno == EINTR));
+      if (!blocked)
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    }
+  errno = saved_errno;
+  return iovcnt ? -1 : 0;
+}
+
+
+/**
+ * Arm the timer for the next estimate or restart, or disarm
+ * it if neither is due
+ * 
+ * @param  state  The strength meter
+ */
+static void passcheck_arm(struct passcheck_state* state)
+{
+  struct itimerspec when;
+  const struct timespec* at = NULL;
+  
+  if (state->timer < 0)
+    return;
+  if (state->due.tv_sec >= 0)
+    at = &(state->due);
+  if (state->down && (!at || time_before(&(state->restart_at), at)))
+    at = &(state->restart_at);
+  
+  memset(&when, 0, sizeof(when));
+  if (at)
+    when.it_value = *at;
+  timerfd_settime(state->timer, TFD_TIMER_ABSTIME, &when, NULL);
+  state->armed = at != NULL;
+}
+
+
+/**
+ * A strength meter that has been stopped but not yet reaped
+ */
+struct stopped_meter
+{
+  /**
+   * The process, and its process file descriptor, -1 if there is none
+   */
+  pid_t pid;
+  int pidfd;
+  
+  /**
+   * When it is killed unless it has exited
+   */
+  struct timespec kill_at;
+};
+
+/**
+ * Strength meters that have been stopped but not yet reaped,
+ * shared by the sessions of all threads
+ */
+static struct stopped_meter stopped_meters[METER_MAX_STOPPED];
+static size_t stopped_count = 0;
+static pthread_mutex_t stopped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Get a process file descriptor for a child process
+ * 
+ * @param   pid  The process
+ * @return       The process file descriptor, -1 on error
+ */
+static int meter_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else /* SYS_pidfd_open */
+  (void) pid;
+  return errno = ENOSYS, -1;
+#endif /* SYS_pidfd_open */
+}
+
+
+/**
+ * Kill a strength meter, through its process file descriptor if it
+ * has one, so that if the application has already reaped it, another
+ * process that has been given its process ID is not killed
+ * 
+ * @param  pid    The process
+ * @param  pidfd  Its process file descriptor, -1 if there is none
+ */
+static void meter_kill(pid_t pid, int pidfd)
+{
+#ifdef SYS_pidfd_send_signal
+  if ((pidfd >= 0) && ((syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0) == 0) || (errno != ENOSYS)))
+    return;
+#else /* SYS_pidfd_send_signal */
+  (void) pidfd;
+#endif /* SYS_pidfd_send_signal */
+  kill(pid, SIGKILL);
+}
+
+
+/**
+ * Reap the strength meters that have been stopped and have exited,
+ * and kill those whose grace period has passed; `stopped_lock`
+ * must be held
+ * 
+ * @param  wait  Whether to wait until all of them have been reaped
+ */
+static void reap_stopped(int wait)
+{
+  static const struct timespec nap = { .tv_sec = 0, .tv_nsec = 10000000L };
+  struct stopped_meter* meter;
+  struct timespec now;
+  struct pollfd pfd;
+  size_t i = 0;
+  pid_t r;
+  int _status, overdue;
+  
+  while (i < stopped_count)
+    {
+      meter = stopped_meters + i;
+      r = waitpid(meter->pid, &_status, WNOHANG);
+      if ((r == -1) && (errno == EINTR))
+	continue;
+      if (r == 0)
+	{
+	  clock_gettime(CLOCK_MONOTONIC, &now);
+	  overdue = !time_before(&now, &(meter->kill_at));
+	  if (overdue)
+	    meter_kill(meter->pid, meter->pidfd);
+	  if (!wait)
+	    i++;
+	  else if (overdue)
+	    waitpid(meter->pid, &_status, 0);
+	  else if (meter->pidfd >= 0)
+	    {
+	      /* Wait for it to exit, or for its grace period to pass */
+	      pfd.fd = meter->pidfd;
+	      pfd.events = POLLIN;
+	      poll(&pfd, 1, passphrase_meter_time_left__(&(meter->kill_at)));
+	    }
+	  else
+	    nanosleep(&nap, NULL);
+	  continue;
+	}
+      /* It has been reaped, by us or by the application */
+      if (meter->pidfd >= 0)
+	close(meter->pidfd);
+      *meter = stopped_meters[--stopped_count];
+    }
+}
+
+
+/**
+ * Reap the strength meters that have been stopped and have exited,
+ * and kill those whose grace period has passed
+ * 
+ * @param  wait  Whether to wait until all of them have been reaped
+ */
+static void meter_reap(int wait)
+{
+  pthread_mutex_lock(&stopped_lock);
+  reap_stopped(wait);
+  pthread_mutex_unlock(&stopped_lock);
+}
+
+
+/**
+ * Close the connection to the strength meter, and have it reaped
+ * once it exits, after it has been killed if it does not exit within
+ * its grace period, so that stopping it does not wait for it
+ * 
+ * @param  state    The strength meter
+ * @param  kill_it  Whether the meter shall be killed without a grace
+ *                  period, because it may be unresponsive
+ */
+static void passcheck_disconnect(struct passcheck_state* state, int kill_it)
+{
+  struct stopped_meter* meter;
+  struct pollfd pfd;
+  int _status;
+  
+  close(state->pipe_rw[0]);
+  if (state->pipe_rw[1] != state->pipe_rw[0])
+    close(state->pipe_rw[1]);
+  
+  pthread_mutex_lock(&stopped_lock);
+  if (state->pid != -1)
+    {
+      if (kill_it)
+	meter_kill(state->pid, state->pidfd);
+      if (stopped_count == METER_MAX_STOPPED)
+	reap_stopped(0);
+      if (stopped_count == METER_MAX_STOPPED)
+	{
+	  /* Make room by killing the oldest stopped meter, which exits
+	     at once, rather than waiting for the grace periods to pass */
+	  meter = stopped_meters;
+	  meter_kill(meter->pid, meter->pidfd);
+	  if (meter->pidfd >= 0)
+	    {
+	      /* It may have been reaped by the application, and its
+		 process ID given to another child, so it is not waited for
+		 until its process file descriptor tells that it has exited */
+	      pfd.fd = meter->pidfd;
+	      pfd.events = POLLIN;
+	      while ((poll(&pfd, 1, -1) < 0) && (errno == EINTR));
+	      waitpid(meter->pid, &_status, WNOHANG);
+	      close(meter->pidfd);
+	    }
+	  else
+	    while ((waitpid(meter->pid, &_status, 0) == -1) && (errno == EINTR));
+	  *meter = stopped_meters[--stopped_count];
+	}
+      meter = stopped_meters + stopped_count++;
+      meter->pid = state->pid;
+      meter->pidfd = state->pidfd;
+      time_after(&(meter->kill_at), kill_it ? 0 : METER_GRACE_PERIOD);
+    }
+  else if (state->pidfd >= 0)
+    close(state->pidfd);
+  state->pid = -1;
+  state->pidfd = -1;
+  
+  reap_stopped(0);
+  pthread_mutex_unlock(&stopped_lock);
+}
+
+
+/**
+ * Start the strength meter, or connect to the shared daemon, and
+ * ask for binary framing
+ * 
+ * @param   state  The strength meter
+ * @return         Zero on success, -1 on error
+ */
+static int passcheck_connect(struct passcheck_state* state)
+{
+  const char* command = state->command;
+  struct iovec iov;
+  
+  state->pid = -1;
+  state->pidfd = -1;
+  state->is_socket = 0;
+  state->mode = METER_MODE_HELLO;
+  state->outstanding = 0;
+  state->reply.state = 0;
+  state->reply.have = 0;
+  
+  /* Use the shared daemon if one is selected, and fall back to
+     starting our own meter if the daemon is not available. */
+  if (!strncmp(command, PASSPHRASE_METER_SOCKET_PREFIX, sizeof(PASSPHRASE_METER_SOCKET_PREFIX) - 1))
+    {
+      state->pipe_rw[0] = passphrase_meter_connect__(command + sizeof(PASSPHRASE_METER_SOCKET_PREFIX) - 1);
+      if (state->pipe_rw[0] >= 0)
+	{
+	  state->pipe_rw[1] = state->pipe_rw[0];
+	  state->is_socket = 1;
+	  goto started;
+	}
+      command = DEFAULT_PASSPHRASE_METER;
+    }
+  
+  state->pid = passphrase_meter_spawn__(command, state->pipe_rw);
+  if (state->pid == -1)
+    return -1;
+  /* So that a crash is noticed even if no reply is expected */
+  state->pidfd = meter_pidfd(state->pid);
+  
+ started:
+  PROBE(meter__spawn, state->pid, state->is_socket);
+  
+  /* Ask for binary framing, the reply is waited for like any other */
+  iov.iov_base = (void*)(size_t)METER_BINARY_HELLO;
+  iov.iov_len = sizeof(METER_BINARY_HELLO) - 1;
+  if (passcheck_write(state, &iov, 1))
+    {
+      passcheck_disconnect(state, 1);
+      return -1;
+    }
+  state->outstanding = 1;
+  return 0;
+}
+
+
+/**
+ * Handle a strength meter that has died or misbehaved: it is
+ * restarted after a delay, that grows with each restart, unless
+ * it has been restarted too many times, in which case it is stopped
+ * 
+ * @param  state  The strength meter
+ */
+static void passcheck_fail(struct passcheck_state* state)
+{
+  if ((state->timer < 0) || (state->restarts >= METER_MAX_RESTARTS))
+    {
+      passcheck_stop(state);
+      return;
+    }
+  
+  PROBE(meter__stop, state->pid);
+  if (!(state->down))
+    passcheck_disconnect(state, 1);
+  state->down = 1;
+  state->outstanding = 0;
+  state->dirty = 1;
+  time_after(&(state->restart_at), (long int)METER_RESTART_DELAY << state->restarts++);
+  
+  /* Estimate the strength while the meter is down */
+  if (state->budget > 0)
+    clock_gettime(CLOCK_MONOTONIC, &(state->due));
+  passcheck_arm(state);
+}
+
+
+/**
+ * Handle the exit of the strength meter, that is detected
+ * with its process file descriptor even if no reply is expected
+ * 
+ * @param  state  The strength meter
+ */
+static void passcheck_exited(struct passcheck_state* state)
+{
+  struct pollfd pfd;
+  
+  /* The meter may already have been replaced */
+  if (!(state->flags) || state->down || (state->pidfd < 0))
+    return;
+  pfd.fd = state->pidfd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 0) <= 0)
+    return;
+  passcheck_fail(state);
+}
+
+
+static void passcheck_start(struct passcheck_state* state, int flags, FILE* tty)
+{
+  const char* budget;
+  char* end;
+  long int value;
+  
+  state->out = tty;
+  state->placement = 0;
+  state->pidfd = -1;
+  state->timer = -1;
+  state->armed = 0;
+  state->due.tv_sec = -1;
+  state->provisional = 0;
+  state->down = 0;
+  state->restarts = 0;
+  state->dirty = 0;
+  state->last_id = state->shown_id = 0;
+  state->rated = 0;
+  state->flags = (flags & PASSPHRASE_READ_NEW) ? (flags & (PASSPHRASE_READ_SCREEN_FREE | PASSPHRASE_READ_BELOW_FREE)) : 0;
+  if (state->flags == 0)
+    return;
+  
+  /* Meters stopped by earlier sessions have had time to exit */
+  meter_reap(0);
+  
+  if (state->flags & PASSPHRASE_READ_BELOW_FREE)
+    state->flags &= ~PASSPHRASE_READ_SCREEN_FREE;
+  
+  state->command = passphrase_meter_command__();
+  
+  state->label = getenv("LIBPASSPHRASE_STRENGTH_LABEL");
+  if (!(state->label) || !*(state->label))
+    state->label = PASSPHRASE_TEXT_STRENGTH;
+  
+  state->budget = METER_LATENCY_BUDGET;
+  budget = getenv("LIBPASSPHRASE_METER_BUDGET");
+  if (budget && *budget)
+    {
+      value = strtol(budget, &end, 10);
+      if (!*end && (value >= 0))
+	state->budget = value;
+    }
+  
+  if (passcheck_connect(state))
+    {
+      state->flags = 0;
+      return;
+    }
+  
+  /* Without a timer, the meter is used as if it had no latency budget */
+  state->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (state->timer < 0)
+    state->budget = 0;
+  
+  state->placement = state->flags;
+  if (state->flags & PASSPHRASE_READ_SCREEN_FREE)
+    {
+      struct termios stty;
+      struct termios saved_stty;
+      tcgetattr(fileno(tty), &stty);
+      saved_stty = stty;
+      stty.c_oflag &= (tcflag_t)~ONLCR;
+      tcsetattr(fileno(tty), TCSAFLUSH, &stty);
+      fprintf(tty, "\n\033[A");
+      fflush(tty);
+      tcsetattr(fileno(tty), TCSAFLUSH, &saved_stty);
+    }
+}
+
+
+/**
+ * Remove the strength from the display
+ * 
+ * @param  state  The strength meter
+ */
+static void passcheck_clear(struct passcheck_state* state)
+{
+  if (state->placement & PASSPHRASE_READ_SCREEN_FREE)
+    fprintf(state->out, "%s\033[E\033[0K%s", state->decsc ? "\0337" : "\033[s", state->decsc ? "\0338" : "\033[u");
+  else
+    fprintf(state->out, "\033[B\033[0K\033[A");
+  fflush(state->out);
+}
+
+
+static void passcheck_stop(struct passcheck_state* state)
+{
+  if (state->flags == 0)
+    return;
+  
+  if (!(state->down))
+    {
+      PROBE(meter__stop, state->pid);
+      passcheck_disconnect(state, 0);
+    }
+  if (state->timer >= 0)
+    close(state->timer);
+  state->timer = -1;
+  state->armed = 0;
+  
+  state->flags = 0;
+  passcheck_clear(state);
+}
+
+
+/**
+ * Send the passphrase to the strength meter; a newer passphrase
+ * makes the answer to an older one uninteresting, so only a few
+ * queries are outstanding at a time, one unless binary framing is
+ * used, and if that many are outstanding the passphrase is sent
+ * when one has been answered
+ * 
+ * @param  state       The strength meter
+ * @param  passphrase  The passphrase
+ * @param  len         The length of the passphrase
+ */
+static void passcheck_query(struct passcheck_state* state, const char* passphrase, size_t len)
+{
+  unsigned char header[METER_FRAME_HEADER];
+  struct iovec iov[2];
+  
+  if (state->flags == 0)
+    return;
+  
+  /* The meter has the latency budget to rate this version of the passphrase */
+  if ((state->budget > 0) && (state->due.tv_sec < 0))
+    {
+      time_after(&(state->due), state->budget);
+      passcheck_arm(state);
+    }
+  
+  if (state->down || (state->outstanding >= (state->mode == METER_MODE_BINARY ? METER_PIPELINE : 1)))
+    {
+      state->dirty = 1;
+      return;
+    }
+  
+  PROBE(meter__query, len);
+  if (state->mode == METER_MODE_BINARY)
+    {
+      passphrase_meter_frame__(header, METER_FRAME_QUERY, 0, ++(state->last_id), len);
+      iov[0].iov_base = header, iov[0].iov_len = sizeof(header);
+      iov[1].iov_base = (void*)(size_t)passphrase, iov[1].iov_len = len;
+    }
+  else
+    {
+      iov[0].iov_base = (void*)(size_t)passphrase, iov[0].iov_len = len;
+      iov[1].iov_base = (void*)(size_t)"\n", iov[1].iov_len = 1;
+    }
+  if (passcheck_write(state, iov, 2))
+    {
+      passcheck_fail(state);
+      return;
+    }
+  
+  state->outstanding++;
+  state->dirty = 0;
+}
+
+
+/**
+ * Display the newest strength the meter has given, or
+ * the estimate if the meter has not rated the passphrase
+ * within its latency budget
+ * 
+ * @param  state  The strength meter
+ * @param  note   Text to display after the strength
+ */
+static void passcheck_render(struct passcheck_state* state, const char* note)
+{
+  unsigned long long int value = state->provisional ? state->estimate : state->score;
+  const char* hint = state->provisional ? "" : state->hint;
+  const char* save = state->decsc ? "\0337" : "\033[s";
+  const char* restore = state->decsc ? "\0338" : "\033[u";
+  const char* colour;
+  const char* desc;
+  
+  if (state->provisional || passphrase_meter_tier_at__(state->tier, &colour, &desc))
+    passphrase_meter_tier__(value, &colour, &desc);
+  if (state->flags & PASSPHRASE_READ_SCREEN_FREE)
+    fprintf(state->out, "%s\033[E\033[0K%s \033[%sm%s\033[m (%lli%s)%s%s%s%s",
+	    save, state->label, colour, desc, value, state->provisional ? ", " PASSPHRASE_TEXT_PROVISIONAL : "",
+	    *hint ? " " : "", hint, note, restore);
+  else
+    fprintf(state->out, "\033[B%s\033[0K\033[%sm%s\033[m (%lli%s)%s%s%s%s\033[A",
+	    save, colour, desc, value, state->provisional ? ", " PASSPHRASE_TEXT_PROVISIONAL : "",
+	    *hint ? " " : "", hint, note, restore);
+  fflush(state->out);
+}
+
+
+/**
+ * Check whether the strength meter has rated the passphrase
+ * as it is now, rather than only an earlier version of it
+ * 
+ * @param   state  The strength meter
+ * @return         Whether the newest strength is for the passphrase
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static int passcheck_current(const struct passcheck_state* state)
+{
+  if (!(state->rated) || state->dirty)
+    return 0;
+  if (state->mode == METER_MODE_BINARY)
+    return state->shown_id == state->last_id;
+  return state->outstanding == 0;
+}
+
+
+/**
+ * Read the strength meter's replies, once it is readable,
+ * and display the strength of the passphrase
+ * 
+ * @param  state       The strength meter
+ * @param  passphrase  The passphrase, sent if it has changed since the last query
+ * @param  len         The length of the passphrase
+ * @param  note        Text to display after the strength
+ */
+static void passcheck_reply(struct passcheck_state* state, const char* passphrase, size_t len, const char* note)
+{
+  /* A text meter may echo the passphrase, so the buffer is wiped */
+  char buf[METER_REPLY_MAX];
+  char hint[METER_HINT_MAX + 1];
+  unsigned long long int value = 0;
+  size_t n, used;
+  ssize_t got;
+  int r, tier = -1, shown = 0;
+  const char* colour;
+  const char* desc;
+  const char* p;
+  
+  if ((state->flags == 0) || state->down || !(state->outstanding))
+    return;
+  
+  got = read(state->pipe_rw[0], buf, sizeof(buf));
+  if (got <= 0)
+    {
+      if (got && ((errno == EINTR) || (errno == EAGAIN)))
+	return;
+      passcheck_fail(state);
+      return;
+    }
+  
+  /* Several replies may have been read, only the newest is displayed */
+  for (p = buf, n = (size_t)got; n && state->outstanding; p += used, n -= used)
+    {
+      if (state->mode == METER_MODE_HELLO)
+	{
+	  r = passphrase_meter_parse_hello__(&(state->reply), p, n, &used);
+	  if (r < 0)
+	    break;
+	  state->mode = r ? METER_MODE_BINARY : METER_MODE_TEXT;
+	  state->outstanding--;
+	  continue;
+	}
+      if (state->mode == METER_MODE_TEXT)
+	used = passphrase_meter_parse__(&(state->reply), p, n);
+      else
+	used = passphrase_meter_parse_frame__(&(state->reply), p, n, METER_FRAME_REPLY, METER_MAX_PAYLOAD);
+      if (used == 0)
+	break;
+      state->outstanding--;
+      if (state->mode == METER_MODE_BINARY)
+	{
+	  /* Discard replies to queries older than the displayed reply */
+	  if ((int32_t)(state->reply.id - state->shown_id) <= 0)
+	    continue;
+	  state->shown_id = state->reply.id;
+	  tier = state->reply.tier;
+	  strcpy(hint, state->reply.hint);
+	}
+      else
+	*hint = '\0';
+      value = state->reply.value;
+      shown = 1;
+    }
+  passphrase_wipe(buf, sizeof(buf));
+  if (state->reply.state == METER_PROTOCOL_ERROR)
+    {
+      passcheck_fail(state);
+      return;
+    }
+  
+  if (shown)
+    {
+      if ((tier < 0) || passphrase_meter_tier_at__(tier, &colour, &desc))
+	tier = passphrase_meter_tier__(value, &colour, &desc);
+      PROBE(meter__response, value, tier);
+      state->rated = 1;
+      state->score = value;
+      state->tier = tier;
+      state->description = desc;
+      strcpy(state->hint, hint);
+      /* A displayed estimate is only replaced by a strength for the
+         passphrase as it is now, rather than by an outdated one */
+      if (!(state->provisional) || passcheck_current(state))
+	{
+	  state->provisional = 0;
+	  passcheck_render(state, note);
+	}
+      if (passcheck_current(state))
+	{
+	  state->due.tv_sec = -1;
+	  passcheck_arm(state);
+	}
+    }
+  
+  if (state->dirty)
+    passcheck_query(state, passphrase, len);
+}
+
+
+/**
+ * Handle the strength meter's timer, once it is readable: restart
+ * the meter if it has died, and display an estimate of the strength
+ * if the meter has not rated the passphrase within its latency budget
+ * 
+ * @param  state       The strength meter
+ * @param  passphrase  The passphrase
+ * @param  len         The length of the passphrase
+ * @param  note        Text to display after the strength
+ */
+static void passcheck_timer(struct passcheck_state* state, const char* passphrase, size_t len, const char* note)
+{
+  struct timespec now;
+  uint64_t expirations;
+  
+  if ((state->flags == 0) || (state->timer < 0))
+    return;
+  if (read(state->timer, &expirations, sizeof(expirations)) < 0)
+    if (errno != EAGAIN)
+      return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  
+  if (state->down && !time_before(&now, &(state->restart_at)))
+    {
+      if (passcheck_connect(state))
+	{
+	  passcheck_fail(state);
+	  if (state->flags == 0)
+	    return;
+	}
+      else
+	{
+	  state->down = 0;
+	  state->dirty = 1;
+	}
+    }
+  
+  if ((state->due.tv_sec >= 0) && !time_before(&now, &(state->due)))
+    {
+      state->due.tv_sec = -1;
+      if (!passcheck_current(state))
+	{
+	  state->provisional = 1;
+	  state->estimate = passphrase_meter_estimate__(passphrase, len);
+	  passcheck_render(state, note);
+	}
+    }
+  
+  passcheck_arm(state);
+}
+#endif /* PASSPHRASE_METER */
+
+
+/**
+ * Remove all NUL characters from a chunk of read input
+ * 
+ * @param   buf  The chunk
+ * @param   n    The length of the chunk
+ * @return       The new length of the chunk
+ */
+static size_t strip_nul(char* buf, size_t n)
+{
+  size_t i, j;
+  if (memchr(buf, 0, n) == NULL)
+    return n;
+  for (i = j = 0; i < n; i++)
+    if (*(buf + i))
+      *(buf + j++) = *(buf + i);
+  passphrase_wipe(buf + j, n - j);
+  return j;
+}
+
+
+/**
+ * Start recording keystroke timings if requested; the environment
+ * is ignored in set-user-ID and set-group-ID programs, as the trace
+ * file is created with the privileges of the program
+ * 
+ * @param  kt  The recorder
+ */
+static void keytrace_start(struct keytrace* kt)
+{
+  kt->path = secure_getenv("LIBPASSPHRASE_KEYTRACE");
+  if (!(kt->path) || !*(kt->path))
+    {
+      kt->path = NULL;
+      return;
+    }
+  memcpy(kt->buf, KEYTRACE_MAGIC, sizeof(KEYTRACE_MAGIC) - 1);
+  kt->n = sizeof(KEYTRACE_MAGIC) - 1;
+  kt->buf[kt->n++] = KEYTRACE_VERSION;
+  clock_gettime(CLOCK_MONOTONIC, &(kt->last));
+}
+
+
+/**
+ * Append the recorded keystrokes to the trace file; the file is
+ * only opened when the buffer is written, so that it is not left
+ * open if the passphrase reading fails
+ * 
+ * @param  kt  The recorder
+ */
+static void keytrace_flush(struct keytrace* kt)
+{
+  size_t ptr = 0;
+  ssize_t n;
+  int fd;
+  
+  if (kt->n == 0)
+    return;
+  fd = open(kt->path, O_WRONLY | O_CREAT | O_APPEND | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd == -1)
+    goto fail;
+  while (ptr < kt->n)
+    {
+      n = write(fd, kt->buf + ptr, kt->n - ptr);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  close(fd);
+	  goto fail;
+	}
+      ptr += (size_t)n;
+    }
+  close(fd);
+  kt->n = 0;
+  return;
+ fail:
+  /* Stop recording, and drop what could not be written,
+     so that nothing is appended past the end of the buffer */
+  kt->path = NULL;
+  kt->n = 0;
+}
+
+
+/**
+ * Record a keystroke
+ * 
+ * @param  kt     The recorder
+ * @param  class  The class of the key, `KEYCLASS_COUNT` to record nothing
+ * @param  when   When the first byte of the key was read
+ */
+static void keytrace_record(struct keytrace* kt, enum keyclass class, const struct timespec* when)
+{
+  unsigned long long int us;
+  
+  if ((kt->path == NULL) || (class == KEYCLASS_COUNT))
+    return;
+  
+  us  = (unsigned long long int)(when->tv_sec - kt->last.tv_sec) * 1000000ULL;
+  us += (unsigned long long int)(when->tv_nsec / 1000L);
+  us -= (unsigned long long int)(kt->last.tv_nsec / 1000L);
+  kt->last = *when;
+  if ((class == KEYCLASS_PRINTABLE) && (us < KEYTRACE_PASTE_THRESHOLD))
+    class = KEYCLASS_PASTE;
+  
+  if (kt->n + 1 + (sizeof(us) * 8 + 6) / 7 > sizeof(kt->buf))
+    {
+      keytrace_flush(kt);
+      if (kt->path == NULL)
+	return;
+    }
+  kt->buf[kt->n++] = (unsigned char)class;
+  do
+    {
+      kt->buf[kt->n] = (unsigned char)(us & 0x7F);
+      us >>= 7;
+      kt->buf[kt->n++] |= (unsigned char)(us ? 0x80 : 0);
+    }
+  while (us);
+}
+
+
+/**
+ * Get the class of a key
+ * 
+ * @param   key  The key, a byte or a `KEY_*` constant
+ * @return       The class of the key, `KEYCLASS_COUNT`
+ *               for continuation bytes
+ */
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+static enum keyclass keytrace_classify(int key)
+{
+  switch (key)
+    {
+    case KEY_HOME:    return KEYCLASS_HOME;
+    case KEY_INSERT:  return KEYCLASS_INSERT;
+    case KEY_DELETE:  return KEYCLASS_DELETE;
+    case KEY_END:     return KEYCLASS_END;
+    case KEY_ERASE:   return KEYCLASS_ERASE;
+    case KEY_RIGHT:   return KEYCLASS_RIGHT;
+    case KEY_LEFT:    return KEYCLASS_LEFT;
+    default:
+      if ((key > 0) && (key < ' '))
+	return KEYCLASS_OTHER;
+      if (key <= 0)
+	return KEYCLASS_OTHER;
+      return ((key & 0xC0) == 0x80) ? KEYCLASS_COUNT : KEYCLASS_PRINTABLE;
+    }
+}
+
+
+#if defined(PASSPHRASE_DEDICATED) && defined(PASSPHRASE_MOVE)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static int get_dedicated_control_key(const unsigned char* key)
+{
+  if (key[1] == 'O')
+    {
+      if (key[2] == 'H')  return KEY_HOME;
+      if (key[2] == 'F')  return KEY_END;
+    }
+  else if (key[1] == '[')
+    {
+      if (key[2] == 'C')  return KEY_RIGHT;
+      if (key[2] == 'D')  return KEY_LEFT;
+      if (('1' <= key[2]) && (key[2] <= '4') && (key[3] == '~'))
+	return -(key[2] - '0');
+    }
+  return 0;
+}
+#endif /* PASSPHRASE_DEDICATED && PASSPHRASE_MOVE */
+
+
+
+#ifdef PASSPHRASE_MOVE
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static int get_key(int c, const unsigned char* key)
+{
+# ifdef PASSPHRASE_DEDICATED
+  if (c == '\033')             return get_dedicated_control_key(key);
+# else /* PASSPHRASE_DEDICATED */
+  (void) key;
+# endif /* PASSPHRASE_DEDICATED */
+  if ((c == 8) || (c == 127))  return KEY_ERASE;
+  if ((c < 0) || (c >= ' '))   return c & 255;
+# ifdef PASSPHRASE_CONTROL
+  if (c == 'A' - '@')          return KEY_HOME;
+  if (c == 'B' - '@')          return KEY_LEFT;
+  if (c == 'D' - '@')          return KEY_DELETE;
+  if (c == 'E' - '@')          return KEY_END;
+  if (c == 'F' - '@')          return KEY_RIGHT;
+# endif /* PASSPHRASE_CONTROL */
+  return 0;
+}
+#endif /* PASSPHRASE_MOVE */
+
+
+#ifdef MULTIBYTE_KEYS
+/**
+ * Get the number of bytes of the key being read
+ * 
+ * @param   s  The session
+ * @return     The number of bytes the key has, as far as can
+ *             be told from the bytes that have been read
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static size_t key_length(const struct passphrase_session* s)
+{
+#ifdef PASSPHRASE_OVERRIDE
+  unsigned char c = *(s->key);
+  size_t n = 0;
+#endif /* PASSPHRASE_OVERRIDE */
+  
+#ifdef PASSPHRASE_DEDICATED
+  if (*(s->key) == '\033')
+    {
+      if ((s->keylen < 2) || ((s->key[1] != 'O') && (s->key[1] != '[')))
+	return 2;
+      if (s->keylen < 3)
+	return 3;
+      return ((s->key[1] == '[') && ('1' <= s->key[2]) && (s->key[2] <= '4')) ? 4 : 3;
+    }
+#endif /* PASSPHRASE_DEDICATED */
+  
+#ifdef PASSPHRASE_OVERRIDE
+  /* `override_char` replaces a whole character at once */
+  if (((c & 0xC0) != 0xC0) || (s->point == s->len))
+    return 1;
+# ifdef PASSPHRASE_INSERT
+  if (s->insert)
+    return 1;
+# endif /* PASSPHRASE_INSERT */
+  while (c & 0x80)
+    {
+      c = (unsigned char)(c << 1);
+      n++;
+    }
+  return n;
+#else /* PASSPHRASE_OVERRIDE */
+  return 1;
+#endif /* PASSPHRASE_OVERRIDE */
+}
+#endif /* MULTIBYTE_KEYS */
+
+
+/**
+ * Fail a session
+ * 
+ * @param   s      The session
+ * @param   error  The error, an `errno` value
+ * @return         -1
+ */
+static int session_fail(struct passphrase_session* s, int error)
+{
+  s->done = -1;
+  s->error = error;
+  errno = error;
+  return -1;
+}
+
+
+/**
+ * Make room for a longer passphrase
+ * 
+ * @param   s  The session
+ * @return     Zero on success, -1 on error
+ */
+static int session_grow(struct passphrase_session* s)
+{
+  if ((s->rc = xrealloc(s->rc, s->size, s->size << 1)) == NULL)
+    return session_fail(s, errno);
+  s->size <<= 1;
+  if (passphrase_policy_reserve__(&(s->policy), s->size))
+    return session_fail(s, errno);
+  return 0;
+}
+
+
+#if defined(DEBUG) && defined(PASSPHRASE_MOVE)
+/**
+ * Display the passphrase at the top of the terminal, never use in production
+ * 
+ * @param  s  The session
+ */
+static void debug_overlay(struct passphrase_session* s)
+{
+  size_t i, n = 0;
+  for (i = s->point; i < s->len; i++)
+    if ((*(s->rc + i) & 0xC0) != 0x80)
+      n++;
+  *(s->rc + s->len) = 0;
+  if (n)
+    fprintf(s->output.stream, "\033[s\033[H\033[K%s\033[%zuD\033[01;34m%s\033[00m\033[u", s->rc, n, s->rc + s->point);
+  else
+    fprintf(s->output.stream, "\033[s\033[H\033[K%s\033[01;34m%s\033[00m\033[u", s->rc, s->rc + s->point);
+  fflush(s->output.stream);
+}
+#endif /* DEBUG && PASSPHRASE_MOVE */
+
+
+#ifdef PASSPHRASE_VIEWPORT
+/**
+ * The characters drawn at the edges of the viewport
+ * when characters are hidden beyond them
+ */
+#ifndef VIEWPORT_LEFT_MARKER
+# define VIEWPORT_LEFT_MARKER  '<'
+#endif
+#ifndef VIEWPORT_RIGHT_MARKER
+# define VIEWPORT_RIGHT_MARKER  '>'
+#endif
+
+/**
+ * The number of milliseconds to wait for the answer to the
+ * cursor position query after the passphrase has been entered
+ */
+#ifndef VIEWPORT_SETTLE_TIMEOUT
+# define VIEWPORT_SETTLE_TIMEOUT  100
+#endif
+
+/**
+ * The number of times the terminal has been resized
+ */
+static volatile sig_atomic_t winch_count = 0;
+
+/**
+ * The SIGWINCH action that was replaced, and the
+ * number of sessions, in any thread, that use the replacement
+ */
+static struct sigaction winch_saved;
+static size_t winch_users = 0;
+static pthread_mutex_t winch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Count that the terminal has been resized, and
+ * run the handler the application had installed
+ * 
+ * @param  signo    The signal
+ * @param  info     Information about the signal
+ * @param  context  The interrupted context
+ */
+static void on_winch(int signo, siginfo_t* info, void* context)
+{
+  winch_count++;
+  if (winch_saved.sa_flags & SA_SIGINFO)
+    {
+      if (winch_saved.sa_sigaction)
+	winch_saved.sa_sigaction(signo, info, context);
+    }
+  else if ((winch_saved.sa_handler != SIG_DFL) && (winch_saved.sa_handler != SIG_IGN))
+    winch_saved.sa_handler(signo);
+}
+
+
+/**
+ * Get the number of characters in a part of the passphrase
+ * 
+ * @param   str  The start of the part
+ * @param   n    The number of bytes in the part
+ * @return       The number of characters
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static size_t count_chars(const char* str, size_t n)
+{
+  size_t i, chars = 0;
+  for (i = 0; i < n; i++)
+    if ((*(str + i) & 0xC0) != 0x80)
+      chars++;
+  return chars;
+}
+
+
+/**
+ * Read the width of the terminal
+ * 
+ * @param  s  The session
+ */
+static void viewport_columns(struct passphrase_session* s)
+{
+  struct winsize ws;
+  s->view.winch = winch_count;
+  if (ioctl(fileno(s->output.tty), TIOCGWINSZ, &ws))
+    s->view.columns = 0;
+  else
+    s->view.columns = ws.ws_col;
+}
+
+
+/**
+ * Get the number of columns the passphrase may use
+ * 
+ * @param   s  The session
+ * @return     The number of columns, 0 if not known or too few to scroll in
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static size_t viewport_width(const struct passphrase_session* s)
+{
+  /* The last column is left empty, so the cursor never wraps */
+  if (!(s->view.start_known) || (s->view.columns < s->view.start + 5))
+    return 0;
+  return s->view.columns - s->view.start - 1;
+}
+
+
+/**
+ * Start tracking the size of the terminal, and ask
+ * it where the passphrase starts; the answer is read
+ * as input, by `viewport_report`, so it is only asked
+ * if `terminal_query` found that it can be
+ * 
+ * @param  s  The session
+ */
+static void viewport_start(struct passphrase_session* s)
+{
+  struct sigaction sa;
+  
+  if (!(s->term.answers))
+    return;
+  
+  pthread_mutex_lock(&winch_lock);
+  if (winch_users++ == 0)
+    {
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = on_winch;
+      sa.sa_flags = SA_SIGINFO | SA_RESTART;
+      sigemptyset(&(sa.sa_mask));
+      sigaction(SIGWINCH, &sa, &winch_saved);
+    }
+  pthread_mutex_unlock(&winch_lock);
+  s->view.watching = 1;
+  viewport_columns(s);
+  
+  fprintf(s->output.tty, "\033[6n");
+  fflush(s->output.tty);
+  s->view.awaiting = 1;
+}
+
+
+/**
+ * Stop tracking the size of the terminal
+ * 
+ * @param  s  The session
+ */
+static void viewport_stop(struct passphrase_session* s)
+{
+  if (!(s->view.watching))
+    return;
+  pthread_mutex_lock(&winch_lock);
+  if (--winch_users == 0)
+    sigaction(SIGWINCH, &winch_saved, NULL);
+  pthread_mutex_unlock(&winch_lock);
+  s->view.watching = 0;
+}
+
+
+/**
+ * Check whether the editing macros may draw the next edit themselves,
+ * that is, whether the passphrase is drawn in full and will still
+ * fit on the line after one more character is added
+ * 
+ * @param   s  The session
+ * @return     Whether the edit may be drawn directly
+ */
+static int viewport_direct(struct passphrase_session* s)
+{
+  size_t width;
+  if (s->view.winch != winch_count)
+    viewport_columns(s);
+  if (s->view.scrolled)
+    return 0;
+  width = viewport_width(s);
+  return (width == 0) || (count_chars(s->rc, s->len) < width);
+}
+
+
+/**
+ * Redraw the part of the passphrase that is displayed,
+ * scrolling it so that the point is visible; the output
+ * is proportional to the width of the terminal rather
+ * than to the length of the passphrase
+ * 
+ * @param  s      The session
+ * @param  point  The position of the point in the passphrase
+ */
+static void viewport_render(struct passphrase_session* s, size_t point)
+{
+  size_t width = viewport_width(s);
+  size_t chars = count_chars(s->rc, s->len);
+  size_t pos = count_chars(s->rc, point);
+  size_t offset = s->view.offset;
+  size_t cells, i = 0, j, n;
+  int left, right;
+  
+  if ((width == 0) || (chars < width))
+    {
+      /* Everything fits, or the width is not known */
+      offset = 0;
+      width = chars + 1;
+    }
+  else if ((offset > chars + 1 - width) ||
+	   (pos < offset + (offset > 0)) ||
+	   (pos - offset + (chars - offset > width) >= width))
+    {
+      /* Centre the point if it has left the viewport */
+      offset = pos > width / 2 ? pos - width / 2 : 0;
+      if (offset > chars + 1 - width)
+	offset = chars + 1 - width;
+    }
+  left = offset > 0;
+  right = chars - offset > width;
+  cells = chars - offset < width ? chars - offset : width;
+  
+  /* The whole line is redrawn, so it is displayed at once */
+  s->output.atomic = 1;
+  
+  if (s->view.cursor)
+    fprintf(s->output.stream, "\033[%zuD", s->view.cursor);
+  for (j = 0; j < offset; j++)
+    for (i++; (i < s->len) && ((*(s->rc + i) & 0xC0) == 0x80); i++);
+  for (j = 0; j < cells; j++)
+    {
+      for (n = 1; (i + n < s->len) && ((*(s->rc + i + n) & 0xC0) == 0x80); n++);
+      if (left && (j == 0))
+	fputc(VIEWPORT_LEFT_MARKER, s->output.stream);
+      else if (right && (j + 1 == cells))
+	fputc(VIEWPORT_RIGHT_MARKER, s->output.stream);
+      else
+# ifdef PASSPHRASE_STAR
+	fprintf(s->output.stream, "%s", PASSPHRASE_STAR_CHAR);
+# else /* PASSPHRASE_STAR */
+	fwrite(s->rc + i, 1, n, s->output.stream);
+# endif /* PASSPHRASE_STAR */
+      i += n;
+    }
+  fprintf(s->output.stream, "\033[K");
+  if (cells > pos - offset)
+    fprintf(s->output.stream, "\033[%zuD", cells - (pos - offset));
+  
+  s->view.offset = offset;
+  s->view.cursor = pos - offset;
+  s->view.scrolled = left || right;
+}
+
+
+/**
+ * Update the display after an edit
+ * 
+ * @param  s       The session
+ * @param  point   The position of the point in the passphrase
+ * @param  direct  Whether the editing macros drew the edit
+ */
+static void viewport_update(struct passphrase_session* s, size_t point, int direct)
+{
+  if (direct)
+    s->view.cursor = count_chars(s->rc, point);
+  else
+    viewport_render(s, point);
+}
+#endif /* PASSPHRASE_VIEWPORT */
+
+
+
+#ifdef PASSPHRASE_QUERY
+/**
+ * The number of terminals whose answers are remembered
+ */
+#ifndef TERMINAL_CACHE_SIZE
+# define TERMINAL_CACHE_SIZE  4
+#endif
+
+/**
+ * The number of milliseconds to wait for the answers to
+ * the queries after the passphrase has been entered
+ */
+#ifndef TERMINAL_QUERY_TIMEOUT
+# define TERMINAL_QUERY_TIMEOUT  100
+#endif
+
+/**
+ * What terminals that have been asked support, so that
+ * each terminal is only asked once, and the number of
+ * terminals that have been asked, by any thread
+ */
+static struct terminal terminal_cache[TERMINAL_CACHE_SIZE];
+static size_t terminal_asked = 0;
+static pthread_mutex_t terminal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Let the renderers use what the terminal supports
+ * 
+ * @param  s  The session
+ */
+static void terminal_apply(struct passphrase_session* s)
+{
+  s->output.sync = (s->term.caps & TERMINAL_SYNC) != 0;
+# ifdef PASSPHRASE_METER
+  s->passcheck.decsc = (s->term.caps & TERMINAL_DECSC) != 0;
+# endif /* PASSPHRASE_METER */
+}
+
+
+/**
+ * Remember what the terminal supports, the oldest
+ * terminal is forgotten if too many have been asked
+ * 
+ * @param  s  The session
+ */
+static void terminal_remember(struct passphrase_session* s)
+{
+  struct terminal* known;
+  pthread_mutex_lock(&terminal_lock);
+  known = terminal_cache + terminal_asked++ % TERMINAL_CACHE_SIZE;
+  known->device = s->term.device;
+  known->caps = s->term.caps;
+  pthread_mutex_unlock(&terminal_lock);
+}
+
+
+/**
+ * Ask the terminal whether it supports synchronized output and
+ * bracketed paste, unless it has already been asked, followed by
+ * the primary device attributes query, which every terminal answers
+ * and thus marks the end of the answers; the answers are read as
+ * input, by `terminal_report`, so the prompt is not delayed
+ * 
+ * Whether the terminal can be asked at all is recorded
+ * for `viewport_start`, even if the queries are disabled
+ * 
+ * @param  s  The session
+ */
+static void terminal_query(struct passphrase_session* s)
+{
+  const char* env = getenv("LIBPASSPHRASE_QUERY");
+  struct termios stty;
+  struct stat in, out;
+  int known = 0;
+  size_t i;
+  
+  /* The answers are sent to the input of the terminal drawn on */
+  if (!isatty(fileno(s->output.tty)) || fstat(fileno(s->output.tty), &out) || fstat(s->fdin, &in))
+    return;
+  if (!S_ISCHR(out.st_mode) || (in.st_rdev != out.st_rdev))
+    return;
+  s->term.device = out.st_rdev;
+  
+  /* The answers would otherwise be displayed, or not
+     be delivered until Enter has been pressed */
+  if (tcgetattr(s->fdin, &stty) || (stty.c_lflag & (tcflag_t)(ECHO | ICANON)))
+    return;
+  s->term.answers = 1;
+  
+  if (env && !strcmp(env, "0"))
+    return;
+  
+  pthread_mutex_lock(&terminal_lock);
+  for (i = 0; (i < terminal_asked) && (i < TERMINAL_CACHE_SIZE); i++)
+    if (terminal_cache[i].device == s->term.device)
+      {
+	s->term.caps = terminal_cache[i].caps;
+	known = 1;
+	break;
+      }
+  pthread_mutex_unlock(&terminal_lock);
+  if (known)
+    return;
+  
+  fprintf(s->output.tty, "\033[?2026$p\033[?2004$p\033[c");
+  fflush(s->output.tty);
+  s->term.awaiting = 1;
+}
+#endif /* PASSPHRASE_QUERY */
+
+
+/**
+ * Get the value that describes the state of the display
+ * for `session_redraw`, once a frame has been drawn
+ * 
+ * @param   s  The session
+ * @return     The position of the cursor in the passphrase
+ *             as displayed, if the passphrase is displayed
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static size_t session_mark(const struct passphrase_session* s)
+{
+#ifdef PASSPHRASE_VIEWPORT
+  return s->view.cursor;
+#else /* PASSPHRASE_VIEWPORT */
+  (void) s;
+  return 0;
+#endif /* PASSPHRASE_VIEWPORT */
+}
+
+
+/**
+ * Send what has been drawn to the terminal, or queue it if
+ * the terminal cannot take more output without blocking
+ * 
+ * @param  s  The session
+ */
+static void session_flush(struct passphrase_session* s)
+{
+  xflush();
+  passphrase_output_frame__(&(s->output), session_mark(s));
+}
+
+
+/* The display can be redrawn from the session, rather than
+   from a history of edits, unless the passphrase is drawn
+   character by character without the viewport renderer */
+#if defined(PASSPHRASE_VIEWPORT) || defined(PASSPHRASE_TEXT) || (defined(PASSPHRASE_METER) && \
+    !(defined(PASSPHRASE_STAR) || (defined(PASSPHRASE_ECHO) && defined(PASSPHRASE_MOVE))))
+# define SESSION_REDRAWABLE
+#endif
+
+#ifdef SESSION_REDRAWABLE
+/**
+ * Draw the current state of the session, when output
+ * has been stalled for long enough that queued
+ * frames were dropped, see `output_redraw_t`
+ * 
+ * @param  data  The session
+ * @param  from  The mark of the frame the display was left at
+ */
+static void session_redraw(void* data, size_t from)
+{
+  struct passphrase_session* s = data;
+# ifdef PASSPHRASE_TEXT
+  int printed_len = 0;
+# endif /* PASSPHRASE_TEXT */
+  
+# if defined(PASSPHRASE_VIEWPORT)
+  s->view.cursor = from;
+#  ifdef PASSPHRASE_MOVE
+  viewport_render(s, s->point);
+#  else /* PASSPHRASE_MOVE */
+  viewport_render(s, s->len);
+#  endif /* PASSPHRASE_MOVE */
+# elif defined(PASSPHRASE_TEXT)
+  (void) from;
+  fprintf(s->output.stream, "\033[K%s%n", s->len ? PASSPHRASE_TEXT_NOT_EMPTY : PASSPHRASE_TEXT_EMPTY, &printed_len);
+  if (printed_len > 3)
+    fprintf(s->output.stream, "\033[%iD", printed_len - 3);
+# else /* PASSPHRASE_VIEWPORT, PASSPHRASE_TEXT */
+  (void) from;
+# endif /* PASSPHRASE_VIEWPORT, PASSPHRASE_TEXT */
+  
+# ifdef PASSPHRASE_METER
+  if (s->passcheck.flags && (s->passcheck.rated || s->passcheck.provisional))
+    passcheck_render(&(s->passcheck), passphrase_policy_describe__(&(s->policy)));
+  else if (s->passcheck.placement && !(s->passcheck.flags))
+    passcheck_clear(&(s->passcheck));
+# endif /* PASSPHRASE_METER */
+}
+# define SESSION_REDRAW  session_redraw
+#else /* SESSION_REDRAWABLE */
+# define SESSION_REDRAW  NULL
+#endif /* SESSION_REDRAWABLE */
+
+
+/**
+ * Apply a key to the passphrase and to the display
+ * 
+ * @param   s    The session
+ * @param   c    The first byte of the key
+ * @param   key  All bytes of the key
+ * @return       The passphrase, which may have been moved, `NULL` on error
+ */
+static char* session_edit(struct passphrase_session* s, int c, const unsigned char* key)
+{
+  char* rc = s->rc;
+  size_t size = s->size;
+  size_t len = s->len;
+#ifdef PASSPHRASE_MOVE
+  size_t point = s->point;
+  size_t i = 0;
+# if defined(PASSPHRASE_OVERRIDE) && defined(PASSPHRASE_INSERT)
+  char insert = s->insert;
+# endif /* PASSPHRASE_OVERRIDE && PASSPHRASE_INSERT */
+  int cc;
+#endif /* PASSPHRASE_MOVE */
+#ifdef PASSPHRASE_TEXT
+  size_t printed_len = 0;
+#endif /* PASSPHRASE_TEXT */
+#ifdef PASSPHRASE_VIEWPORT
+  int direct = s->view.watching ? viewport_direct(s) : 1;
+#endif /* PASSPHRASE_VIEWPORT */
+  enum keyclass class;
+  
+#if defined(PASSPHRASE_MOVE)
+  cc = get_key(c, key);
+  class = keytrace_classify(cc);
+  keytrace_record(&(s->keytrace), class, &(s->keytime));
+  PROBE(key, class, len, point);
+  if (cc > 0)
+    {
+      c = (char)cc;
+      if (point == len)
+	append_char();
+# ifdef PASSPHRASE_INSERT
+      else
+#  ifdef PASSPHRASE_OVERRIDE
+	if (insert)
+#  endif /* PASSPHRASE_OVERRIDE */
+	  insert_char();
+# endif /* PASSPHRASE_INSERT */
+# ifdef PASSPHRASE_OVERRIDE
+	else
+	  override_char();
+# endif /* PASSPHRASE_OVERRIDE */
+    }
+# if defined(PASSPHRASE_INSERT) && defined(PASSPHRASE_OVERRIDE)
+  else if (cc == KEY_INSERT)                      insert ^= 1;
+# endif /* PASSPHRASE_INSERT && PASSPHRASE_OVERRIDE */
+# ifdef PASSPHRASE_DELETE
+  else if ((cc == KEY_DELETE) && (len != point))  { delete_next(); print_delete(); }
+# endif /* PASSPHRASE_DELETE */
+  else if ((cc == KEY_ERASE) && point)            { erase_prev(); print_erase(); }
+  else if ((cc == KEY_HOME)  && (point != 0))     move_home();
+  else if ((cc == KEY_END)   && (point != len))   move_end();
+  else if ((cc == KEY_RIGHT) && (point != len))   move_right();
+  else if ((cc == KEY_LEFT)  && (point != 0))     move_left();
+  
+  s->point = point;
+# if defined(PASSPHRASE_OVERRIDE) && defined(PASSPHRASE_INSERT)
+  s->insert = insert;
+# endif /* PASSPHRASE_OVERRIDE && PASSPHRASE_INSERT */
+  
+#elif defined(PASSPHRASE_STAR) || defined(PASSPHRASE_TEXT) /* PASSPHRASE_MOVE */
+  (void) key;
+  class = keytrace_classify(((c == 8) || (c == 127)) ? KEY_ERASE : c);
+  keytrace_record(&(s->keytrace), class, &(s->keytime));
+  PROBE(key, class, len, len);
+  if ((c == 8) || (c == 127))
+    {
+      if (len == 0)
+	return rc;
+      erase_prev();
+      print_erase();
+    }
+  else
+    append_char();
+  
+#else /* PASSPHRASE_MOVE, PASSPHRASE_STAR || PASSPHRASE_TEXT */
+  (void) key;
+  class = keytrace_classify(((c == 8) || (c == 127)) ? KEY_ERASE : c);
+  keytrace_record(&(s->keytrace), class, &(s->keytime));
+  PROBE(key, class, len, len);
+  append_char();
+#endif /* PASSPHRASE_MOVE, PASSPHRASE_STAR || PASSPHRASE_TEXT */
+  
+  s->size = size;
+  s->len = len;
+#ifdef PASSPHRASE_VIEWPORT
+  if (s->view.watching)
+    {
+      s->rc = rc;
+# ifdef PASSPHRASE_MOVE
+      viewport_update(s, point, direct);
+# else /* PASSPHRASE_MOVE */
+      viewport_update(s, len, direct);
+# endif /* PASSPHRASE_MOVE */
+    }
+#endif /* PASSPHRASE_VIEWPORT */
+#ifdef PASSPHRASE_METER
+  s->passcheck.dirty = 1;
+#endif /* PASSPHRASE_METER */
+  return rc;
+}
+
+
+#ifdef PASSPHRASE_VIEWPORT
+/**
+ * Collect a byte of the answer, on the form ESC [ row ; column R,
+ * to the cursor position query
+ * 
+ * @param   s  The session
+ * @param   c  The byte
+ * @return     Whether the byte was a part of the answer
+ */
+static int viewport_scan(struct passphrase_session* s, unsigned char c)
+{
+  unsigned char* report = s->view.report;
+  size_t i, n = s->view.reportlen, column = 0;
+  int valid, fields = 1;
+  
+  if (n == 0)
+    valid = c == '\033';
+  else if (n == 1)
+    valid = c == '[';
+  else if ((c == ';') || (c == 'R'))
+    valid = (n > 2) && (report[n - 1] != ';');
+  else
+    valid = ('0' <= c) && (c <= '9');
+  if (!valid || (n == sizeof(s->view.report)))
+    return 0;
+  
+  report[n++] = c;
+  s->view.reportlen = n;
+  if (c != 'R')
+    return 1;
+  for (i = 2; i + 1 < n; i++)
+    if (report[i] == ';')
+      fields++, column = 0;
+    else
+      column = column * 10 + (size_t)(report[i] - '0');
+  if ((fields != 2) || (column == 0))
+    {
+      s->view.reportlen = n - 1;
+      return 0;
+    }
+  
+  s->view.reportlen = 0;
+  s->view.awaiting = 0;
+  s->view.start = column - 1;
+  s->view.start_known = 1;
+  /* Scroll if what has been typed so far does not fit */
+  if (!viewport_direct(s))
+# ifdef PASSPHRASE_MOVE
+    viewport_render(s, s->point);
+# else /* PASSPHRASE_MOVE */
+    viewport_render(s, s->len);
+# endif /* PASSPHRASE_MOVE */
+  return 1;
+}
+
+
+/**
+ * Wait briefly for the answer to the cursor position query if the
+ * passphrase was completed before it arrived, so that the answer
+ * is not left in the input for the application to read
+ * 
+ * @param  s  The session
+ */
+static void viewport_settle(struct passphrase_session* s)
+{
+  struct pollfd pfd;
+  unsigned char c;
+  int r;
+  
+  pfd.fd = s->fdin;
+  pfd.events = POLLIN;
+  while (s->view.awaiting)
+    {
+      r = poll(&pfd, 1, VIEWPORT_SETTLE_TIMEOUT);
+      if ((r < 0) && (errno == EINTR))
+	continue;
+      if ((r <= 0) || (read(s->fdin, &c, sizeof(c)) != 1) || !viewport_scan(s, c))
+	break;
+    }
+  s->view.awaiting = 0;
+  s->view.reportlen = 0;
+}
+#endif /* PASSPHRASE_VIEWPORT */
+
+
+#ifdef PASSPHRASE_QUERY
+/**
+ * Collect a byte of an answer to the queries, on the form
+ * ESC [ ? mode ; value $ y or ESC [ ? attributes c, or of
+ * a bracketed paste marker, ESC [ 2 0 0 ~ or ESC [ 2 0 1 ~
+ * 
+ * @param   s  The session
+ * @param   c  The byte
+ * @return     Whether the byte was a part of an answer or a marker
+ */
+static int terminal_scan(struct passphrase_session* s, unsigned char c)
+{
+  unsigned char* report = s->term.report;
+  size_t i, n = s->term.reportlen;
+  unsigned long int mode = 0, value = 0;
+  int valid, fields = 1;
+  
+  if (n == 0)
+    valid = c == '\033';
+  else if (n == 1)
+    valid = c == '[';
+  else if (n == 2)
+    valid = ((c == '?') && s->term.awaiting) || ((c == '2') && (s->term.caps & TERMINAL_PASTE));
+  else if (report[2] == '2')
+    valid = n == 5 ? c == '~' : (c == '0') || ((n == 4) && (c == '1'));
+  else if (c == 'y')
+    valid = report[n - 1] == '$';
+  else if (report[n - 1] == '$')
+    valid = 0;
+  else if ((c == ';') || (c == '$') || (c == 'c'))
+    valid = (n > 3) && (report[n - 1] != ';');
+  else
+    valid = ('0' <= c) && (c <= '9');
+  if (!valid || (n == sizeof(s->term.report)))
+    return 0;
+  
+  report[n++] = c;
+  s->term.reportlen = n;
+  if ((c != '~') && (c != 'y') && (c != 'c'))
+    return 1;
+  s->term.reportlen = 0;
+  
+  if (c == 'y')
+    {
+      /* DECRPM: 1 and 3 mean set, 2 means reset, so the mode is supported */
+      for (i = 3; i + 2 < n; i++)
+	if (report[i] == ';')
+	  fields++;
+	else if (fields == 1)
+	  mode = mode * 10 + (unsigned long int)(report[i] - '0');
+	else
+	  value = value * 10 + (unsigned long int)(report[i] - '0');
+      if ((fields == 2) && (1 <= value) && (value <= 3))
+	s->term.caps |= mode == 2026 ? TERMINAL_SYNC : mode == 2004 ? TERMINAL_PASTE : 0;
+    }
+  else if (c == 'c')
+    {
+      /* The terminal has answered every query */
+      s->term.caps |= TERMINAL_DECSC;
+      s->term.awaiting = 0;
+      terminal_remember(s);
+      terminal_apply(s);
+    }
+  return 1;
+}
+
+
+/**
+ * Wait briefly for the answers to the queries if the passphrase
+ * was completed before they arrived, so that they are not left
+ * in the input for the application to read; a terminal that
+ * does not answer in time is remembered to support nothing
+ * 
+ * @param  s  The session
+ */
+static void terminal_settle(struct passphrase_session* s)
+{
+  struct pollfd pfd;
+  unsigned char c;
+  int r;
+  
+  pfd.fd = s->fdin;
+  pfd.events = POLLIN;
+  while (s->term.awaiting)
+    {
+      r = poll(&pfd, 1, TERMINAL_QUERY_TIMEOUT);
+      if ((r < 0) && (errno == EINTR))
+	continue;
+      if (r == 0)
+	terminal_remember(s);
+      if ((r <= 0) || (read(s->fdin, &c, sizeof(c)) != 1) || !terminal_scan(s, c))
+	break;
+    }
+  s->term.awaiting = 0;
+  s->term.reportlen = 0;
+}
+#endif /* PASSPHRASE_QUERY */
+
+
+/**
+ * Finish reading the passphrase, after Enter or the end of the input
+ * 
+ * @param   s  The session
+ * @return     1 on success, -1 on error
+ */
+static int session_complete(struct passphrase_session* s)
+{
+#ifdef PASSPHRASE_METER
+  /* Let the meter rate the final passphrase before it is returned */
+  if ((s->flags & PASSPHRASE_READ_STRENGTH) && !(s->entered) &&
+      s->passcheck.flags && !passcheck_current(&(s->passcheck)))
+    {
+      s->entered = 1;
+      time_after(&(s->rate_by), METER_RATE_TIMEOUT);
+      if (s->passcheck.outstanding == 0)
+	s->passcheck.dirty = 1;
+      if (s->passcheck.dirty)
+	passcheck_query(&(s->passcheck), s->rc, s->len);
+      if (s->passcheck.flags)
+	return 0;
+    }
+#endif /* PASSPHRASE_METER */
+  
+  keytrace_flush(&(s->keytrace));
+#ifdef PASSPHRASE_QUERY
+  if (s->term.awaiting)
+    terminal_settle(s);
+#endif /* PASSPHRASE_QUERY */
+#ifdef PASSPHRASE_VIEWPORT
+  if (s->view.awaiting)
+    viewport_settle(s);
+  viewport_stop(s);
+#endif /* PASSPHRASE_VIEWPORT */
+#ifdef PASSPHRASE_METER
+  passcheck_stop(&(s->passcheck));
+#endif /* PASSPHRASE_METER */
+  
+  /* NUL-terminate passphrase */
+  *(s->rc + s->len) = 0;
+  
+  if (s->stream)
+    {
+      if (passphrase_policy_start__(&(s->policy), (s->flags & PASSPHRASE_READ_NEW) ? s->len + 1 : 0))
+	return session_fail(s, errno);
+      passphrase_policy_update__(&(s->policy), s->rc, s->len, 0);
+    }
+#if !defined(PASSPHRASE_ECHO) || defined(PASSPHRASE_MOVE)
+  else
+    fprintf(s->output.stream, "\n");
+#endif /* !PASSPHRASE_ECHO || PASSPHRASE_MOVE */
+  passphrase_output_stop__(&(s->output));
+  
+  /* Input ended before the passphrase satisfied the policy */
+  if (passphrase_policy_refuse__(&(s->policy)))
+    return session_fail(s, EINVAL);
+  
+  if (passphrase_utf8_finalise__(&(s->rc), &(s->len), &(s->size), s->flags))
+    return session_fail(s, errno);
+  
+  s->done = 1;
+  return 1;
+}
+
+
+/**
+ * Process a key whose bytes have all been read
+ * 
+ * @param   s  The session
+ * @return     0 if more keys are wanted, 1 if the passphrase
+ *             is complete, -1 on error
+ */
+static int session_key(struct passphrase_session* s)
+{
+  int c = *(s->key);
+  size_t from;
+  char* rc;
+  
+  if (c == '\n')
+    {
+      keytrace_record(&(s->keytrace), KEYCLASS_ENTER, &(s->keytime));
+      if (!passphrase_policy_refuse__(&(s->policy)))
+	return session_complete(s);
+      /* Do not accept the passphrase until it satisfies the policy */
+      fprintf(s->output.stream, "\a");
+      session_flush(s);
+      return 0;
+    }
+  /* Skip all \0 as that is probably not a part of the passphrase
+     (good luck typing that in X.org) and can be echoed into stdin
+     by the kernel. */
+  if (c == 0)
+    return 0;
+  
+  /* Remember where the passphrase may be changed, so
+     that only the rest of it needs to be rescanned */
+#ifdef PASSPHRASE_MOVE
+  from = s->point;
+#else /* PASSPHRASE_MOVE */
+  from = s->len;
+#endif /* PASSPHRASE_MOVE */
+  
+  rc = session_edit(s, c, s->key);
+  if (rc == NULL)
+    {
+      s->rc = NULL;
+      return session_fail(s, errno);
+    }
+  s->rc = rc;
+  
+#ifdef PASSPHRASE_MOVE
+  if (s->point < from)
+    from = s->point;
+  PROBE(edit, from, s->len, s->point);
+#else /* PASSPHRASE_MOVE */
+  if (s->len < from)
+    from = s->len;
+  PROBE(edit, from, s->len, s->len);
+#endif /* PASSPHRASE_MOVE */
+  passphrase_policy_update__(&(s->policy), s->rc, s->len, from);
+  
+  if ((s->len == s->size) && session_grow(s))
+    return -1;
+  
+#if defined(DEBUG) && defined(PASSPHRASE_MOVE)
+  debug_overlay(s);
+#endif /* DEBUG && PASSPHRASE_MOVE */
+  return 0;
+}
+
+
+/**
+ * Process a byte read from a terminal
+ * 
+ * @param   s  The session
+ * @param   c  The byte
+ * @return     0 if more keys are wanted, 1 if the passphrase
+ *             is complete, -1 on error
+ */
+static int session_byte(struct passphrase_session* s, unsigned char c)
+{
+  int r;
+  if ((s->keylen == 0) && s->keytrace.path)
+    clock_gettime(CLOCK_MONOTONIC, &(s->keytime));
+  s->key[s->keylen++] = c;
+#ifdef MULTIBYTE_KEYS
+  if (s->keylen < key_length(s))
+    return 0;
+#endif /* MULTIBYTE_KEYS */
+  r = session_key(s);
+  s->keylen = 0;
+  return r;
+}
+
+
+#ifdef PASSPHRASE_VIEWPORT
+/**
+ * Process a byte read from a terminal while the answer to the
+ * cursor position query is expected; bytes that turn out not
+ * to be a part of the answer are processed as keys
+ * 
+ * @param   s  The session
+ * @param   c  The byte
+ * @return     0 if more keys are wanted, 1 if the passphrase
+ *             is complete, -1 on error
+ */
+static int viewport_report(struct passphrase_session* s, unsigned char c)
+{
+  size_t i, n;
+  int r = 0;
+  
+  /* An escape in the middle of a key is a part of the key */
+  if (((s->view.reportlen > 0) || (s->keylen == 0)) && viewport_scan(s, c))
+    return 0;
+  
+  /* It was not the answer after all */
+  n = s->view.reportlen;
+  s->view.reportlen = 0;
+  for (i = 0; (i < n) && (r == 0); i++)
+    r = session_byte(s, s->view.report[i]);
+  return r ? r : session_byte(s, c);
+}
+
+
+#endif /* PASSPHRASE_VIEWPORT */
+
+
+/**
+ * Process a byte read from a terminal, that is
+ * not a part of an answer to the queries
+ * 
+ * @param   s  The session
+ * @param   c  The byte
+ * @return     0 if more keys are wanted, 1 if the passphrase
+ *             is complete, -1 on error
+ */
+static int session_input(struct passphrase_session* s, unsigned char c)
+{
+#ifdef PASSPHRASE_VIEWPORT
+  if (s->view.awaiting)
+    return viewport_report(s, c);
+#endif /* PASSPHRASE_VIEWPORT */
+  return session_byte(s, c);
+}
+
+
+#ifdef PASSPHRASE_QUERY
+/**
+ * Process a byte read from a terminal while answers to the queries,
+ * or bracketed paste markers, are expected; bytes that turn out not
+ * to be a part of either are processed as input
+ * 
+ * @param   s  The session
+ * @param   c  The byte
+ * @return     0 if more keys are wanted, 1 if the passphrase
+ *             is complete, -1 on error
+ */
+static int terminal_report(struct passphrase_session* s, unsigned char c)
+{
+  size_t i, n;
+  int r = 0;
+  
+  /* An escape in the middle of a key is a part of the key */
+  if (((s->term.reportlen > 0) || (s->keylen == 0)) && terminal_scan(s, c))
+    return 0;
+  
+  /* It was not an answer after all, but the byte that
+     revealed that may start one, unless it is a key */
+  n = s->term.reportlen;
+  s->term.reportlen = 0;
+  for (i = 0; (i < n) && (r == 0); i++)
+    r = session_input(s, s->term.report[i]);
+  if (r)
+    return r;
+  return n ? terminal_report(s, c) : session_input(s, c);
+}
+#endif /* PASSPHRASE_QUERY */
+
+
+
+/**
+ * Read and process the keys that are available from a terminal
+ * 
+ * @param   s  The session
+ * @return     0 if more keys are wanted, 1 if the passphrase
+ *             is complete, -1 on error
+ */
+static int session_read_keys(struct passphrase_session* s)
+{
+  unsigned char c;
+  ssize_t got;
+  int avail = 1, r = 0;
+  
+  /* The input is read byte by byte, so that input typed
+     after Enter is left for whoever reads it next */
+  while ((r == 0) && !(s->entered))
+    {
+      if (!(s->nonblocking) && !avail)
+	if (ioctl(s->fdin, FIONREAD, &avail) || (avail <= 0))
+	  break;
+      got = read(s->fdin, &c, sizeof(c));
+      PROBE(input__read, s->fdin, got);
+      if (got < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == EAGAIN)
+	    break;
+	}
+      if (got <= 0)
+	{
+	  keytrace_record(&(s->keytrace), KEYCLASS_EOF, &(s->keytime));
+	  s->ended = 1;
+	  r = session_complete(s);
+	  break;
+	}
+      avail--;
+#ifdef PASSPHRASE_QUERY
+      if (s->term.awaiting || (s->term.caps & TERMINAL_PASTE))
+	{
+	  r = terminal_report(s, c);
+	  continue;
+	}
+#endif /* PASSPHRASE_QUERY */
+      r = session_input(s, c);
+    }
+  
+#ifdef PASSPHRASE_METER
+  if ((r == 0) && s->passcheck.dirty)
+    passcheck_query(&(s->passcheck), s->rc, s->len);
+#endif /* PASSPHRASE_METER */
+  session_flush(s);
+  return r;
+}
+
+
+/**
+ * Read what is available from a file or pipe rather than
+ * from a terminal. Nothing is rendered and the input is read
+ * in large chunks rather than byte by byte. Input after the
+ * first new line is wiped, but if `fdin` is seekable the file
+ * offset is set to just after the new line.
+ * 
+ * @param   s  The session
+ * @return     0 if more input is wanted, 1 if the passphrase
+ *             is complete, -1 on error
+ */
+static int session_read_stream(struct passphrase_session* s)
+{
+  size_t n, over;
+  ssize_t got;
+  char* nl;
+  
+  for (;;)
+    {
+      if ((s->len + 1 == s->size) && session_grow(s))
+	return -1;
+      got = read(s->fdin, s->rc + s->len, s->size - s->len - 1);
+      PROBE(input__read, s->fdin, got);
+      if (got < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == EAGAIN)
+	    return 0;
+	  return session_fail(s, errno);
+	}
+      if (got == 0)
+	{
+	  s->ended = 1;
+	  break;
+	}
+      n = (size_t)got;
+      nl = memchr(s->rc + s->len, '\n', n);
+      if (nl == NULL)
+	{
+	  s->len += strip_nul(s->rc + s->len, n);
+	  /* Only read again if it cannot block */
+	  if (s->nonblocking || s->seekable)
+	    continue;
+	  return 0;
+	}
+      over = n - (size_t)(nl - (s->rc + s->len));
+      n -= over--;
+      if (s->seekable && over)
+	lseek(s->fdin, -(off_t)over, SEEK_CUR);
+      passphrase_wipe(nl, over + 1);
+      s->len += strip_nul(s->rc + s->len, n);
+      break;
+    }
+  
+  return session_complete(s);
+}
+
+
+/**
+ * Make as much progress as possible without blocking
+ * 
+ * @param   s       The session
+ * @param   input   Whether `fdin` is readable
+ * @param   meter   Whether the strength meter is readable
+ * @param   output  Whether the terminal can take more of the queued output
+ * @param   timer   Whether the strength meter's timer has expired
+ * @param   exited  Whether the strength meter's process file descriptor is readable
+ * @return          0 if more input is wanted, 1 if the
+ *                  passphrase is complete, -1 on error
+ */
+static int session_advance(struct passphrase_session* s, int input, int meter, int output, int timer, int exited)
+{
+  if (s->done)
+    return s->done > 0 ? 1 : (errno = s->error, -1);
+  
+  if (output)
+    passphrase_output_write__(&(s->output));
+#ifdef PASSPHRASE_METER
+  /* The strength is drawn below the passphrase, so it is displayed at once */
+  if (meter || timer)
+    s->output.atomic = 1;
+  if (meter)
+    {
+      passcheck_reply(&(s->passcheck), s->rc, s->len, passphrase_policy_describe__(&(s->policy)));
+      session_flush(s);
+    }
+  /* The meter is restarted by the timer, so a meter that
+     has crashed is handled before the timer is */
+  if (exited)
+    passcheck_exited(&(s->passcheck));
+  if (timer)
+    {
+      passcheck_timer(&(s->passcheck), s->rc, s->len, passphrase_policy_describe__(&(s->policy)));
+      session_flush(s);
+    }
+  if (s->entered)
+    return (s->passcheck.flags && !passcheck_current(&(s->passcheck))) ? 0 : session_complete(s);
+#else /* PASSPHRASE_METER */
+  (void) meter;
+  (void) timer;
+  (void) exited;
+#endif /* PASSPHRASE_METER */
+  
+  if (!input)
+    return 0;
+  return s->stream ? session_read_stream(s) : session_read_keys(s);
+}
+
+
+/**
+ * Start reading a passphrase without blocking
+ * 
+ * @param   fdin   File descriptor for input
+ * @param   flags  Settings, see `passphrase_read2`
+ * @param   tty    The stream for the terminal to draw on, usually `stderr`
+ * @return         The session, `NULL` on error
+ */
+static struct passphrase_session* session_open(int fdin, int flags, FILE* tty)
+{
+  struct passphrase_session* s;
+  struct stat attr;
+#ifdef PASSPHRASE_TEXT
+  size_t printed_len = 0;
+# ifdef PASSPHRASE_VIEWPORT
+  const int direct = 1;
+# endif /* PASSPHRASE_VIEWPORT */
+#endif /* PASSPHRASE_TEXT */
+  int fl, saved_errno;
+  
+  s = calloc(1, sizeof(*s));
+  if (s == NULL)
+    return NULL;
+  s->fdin = fdin;
+  s->flags = flags;
+  s->size = START_PASSPHRASE_LIMIT;
+  s->output.stream = s->output.tty = tty;
+  s->output.fd = -1;
+  fl = fcntl(fdin, F_GETFL);
+  s->nonblocking = (fl != -1) && (fl & O_NONBLOCK);
+  s->stream = !isatty(fdin);
+#ifdef PASSPHRASE_MOVE
+# if defined(PASSPHRASE_OVERRIDE) && defined(PASSPHRASE_INSERT)
+  s->insert = DEFAULT_INSERT_VALUE;
+# endif /* PASSPHRASE_OVERRIDE && PASSPHRASE_INSERT */
+#endif /* PASSPHRASE_MOVE */
+  
+  if (s->stream && !fstat(fdin, &attr) && S_ISREG(attr.st_mode))
+    {
+      s->seekable = 1;
+      if ((attr.st_size > 0) && (attr.st_size <= MAX_STREAM_PREALLOCATION))
+	s->size = (size_t)(attr.st_size) + 2;
+    }
+  
+  if ((s->rc = xmalloc(s->size)) == NULL)
+    goto fail;
+  /* For streams, the policy is evaluated once all input has been read */
+  if (passphrase_policy_start__(&(s->policy), ((flags & PASSPHRASE_READ_NEW) && !(s->stream)) ? s->size : 0))
+    goto fail;
+  if (s->stream)
+    return s;
+  
+#ifdef PASSPHRASE_METER
+  passcheck_start(&(s->passcheck), flags, s->output.tty);
+#endif /* PASSPHRASE_METER */
+  keytrace_start(&(s->keytrace));
+#ifdef PASSPHRASE_QUERY
+  terminal_query(s);
+#endif /* PASSPHRASE_QUERY */
+#ifdef PASSPHRASE_VIEWPORT
+  viewport_start(s);
+#endif /* PASSPHRASE_VIEWPORT */
+  
+#ifdef PASSPHRASE_TEXT
+  xprintf("%s%zn", PASSPHRASE_TEXT_EMPTY, &printed_len);
+  if (printed_len)
+    xprintf("\e[%zuD", printed_len);
+#endif /* PASSPHRASE_TEXT */
+  
+  /* What is drawn from now on is queued, so that
+     a stalled terminal does not stall the input */
+  passphrase_output_start__(&(s->output), s->output.tty, SESSION_REDRAW, s);
+#ifdef PASSPHRASE_METER
+  s->passcheck.out = s->output.stream;
+#endif /* PASSPHRASE_METER */
+#ifdef PASSPHRASE_QUERY
+  terminal_apply(s);
+#endif /* PASSPHRASE_QUERY */
+  
+  return s;
+ fail:
+  saved_errno = errno;
+  free(s->rc);
+  free(s);
+  errno = saved_errno;
+  return NULL;
+}
+
+
+/**
+ * Start reading a passphrase without blocking
+ * 
+ * @param   fdin   File descriptor for input
+ * @param   flags  Settings, see `passphrase_read2`
+ * @return         The session, `NULL` on error
+ */
+struct passphrase_session* passphrase_session_start(int fdin, int flags)
+{
+  return session_open(fdin, flags, stderr);
+}
+
+
+/**
+ * Get the file descriptors a session is waiting for
+ * 
+ * @param   s    The session
+ * @param   fds  Output parameter for the file descriptors, and the
+ *               events to wait for, at most `PASSPHRASE_SESSION_FDS`
+ * @return       The number of file descriptors, 0 if the
+ *               session is not waiting for anything
+ */
+size_t passphrase_session_fds(const struct passphrase_session* s, struct pollfd* fds)
+{
+  size_t n = 0;
+  if (s->done)
+    return 0;
+  if (!(s->entered))
+    {
+      fds[n].fd = s->fdin;
+      fds[n].events = POLLIN;
+      fds[n++].revents = 0;
+    }
+#ifdef PASSPHRASE_METER
+  if (s->passcheck.flags && s->passcheck.outstanding)
+    {
+      fds[n].fd = s->passcheck.pipe_rw[0];
+      fds[n].events = POLLIN;
+      fds[n++].revents = 0;
+    }
+  if (s->passcheck.flags && s->passcheck.armed)
+    {
+      fds[n].fd = s->passcheck.timer;
+      fds[n].events = POLLIN;
+      fds[n++].revents = 0;
+    }
+  if (s->passcheck.flags && !(s->passcheck.down) && (s->passcheck.pidfd >= 0))
+    {
+      fds[n].fd = s->passcheck.pidfd;
+      fds[n].events = POLLIN;
+      fds[n++].revents = 0;
+    }
+#endif /* PASSPHRASE_METER */
+  if (passphrase_output_pending__(&(s->output)))
+    {
+      fds[n].fd = s->output.fd;
+      fds[n].events = POLLOUT;
+      fds[n++].revents = 0;
+    }
+  return n;
+}
+
+
+/**
+ * Get how long a session may be waited for
+ * 
+ * @param   s  The session
+ * @return     The time left, in milliseconds, for `poll`,
+ *             -1 if there is no limit, 0 if it has passed
+ */
+int passphrase_session_timeout(const struct passphrase_session* s)
+{
+  if (s->done || !(s->entered))
+    return -1;
+  return passphrase_meter_time_left__(&(s->rate_by));
+}
+
+
+/**
+ * Find out which of the file descriptors from
+ * `passphrase_session_fds` are ready
+ * 
+ * @param  s       The session
+ * @param  fds     The file descriptors, after `poll`
+ * @param  n       The number of file descriptors
+ * @param  input   Output parameter for whether `fdin` is readable
+ * @param  meter   Output parameter for whether the strength meter is readable
+ * @param  output  Output parameter for whether the terminal is writable
+ * @param  timer   Output parameter for whether the strength meter's timer has expired
+ * @param  exited  Output parameter for whether the strength meter has exited
+ */
+static void session_ready(const struct passphrase_session* s, const struct pollfd* fds,
+			  nfds_t n, int* input, int* meter, int* output, int* timer, int* exited)
+{
+  nfds_t i;
+  *input = *meter = *output = *timer = *exited = 0;
+  for (i = 0; i < n; i++)
+    if (fds[i].revents)
+      *(fds[i].fd == s->fdin ? input : fds[i].fd == s->output.fd ? output :
+#ifdef PASSPHRASE_METER
+	fds[i].fd == s->passcheck.timer ? timer :
+	fds[i].fd == s->passcheck.pidfd ? exited :
+#endif /* PASSPHRASE_METER */
+	meter) = 1;
+}
+
+
+/**
+ * Make as much progress as possible without blocking
+ * 
+ * @param   s  The session
+ * @return     0 if the session shall be continued when one of
+ *             the file descriptors from `passphrase_session_fds`
+ *             is ready, 1 if the passphrase is complete, -1 on error
+ */
+int passphrase_session_step(struct passphrase_session* s)
+{
+  struct pollfd fds[PASSPHRASE_SESSION_FDS];
+  nfds_t n = (nfds_t)passphrase_session_fds(s, fds);
+  int input, meter, output, timer, exited;
+  
+  if (n == 0)
+    return session_advance(s, 0, 0, 0, 0, 0);
+  while (poll(fds, n, 0) < 0)
+    if (errno != EINTR)
+      return session_fail(s, errno);
+  session_ready(s, fds, n, &input, &meter, &output, &timer, &exited);
+  return session_advance(s, input, meter, output, timer, exited);
+}
+
+
+/**
+ * End a session, and get the passphrase, its strength, and its length
+ * and allocation size as they are once it has been validated and
+ * normalised, which may reallocate it
+ * 
+ * @param   s         The session, it is deallocated
+ * @param   strength  Output parameter for the strength of the passphrase,
+ *                    `NULL` if not wanted; only set if the passphrase is returned
+ * @param   lenp      Output parameter for the length of the passphrase,
+ *                    `NULL` if not wanted; only set if the passphrase is returned
+ * @param   sizep     Output parameter for the allocation size of the passphrase,
+ *                    `NULL` if not wanted; only set if the passphrase is returned
+ * @return            The passphrase, should be wiped and `free`:ed, `NULL` on
+ *                    error or if the passphrase is not complete, in which case
+ *                    `errno` is set to `ECANCELED`
+ */
+static char* session_end(struct passphrase_session* s, struct passphrase_strength* strength,
+			 size_t* lenp, size_t* sizep)
+{
+  char* rc = NULL;
+  int error;
+  
+  /* Stop waiting for the strength of the final passphrase */
+  if ((s->done == 0) && s->entered)
+    session_complete(s);
+  error = s->error;
+  
+  if ((s->done > 0) && strength)
+    {
+#ifdef PASSPHRASE_METER
+      strength->current = passcheck_current(&(s->passcheck));
+      if (s->passcheck.rated)
+	{
+	  strength->rating.score = s->passcheck.score;
+	  strength->rating.tier = s->passcheck.tier;
+	  strength->rating.description = s->passcheck.description;
+	}
+      else
+#endif /* PASSPHRASE_METER */
+	{
+	  strength->current = 0;
+	  strength->rating.score = 0;
+	  strength->rating.tier = -1;
+	  strength->rating.description = NULL;
+	}
+    }
+  
+  if (s->done > 0)
+    {
+      rc = s->rc;
+      if (lenp)
+	*lenp = s->len;
+      if (sizep)
+	*sizep = s->size;
+    }
+  else if (s->done == 0)
+    {
+      /* The meter may be what the application has been waiting for,
+	 so do not wait for it to exit by itself */
+      error = ECANCELED;
+      keytrace_flush(&(s->keytrace));
+#ifdef PASSPHRASE_METER
+      if ((s->passcheck.flags != 0) && (s->passcheck.pid != -1))
+	meter_kill(s->passcheck.pid, s->passcheck.pidfd);
+      passcheck_stop(&(s->passcheck));
+#endif /* PASSPHRASE_METER */
+#if !defined(PASSPHRASE_ECHO) || defined(PASSPHRASE_MOVE)
+      if (!(s->stream))
+	fprintf(s->output.stream, "\n");
+#endif /* !PASSPHRASE_ECHO || PASSPHRASE_MOVE */
+    }
+  
+#ifdef PASSPHRASE_METER
+  passcheck_stop(&(s->passcheck));
+#endif /* PASSPHRASE_METER */
+#ifdef PASSPHRASE_VIEWPORT
+  viewport_stop(s);
+#endif /* PASSPHRASE_VIEWPORT */
+  passphrase_output_stop__(&(s->output));
+  passphrase_policy_stop__(&(s->policy));
+  if ((rc == NULL) && s->rc)
+    {
+      passphrase_wipe(s->rc, s->size);
+      free(s->rc);
+    }
+  passphrase_wipe((char*)(s->key), sizeof(s->key));
+  free(s);
+  if (rc == NULL)
+    errno = error;
+  return rc;
+}
+
+
+/**
+ * End a session, and get the passphrase
+ * 
+ * @param   s  The session, it is deallocated
+ * @return     The passphrase, should be wiped and `free`:ed, `NULL` on
+ *             error or if the passphrase is not complete, in which case
+ *             `errno` is set to `ECANCELED`
+ */
+char* passphrase_session_finish(struct passphrase_session* s)
+{
+  return session_end(s, NULL, NULL, NULL);
+}
+
+
+/**
+ * End a session, and get the passphrase and its strength
+ * 
+ * @param   s         The session, it is deallocated
+ * @param   strength  Output parameter for the strength of the passphrase,
+ *                    `NULL` if not wanted; only set if the passphrase is returned
+ * @return            The passphrase, should be wiped and `free`:ed, `NULL` on
+ *                    error or if the passphrase is not complete, in which case
+ *                    `errno` is set to `ECANCELED`
+ */
+char* passphrase_session_finish2(struct passphrase_session* s, struct passphrase_strength* strength)
+{
+  return session_end(s, strength, NULL, NULL);
+}
+
+
+/**
+ * Reap the strength meters that have been stopped but had not
+ * exited yet, they are otherwise reaped by later sessions
+ * 
+ * @param  wait  Whether to wait until all of them have exited,
+ *               those that do not exit within their grace period
+ *               are killed
+ */
+void passphrase_reap_meters(int wait)
+{
+#ifdef PASSPHRASE_METER
+  meter_reap(wait);
+#else /* PASSPHRASE_METER */
+  (void) wait;
 #endif /* PASSPHRASE_METER */
+}
+
+
+/**
+ * Reads the passphrase from stdin
+ * 
+ * @param   fdin   File descriptor for input
+ * @param   flags  Settings, a combination of the constants:
+ *                 * PASSPHRASE_READ_EXISTING
+ *                 * PASSPHRASE_READ_NEW
+ *                 * PASSPHRASE_READ_SCREEN_FREE
+ *                 * PASSPHRASE_READ_BELOW_FREE
+ *                 * PASSPHRASE_READ_VALIDATE
+ *                 * PASSPHRASE_READ_NFC
+ *                 * PASSPHRASE_READ_NFKC
+ *                 * PASSPHRASE_READ_STRENGTH
+ *                 Invalid input is ignored, to make use the
+ *                 application will work.
+ * @return         The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+char* passphrase_read2(int fdin, int flags)
+{
+  return passphrase_read3(fdin, flags, NULL, -1);
+}
+
+
+/**
+ * Reads the passphrase, but give up at a deadline or when cancelled
+ * 
+ * @param   fdin      File descriptor for input
+ * @param   flags     Settings, see `passphrase_read2`
+ * @param   deadline  The time, on `CLOCK_MONOTONIC`, when reading shall
+ *                    fail with `ETIMEDOUT`, `NULL` for no deadline
+ * @param   cancelfd  File descriptor that, when it becomes readable, makes
+ *                    reading fail with `ECANCELED`, -1 for none; it is never
+ *                    read from, so it may be shared by any number of readers
+ * @return            The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+char* passphrase_read3(int fdin, int flags, const struct timespec* deadline, int cancelfd)
+{
+  return passphrase_read4(fdin, flags, deadline, cancelfd, NULL);
+}
+
+
+/**
+ * Wait for a session to complete, unless the deadline
+ * passes or reading is cancelled first
+ * 
+ * @param   s         The session
+ * @param   deadline  See `passphrase_read4`
+ * @param   cancelfd  See `passphrase_read4`
+ * @return            The reason reading was given up, 0 if it was not
+ */
+static int session_wait(struct passphrase_session* s, const struct timespec* deadline, int cancelfd)
+{
+  struct pollfd fds[PASSPHRASE_SESSION_FDS + 1];
+  nfds_t n, m;
+  int r, timeout, wait, input = 0, meter = 0, output = 0, timer = 0, exited = 0, aborted = 0;
+  
+  while (!(r = session_advance(s, input, meter, output, timer, exited)))
+    {
+      n = m = (nfds_t)passphrase_session_fds(s, fds);
+      if (cancelfd >= 0)
+	{
+	  fds[n].fd = cancelfd;
+	  fds[n].events = POLLIN;
+	  fds[n++].revents = 0;
+	}
+      timeout = passphrase_meter_time_left__(deadline);
+      if (s->entered)
+	{
+	  /* The passphrase has been entered, so rather than
+	     failing, stop waiting for the strength meter */
+	  wait = passphrase_meter_time_left__(&(s->rate_by));
+	  if ((wait == 0) || (timeout == 0))
+	    break;
+	  if ((timeout < 0) || (wait < timeout))
+	    timeout = wait;
+	}
+      if (timeout == 0)
+	{
+	  aborted = ETIMEDOUT;
 	  break;
 	}
-      if (c == 0)
-	continue;
       
-#if defined(PASSPHRASE_MOVE)
-      cc = get_key(c, fdin);
-      if (cc > 0)
+      /* The cancellation file descriptor is never read from, so one
+	 write to it is enough to cancel any number of readers */
+      r = poll(fds, n, timeout);
+      input = meter = output = timer = exited = 0;
+      if (r < 0)
 	{
-	  c = (char)cc;
-	  if (point == len)
-	    append_char();
-# ifdef PASSPHRASE_INSERT
-	  else
-#  ifdef PASSPHRASE_OVERRIDE
-	    if (insert)
-#  endif /* PASSPHRASE_OVERRIDE */
-	      insert_char();
-# endif /* PASSPHRASE_INSERT */
-# ifdef PASSPHRASE_OVERRIDE
-	    else
-	      override_char();
-# endif /* PASSPHRASE_OVERRIDE */
+	  if (errno == EINTR)
+	    continue;
+	  aborted = errno;
+	  break;
 	}
-# if defined(PASSPHRASE_INSERT) && defined(PASSPHRASE_OVERRIDE)
-      else if (cc == KEY_INSERT)                      insert ^= 1;
-# endif /* PASSPHRASE_INSERT && PASSPHRASE_OVERRIDE */
-# ifdef PASSPHRASE_DELETE
-      else if ((cc == KEY_DELETE) && (len != point))  { delete_next(); print_delete(); }
-# endif /* PASSPHRASE_DELETE */
-      else if ((cc == KEY_ERASE) && point)            { erase_prev(); print_erase(); }
-      else if ((cc == KEY_HOME)  && (point != 0))     move_home();
-      else if ((cc == KEY_END)   && (point != len))   move_end();
-      else if ((cc == KEY_RIGHT) && (point != len))   move_right();
-      else if ((cc == KEY_LEFT)  && (point != 0))     move_left();
-      
-#elif defined(PASSPHRASE_STAR) || defined(PASSPHRASE_TEXT) /* PASSPHRASE_MOVE */
-      if ((c == 8) || (c == 127))
+      if ((cancelfd >= 0) && fds[n - 1].revents)
+	{
+	  aborted = s->entered ? 0 : ECANCELED;
+	  break;
+	}
+      session_ready(s, fds, m, &input, &meter, &output, &timer, &exited);
+    }
+  
+  return aborted;
+}
+
+
+#ifdef PASSPHRASE_AGENT
+/**
+ * Let the passphrase agent read the passphrase, if there is one
+ * 
+ * @param   fdin      File descriptor for input, the agent is only used for terminals
+ * @param   flags     Settings, see `passphrase_read2`
+ * @param   deadline  See `passphrase_read4`
+ * @param   cancelfd  See `passphrase_read4`
+ * @param   strength  See `passphrase_read4`
+ * @param   rc        Output parameter for the passphrase, `NULL` on error
+ * @param   len       Output parameter for the length of the passphrase
+ * @param   size      Output parameter for the size of the allocation
+ * @return            1 if the agent read the passphrase, or failed to,
+ *                    0 if there is no agent
+ */
+static int agent_read(int fdin, int flags, const struct timespec* deadline, int cancelfd,
+		      struct passphrase_strength* strength, char** rc, size_t* len, size_t* size)
+{
+  int fd, memfd;
+  
+  if (!isatty(fdin))
+    return 0;
+  /* A stale or untrusted agent must not stop the
+     passphrase from being read from the terminal */
+  fd = passphrase_agent_connect__();
+  if (fd < 0)
+    return 0;
+  
+  *rc = NULL;
+  memfd = passphrase_agent_ask__(fd, flags, deadline, cancelfd, strength);
+  if (memfd >= 0)
+    *rc = passphrase_agent_take__(memfd, len, size);
+  return 1;
+}
+#endif /* PASSPHRASE_AGENT */
+
+
+/**
+ * Reads the passphrase, but give up at a deadline or when
+ * cancelled, and get the strength of the passphrase
+ * 
+ * @param   fdin      File descriptor for input
+ * @param   flags     Settings, see `passphrase_read2`
+ * @param   deadline  The time, on `CLOCK_MONOTONIC`, when reading shall
+ *                    fail with `ETIMEDOUT`, `NULL` for no deadline
+ * @param   cancelfd  File descriptor that, when it becomes readable, makes
+ *                    reading fail with `ECANCELED`, -1 for none; it is never
+ *                    read from, so it may be shared by any number of readers
+ * @param   strength  Output parameter for the strength of the passphrase, `NULL`
+ *                    if not wanted; only set if the passphrase is returned
+ * @return            The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+char* passphrase_read4(int fdin, int flags, const struct timespec* deadline, int cancelfd,
+		       struct passphrase_strength* strength)
+{
+  struct passphrase_session* s;
+  int aborted;
+  char* rc;
+#ifdef PASSPHRASE_AGENT
+  size_t len, size;
+  
+  if (agent_read(fdin, flags, deadline, cancelfd, strength, &rc, &len, &size))
+    return rc;
+#endif /* PASSPHRASE_AGENT */
+  
+  s = passphrase_session_start(fdin, strength ? (flags | PASSPHRASE_READ_STRENGTH) : flags);
+  if (s == NULL)
+    return NULL;
+  
+  aborted = session_wait(s, deadline, cancelfd);
+  rc = passphrase_session_finish2(s, strength);
+  if (aborted)
+    errno = aborted;
+  return rc;
+}
+
+
+/**
+ * Reads the passphrase, and give it to a function rather than
+ * returning it; the function reads it from the same locked
+ * memory the passphrase was edited in, and it is wiped afterwards
+ * 
+ * @param   fdin    File descriptor for input
+ * @param   flags   Settings, see `passphrase_read2`
+ * @param   update  Function that is called with `data` and consecutive
+ *                  segments of the passphrase, in order, and returns zero
+ *                  on success; otherwise it shall set `errno`, and reading
+ *                  fails without the rest of the passphrase being given
+ * @param   data    The first argument for `update`
+ * @return          Zero on success, -1 on error
+ */
+int passphrase_read_sink(int fdin, int flags, int (*update)(void*, const char*, size_t), void* data)
+{
+  struct passphrase_session* s;
+  size_t len, size;
+  int r, saved_errno;
+  char* rc;
+  
+#ifdef PASSPHRASE_AGENT
+  if (agent_read(fdin, flags, NULL, -1, NULL, &rc, &len, &size))
+    {
+      if (rc == NULL)
+	return -1;
+      goto have_passphrase;
+    }
+#endif /* PASSPHRASE_AGENT */
+  
+  s = passphrase_session_start(fdin, flags);
+  if (s == NULL)
+    return -1;
+  
+  session_wait(s, NULL, -1);
+  if ((rc = session_end(s, NULL, &len, &size)) == NULL)
+    return -1;
+  
+#ifdef PASSPHRASE_AGENT
+ have_passphrase:
+#endif /* PASSPHRASE_AGENT */
+  /* The passphrase is contiguous, so it is given as one segment */
+  r = update(data, rc, len);
+  saved_errno = errno;
+  passphrase_wipe(rc, size);
+  free(rc);
+  errno = saved_errno;
+  return r ? -1 : 0;
+}
+
+
+/**
+ * Open a stream for drawing on the terminal that is read from
+ * 
+ * @param   fdin  File descriptor for input
+ * @return        The stream, `stderr` if `fdin` is not a terminal
+ *                or if it cannot be opened, should be `fclose`:d
+ *                unless it is `stderr`
+ */
+static FILE* tty_open(int fdin)
+{
+  const char* name;
+  FILE* tty;
+  int fd;
+  
+  if (!isatty(fdin) || !(name = ttyname(fdin)))
+    return stderr;
+  fd = open(name, O_WRONLY | O_NOCTTY | O_CLOEXEC);
+  if (fd < 0)
+    return stderr;
+  tty = fdopen(fd, "w");
+  if (tty == NULL)
+    {
+      close(fd);
+      return stderr;
+    }
+  /* Like `stderr`, it is unbuffered */
+  setvbuf(tty, NULL, _IONBF, 0);
+  return tty;
+}
+
+
+/**
+ * End a session of `passphrase_read_any` that did not win,
+ * wipe what has been typed, and restore the terminal
+ * 
+ * @param  s      The session, `NULL` if it has already been ended
+ * @param  fdin   File descriptor for input
+ * @param  saved  The original terminal settings
+ * @param  tty    The stream from `tty_open`
+ */
+static void any_close(struct passphrase_session* s, int fdin, const struct termios* saved, FILE* tty)
+{
+  int saved_errno = errno;
+  size_t size;
+  char* rc;
+  
+  if (s)
+    {
+      if ((rc = session_end(s, NULL, NULL, &size)))
+	{
+	  passphrase_wipe(rc, size);
+	  free(rc);
+	}
+    }
+  passphrase_reenable_echo2__(fdin, saved);
+  if (tty != stderr)
+    fclose(tty);
+  errno = saved_errno;
+}
+
+
+/**
+ * Reads the passphrase from several terminals at the same time,
+ * the first terminal on which it is entered wins, and what has
+ * been typed on the other terminals is wiped
+ * 
+ * @param   fds     File descriptors for input, each is drawn on
+ *                  through its own terminal, echo is disabled on
+ *                  them by this function
+ * @param   n       The number of file descriptors
+ * @param   flags   Settings, see `passphrase_read2`
+ * @param   winner  Output parameter for the index, in `fds`, of the
+ *                  file descriptor the passphrase was read from,
+ *                  `NULL` if not wanted; only set on success
+ * @return          The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+char* passphrase_read_any(const int* fds, size_t n, int flags, size_t* winner)
+{
+  struct passphrase_session** sessions = NULL;
+  struct termios* saved = NULL;
+  struct pollfd* pfds = NULL;
+  size_t* counts = NULL;
+  FILE** ttys = NULL;
+  size_t i, at, opened = 0, live, won = n;
+  nfds_t m;
+  int r, timeout, wait, polled = 0, error = 0;
+  int input, meter, output, timer, exited;
+  char* rc = NULL;
+  
+  if (n == 0)
+    return errno = EINVAL, NULL;
+  
+  sessions = calloc(n, sizeof(*sessions));
+  saved = calloc(n, sizeof(*saved));
+  pfds = calloc(n, PASSPHRASE_SESSION_FDS * sizeof(*pfds));
+  counts = calloc(n, sizeof(*counts));
+  ttys = calloc(n, sizeof(*ttys));
+  if (!sessions || !saved || !pfds || !counts || !ttys)
+    goto fail;
+  
+  while (opened < n)
+    {
+      i = opened++;
+      ttys[i] = tty_open(fds[i]);
+      passphrase_disable_echo2__(fds[i], saved + i);
+      if ((sessions[i] = session_open(fds[i], flags, ttys[i])) == NULL)
+	goto fail;
+    }
+  
+  for (live = n;;)
+    {
+      /* Advance each session by what it has become ready for */
+      for (i = at = 0; i < n; at += counts[i++])
 	{
-	  if (len == 0)
+	  if (sessions[i] == NULL)
 	    continue;
-	  erase_prev();
-	  print_erase();
-	  
-#ifdef PASSPHRASE_METER
-	  passcheck_update(&passcheck, rc, len);
-#endif /* PASSPHRASE_METER */
-	  
-	  xflush();
-# ifdef DEBUG
-	  goto debug;
-# else /* DEBUG */
-	  continue;
-# endif /* DEBUG */
+	  input = meter = output = timer = exited = 0;
+	  if (polled)
+	    session_ready(sessions[i], pfds + at, (nfds_t)(counts[i]), &input, &meter, &output, &timer, &exited);
+	  r = session_advance(sessions[i], input, meter, output, timer, exited);
+	  if (r == 0)
+	    continue;
+	  if ((r > 0) && !(sessions[i]->ended))
+	    {
+	      won = i;
+	      goto done;
+	    }
+	  /* A terminal that hangs up does not win, it drops out */
+	  error = r < 0 ? errno : EIO;
+	  any_close(sessions[i], fds[i], saved + i, ttys[i]);
+	  sessions[i] = NULL;
+	  ttys[i] = stderr;
+	  if (--live == 0)
+	    goto fail_error;
 	}
-      append_char();
       
-#else /* PASSPHRASE_MOVE, PASSPHRASE_STAR || PASSPHRASE_TEXT */
-      append_char();
-#endif /* PASSPHRASE_MOVE, PASSPHRASE_STAR || PASSPHRASE_TEXT */
-      
-#ifdef PASSPHRASE_METER
-      passcheck_update(&passcheck, rc, len);
-#endif /* PASSPHRASE_METER */
-      
-      xflush();
-      if (len == size)
+      for (i = 0, m = 0, timeout = -1; i < n; m += (nfds_t)(counts[i++]))
 	{
-	  if ((rc = xrealloc(rc, (size_t)size, (size_t)size << 1)) == NULL)
-	    return NULL;
-	  size <<= 1L;
+	  counts[i] = 0;
+	  if (sessions[i] == NULL)
+	    continue;
+	  counts[i] = passphrase_session_fds(sessions[i], pfds + m);
+	  if (sessions[i]->entered)
+	    {
+	      /* Rather than waiting longer for the strength
+		 meter, the passphrase that has been entered wins */
+	      wait = passphrase_meter_time_left__(&(sessions[i]->rate_by));
+	      if (wait == 0)
+		{
+		  won = i;
+		  goto done;
+		}
+	      if ((timeout < 0) || (wait < timeout))
+		timeout = wait;
+	    }
 	}
       
-#ifdef DEBUG
-# ifdef __GNUC__
-#  pragma GCC diagnostic push
-#   pragma GCC diagnostic ignored "-Wunused-label"
-# endif
-    debug:
-      {
-	size_t n = 0;
-	for (i = point; i < len; i++)
-	  if ((*(rc + i) & 0xC0) != 0x80)
-	    n++;
-	*(rc + len) = 0;
-	if (n)
-	  fprintf(stderr, "\033[s\033[H\033[K%s\033[%zuD\033[01;34m%s\033[00m\033[u", rc, n, rc + point);
-	else
-	  fprintf(stderr, "\033[s\033[H\033[K%s\033[01;34m%s\033[00m\033[u", rc, rc + point);
-	fflush(stderr);
-      }
-#endif /* DEBUG */
+      polled = poll(pfds, m, timeout) >= 0;
+      if (!polled && (errno != EINTR))
+	goto fail;
     }
   
-  /* NUL-terminate passphrase */
-  *(rc + len) = 0;
+ done:
+  rc = passphrase_session_finish(sessions[won]);
+  sessions[won] = NULL;
+  if (rc == NULL)
+    goto fail;
+  goto out;
   
-#if !defined(PASSPHRASE_ECHO) || defined(PASSPHRASE_MOVE)
-  fprintf(stderr, "\n");
-#endif /* !PASSPHRASE_ECHO || PASSPHRASE_MOVE */
+ fail:
+  error = errno;
+ fail_error:
+  won = n;
+ out:
+  for (i = 0; i < opened; i++)
+    any_close(sessions[i], fds[i], saved + i, ttys[i]);
+  free(sessions);
+  free(saved);
+  free(pfds);
+  free(counts);
+  free(ttys);
+  if (rc == NULL)
+    errno = error;
+  else if (winner)
+    *winner = won;
   return rc;
+}
+
+
+/**
+ * The buffer `passphrase_read_static` returns the passphrase in
+ */
+static char static_buffer[PASSPHRASE_STATIC_MAX];
+
+
+/**
+ * Append a segment of the passphrase to the buffer of `passphrase_read_static`
+ * 
+ * @param   data     The length of what has been appended, a `size_t`
+ * @param   segment  The segment of the passphrase
+ * @param   n        The length of the segment
+ * @return           Zero on success, -1 if the buffer is full
+ */
+static int static_append(void* data, const char* segment, size_t n)
+{
+  size_t* len = data;
+  if (*len + n >= PASSPHRASE_STATIC_MAX)
+    return errno = ENOBUFS, -1;
+  memcpy(static_buffer + *len, segment, n);
+  *len += n;
+  return 0;
+}
+
+
+/**
+ * Reads the passphrase into a static buffer
+ * 
+ * @param   fdin   File descriptor for input
+ * @param   flags  Settings, see `passphrase_read2`
+ * @return         The passphrase, should be wiped but not `free`:ed,
+ *                 `NULL` on error; it is overwritten by the next call
+ */
+char* passphrase_read_static(int fdin, int flags)
+{
+  static int locked = 0;
+  size_t len = 0;
   
-#ifndef PASSPHRASE_METER
-  (void) flags;
-#endif /* !PASSPHRASE_METER */
+  if (!locked)
+    locked = !mlock(static_buffer, sizeof(static_buffer));
+  if (passphrase_read_sink(fdin, flags, static_append, &len))
+    {
+      passphrase_wipe(static_buffer, len);
+      return NULL;
+    }
+  static_buffer[len] = '\0';
+  return static_buffer;
 }
 
 
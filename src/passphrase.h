@@ -20,6 +20,8 @@
 #define PASSPHRASE_H
 
 #include <stddef.h>
+#include <time.h>
+#include <poll.h>
 
 #if defined(__GNUC__) && !defined(PASSPHRASE_USE_DEPRECATED)
 # define PASSPHRASE_DEPRECATED(MSG)  __attribute__((__deprecated__(MSG)))
@@ -27,6 +29,10 @@
 # define PASSPHRASE_DEPRECATED(MSG)  /* ignore */
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
 
 /**
@@ -67,6 +73,166 @@
  */
 #define PASSPHRASE_READ_BELOW_FREE  4
 
+/**
+ * `passphrase_read2` shall fail, with `errno`
+ * set to `EILSEQ`, if the passphrase is not
+ * valid UTF-8.
+ */
+#define PASSPHRASE_READ_VALIDATE  8
+
+/**
+ * `passphrase_read2` shall validate the passphrase,
+ * as with `PASSPHRASE_READ_VALIDATE`, and convert
+ * it to Normalization Form C, so that the same
+ * passphrase always gives the same bytes. If
+ * libpassphrase was compiled without support for
+ * normalisation, `passphrase_read2` fails, with
+ * `errno` set to `ENOTSUP`, if the passphrase is
+ * not pure ASCII. The passphrase is normalised by
+ * libunistring, whose working memory is neither
+ * locked nor wiped, so parts of a passphrase that
+ * is not pure ASCII may be left in freed memory.
+ */
+#define PASSPHRASE_READ_NFC  16
+
+/**
+ * Like `PASSPHRASE_READ_NFC`, but convert the
+ * passphrase to Normalization Form KC.
+ * Should not be combined with `PASSPHRASE_READ_NFC`.
+ */
+#define PASSPHRASE_READ_NFKC  32
+
+/**
+ * When Enter is pressed, wait for the passphrase
+ * strength meter to rate the final passphrase, so
+ * that its strength can be retrieved with
+ * `passphrase_read4` or `passphrase_session_finish2`
+ */
+#define PASSPHRASE_READ_STRENGTH  64
+
+
+
+/**
+ * Character classes for `struct passphrase_policy.required_classes`
+ */
+#define PASSPHRASE_CLASS_LOWER      1 /* a-z */
+#define PASSPHRASE_CLASS_UPPER      2 /* A-Z */
+#define PASSPHRASE_CLASS_DIGIT      4 /* 0-9 */
+#define PASSPHRASE_CLASS_SYMBOL     8 /* Any other ASCII character */
+#define PASSPHRASE_CLASS_NON_ASCII 16 /* Any non-ASCII character */
+
+/**
+ * `passphrase_read2` shall not accept the passphrase
+ * when Enter is pressed, unless it satisfies the policy
+ */
+#define PASSPHRASE_POLICY_ENFORCE  1
+
+/**
+ * The passphrase may not contain the user's username
+ */
+#define PASSPHRASE_POLICY_NOT_USER  2
+
+/**
+ * The passphrase may not contain the machine's hostname
+ */
+#define PASSPHRASE_POLICY_NOT_HOST  4
+
+
+/**
+ * Rules new passphrases must satisfy, see `passphrase_set_policy`
+ */
+struct passphrase_policy
+{
+  /**
+   * The minimum number of characters
+   */
+  size_t min_length;
+  
+  /**
+   * The character classes, `PASSPHRASE_CLASS_*`,
+   * that must all be used at least once
+   */
+  int required_classes;
+  
+  /**
+   * The maximum number of identical characters
+   * in a row, 0 for no limit
+   */
+  size_t max_run;
+  
+  /**
+   * `NULL`-terminated list of substrings, that the
+   * passphrase may not contain, ignoring the case
+   * of ASCII letters, `NULL` for none
+   */
+  const char* const* forbidden;
+  
+  /**
+   * A combination of `PASSPHRASE_POLICY_*`
+   */
+  int flags;
+};
+
+
+/**
+ * The strength of a passphrase, as rated by `passphrase_score_batch`
+ */
+struct passphrase_score
+{
+  /**
+   * The score the passphrase strength meter gave the passphrase
+   */
+  unsigned long long int score;
+  
+  /**
+   * The index of the passphrase's strength tier, 0 for the weakest tier
+   */
+  int tier;
+  
+  /**
+   * The description of the passphrase's strength tier,
+   * the same text the interactive strength meter shows
+   */
+  const char* description;
+};
+
+
+/**
+ * The strength of a passphrase read with `passphrase_read4`
+ */
+struct passphrase_strength
+{
+  /**
+   * The strength the passphrase strength meter gave the newest
+   * version of the passphrase it rated; `tier` is -1 and
+   * `description` is `NULL` if it did not rate any version
+   */
+  struct passphrase_score rating;
+  
+  /**
+   * Whether `rating` is for the final passphrase, as it
+   * was typed, rather than for an earlier version of it
+   */
+  int current;
+};
+
+
+/**
+ * The size of the buffer `passphrase_read_static` returns,
+ * including the NUL byte that terminates the passphrase
+ */
+#define PASSPHRASE_STATIC_MAX  1024
+
+/**
+ * The largest number of file descriptors `passphrase_session_fds` returns
+ */
+#define PASSPHRASE_SESSION_FDS  5
+
+/**
+ * A passphrase being read without blocking, see `passphrase_session_start`
+ */
+struct passphrase_session;
+
 
 
 /**
@@ -86,12 +252,192 @@ char* passphrase_read(void);
  *                 * PASSPHRASE_READ_NEW
  *                 * PASSPHRASE_READ_SCREEN_FREE
  *                 * PASSPHRASE_READ_BELOW_FREE
+ *                 * PASSPHRASE_READ_VALIDATE
+ *                 * PASSPHRASE_READ_NFC
+ *                 * PASSPHRASE_READ_NFKC
+ *                 * PASSPHRASE_READ_STRENGTH
  *                 Invalid input is ignored, to make use the
  *                 application will work.
  * @return         The passphrase, should be wiped and `free`:ed, `NULL` on error
  */
 char* passphrase_read2(int, int);
 
+/**
+ * Reads the passphrase, but give up at a deadline or when cancelled.
+ * When reading is given up, the passphrase is wiped and the strength
+ * meter is stopped, but `passphrase_reenable_echo1` must still be called.
+ * 
+ * @param   fdin      File descriptor for input
+ * @param   flags     Settings, see `passphrase_read2`
+ * @param   deadline  The time, on `CLOCK_MONOTONIC`, when reading shall
+ *                    fail with `ETIMEDOUT`, `NULL` for no deadline
+ * @param   cancelfd  File descriptor that, when it becomes readable, makes
+ *                    reading fail with `ECANCELED`, -1 for none; it is never
+ *                    read from, so it may be shared by any number of readers
+ * @return            The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+char* passphrase_read3(int, int, const struct timespec*, int);
+
+/**
+ * Like `passphrase_read3`, but also get the strength of the passphrase,
+ * as rated by the passphrase strength meter while it was typed. If the
+ * meter has not rated the final passphrase when Enter is pressed, it
+ * is waited for, but not for longer than a second, nor past `deadline`.
+ * 
+ * @param   fdin      File descriptor for input
+ * @param   flags     Settings, see `passphrase_read2`; `PASSPHRASE_READ_STRENGTH`
+ *                    is added if `strength` is not `NULL`
+ * @param   deadline  See `passphrase_read3`
+ * @param   cancelfd  See `passphrase_read3`; after Enter has been pressed,
+ *                    it only stops the wait for the strength meter
+ * @param   strength  Output parameter for the strength of the passphrase, `NULL`
+ *                    if not wanted; only set if the passphrase is returned
+ * @return            The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+char* passphrase_read4(int, int, const struct timespec*, int, struct passphrase_strength*);
+
+/**
+ * Reads the passphrase, and give it to a function, such as the update
+ * function of a hash or key derivation function, rather than returning
+ * it. The function reads the passphrase directly from the locked memory
+ * it was edited in, so no copy of it is made, and it is wiped afterwards.
+ * 
+ * @param   fdin    File descriptor for input
+ * @param   flags   Settings, see `passphrase_read2`
+ * @param   update  Function that is called with `data` and consecutive
+ *                  segments of the passphrase, in order, and returns zero
+ *                  on success; otherwise it shall set `errno`, and reading
+ *                  fails without the rest of the passphrase being given
+ * @param   data    The first argument for `update`
+ * @return          Zero on success, -1 on error
+ */
+int passphrase_read_sink(int, int, int (*)(void*, const char*, size_t), void*);
+
+/**
+ * Reads the passphrase from several terminals at the same time, for
+ * example from the console, a serial console and a network console,
+ * in one process. Echo is disabled on all of them, and the passphrase
+ * is edited separately on each, as by `passphrase_read2`, drawing on
+ * the terminal that is read from rather than on the standard error.
+ * The first terminal on which Enter is pressed wins; what has been
+ * typed on the others is wiped, and they are restored. A terminal
+ * that hangs up drops out, and reading fails with `EIO` if all of
+ * them do. The application shall write the prompt to each terminal.
+ * 
+ * @param   fds     File descriptors for input, echo shall not be disabled
+ *                  on them with `passphrase_disable_echo1`
+ * @param   n       The number of file descriptors, at least one
+ * @param   flags   Settings, see `passphrase_read2`
+ * @param   winner  Output parameter for the index, in `fds`, of the
+ *                  file descriptor the passphrase was read from,
+ *                  `NULL` if not wanted; only set on success
+ * @return          The passphrase, should be wiped and `free`:ed, `NULL` on error
+ */
+char* passphrase_read_any(const int*, size_t, int, size_t*);
+
+/**
+ * Reads the passphrase into a static buffer rather than allocating
+ * memory for it; this is what the minimal build, see `make tiny`,
+ * provides instead of the other functions for reading passphrases.
+ * In the minimal build, the strength of the passphrase is estimated
+ * rather than rated by a strength meter, and flags other than
+ * `PASSPHRASE_READ_NEW`, `PASSPHRASE_READ_SCREEN_FREE`
+ * and `PASSPHRASE_READ_BELOW_FREE` are ignored.
+ * 
+ * @param   fdin   File descriptor for input
+ * @param   flags  Settings, see `passphrase_read2`
+ * @return         The passphrase, in a locked buffer that is reused by
+ *                 the next call, should be wiped but not `free`:ed,
+ *                 `NULL` on error; a passphrase of `PASSPHRASE_STATIC_MAX`
+ *                 bytes or longer fails with `ENOBUFS`
+ */
+char* passphrase_read_static(int, int);
+
+/**
+ * Start reading a passphrase without blocking, so that many
+ * passphrases can be read at the same time in one thread.
+ * `passphrase_session_step` is called whenever one of the
+ * file descriptors from `passphrase_session_fds` is ready,
+ * until it returns non-zero, and then `passphrase_session_finish`
+ * is called to get the passphrase. The terminal is handled
+ * as by `passphrase_read2`.
+ * 
+ * @param   fdin   File descriptor for input, it need not be non-blocking
+ * @param   flags  Settings, see `passphrase_read2`
+ * @return         The session, `NULL` on error
+ */
+struct passphrase_session* passphrase_session_start(int, int);
+
+/**
+ * Get the file descriptors a session is waiting for, this
+ * changes after each call to `passphrase_session_step`
+ * 
+ * @param   session  The session
+ * @param   fds      Output parameter for the file descriptors, and the
+ *                   events to wait for, at most `PASSPHRASE_SESSION_FDS`
+ * @return           The number of file descriptors, 0 if the
+ *                   session is not waiting for anything
+ */
+size_t passphrase_session_fds(const struct passphrase_session*, struct pollfd*);
+
+/**
+ * Get how long a session may be waited for; once the passphrase has
+ * been entered, the strength meter's rating of it is only waited for
+ * a short while, after which the session shall be ended with
+ * `passphrase_session_finish2`, which gives the last rating
+ * 
+ * @param   session  The session
+ * @return           The time left, in milliseconds, for `poll`,
+ *                   -1 if there is no limit, 0 if it has passed
+ */
+int passphrase_session_timeout(const struct passphrase_session*);
+
+/**
+ * Make as much progress as possible without blocking
+ * 
+ * @param   session  The session
+ * @return           0 if the session shall be continued when one of
+ *                   the file descriptors from `passphrase_session_fds`
+ *                   is ready, 1 if the passphrase is complete, -1 on error
+ */
+int passphrase_session_step(struct passphrase_session*);
+
+/**
+ * End a session, and get the passphrase; a session
+ * may be ended at any time to give up reading
+ * 
+ * @param   session  The session, it is deallocated
+ * @return           The passphrase, should be wiped and `free`:ed, `NULL` on
+ *                   error or if the passphrase is not complete, in which case
+ *                   `errno` is set to `ECANCELED`
+ */
+char* passphrase_session_finish(struct passphrase_session*);
+
+/**
+ * Like `passphrase_session_finish`, but also get the strength of
+ * the passphrase. If the session was started with
+ * `PASSPHRASE_READ_STRENGTH` and Enter has been pressed, but the
+ * strength meter has not yet rated the final passphrase, the
+ * passphrase is returned with the newest strength that is known.
+ * 
+ * @param   session   The session, it is deallocated
+ * @param   strength  Output parameter for the strength of the passphrase,
+ *                    `NULL` if not wanted; only set if the passphrase is returned
+ * @return            See `passphrase_session_finish`
+ */
+char* passphrase_session_finish2(struct passphrase_session*, struct passphrase_strength*);
+
+/**
+ * When a passphrase has been read, the strength meter is stopped
+ * without waiting for it to exit; it is reaped by later calls, and
+ * killed if it has not exited a second after it was stopped. This
+ * function reaps the meters that have exited since, for example
+ * before the application stops reading passphrases for a while.
+ * 
+ * @param  wait  Whether to wait until all stopped meters have exited
+ */
+void passphrase_reap_meters(int);
+
 /**
  * Forcefully write NUL characters to a passphrase
  * 
@@ -133,6 +479,37 @@ void passphrase_disable_echo1(int);
  */
 void passphrase_reenable_echo1(int);
 
+/**
+ * Set the policy new passphrases must satisfy. The policy
+ * is evaluated while the user is typing when `passphrase_read2`
+ * is used with `PASSPHRASE_READ_NEW`, and the rules that are not
+ * satisfied are displayed along with the strength meter.
+ * 
+ * @param   policy  The policy, `NULL` to remove the policy; it is
+ *                  copied, and need not be kept after the call
+ * @return          Zero on success, -1 on error
+ */
+int passphrase_set_policy(const struct passphrase_policy*);
+
+/**
+ * Rate the strength of many passphrases without any user interaction,
+ * using the same passphrase strength meter and strength tiers as
+ * `passphrase_read2` with `PASSPHRASE_READ_NEW`. The passphrases
+ * are spread over a pool of meter processes.
+ * 
+ * @param   passphrases  The passphrases, they may not contain line feeds
+ * @param   lengths      The length of each passphrase, `NULL` if they are NUL-terminated
+ * @param   n            The number of passphrases
+ * @param   scores       Output parameter for the strength of each passphrase
+ * @param   workers      The number of meter processes to use, 0 for one per processor
+ * @return               Zero on success, -1 on error
+ */
+int passphrase_score_batch(const char* const*, const size_t*, size_t, struct passphrase_score*, size_t);
+
+
+#ifdef __cplusplus
+}
+#endif
 
 
 #undef PASSPHRASE_DEPRECATED
@@ -0,0 +1,352 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PASSPHRASE_HPP
+#define PASSPHRASE_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory_resource>
+#include <new>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#if __cplusplus >= 202002L
+# include <span>
+#endif
+
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+# include <malloc.h>
+#endif
+
+#include "passphrase.h"
+
+
+
+/* C++ binding for libpassphrase. It is header-only, and
+ * only needs the C library at link time. */
+
+
+namespace passphrase
+{
+  /**
+   * A passphrase returned by libpassphrase, owned without being copied,
+   * and wiped and freed when destroyed. It can be moved but not copied,
+   * so that there is never more than one copy of the passphrase.
+   */
+  class secure_string
+  {
+  public:
+    /**
+     * Create an empty passphrase
+     */
+    secure_string() noexcept
+      : buffer(nullptr), length(0)
+    {
+    }
+    
+    /**
+     * Take ownership of a passphrase returned by `passphrase_read2`
+     * 
+     * @param  str  The passphrase, may be `nullptr`
+     */
+    explicit secure_string(char* str) noexcept
+      : buffer(str), length(str ? std::strlen(str) : 0)
+    {
+    }
+    
+    secure_string(secure_string&& other) noexcept
+      : buffer(std::exchange(other.buffer, nullptr)), length(std::exchange(other.length, 0))
+    {
+    }
+    
+    secure_string& operator=(secure_string&& other) noexcept
+    {
+      if (this != &other)
+	{
+	  this->reset();
+	  this->buffer = std::exchange(other.buffer, nullptr);
+	  this->length = std::exchange(other.length, 0);
+	}
+      return *this;
+    }
+    
+    secure_string(const secure_string&) = delete;
+    secure_string& operator=(const secure_string&) = delete;
+    
+    ~secure_string()
+    {
+      this->reset();
+    }
+    
+    /**
+     * Wipe and free the passphrase, and make this object empty
+     */
+    void reset() noexcept
+    {
+      if (this->buffer == nullptr)
+	return;
+      /* Erased characters may remain after the NUL byte */
+#if defined(__linux__)
+      passphrase_wipe(this->buffer, malloc_usable_size(this->buffer));
+#else
+      passphrase_wipe(this->buffer, this->length);
+#endif
+      std::free(this->buffer);
+      this->buffer = nullptr;
+      this->length = 0;
+    }
+    
+    /**
+     * Give up ownership of the passphrase
+     * 
+     * @return  The passphrase, should be wiped and `free`:ed, `nullptr` if empty
+     */
+    [[nodiscard]] char* release() noexcept
+    {
+      this->length = 0;
+      return std::exchange(this->buffer, nullptr);
+    }
+    
+    /**
+     * @return  The passphrase, NUL-terminated
+     */
+    const char* c_str() const noexcept
+    {
+      return this->buffer ? this->buffer : "";
+    }
+    
+    /**
+     * @return  The passphrase, NUL-terminated, `nullptr` if empty
+     */
+    const char* data() const noexcept
+    {
+      return this->buffer;
+    }
+    
+    /**
+     * @return  The length of the passphrase, in bytes
+     */
+    std::size_t size() const noexcept
+    {
+      return this->length;
+    }
+    
+    bool empty() const noexcept
+    {
+      return this->length == 0;
+    }
+    
+    /**
+     * @return  The passphrase, valid as long as this object is not changed
+     */
+    std::string_view view() const noexcept
+    {
+      return std::string_view(this->c_str(), this->length);
+    }
+    
+    operator std::string_view() const noexcept
+    {
+      return this->view();
+    }
+    
+#if __cplusplus >= 202002L
+    /**
+     * @return  The bytes of the passphrase, valid as long as this object is not changed
+     */
+    std::span<const char> span() const noexcept
+    {
+      return std::span<const char>(this->c_str(), this->length);
+    }
+#endif
+    
+  private:
+    char* buffer;
+    std::size_t length;
+  };
+  
+  
+  /**
+   * Read a passphrase, see `passphrase_read2`
+   * 
+   * @param   fdin   File descriptor for input
+   * @param   flags  Settings, see `passphrase_read2`
+   * @return         The passphrase
+   * @throws         std::system_error  On error
+   */
+  inline secure_string read(int fdin = STDIN_FILENO, int flags = PASSPHRASE_READ_EXISTING)
+  {
+    char* str = passphrase_read2(fdin, flags);
+    if (str == nullptr)
+      throw std::system_error(errno, std::generic_category(), "passphrase_read2");
+    return secure_string(str);
+  }
+  
+  /**
+   * Read a passphrase, unless the deadline passes or reading
+   * is cancelled first, see `passphrase_read3`
+   * 
+   * @param   fdin      File descriptor for input
+   * @param   flags     Settings, see `passphrase_read2`
+   * @param   deadline  The time, on `CLOCK_MONOTONIC`, when reading
+   *                    shall be given up, `nullptr` for no deadline
+   * @param   cancelfd  File descriptor that cancels reading when
+   *                    it becomes readable, -1 for none
+   * @return            The passphrase
+   * @throws            std::system_error  On error, with `ETIMEDOUT` or `ECANCELED`
+   *                                       if reading was given up
+   */
+  inline secure_string read(int fdin, int flags, const struct timespec* deadline, int cancelfd)
+  {
+    char* str = passphrase_read3(fdin, flags, deadline, cancelfd);
+    if (str == nullptr)
+      throw std::system_error(errno, std::generic_category(), "passphrase_read3");
+    return secure_string(str);
+  }
+  
+  /**
+   * Read a passphrase, and get its strength, see `passphrase_read4`
+   * 
+   * @param   fdin      File descriptor for input
+   * @param   flags     Settings, see `passphrase_read2`
+   * @param   deadline  See `read`
+   * @param   cancelfd  See `read`
+   * @param   strength  Output parameter for the strength of the passphrase
+   * @return            The passphrase
+   * @throws            std::system_error  On error
+   */
+  inline secure_string read(int fdin, int flags, const struct timespec* deadline, int cancelfd,
+			    struct passphrase_strength& strength)
+  {
+    char* str = passphrase_read4(fdin, flags, deadline, cancelfd, &strength);
+    if (str == nullptr)
+      throw std::system_error(errno, std::generic_category(), "passphrase_read4");
+    return secure_string(str);
+  }
+  
+  /**
+   * Read a passphrase, and give it to a function rather than
+   * returning it, see `passphrase_read_sink`
+   * 
+   * @param   update  Function that is called with consecutive segments of
+   *                  the passphrase, in order, as `std::string_view`:s
+   * @param   fdin    File descriptor for input
+   * @param   flags   Settings, see `passphrase_read2`
+   * @throws          std::system_error  On error
+   * @throws          Whatever `update` throws, after the passphrase has been wiped
+   */
+  template <class Update>
+  void read_sink(Update&& update, int fdin = STDIN_FILENO, int flags = PASSPHRASE_READ_EXISTING)
+  {
+    struct context
+    {
+      Update& update;
+      std::exception_ptr error;
+    } ctx{update, nullptr};
+    int r = passphrase_read_sink(fdin, flags, [](void* data, const char* segment, std::size_t n) noexcept -> int
+      {
+	context* c = static_cast<context*>(data);
+	try
+	  {
+	    c->update(std::string_view(segment, n));
+	    return 0;
+	  }
+	catch (...)
+	  {
+	    c->error = std::current_exception();
+	    errno = ECANCELED;
+	    return -1;
+	  }
+      }, &ctx);
+    if (ctx.error)
+      std::rethrow_exception(ctx.error);
+    if (r)
+      throw std::system_error(errno, std::generic_category(), "passphrase_read_sink");
+  }
+  
+  
+  /**
+   * Memory resource for secrets derived from passphrases. Each
+   * allocation gets pages of its own, which are locked into memory
+   * if `RLIMIT_MEMLOCK` permits, excluded from core dumps where
+   * supported, and wiped before they are unmapped.
+   * 
+   * Because each allocation takes at least one page, this is meant
+   * for a few secrets, not for general use. Note that `std::pmr::string`
+   * stores short strings inside the object itself, outside this resource.
+   */
+  class locked_memory_resource : public std::pmr::memory_resource
+  {
+  protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+      std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+      std::size_t size = round_up(bytes, page);
+      void* ptr;
+      if ((alignment > page) || (size < bytes))
+	throw std::bad_alloc();
+      ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ptr == MAP_FAILED)
+	throw std::bad_alloc();
+#ifdef MADV_DONTDUMP
+      madvise(ptr, size, MADV_DONTDUMP);
+#endif
+      mlock(ptr, size);
+      return ptr;
+    }
+    
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override
+    {
+      std::size_t size = round_up(bytes, static_cast<std::size_t>(sysconf(_SC_PAGESIZE)));
+      passphrase_wipe(static_cast<char*>(ptr), size);
+      munlock(ptr, size);
+      munmap(ptr, size);
+      (void) alignment;
+    }
+    
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+      return this == &other;
+    }
+    
+  private:
+    static std::size_t round_up(std::size_t bytes, std::size_t page) noexcept
+    {
+      return bytes ? (bytes + page - 1) & ~(page - 1) : page;
+    }
+  };
+  
+  /**
+   * @return  A `locked_memory_resource` shared by the whole program
+   */
+  inline locked_memory_resource* locked_resource() noexcept
+  {
+    static locked_memory_resource resource;
+    return &resource;
+  }
+}
+
+
+
+#endif
+
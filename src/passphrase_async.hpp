@@ -0,0 +1,510 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PASSPHRASE_ASYNC_HPP
+#define PASSPHRASE_ASYNC_HPP
+
+#include <coroutine>
+#include <cerrno>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "passphrase.hpp"
+
+
+
+/* C++20 coroutine adapter for reading passphrases without blocking,
+ * on top of `passphrase_session_start`. Any number of passphrases can
+ * be read at the same time in one thread, by one reactor. A reactor
+ * using epoll is included, and if Asio or Boost.Asio is included
+ * before this header, one using an Asio `io_context` as well. */
+
+
+namespace passphrase
+{
+  /**
+   * Event loop that coroutines reading passphrases wait in
+   */
+  class reactor
+  {
+  public:
+    virtual ~reactor() = default;
+    
+    /**
+     * Call a function once, when any of some file descriptors is ready
+     * 
+     * @param  fds    The file descriptors, and the events to wait for
+     * @param  n      The number of file descriptors, at most `PASSPHRASE_SESSION_FDS`
+     * @param  ready  The function to call
+     * @param  data   Argument for `ready`, identifies the watch
+     */
+    virtual void watch(const struct pollfd* fds, std::size_t n, void (*ready)(void*), void* data) = 0;
+    
+    /**
+     * Stop waiting for a watch that has not been called yet
+     * 
+     * @param  data  The argument that was passed to `watch`
+     */
+    virtual void unwatch(void* data) noexcept = 0;
+  };
+  
+  
+  /**
+   * Awaitable for reading a passphrase, returned by `async_read`
+   */
+  class read_awaitable
+  {
+  public:
+    read_awaitable(passphrase::reactor& reactor, int fdin, int flags) noexcept
+      : reactor(reactor), session(nullptr), fdin(fdin), flags(flags), error(0), watching(false)
+    {
+    }
+    
+    read_awaitable(const read_awaitable&) = delete;
+    read_awaitable& operator=(const read_awaitable&) = delete;
+    
+    ~read_awaitable()
+    {
+      if (this->watching)
+	this->reactor.unwatch(this);
+      if (this->session != nullptr)
+	{
+	  secure_string discarded(passphrase_session_finish(this->session));
+	}
+    }
+    
+    bool await_ready()
+    {
+      this->session = passphrase_session_start(this->fdin, this->flags);
+      if (this->session == nullptr)
+	{
+	  this->error = errno;
+	  return true;
+	}
+      return passphrase_session_step(this->session) != 0;
+    }
+    
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      this->handle = handle;
+      this->arm();
+    }
+    
+    /**
+     * @return  The passphrase
+     * @throws  std::system_error  On error
+     */
+    secure_string await_resume()
+    {
+      char* str;
+      if (this->error)
+	throw std::system_error(this->error, std::generic_category(), "passphrase_session_start");
+      str = passphrase_session_finish(std::exchange(this->session, nullptr));
+      if (str == nullptr)
+	throw std::system_error(errno, std::generic_category(), "passphrase_session_step");
+      return secure_string(str);
+    }
+    
+  private:
+    void arm()
+    {
+      struct pollfd fds[PASSPHRASE_SESSION_FDS];
+      std::size_t n = passphrase_session_fds(this->session, fds);
+      this->reactor.watch(fds, n, &read_awaitable::ready, this);
+      this->watching = true;
+    }
+    
+    static void ready(void* data)
+    {
+      read_awaitable* self = static_cast<read_awaitable*>(data);
+      self->watching = false;
+      if (passphrase_session_step(self->session))
+	self->handle.resume();
+      else
+	self->arm();
+    }
+    
+    passphrase::reactor& reactor;
+    struct passphrase_session* session;
+    std::coroutine_handle<> handle;
+    int fdin;
+    int flags;
+    int error;
+    bool watching;
+  };
+  
+  /**
+   * Read a passphrase in a coroutine, see `passphrase_read2`
+   * 
+   * `co_await` on the result suspends the coroutine until the passphrase
+   * is complete, and evaluates to a `secure_string` or throws a
+   * `std::system_error`. If the coroutine is destroyed while suspended,
+   * reading is given up.
+   * 
+   * @param   reactor  The reactor that shall resume the coroutine
+   * @param   fdin     File descriptor for input
+   * @param   flags    Settings, see `passphrase_read2`
+   * @return           An awaitable for the passphrase
+   */
+  inline read_awaitable async_read(reactor& reactor, int fdin = STDIN_FILENO,
+				   int flags = PASSPHRASE_READ_EXISTING) noexcept
+  {
+    return read_awaitable(reactor, fdin, flags);
+  }
+  
+  
+  /**
+   * Reactor using epoll, it is run with `run` or `run_once`
+   * 
+   * Each file descriptor may only be watched by one watch at a time
+   */
+  class epoll_reactor : public reactor
+  {
+  public:
+    epoll_reactor()
+      : epfd(epoll_create1(EPOLL_CLOEXEC))
+    {
+      if (this->epfd < 0)
+	throw std::system_error(errno, std::generic_category(), "epoll_create1");
+    }
+    
+    epoll_reactor(const epoll_reactor&) = delete;
+    epoll_reactor& operator=(const epoll_reactor&) = delete;
+    
+    ~epoll_reactor()
+    {
+      for (auto& w : this->watches)
+	delete w.second;
+      close(this->epfd);
+    }
+    
+    void watch(const struct pollfd* fds, std::size_t n, void (*ready)(void*), void* data) override
+    {
+      std::unique_ptr<record> r(new record);
+      struct epoll_event ev;
+      std::size_t i;
+      r->ready = ready;
+      r->data = data;
+      r->n = 0;
+      this->watches.reserve(this->watches.size() + 1);
+      for (i = 0; i < n; i++)
+	{
+	  ev.events = ((fds[i].events & POLLIN) ? static_cast<unsigned>(EPOLLIN) : 0U) |
+	              ((fds[i].events & POLLOUT) ? static_cast<unsigned>(EPOLLOUT) : 0U);
+	  ev.data.fd = fds[i].fd;
+	  if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) < 0)
+	    {
+	      int saved_errno = errno;
+	      this->release(r.get());
+	      throw std::system_error(saved_errno, std::generic_category(), "epoll_ctl");
+	    }
+	  if (static_cast<std::size_t>(fds[i].fd) >= this->by_fd.size())
+	    this->by_fd.resize(static_cast<std::size_t>(fds[i].fd) + 1, nullptr);
+	  this->by_fd[static_cast<std::size_t>(fds[i].fd)] = r.get();
+	  r->fds[r->n++] = fds[i].fd;
+	}
+      this->watches.emplace(data, r.release());
+    }
+    
+    void unwatch(void* data) noexcept override
+    {
+      auto it = this->watches.find(data);
+      if (it == this->watches.end())
+	return;
+      this->release(it->second);
+      delete it->second;
+      this->watches.erase(it);
+    }
+    
+    /**
+     * Wait for file descriptors and call their watches
+     * 
+     * @param   timeout  The number of milliseconds to wait at most, -1 for no limit
+     * @return           The number of called watches
+     * @throws           std::system_error  On error
+     */
+    std::size_t run_once(int timeout = -1)
+    {
+      struct epoll_event events[256];
+      std::size_t count = 0;
+      record* r;
+      int i, n;
+      
+      n = epoll_wait(this->epfd, events, 256, timeout);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    return 0;
+	  throw std::system_error(errno, std::generic_category(), "epoll_wait");
+	}
+      for (i = 0; i < n; i++)
+	{
+	  /* The watch may have ended earlier in this batch */
+	  r = this->by_fd[static_cast<std::size_t>(events[i].data.fd)];
+	  if (r == nullptr)
+	    continue;
+	  this->release(r);
+	  this->watches.erase(r->data);
+	  std::unique_ptr<record> owned(r);
+	  count++;
+	  r->ready(r->data);
+	}
+      return count;
+    }
+    
+    /**
+     * Call watches until there are none left
+     * 
+     * @throws  std::system_error  On error
+     */
+    void run()
+    {
+      while (!this->watches.empty())
+	this->run_once(-1);
+    }
+    
+    /**
+     * @return  The number of watches that have not been called yet
+     */
+    std::size_t pending() const noexcept
+    {
+      return this->watches.size();
+    }
+    
+  private:
+    struct record
+    {
+      void (*ready)(void*);
+      void* data;
+      int fds[PASSPHRASE_SESSION_FDS];
+      std::size_t n;
+    };
+    
+    void release(record* r) noexcept
+    {
+      std::size_t i;
+      for (i = 0; i < r->n; i++)
+	{
+	  epoll_ctl(this->epfd, EPOLL_CTL_DEL, r->fds[i], nullptr);
+	  this->by_fd[static_cast<std::size_t>(r->fds[i])] = nullptr;
+	}
+      r->n = 0;
+    }
+    
+    int epfd;
+    std::unordered_map<void*, record*> watches;
+    std::vector<record*> by_fd;
+  };
+  
+  
+#if defined(BOOST_ASIO_VERSION) || defined(ASIO_VERSION)
+# if defined(BOOST_ASIO_VERSION)
+  namespace asio_ = ::boost::asio;
+# else
+  namespace asio_ = ::asio;
+# endif
+  
+  /**
+   * Reactor that waits in an Asio `io_context`, so that passphrases
+   * can be read by coroutines running alongside other Asio work
+   */
+  class asio_reactor : public reactor
+  {
+  public:
+    explicit asio_reactor(asio_::io_context& context) noexcept
+      : context(context)
+    {
+    }
+    
+    asio_reactor(const asio_reactor&) = delete;
+    asio_reactor& operator=(const asio_reactor&) = delete;
+    
+    /**
+     * @return  The `io_context` the reactor waits in
+     */
+    asio_::io_context& get_context() const noexcept
+    {
+      return this->context;
+    }
+    
+    ~asio_reactor()
+    {
+      for (auto& w : this->watches)
+	w.second->release();
+    }
+    
+    void watch(const struct pollfd* fds, std::size_t n, void (*ready)(void*), void* data) override
+    {
+      std::shared_ptr<record> r = std::make_shared<record>();
+      std::size_t i;
+      r->ready = ready;
+      r->data = data;
+      r->fired = false;
+      r->descriptors.reserve(n);
+      r->status_flags.reserve(n);
+      for (i = 0; i < n; i++)
+	{
+	  r->status_flags.push_back(fcntl(fds[i].fd, F_GETFL));
+	  r->descriptors.emplace_back(this->context, fds[i].fd);
+	}
+      this->watches[data] = r;
+      for (i = 0; i < n; i++)
+	r->descriptors[i].async_wait((fds[i].events & POLLOUT)
+				     ? asio_::posix::stream_descriptor::wait_write
+				     : asio_::posix::stream_descriptor::wait_read,
+				     [this, r](const auto& error)
+				     {
+				       if (r->fired)
+					 return;
+				       (void) error;
+				       r->release();
+				       this->watches.erase(r->data);
+				       r->ready(r->data);
+				     });
+    }
+    
+    void unwatch(void* data) noexcept override
+    {
+      auto it = this->watches.find(data);
+      if (it == this->watches.end())
+	return;
+      it->second->release();
+      this->watches.erase(it);
+    }
+    
+  private:
+    struct record
+    {
+      void (*ready)(void*);
+      void* data;
+      bool fired;
+      std::vector<asio_::posix::stream_descriptor> descriptors;
+      std::vector<int> status_flags;
+      
+      /**
+       * Stop waiting, without closing the file descriptors, which
+       * belong to the session, and undo Asio making them non-blocking,
+       * as the file description may be shared with other processes
+       */
+      void release() noexcept
+      {
+	std::size_t i;
+	int fd;
+	this->fired = true;
+	for (i = 0; i < this->descriptors.size(); i++)
+	  {
+	    fd = this->descriptors[i].release();
+	    if (this->status_flags[i] != -1)
+	      fcntl(fd, F_SETFL, this->status_flags[i]);
+	  }
+      }
+    };
+    
+    asio_::io_context& context;
+    std::unordered_map<void*, std::shared_ptr<record>> watches;
+  };
+  
+  /**
+   * Read a passphrase as an Asio asynchronous operation, see `passphrase_read2`
+   * 
+   * This is for coroutine types, such as `asio::awaitable`, that cannot
+   * `co_await` the awaitable from `async_read(reactor&, int, int)`, and for
+   * callbacks. The completion signature is `void(std::exception_ptr, secure_string)`,
+   * so that with `use_awaitable` the passphrase is returned and errors are thrown.
+   * The completion handler is always called from the `io_context`.
+   * 
+   * @param   reactor  The reactor, it is used for the waits
+   * @param   fdin     File descriptor for input
+   * @param   flags    Settings, see `passphrase_read2`
+   * @param   token    The completion token
+   * @return           Whatever the completion token makes it
+   */
+  template <typename CompletionToken>
+  auto async_read(asio_reactor& reactor, int fdin, int flags, CompletionToken&& token)
+  {
+    return asio_::async_initiate<CompletionToken, void(std::exception_ptr, secure_string)>
+      ([&reactor, fdin, flags](auto handler)
+       {
+	 using handler_type = decltype(handler);
+	 
+	 struct operation
+	 {
+	   asio_reactor& reactor;
+	   struct passphrase_session* session;
+	   handler_type handler;
+	   
+	   static void ready(void* data)
+	   {
+	     operation* self = static_cast<operation*>(data);
+	     struct pollfd fds[PASSPHRASE_SESSION_FDS];
+	     if (passphrase_session_step(self->session) == 0)
+	       self->reactor.watch(fds, passphrase_session_fds(self->session, fds),
+				   &operation::ready, self);
+	     else
+	       self->complete();
+	   }
+	   
+	   void complete()
+	   {
+	     std::unique_ptr<operation> self(this);
+	     handler_type h(std::move(this->handler));
+	     char* str = passphrase_session_finish(this->session);
+	     std::exception_ptr error;
+	     if (str == nullptr)
+	       error = std::make_exception_ptr(std::system_error(errno, std::generic_category(),
+								 "passphrase_session_step"));
+	     self.reset();
+	     std::move(h)(error, secure_string(str));
+	   }
+	 };
+	 
+	 struct passphrase_session* session = passphrase_session_start(fdin, flags);
+	 if (session == nullptr)
+	   {
+	     std::exception_ptr error
+	       = std::make_exception_ptr(std::system_error(errno, std::generic_category(),
+							   "passphrase_session_start"));
+	     asio_::post(reactor.get_context(),
+			 [h = std::move(handler), error]() mutable
+			 {
+			   std::move(h)(error, secure_string());
+			 });
+	     return;
+	   }
+	 operation* op = new operation{reactor, session, std::move(handler)};
+	 /* Never complete inside the initiating function */
+	 asio_::post(reactor.get_context(), [op]() { operation::ready(op); });
+       }, token);
+  }
+#endif
+}
+
+
+
+#endif
+
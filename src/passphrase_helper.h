@@ -19,6 +19,8 @@
 #ifndef PASSPHRASE_HELPER_H
 #define PASSPHRASE_HELPER_H
 
+#include "probes.h"
+
 
 
 /* Fix conflicting configurations */
@@ -36,6 +38,30 @@
 #endif
 
 
+/* Passphrases wider than the terminal are displayed in a
+   scrolling viewport when the characters are displayed */
+#if (defined(PASSPHRASE_STAR) || (defined(PASSPHRASE_ECHO) && defined(PASSPHRASE_MOVE))) && \
+    !defined(PASSPHRASE_NO_VIEWPORT)
+# define PASSPHRASE_VIEWPORT
+#endif
+
+
+/* The terminal is asked what it supports when more than
+   the edits of the passphrase is drawn, so that it can
+   be drawn with fewer bytes and without flicker */
+#if (defined(PASSPHRASE_METER) || defined(PASSPHRASE_VIEWPORT)) && \
+    !defined(PASSPHRASE_NO_QUERY)
+# define PASSPHRASE_QUERY
+#endif
+
+
+/* Passphrases are read by the agent named by `LIBPASSPHRASE_AGENT`
+   rather than by the process itself, when it is set */
+#ifndef PASSPHRASE_NO_AGENT
+# define PASSPHRASE_AGENT
+#endif
+
+
 /* Default texts */
 #ifndef PASSPHRASE_STAR_CHAR
 # define PASSPHRASE_STAR_CHAR  "*"
@@ -49,6 +75,9 @@
 #ifndef PASSPHRASE_TEXT_STRENGTH
 # define PASSPHRASE_TEXT_STRENGTH  "Strength:"
 #endif
+#ifndef PASSPHRASE_TEXT_PROVISIONAL
+# define PASSPHRASE_TEXT_PROVISIONAL  "estimate"
+#endif
 
 
 /* Strength limits and descriptions */
@@ -122,33 +151,72 @@
 
 
 
+/* Whether the editing macros shall draw their changes, rather
+   than leave the display to the viewport renderer */
+#ifndef draw_directly
+# define draw_directly()  1
+#endif
+
+/* The stream the editing macros draw to */
+#ifndef output_stream
+# define output_stream()  stderr
+#endif
+
+/* Take back output that the editing macros drew but that has not
+   been written to the terminal, evaluates to whether it was */
+#ifndef retract_output
+# define retract_output(STR)  0
+#endif
+
+
+
 /* Custom fflush and fprintf */
 #if defined(PASSPHRASE_STAR) || defined(PASSPHRASE_TEXT)
-# define xprintf(...)  VOID(fprintf(stderr, __VA_ARGS__))
-# define xflush()      VOID(fflush(stderr))
+# ifdef PASSPHRASE_VIEWPORT
+#  define xprintf(...)  VOID(draw_directly() ? fprintf(output_stream(), __VA_ARGS__) : 0)
+# else
+#  define xprintf(...)  VOID(fprintf(output_stream(), __VA_ARGS__))
+# endif
+# define xflush()      VOID(PROBE(frame__flush); fflush(output_stream()))
 #elif defined(PASSPHRASE_MOVE) && !defined(PASSPHRASE_ECHO)
 # define xprintf(...)  VOID()
 # define xflush()      VOID()
 #elif defined(PASSPHRASE_MOVE)
-# define xprintf(...)  VOID(fprintf(stderr, __VA_ARGS__))
-# define xflush()      VOID(fflush(stderr))
+# ifdef PASSPHRASE_VIEWPORT
+#  define xprintf(...)  VOID(draw_directly() ? fprintf(output_stream(), __VA_ARGS__) : 0)
+# else
+#  define xprintf(...)  VOID(fprintf(output_stream(), __VA_ARGS__))
+# endif
+# define xflush()      VOID(PROBE(frame__flush); fflush(output_stream()))
 #else
-# define xflush()      VOID(fflush(stderr))
+# define xflush()      VOID(PROBE(frame__flush); fflush(output_stream()))
 #endif
 
 
 
 /* Custom putchar */
-#if defined(PASSPHRASE_STAR)
-# define xputchar(C)  VOID(((C & 0xC0) != 0x80) ? fprintf(stderr, "%s", PASSPHRASE_STAR_CHAR) : 0)
+#if defined(PASSPHRASE_STAR) && defined(PASSPHRASE_VIEWPORT)
+# define xputchar(C)  VOID((draw_directly() && ((C & 0xC0) != 0x80)) ? fprintf(output_stream(), "%s", PASSPHRASE_STAR_CHAR) : 0)
+#elif defined(PASSPHRASE_STAR)
+# define xputchar(C)  VOID(((C & 0xC0) != 0x80) ? fprintf(output_stream(), "%s", PASSPHRASE_STAR_CHAR) : 0)
+#elif defined(PASSPHRASE_ECHO) && defined(PASSPHRASE_MOVE) && defined(PASSPHRASE_VIEWPORT)
+# define xputchar(C)  VOID(draw_directly() ? fputc(C, output_stream()) : 0)
 #elif defined(PASSPHRASE_ECHO) && defined(PASSPHRASE_MOVE)
-# define xputchar(C)  VOID(fputc(C, stderr))
+# define xputchar(C)  VOID(fputc(C, output_stream()))
 #else
 # define xputchar(C)  VOID()
 #endif
 
 
 
+/* Get the next byte of a multibyte character, all of
+   its bytes are read into `key` before it is written */
+#ifndef next_byte
+# define next_byte()  ((int)*(key + i))
+#endif
+
+
+
 /* Is insert active by default? */
 #if defined(PASSPHRASE_OVERRIDE) && defined(PASSPHRASE_INSERT)
 # if defined(DEFAULT_INSERT)
@@ -358,7 +426,7 @@
     for (i = 0; i < n; i++)					\
       {								\
 	if (i)							\
-	  c = getchar();					\
+	  c = next_byte();					\
 	xputchar(c);						\
 	*(rc + point++) = (char)c;				\
       }								\
@@ -392,8 +460,11 @@
   } while (0)
 #elif defined(PASSPHRASE_MOVE)
 # define print_erase()  VOID(xprintf("\033[D\033[P"))
-#elif defined(PASSPHRASE_STAR)
+#elif defined(PASSPHRASE_STAR) && defined(PASSPHRASE_VIEWPORT)
 # define print_erase()  VOID(xprintf("\033[D \033[D"))
+#elif defined(PASSPHRASE_STAR)
+/* A star that has not been written yet is taken back rather than erased */
+# define print_erase()  VOID(if (!retract_output(PASSPHRASE_STAR_CHAR)) xprintf("\033[D \033[D"))
 #endif
 
 
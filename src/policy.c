@@ -0,0 +1,587 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pwd.h>
+#include <pthread.h>
+
+#define PASSPHRASE_USE_DEPRECATED
+#include "passphrase.h"
+#include "passphrase_helper.h"
+#include "policy.h"
+#include "wipe.h"
+
+
+
+#ifndef PASSPHRASE_TEXT_POLICY
+# define PASSPHRASE_TEXT_POLICY  "Required:"
+#endif
+
+
+/**
+ * Marks a missing transition while the automaton is built
+ */
+#define NO_STATE  UINT_MAX
+
+
+
+/**
+ * The policy compiled into a scanner
+ */
+struct compiled_policy
+{
+  /**
+   * See `struct passphrase_policy`
+   */
+  size_t min_length;
+  int required_classes;
+  size_t max_run;
+  int flags;
+  
+  /**
+   * The symbol for each byte, ASCII letters are
+   * folded to lower case, and bytes that do not
+   * appear in any forbidden substring map to 0
+   */
+  unsigned char symbol[256];
+  
+  /**
+   * The number of symbols
+   */
+  size_t symbols;
+  
+  /**
+   * The number of states in the automaton
+   */
+  size_t states;
+  
+  /**
+   * The transition for each state and symbol,
+   * `delta[state * symbols + symbol]`
+   */
+  unsigned int* delta;
+  
+  /**
+   * Whether a forbidden substring has been found
+   * when the automaton is in a state
+   */
+  unsigned char* accept;
+  
+  /**
+   * The number of references to the policy: one while it is the
+   * current policy, and one for each passphrase it is evaluated for
+   */
+  size_t refs;
+};
+
+
+
+/**
+ * The current policy, `NULL` if none
+ */
+static struct compiled_policy* current_policy = NULL;
+
+/**
+ * Protects `current_policy` and the reference counts of policies,
+ * as the policy can be replaced while passphrases are read
+ */
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Buffer for `passphrase_policy_describe__`
+ */
+static char description[256];
+
+
+
+/**
+ * Fold an ASCII letter to lower case
+ * 
+ * @param   c  The byte
+ * @return     The byte, in lower case if it is an ASCII letter
+ */
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+static unsigned char fold(unsigned char c)
+{
+  return (('A' <= c) && (c <= 'Z')) ? (unsigned char)(c | 0x20) : c;
+}
+
+
+/**
+ * Get the character class of a byte
+ * 
+ * @param   c  The first byte of a character
+ * @return     `PASSPHRASE_CLASS_*` for the character
+ */
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+static int classify(unsigned char c)
+{
+  if (('a' <= c) && (c <= 'z'))  return PASSPHRASE_CLASS_LOWER;
+  if (('A' <= c) && (c <= 'Z'))  return PASSPHRASE_CLASS_UPPER;
+  if (('0' <= c) && (c <= '9'))  return PASSPHRASE_CLASS_DIGIT;
+  if (c & 0x80)                  return PASSPHRASE_CLASS_NON_ASCII;
+  return PASSPHRASE_CLASS_SYMBOL;
+}
+
+
+/**
+ * Free a compiled policy
+ * 
+ * @param  p  The policy, may be `NULL`
+ */
+static void free_policy(struct compiled_policy* p)
+{
+  if (p == NULL)
+    return;
+  free(p->delta);
+  free(p->accept);
+  free(p);
+}
+
+
+/**
+ * Drop a reference to a compiled policy, and free
+ * it if it was the last reference
+ * 
+ * @param  p  The policy, may be `NULL`
+ */
+static void release_policy(struct compiled_policy* p)
+{
+  size_t refs;
+  if (p == NULL)
+    return;
+  pthread_mutex_lock(&policy_lock);
+  refs = --(p->refs);
+  pthread_mutex_unlock(&policy_lock);
+  if (refs == 0)
+    free_policy(p);
+}
+
+
+/**
+ * Compile the forbidden substrings into an Aho–Corasick automaton
+ * 
+ * @param   p         The compiled policy
+ * @param   patterns  The forbidden substrings
+ * @param   n         The number of elements in `patterns`
+ * @return            Zero on success, -1 on error
+ */
+static int compile_forbidden(struct compiled_policy* p, const char* const* patterns, size_t n)
+{
+  size_t max_states = 1, i, j, s, head = 0, tail = 0;
+  unsigned int* fail = NULL;
+  unsigned int* queue = NULL;
+  unsigned int r, u;
+  const unsigned char* pattern;
+  
+  memset(p->symbol, 0, sizeof(p->symbol));
+  p->symbols = 1;
+  for (i = 0; i < n; i++)
+    for (pattern = (const unsigned char*)(patterns[i]); *pattern; pattern++, max_states++)
+      if (p->symbol[fold(*pattern)] == 0)
+	p->symbol[fold(*pattern)] = (unsigned char)(p->symbols++);
+  for (i = 0; i < 256; i++)
+    p->symbol[i] = p->symbol[fold((unsigned char)i)];
+  
+  p->delta = malloc(max_states * p->symbols * sizeof(*(p->delta)));
+  p->accept = calloc(max_states, sizeof(*(p->accept)));
+  fail = malloc(max_states * sizeof(*fail));
+  queue = malloc(max_states * sizeof(*queue));
+  if (!(p->delta) || !(p->accept) || !fail || !queue)
+    goto fail;
+  for (i = 0; i < max_states * p->symbols; i++)
+    p->delta[i] = NO_STATE;
+  
+  /* Build the trie */
+  p->states = 1;
+  for (i = 0; i < n; i++)
+    {
+      pattern = (const unsigned char*)(patterns[i]);
+      if (*pattern == 0)
+	continue;
+      for (s = 0; *pattern; pattern++)
+	{
+	  j = s * p->symbols + p->symbol[*pattern];
+	  if (p->delta[j] == NO_STATE)
+	    p->delta[j] = (unsigned int)(p->states++);
+	  s = p->delta[j];
+	}
+      p->accept[s] = 1;
+    }
+  
+  /* Turn the trie into a complete automaton, breadth first */
+  for (j = 0; j < p->symbols; j++)
+    if (p->delta[j] == NO_STATE)
+      p->delta[j] = 0;
+    else
+      fail[p->delta[j]] = 0, queue[tail++] = p->delta[j];
+  while (head < tail)
+    {
+      r = queue[head++];
+      p->accept[r] |= p->accept[fail[r]];
+      for (j = 0; j < p->symbols; j++)
+	{
+	  u = p->delta[r * p->symbols + j];
+	  if (u == NO_STATE)
+	    p->delta[r * p->symbols + j] = p->delta[fail[r] * p->symbols + j];
+	  else
+	    fail[u] = p->delta[fail[r] * p->symbols + j], queue[tail++] = u;
+	}
+    }
+  
+  free(fail);
+  free(queue);
+  return 0;
+ fail:
+  free(fail);
+  free(queue);
+  return -1;
+}
+
+
+/**
+ * Set the policy new passphrases must satisfy. The policy
+ * is evaluated while the user is typing when `passphrase_read2`
+ * is used with `PASSPHRASE_READ_NEW`, and the rules that are not
+ * satisfied are displayed along with the strength meter.
+ * 
+ * @param   new_policy  The policy, `NULL` to remove the policy; it is
+ *                      copied, and need not be kept after the call
+ * @return              Zero on success, -1 on error
+ */
+int passphrase_set_policy(const struct passphrase_policy* new_policy)
+{
+  struct compiled_policy* p;
+  struct compiled_policy* old;
+  const char** patterns = NULL;
+  size_t n = 0, i;
+  char hostname[256];
+  struct passwd* pwd;
+  char* dot;
+  int saved_errno;
+  
+  /* Passphrases that are being read keep the policy they were started with */
+  if (new_policy == NULL)
+    {
+      pthread_mutex_lock(&policy_lock);
+      old = current_policy, current_policy = NULL;
+      pthread_mutex_unlock(&policy_lock);
+      release_policy(old);
+      return 0;
+    }
+  
+  p = calloc(1, sizeof(*p));
+  if (p == NULL)
+    return -1;
+  p->min_length = new_policy->min_length;
+  p->required_classes = new_policy->required_classes;
+  p->max_run = new_policy->max_run;
+  p->flags = new_policy->flags;
+  
+  if (new_policy->forbidden)
+    while (new_policy->forbidden[n])
+      n++;
+  patterns = malloc((n + 3) * sizeof(*patterns));
+  if (patterns == NULL)
+    goto fail;
+  for (i = 0; i < n; i++)
+    patterns[i] = new_policy->forbidden[i];
+  
+  if (p->flags & PASSPHRASE_POLICY_NOT_USER)
+    if ((pwd = getpwuid(getuid())) && pwd->pw_name)
+      patterns[n++] = pwd->pw_name;
+  if (p->flags & PASSPHRASE_POLICY_NOT_HOST)
+    if (!gethostname(hostname, sizeof(hostname)))
+      {
+	hostname[sizeof(hostname) - 1] = '\0';
+	patterns[n++] = hostname;
+	/* The full name contains the short name, so the short name is enough */
+	if ((dot = strchr(hostname, '.')))
+	  *dot = '\0';
+      }
+  
+  if (compile_forbidden(p, patterns, n))
+    goto fail;
+  
+  free(patterns);
+  p->refs = 1;
+  pthread_mutex_lock(&policy_lock);
+  old = current_policy, current_policy = p;
+  pthread_mutex_unlock(&policy_lock);
+  release_policy(old);
+  return 0;
+ fail:
+  saved_errno = errno;
+  free(patterns);
+  free_policy(p);
+  errno = saved_errno;
+  return -1;
+}
+
+
+/**
+ * Start evaluating the policy for a new passphrase
+ * 
+ * @param   state  The policy evaluation state
+ * @param   size   The allocation size of the passphrase,
+ *                 0 if the policy shall not be evaluated
+ * @return         Zero on success, -1 on error
+ */
+int passphrase_policy_start__(struct policy_state* state, size_t size)
+{
+  state->policy = NULL;
+  state->positions = NULL;
+  state->size = 0;
+  state->scanned = 0;
+  if (size)
+    {
+      pthread_mutex_lock(&policy_lock);
+      if ((state->policy = current_policy))
+	current_policy->refs++;
+      pthread_mutex_unlock(&policy_lock);
+    }
+  state->active = state->policy != NULL;
+  if (!(state->active))
+    return 0;
+  if (passphrase_policy_reserve__(state, size))
+    {
+      passphrase_policy_stop__(state);
+      return -1;
+    }
+  return 0;
+}
+
+
+/**
+ * Make room for a larger passphrase
+ * 
+ * @param   state  The policy evaluation state
+ * @param   size   The new allocation size of the passphrase
+ * @return         Zero on success, -1 on error
+ */
+int passphrase_policy_reserve__(struct policy_state* state, size_t size)
+{
+  struct policy_position* new;
+  
+  if (!(state->active) || (size <= state->size))
+    return 0;
+  
+  /* The scanner state reveals a lot about the passphrase,
+     so it is treated like the passphrase itself */
+  if (size > SIZE_MAX / sizeof(*new))
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+  new = passphrase_secret_alloc__(size * sizeof(*new));
+  if (new == NULL)
+    return -1;
+  memset(new, 0, size * sizeof(*new));
+  if (state->positions)
+    {
+      memcpy(new, state->positions, state->scanned * sizeof(*new));
+      passphrase_secret_free__(state->positions, state->size * sizeof(*new));
+    }
+  state->positions = new;
+  state->size = size;
+  return 0;
+}
+
+
+/**
+ * Reevaluate the policy after the passphrase has been edited
+ * 
+ * @param   state       The policy evaluation state
+ * @param   passphrase  The passphrase
+ * @param   len         The length of the passphrase
+ * @param   from        The index of the first byte that has been changed
+ */
+void passphrase_policy_update__(struct policy_state* state, const char* passphrase, size_t len, size_t from)
+{
+  static const struct policy_position initial = { 0, 0, 0, 0, 0 };
+  const struct compiled_policy* policy = state->policy;
+  const unsigned char* buf = (const unsigned char*)passphrase;
+  const struct policy_position* prev;
+  struct policy_position* pos;
+  size_t i, prev_start;
+  
+  if (!(state->active))
+    return;
+  
+  if (from < state->scanned)
+    state->scanned = from;
+  
+  /* Each position depends only on the previous positions, so
+     appending or erasing at the end only costs constant time */
+  for (i = state->scanned; i < len; i++)
+    {
+      prev = i ? state->positions + i - 1 : &initial;
+      pos = state->positions + i;
+      pos->state = policy->delta[prev->state * policy->symbols + policy->symbol[buf[i]]];
+      pos->flags = prev->flags;
+      if (policy->accept[pos->state])
+	pos->flags |= POLICY_FORBIDDEN;
+      
+      if ((buf[i] & 0xC0) != 0x80)
+	{
+	  pos->start = i;
+	  pos->chars = prev->chars + 1;
+	  pos->flags |= classify(buf[i]);
+	}
+      else
+	{
+	  pos->start = prev->start;
+	  pos->chars = prev->chars;
+	}
+      
+      /* Compare the character, as far as it has been read, with the previous character */
+      pos->run = 1;
+      if (pos->start)
+	{
+	  prev_start = state->positions[pos->start - 1].start;
+	  if ((pos->start - prev_start == i + 1 - pos->start) &&
+	      !memcmp(buf + prev_start, buf + pos->start, i + 1 - pos->start))
+	    pos->run = state->positions[pos->start - 1].run + 1;
+	}
+      if (policy->max_run && (pos->run > policy->max_run))
+	pos->flags |= POLICY_TOO_LONG_RUN;
+    }
+  state->scanned = len;
+}
+
+
+/**
+ * Check whether the passphrase satisfies the policy
+ * 
+ * @param   state  The policy evaluation state
+ * @return         1 if the policy is satisfied or there is no policy,
+ *                 0 if it is not satisfied
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+int passphrase_policy_passes__(const struct policy_state* state)
+{
+  const struct compiled_policy* policy = state->policy;
+  const struct policy_position* pos;
+  
+  if (!(state->active))
+    return 1;
+  if (state->scanned == 0)
+    return (policy->min_length == 0) && (policy->required_classes == 0);
+  
+  pos = state->positions + state->scanned - 1;
+  if (pos->chars < policy->min_length)
+    return 0;
+  if ((pos->flags & policy->required_classes) != policy->required_classes)
+    return 0;
+  return !(pos->flags & (POLICY_TOO_LONG_RUN | POLICY_FORBIDDEN));
+}
+
+
+/**
+ * Check whether Enter shall be refused because the policy is not satisfied
+ * 
+ * @param   state  The policy evaluation state
+ * @return         1 if the passphrase may not be accepted, 0 otherwise
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+int passphrase_policy_refuse__(const struct policy_state* state)
+{
+  if (!(state->active) || !(state->policy->flags & PASSPHRASE_POLICY_ENFORCE))
+    return 0;
+  return !passphrase_policy_passes__(state);
+}
+
+
+/**
+ * Describe the rules that the passphrase does not satisfy
+ * 
+ * @param   state  The policy evaluation state
+ * @return         Text to display after the strength meter, the empty
+ *                 string if the policy is satisfied or there is no policy
+ */
+const char* passphrase_policy_describe__(const struct policy_state* state)
+{
+  static const struct policy_position empty = { 0, 0, 0, 0, 0 };
+  const struct compiled_policy* policy = state->policy;
+  const struct policy_position* pos;
+  int missing;
+  size_t n = 0;
+  const char* sep = " " PASSPHRASE_TEXT_POLICY " ";
+  
+#define APPEND(...)							\
+  do {									\
+    n += (size_t)snprintf(description + n, sizeof(description) - n, __VA_ARGS__); \
+    if (n >= sizeof(description))					\
+      n = sizeof(description) - 1;					\
+    sep = ", ";								\
+  } while (0)
+  
+  *description = '\0';
+  if (passphrase_policy_passes__(state))
+    return description;
+  
+  pos = state->scanned ? state->positions + state->scanned - 1 : &empty;
+  missing = policy->required_classes & ~(pos->flags);
+  
+  if (pos->chars < policy->min_length)
+    APPEND("%s%zu characters", sep, policy->min_length);
+  if (missing & PASSPHRASE_CLASS_LOWER)      APPEND("%slower case letter", sep);
+  if (missing & PASSPHRASE_CLASS_UPPER)      APPEND("%supper case letter", sep);
+  if (missing & PASSPHRASE_CLASS_DIGIT)      APPEND("%sdigit", sep);
+  if (missing & PASSPHRASE_CLASS_SYMBOL)     APPEND("%ssymbol", sep);
+  if (missing & PASSPHRASE_CLASS_NON_ASCII)  APPEND("%snon-ASCII character", sep);
+  if (pos->flags & POLICY_TOO_LONG_RUN)
+    APPEND("%sat most %zu repeated characters", sep, policy->max_run);
+  if (pos->flags & POLICY_FORBIDDEN)
+    APPEND("%sno forbidden words", sep);
+  
+#undef APPEND
+  return description;
+}
+
+
+/**
+ * Stop evaluating the policy, and wipe the scanner state
+ * 
+ * @param  state  The policy evaluation state
+ */
+void passphrase_policy_stop__(struct policy_state* state)
+{
+  passphrase_secret_free__(state->positions, state->size * sizeof(*(state->positions)));
+  state->positions = NULL;
+  state->size = 0;
+  state->scanned = 0;
+  state->active = 0;
+  release_policy(state->policy);
+  state->policy = NULL;
+}
+
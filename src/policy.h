@@ -0,0 +1,192 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stddef.h>
+
+#include "meter.h"
+
+
+
+/* Incremental evaluation of the policy set with `passphrase_set_policy`.
+ * These functions are not part of the public API. */
+
+
+/**
+ * A compiled policy, see policy.c
+ */
+struct compiled_policy;
+
+
+/**
+ * Set in `struct policy_position.flags` if a too long run
+ * of identical characters has been found
+ */
+#define POLICY_TOO_LONG_RUN  0x100
+
+/**
+ * Set in `struct policy_position.flags` if a forbidden substring has been found
+ */
+#define POLICY_FORBIDDEN  0x200
+
+
+/**
+ * The state of the policy scanner after a byte in the passphrase
+ */
+struct policy_position
+{
+  /**
+   * The state of the forbidden substring automaton
+   */
+  unsigned int state;
+  
+  /**
+   * The number of identical characters, up to and
+   * including the character this byte belongs to
+   */
+  unsigned int run;
+  
+  /**
+   * The index of the first byte of the character this byte belongs to
+   */
+  size_t start;
+  
+  /**
+   * The number of characters up to and including this byte
+   */
+  size_t chars;
+  
+  /**
+   * `PASSPHRASE_CLASS_*` for all character classes up to and
+   * including this byte, and `POLICY_TOO_LONG_RUN` and
+   * `POLICY_FORBIDDEN` if those rules have been broken
+   */
+  int flags;
+};
+
+
+/**
+ * Policy evaluation for one passphrase
+ */
+struct policy_state
+{
+  /**
+   * Whether a policy is in effect
+   */
+  int active;
+  
+  /**
+   * The policy that was current when the evaluation started, it is
+   * referenced until `passphrase_policy_stop__`, so that it is used
+   * for the entire passphrase even if the policy is replaced
+   */
+  struct compiled_policy* policy;
+  
+  /**
+   * The state after each byte in the passphrase
+   */
+  struct policy_position* positions;
+  
+  /**
+   * The number of elements allocated for `positions`
+   */
+  size_t size;
+  
+  /**
+   * The number of bytes for which `positions` is up to date
+   */
+  size_t scanned;
+};
+
+
+
+/**
+ * Start evaluating the policy for a new passphrase
+ * 
+ * @param   state  The policy evaluation state
+ * @param   size   The allocation size of the passphrase,
+ *                 0 if the policy shall not be evaluated
+ * @return         Zero on success, -1 on error
+ */
+METER_INTERNAL
+int passphrase_policy_start__(struct policy_state* state, size_t size);
+
+/**
+ * Make room for a larger passphrase
+ * 
+ * @param   state  The policy evaluation state
+ * @param   size   The new allocation size of the passphrase
+ * @return         Zero on success, -1 on error
+ */
+METER_INTERNAL
+int passphrase_policy_reserve__(struct policy_state* state, size_t size);
+
+/**
+ * Reevaluate the policy after the passphrase has been edited
+ * 
+ * @param   state       The policy evaluation state
+ * @param   passphrase  The passphrase
+ * @param   len         The length of the passphrase
+ * @param   from        The index of the first byte that has been changed
+ */
+METER_INTERNAL
+void passphrase_policy_update__(struct policy_state* state, const char* passphrase, size_t len, size_t from);
+
+/**
+ * Check whether the passphrase satisfies the policy
+ * 
+ * @param   state  The policy evaluation state
+ * @return         1 if the policy is satisfied or there is no policy,
+ *                 0 if it is not satisfied
+ */
+METER_INTERNAL
+int passphrase_policy_passes__(const struct policy_state* state);
+
+/**
+ * Check whether Enter shall be refused because the policy is not satisfied
+ * 
+ * @param   state  The policy evaluation state
+ * @return         1 if the passphrase may not be accepted, 0 otherwise
+ */
+METER_INTERNAL
+int passphrase_policy_refuse__(const struct policy_state* state);
+
+/**
+ * Describe the rules that the passphrase does not satisfy
+ * 
+ * @param   state  The policy evaluation state
+ * @return         Text to display after the strength meter, the empty
+ *                 string if the policy is satisfied or there is no policy
+ */
+METER_INTERNAL
+const char* passphrase_policy_describe__(const struct policy_state* state);
+
+/**
+ * Stop evaluating the policy, and wipe the scanner state
+ * 
+ * @param  state  The policy evaluation state
+ */
+METER_INTERNAL
+void passphrase_policy_stop__(struct policy_state* state);
+
+
+
+#endif
+
@@ -0,0 +1,62 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+
+
+/* Static tracepoints, for use with bpftrace, perf and SystemTap
+ * under the provider name `libpassphrase`. A probe is a single
+ * `nop` instruction until a tracer attaches to it. Where
+ * <sys/sdt.h> is not available, or `PASSPHRASE_NO_PROBES` is
+ * defined, the probes expand to nothing.
+ * 
+ * Probe arguments are lengths, positions, counts, key classes
+ * and process IDs, never the content of the passphrase. Timings
+ * are taken by the tracer between pairs of probes, for example
+ * `meter__query` and `meter__response`, so that no clock is read
+ * when nothing is attached.
+ * 
+ *   input__read      (fd, bytes)            Input was read, bytes is -1 on error or end of file
+ *   key              (class, len, point)    A key was decoded, class is an `enum keyclass`
+ *   edit             (from, len, point)     The passphrase was changed from position `from`
+ *   buffer__grow     (old_size, new_size)   The passphrase buffer was reallocated
+ *   meter__spawn     (pid, is_socket)       A strength meter was started, pid is -1 for passcheckd
+ *   meter__query     (len)                  A passphrase was sent to the strength meter
+ *   meter__response  (score, tier)          The strength meter replied
+ *   meter__stop      (pid)                  The strength meter was stopped
+ *   frame__flush     ()                     Terminal output for a key was flushed
+ */
+
+
+#if !defined(PASSPHRASE_NO_PROBES) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define PROBE(...)  STAP_PROBEV(libpassphrase, __VA_ARGS__)
+# endif
+#endif
+
+#ifndef PROBE
+# define PROBE(...)  ((void) 0)
+#endif
+
+
+
+#endif
+
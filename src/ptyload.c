@@ -0,0 +1,645 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/ptrace.h>
+#include <sys/prctl.h>
+
+#include "passphrase.h"
+
+
+
+/*
+ * ptyload — fixed terminal workload for the performance matrix
+ * 
+ * Usage: ptyload [-r ROUNDS]
+ * 
+ * Reads a passphrase with `passphrase_read2` in a new pseudoterminal,
+ * as `syscount` does, but with a workload that also pastes text and
+ * edits in the middle of the passphrase, and prints one line:
+ * the median and the 95th percentile of the latency of the input,
+ * in microseconds; the number of system calls; the number of bytes
+ * written to the terminal; and the peak locked memory, in kilobytes.
+ * 
+ * The latency of an input is the time from it being written to the
+ * terminal until the process has read all of it and waits again. It
+ * is measured over ROUNDS runs, 5 by default, without the process
+ * being traced; input that is held by the terminal until Enter is
+ * pressed, in canonical mode, is not measured. The system calls are
+ * counted, with ptrace(2), in a separate run, from the start to the
+ * exit of the process. Child processes, such as the strength meter,
+ * are not counted.
+ */
+
+
+
+/**
+ * The time without output after which the process is
+ * considered to have drawn the prompt, in microseconds
+ */
+#ifndef IDLE_TIME
+# define IDLE_TIME  30000LL
+#endif
+
+/**
+ * The longest time the process may take to exit after Enter, in microseconds
+ */
+#ifndef EXIT_TIME
+# define EXIT_TIME  5000000LL
+#endif
+
+/**
+ * Signal delivered on system call stops, with `PTRACE_O_TRACESYSGOOD`
+ */
+#define SYSCALL_STOP  (SIGTRAP | 0x80)
+
+
+/**
+ * The input that is written, one element at a time, not including the final Enter
+ */
+static const char* workload[] =
+  {
+    /* Typing */
+    "c", "o", "r", "r", "e", "c", "t", " ", "h", "o", "r", "s", "e",
+    /* Pasting, in one write, as a terminal with bracketed paste does */
+    "\033[200~ battery staple 0123456789 abcdefghijklmnopqrstuvwxyz\033[201~",
+    /* Editing in the middle */
+    "\033[D", "\033[D", "\033[D", "\033[D", "\033[D", "\033[D", "\033[D", "\033[D",
+    "\033[D", "\033[D", "\033[D", "\033[D", "X", "Y", "\177", "\177", "Z",
+    "\033[C", "\033[C", "\033[C", "\033[C", "\033[C", "\033[C",
+    "!", "\177", "?"
+  };
+
+/**
+ * The queries the terminal answers, and the answers
+ */
+static const char* queries[][2] =
+  {
+    { "\033[?2026$p", "\033[?2026;2$y" },
+    { "\033[?2004$p", "\033[?2004;2$y" },
+    { "\033[c",       "\033[?62;22c" },
+    { "\033[6n",      "\033[1;1R" }
+  };
+
+
+
+/**
+ * `argv[0]` from `main`
+ */
+static const char* argv0;
+
+/**
+ * The reading process
+ */
+static pid_t pid;
+
+/**
+ * Whether the reading process has exited, and its wait status
+ */
+static int exited;
+static int exit_status;
+
+/**
+ * The number of bytes the process has written to the terminal
+ */
+static size_t bytes;
+
+/**
+ * When the process last wrote to the terminal
+ */
+static long long int last_output;
+
+/**
+ * The output of the process that has not been searched for queries
+ */
+static char pending[64];
+static size_t pending_len;
+
+
+
+/**
+ * Get the current time
+ * 
+ * @return  The current time, in microseconds
+ */
+static long long int now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long int)(ts.tv_sec) * 1000000LL + (long long int)(ts.tv_nsec / 1000L);
+}
+
+
+/**
+ * Write a complete string to the terminal
+ * 
+ * @param   master  The master side of the terminal
+ * @param   text    The string
+ * @return          Zero on success, -1 on error
+ */
+static int type(int master, const char* text)
+{
+  size_t n = strlen(text);
+  ssize_t r;
+  while (n)
+    {
+      r = write(master, text, n);
+      if (r < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      text += (size_t)r;
+      n -= (size_t)r;
+    }
+  return 0;
+}
+
+
+/**
+ * Read what the process has written to the terminal,
+ * count it, and answer the queries in it
+ * 
+ * @param   master   The master side of the terminal
+ * @param   timeout  The number of milliseconds to wait for output
+ */
+static void drain(int master, int timeout)
+{
+  char buf[4096 + sizeof(pending)];
+  struct pollfd pfd;
+  size_t i, n, len;
+  ssize_t r;
+  char* at;
+  
+  pfd.fd = master;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, timeout) > 0)
+    {
+      memcpy(buf, pending, pending_len);
+      r = read(master, buf + pending_len, sizeof(buf) - pending_len);
+      if (r <= 0)
+	return;
+      bytes += (size_t)r;
+      last_output = now();
+      n = pending_len + (size_t)r;
+      for (i = 0; i < sizeof(queries) / sizeof(*queries); i++)
+	{
+	  len = strlen(queries[i][0]);
+	  while ((at = memmem(buf, n, queries[i][0], len)))
+	    {
+	      *at = '\0';
+	      type(master, queries[i][1]);
+	    }
+	}
+      /* Keep the end, which may be the start of a query */
+      pending_len = n < sizeof(pending) ? n : sizeof(pending);
+      memcpy(pending, buf + n - pending_len, pending_len);
+      timeout = 0;
+    }
+}
+
+
+/**
+ * Read a file about the process from /proc
+ * 
+ * @param   file  The name of the file
+ * @param   buf   Output parameter for the content, NUL-terminated
+ * @param   size  The size of `buf`
+ * @return        Zero on success, -1 on error
+ */
+static int proc_read(const char* file, char* buf, size_t size)
+{
+  char path[64];
+  ssize_t r;
+  int fd;
+  
+  sprintf(path, "/proc/%li/%s", (long int)pid, file);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  r = read(fd, buf, size - 1);
+  close(fd);
+  if (r < 0)
+    return -1;
+  buf[r] = '\0';
+  return 0;
+}
+
+
+/**
+ * Get a field from a file about the process in /proc
+ * 
+ * @param   file   The name of the file, such as "status" or "io"
+ * @param   field  The name of the field, including the colon
+ * @return         The value of the field, -1 on error
+ */
+static long int proc_field(const char* file, const char* field)
+{
+  char buf[4096];
+  char* at;
+  
+  if (proc_read(file, buf, sizeof(buf)))
+    return -1;
+  for (at = buf; at; at = strchr(at, '\n'), at = at ? at + 1 : NULL)
+    if (!strncmp(at, field, strlen(field)))
+      return strtol(at + strlen(field), NULL, 10);
+  return -1;
+}
+
+
+/**
+ * Check whether the process is blocked, rather than running
+ * 
+ * @return  1 if it is sleeping, 0 otherwise
+ */
+static int sleeping(void)
+{
+  char buf[512];
+  char* state;
+  
+  if (proc_read("stat", buf, sizeof(buf)) || !(state = strrchr(buf, ')')))
+    return 0;
+  return state[1] == ' ' && state[2] == 'S';
+}
+
+
+/**
+ * Check whether the process has exited, which sets `exited`
+ * 
+ * @return  Whether the process has exited
+ */
+static int reap(void)
+{
+  pid_t r = waitpid(pid, &exit_status, __WALL | WNOHANG);
+  if ((r < 0) && (errno != EINTR))
+    exit_status = -1;
+  else if ((r != pid) || !(WIFEXITED(exit_status) || WIFSIGNALED(exit_status)))
+    return 0;
+  return exited = 1;
+}
+
+
+/**
+ * Wait until the process waits for input again, without tracing it
+ * 
+ * @param   master  The master side of the terminal
+ * @param   slave   The slave side of the terminal
+ * @param   reads   The number of read(2) calls the process had made before
+ *                  the input was written, -1 if it is not waited for
+ * @param   quiet   The time the process must not have written to
+ *                  the terminal for, in microseconds
+ * @param   start   When the input was written, in microseconds, the process
+ *                  may already have read it when the write returns
+ * @param   limit   The longest time to wait, in microseconds
+ * @return          The time it took, in microseconds, -1 if the
+ *                  process exited or did not settle in time
+ */
+static long long int settle(int master, int slave, long int reads, long long int quiet,
+			    long long int start, long long int limit)
+{
+  struct timespec nap = { .tv_sec = 0, .tv_nsec = 10000L };
+  long long int t;
+  int queued;
+  
+  for (;;)
+    {
+      drain(master, 0);
+      t = now();
+      if (reap() || (t - start >= limit))
+	return -1;
+      /* The process must have read all input, and be blocked */
+      if (!ioctl(slave, FIONREAD, &queued) && (queued == 0) &&
+	  ((reads < 0) || (proc_field("io", "syscr:") > reads)) &&
+	  (t - last_output >= quiet) && sleeping())
+	return t - start;
+      nanosleep(&nap, NULL);
+    }
+}
+
+
+/**
+ * Let the traced process run until it has exited, which sets `exited`,
+ * or until it has not made a system call for a while
+ * 
+ * @param   master  The master side of the terminal
+ * @param   idle    The time without system calls after which the process
+ *                  is considered to wait for input, in microseconds
+ * @param   limit   The longest time to let it run, in microseconds
+ * @return          The number of system calls it made
+ */
+static long int run_traced(int master, long long int idle, long long int limit)
+{
+  struct __ptrace_syscall_info info;
+  long long int start = now(), last = start;
+  long int count = 0;
+  int status, sig;
+  pid_t r;
+  
+  for (;;)
+    {
+      r = waitpid(pid, &status, __WALL | WNOHANG);
+      if (((r < 0) && (errno != EINTR)) || ((r == pid) && (WIFEXITED(status) || WIFSIGNALED(status))))
+	{
+	  exit_status = r < 0 ? -1 : status;
+	  exited = 1;
+	  return count;
+	}
+      if ((r == pid) && WIFSTOPPED(status))
+	{
+	  sig = WSTOPSIG(status);
+	  if (sig == SYSCALL_STOP)
+	    {
+	      /* Each system call stops on entry and on exit */
+	      if ((ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void*)sizeof(info), &info) > 0) &&
+		  (info.op == PTRACE_SYSCALL_INFO_ENTRY))
+		count++;
+	      sig = 0;
+	    }
+	  ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(long int)sig);
+	  last = now();
+	  continue;
+	}
+      if ((now() - last >= idle) || (now() - start >= limit))
+	return count;
+      drain(master, 1);
+    }
+}
+
+
+/**
+ * Start reading a passphrase in a new pseudoterminal
+ * 
+ * @param   traced  Whether the process shall be traced
+ * @param   slave   Output parameter for the slave side of the terminal
+ * @return          The master side of the terminal, -1 on error
+ */
+static int spawn(int traced, int* slave)
+{
+  struct winsize ws = { .ws_row = 24, .ws_col = 80, .ws_xpixel = 0, .ws_ypixel = 0 };
+  int master, status, fd;
+  const char* name;
+  char* passphrase;
+  
+  exited = 0;
+  bytes = 0;
+  pending_len = 0;
+  last_output = now();
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if ((master == -1) || grantpt(master) || unlockpt(master) || !(name = ptsname(master)))
+    return -1;
+  ioctl(master, TIOCSWINSZ, &ws);
+  
+  pid = fork();
+  if (pid == -1)
+    return -1;
+  if (pid)
+    {
+      while (waitpid(pid, &status, __WALL | WUNTRACED) == -1)
+	if (errno != EINTR)
+	  return -1;
+      if (!WIFSTOPPED(status))
+	return -1;
+      if (traced)
+	{
+	  if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL)) ||
+	      ptrace(PTRACE_SYSCALL, pid, NULL, NULL))
+	    return -1;
+	}
+      else if (kill(pid, SIGCONT))
+	return -1;
+      /* Only used to see whether the process has read its input */
+      *slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+      return *slave < 0 ? -1 : master;
+    }
+  
+  setsid();
+  fd = open(name, O_RDWR);
+  if (fd == -1)
+    _exit(127);
+  ioctl(fd, TIOCSCTTY, 0);
+  dup2(fd, STDIN_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+  if (fd > STDERR_FILENO)
+    close(fd);
+  if ((traced && ptrace(PTRACE_TRACEME, 0, NULL, NULL)) || raise(SIGSTOP))
+    _exit(127);
+  
+  passphrase_disable_echo1(STDIN_FILENO);
+  passphrase = passphrase_read2(STDIN_FILENO, PASSPHRASE_READ_NEW | PASSPHRASE_READ_SCREEN_FREE);
+  passphrase_reenable_echo1(STDIN_FILENO);
+  _exit(passphrase ? 0 : 3);
+}
+
+
+/**
+ * Check that the process has read the passphrase successfully
+ * 
+ * @return  Zero if it has, -1 otherwise
+ */
+static int succeeded(void)
+{
+  if (!exited)
+    {
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, __WALL);
+      return -1;
+    }
+  return ((exit_status == -1) || !WIFEXITED(exit_status) || WEXITSTATUS(exit_status)) ? -1 : 0;
+}
+
+
+/**
+ * Count the system calls of the workload
+ * 
+ * @return  The number of system calls, -1 on error
+ */
+static long int count_syscalls(void)
+{
+  long int count;
+  size_t i;
+  int master, slave;
+  
+  master = spawn(1, &slave);
+  if (master == -1)
+    return -1;
+  count = run_traced(master, IDLE_TIME, IDLE_TIME * 20);
+  for (i = 0; !exited && (i < sizeof(workload) / sizeof(*workload)); i++)
+    if (!type(master, workload[i]))
+      count += run_traced(master, IDLE_TIME, IDLE_TIME * 20);
+  if (!exited && !type(master, "\r"))
+    count += run_traced(master, EXIT_TIME, EXIT_TIME);
+  close(master);
+  close(slave);
+  return succeeded() ? -1 : count;
+}
+
+
+/**
+ * Run the workload without tracing the process, and measure it
+ * 
+ * @param   latencies  Output parameter for the latencies, in microseconds,
+ *                     must fit one for each element of `workload`
+ * @param   n          Output parameter for the number of latencies
+ * @param   locked     Output parameter for the peak locked memory, in kilobytes,
+ *                     it is only updated if it was lower
+ * @return             Zero on success, -1 on error
+ */
+static int measure(long long int* latencies, size_t* n, long int* locked)
+{
+  struct termios stty;
+  long long int latency, start;
+  long int reads, vmlck;
+  size_t i;
+  int master, slave;
+  
+  *n = 0;
+  master = spawn(0, &slave);
+  if (master == -1)
+    return -1;
+  if (settle(master, slave, -1, IDLE_TIME, now(), IDLE_TIME * 20) < 0)
+    goto done;
+  for (i = 0; i < sizeof(workload) / sizeof(*workload); i++)
+    {
+      if ((vmlck = proc_field("status", "VmLck:")) > *locked)
+	*locked = vmlck;
+      /* In canonical mode, nothing is read until Enter is pressed */
+      reads = tcgetattr(slave, &stty) ? -1 : (stty.c_lflag & ICANON) ? -1 : proc_field("io", "syscr:");
+      start = now();
+      if (type(master, workload[i]))
+	goto done;
+      latency = settle(master, slave, reads, 0, start, IDLE_TIME * 20);
+      if (latency < 0)
+	goto done;
+      if (reads >= 0)
+	latencies[(*n)++] = latency;
+    }
+  if (!type(master, "\r"))
+    settle(master, slave, -1, EXIT_TIME, now(), EXIT_TIME);
+ done:
+  close(master);
+  close(slave);
+  return succeeded();
+}
+
+
+/**
+ * Compare two latencies, for `qsort`
+ * 
+ * @param   a  One of the latencies
+ * @param   b  The other latency
+ * @return     Negative if `a` is lower, positive if it is higher, otherwise zero
+ */
+static int compare(const void* a, const void* b)
+{
+  long long int x = *(const long long int*)a;
+  long long int y = *(const long long int*)b;
+  return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Print usage information and exit
+ */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+static void usage(void)
+{
+  fprintf(stderr, "usage: %s [-r ROUNDS]\n", argv0);
+  exit(2);
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        Zero on success, 2 on error
+ */
+int main(int argc, char** argv)
+{
+  long long int* latencies;
+  long int syscalls, locked = 0, rounds = 5;
+  size_t i, n, total = 0, max_bytes = 0;
+  char* end;
+  int opt;
+  
+  argv0 = argc ? *argv : "ptyload";
+  while ((opt = getopt(argc, argv, "r:")) != -1)
+    if (opt == 'r')
+      {
+	rounds = strtol(optarg, &end, 10);
+	if (*end || (rounds < 1) || (rounds > 1000))
+	  usage();
+      }
+    else
+      usage();
+  if (optind != argc)
+    usage();
+  
+  /* Otherwise the naps in `settle` are rounded up to 50 µs */
+  prctl(PR_SET_TIMERSLACK, 1UL);
+  
+  latencies = malloc((size_t)rounds * (sizeof(workload) / sizeof(*workload)) * sizeof(*latencies));
+  if (latencies == NULL)
+    {
+      perror(argv0);
+      return 2;
+    }
+  
+  syscalls = count_syscalls();
+  if (syscalls < 0)
+    goto died;
+  for (i = 0; i < (size_t)rounds; i++)
+    {
+      if (measure(latencies + total, &n, &locked))
+	goto died;
+      total += n;
+      if (bytes > max_bytes)
+	max_bytes = bytes;
+    }
+  
+  qsort(latencies, total, sizeof(*latencies), compare);
+  printf("%lli %lli %li %zu %li\n",
+	 total ? latencies[total / 2] : 0,
+	 total ? latencies[total * 95 / 100] : 0,
+	 syscalls, max_bytes, locked < 0 ? 0 : locked);
+  free(latencies);
+  return 0;
+  
+ died:
+  fprintf(stderr, "%s: the passphrase could not be read\n", argv0);
+  free(latencies);
+  return 2;
+}
+
@@ -0,0 +1,519 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#define PASSPHRASE_USE_DEPRECATED
+#include "passphrase.h"
+#include "passphrase_helper.h"
+#include "meter.h"
+
+
+
+/**
+ * The number of passphrases that may be sent to a meter
+ * before its first outstanding score has been read
+ */
+#ifndef PASSPHRASE_BATCH_WINDOW
+# define PASSPHRASE_BATCH_WINDOW  16
+#endif
+
+
+
+/**
+ * A strength meter process, or a connection to a strength meter daemon
+ */
+struct worker
+{
+  /**
+   * The file descriptor to read from, and the file descriptor to write to,
+   * -1 if the worker has died
+   */
+  int fds[2];
+  
+  /**
+   * The process ID of the meter, -1 if connected to a daemon
+   */
+  pid_t pid;
+  
+  /**
+   * `METER_MODE_HELLO`, `METER_MODE_TEXT`, or `METER_MODE_BINARY`;
+   * binary framing is only negotiated with daemons, which only
+   * accept one text query at a time from each client
+   */
+  int mode;
+  
+  /**
+   * The indices of the passphrases that have been sent,
+   * or are being sent, but not scored, as a ring buffer
+   */
+  size_t window[PASSPHRASE_BATCH_WINDOW];
+  
+  /**
+   * The position of the oldest passphrase in `window`
+   */
+  size_t head;
+  
+  /**
+   * The number of passphrases in `window`
+   */
+  size_t count;
+  
+  /**
+   * The number of bytes of the newest passphrase in
+   * `window`, and its frame header or terminating line feed,
+   * that have been written, -1 if it has been written in full
+   */
+  ssize_t written;
+  
+  /**
+   * The reply parser
+   */
+  struct meter_reply reply;
+};
+
+
+
+/**
+ * Start a worker
+ * 
+ * @param   worker   The worker
+ * @param   command  The meter command
+ * @return           Zero on success, -1 on error
+ */
+static int worker_start(struct worker* worker, const char* command)
+{
+  size_t prefix = sizeof(PASSPHRASE_METER_SOCKET_PREFIX) - 1;
+  int i;
+  
+  worker->pid = -1;
+  worker->mode = METER_MODE_TEXT;
+  worker->head = worker->count = 0;
+  worker->written = -1;
+  worker->reply.state = 0;
+  worker->reply.have = 0;
+  
+  if (!strncmp(command, PASSPHRASE_METER_SOCKET_PREFIX, prefix))
+    {
+      worker->fds[0] = worker->fds[1] = passphrase_meter_connect__(command + prefix);
+      /* Queries are sent once the daemon has replied to the hello */
+      if ((worker->fds[0] >= 0) &&
+	  (send(worker->fds[0], METER_BINARY_HELLO, sizeof(METER_BINARY_HELLO) - 1, MSG_NOSIGNAL) ==
+	   (ssize_t)sizeof(METER_BINARY_HELLO) - 1))
+	{
+	  worker->mode = METER_MODE_HELLO;
+	  goto started;
+	}
+      if (worker->fds[0] >= 0)
+	close(worker->fds[0]);
+      command = DEFAULT_PASSPHRASE_METER;
+    }
+  
+  worker->pid = passphrase_meter_spawn__(command, worker->fds);
+  if (worker->pid == -1)
+    return -1;
+  
+ started:
+  for (i = 0; i < 2; i++)
+    fcntl(worker->fds[i], F_SETFL, fcntl(worker->fds[i], F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+
+/**
+ * Stop a worker, and put its unscored passphrases back in the queue
+ * 
+ * @param  worker  The worker
+ * @param  retry   The queue of passphrases to score again
+ * @param  nretry  The number of passphrases in `retry`, will be updated
+ */
+static void worker_stop(struct worker* worker, size_t* retry, size_t* nretry)
+{
+  int _status;
+  
+  if (worker->fds[0] < 0)
+    return;
+  
+  for (; worker->count; worker->count--)
+    {
+      retry[(*nretry)++] = worker->window[worker->head];
+      worker->head = (worker->head + 1) % PASSPHRASE_BATCH_WINDOW;
+    }
+  
+  close(worker->fds[0]);
+  if (worker->fds[1] != worker->fds[0])
+    close(worker->fds[1]);
+  worker->fds[0] = worker->fds[1] = -1;
+  
+  if (worker->pid != -1)
+    {
+    rereap:
+      if ((waitpid(worker->pid, &_status, 0) == -1) && (errno == EINTR))
+	goto rereap;
+    }
+}
+
+
+/**
+ * Restart a worker that has died, unless too many workers have died
+ * 
+ * @param   worker    The worker
+ * @param   command   The meter command
+ * @param   retry     The queue of passphrases to score again
+ * @param   nretry    The number of passphrases in `retry`, will be updated
+ * @param   restarts  The number of restarts left, will be updated
+ * @return            Zero if the worker was restarted, -1 otherwise
+ */
+static int worker_restart(struct worker* worker, const char* command, size_t* retry, size_t* nretry, size_t* restarts)
+{
+  int saved_errno = errno;
+  worker_stop(worker, retry, nretry);
+  if (*restarts == 0)
+    return errno = saved_errno, -1;
+  --*restarts;
+  return worker_start(worker, command);
+}
+
+
+/**
+ * Write as much as possible of the passphrase the worker is sending
+ * 
+ * @param   worker       The worker
+ * @param   passphrases  The passphrases
+ * @param   lengths      The length of each passphrase
+ * @return               Zero on success, -1 if the worker has died
+ */
+static int worker_write(struct worker* worker, const char* const* passphrases, const size_t* lengths)
+{
+  size_t index = worker->window[(worker->head + worker->count - 1) % PASSPHRASE_BATCH_WINDOW];
+  size_t len = lengths[index];
+  size_t written = (size_t)(worker->written);
+  size_t head = worker->mode == METER_MODE_BINARY ? METER_FRAME_HEADER : 0;
+  size_t tail = !head;
+  unsigned char header[METER_FRAME_HEADER];
+  struct iovec iov[3];
+  int iovcnt = 0;
+  ssize_t n;
+  
+  /* The request ID is only checked against the index */
+  if (head)
+    passphrase_meter_frame__(header, METER_FRAME_QUERY, 0, (uint32_t)index, len);
+  
+  for (;;)
+    {
+      iovcnt = 0;
+      if (written < head)
+	{
+	  iov[iovcnt].iov_base = header + written;
+	  iov[iovcnt].iov_len = head - written;
+	  iovcnt++;
+	}
+      if (written < head + len)
+	{
+	  iov[iovcnt].iov_base = (void*)(size_t)(passphrases[index] + (written > head ? written - head : 0));
+	  iov[iovcnt].iov_len = len - (written > head ? written - head : 0);
+	  iovcnt++;
+	}
+      if (tail)
+	{
+	  iov[iovcnt].iov_base = (void*)(size_t)"\n";
+	  iov[iovcnt].iov_len = 1;
+	  iovcnt++;
+	}
+      
+      n = writev(worker->fds[1], iov, iovcnt);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == EAGAIN)
+	    break;
+	  return -1;
+	}
+      written += (size_t)n;
+      if (written == head + len + tail)
+	{
+	  worker->written = -1;
+	  return 0;
+	}
+    }
+  
+  worker->written = (ssize_t)written;
+  return 0;
+}
+
+
+/**
+ * Read the scores a worker has sent
+ * 
+ * @param   worker  The worker
+ * @param   scores  The scores of the passphrases
+ * @param   done    The number of scored passphrases, will be updated
+ * @return          Zero on success, -1 if the worker has died
+ */
+static int worker_read(struct worker* worker, struct passphrase_score* scores, size_t* done)
+{
+  /* The meter may echo the passphrase, so the buffer is wiped */
+  char buf[512];
+  struct passphrase_score* score;
+  size_t off, k;
+  ssize_t n;
+  int r, rc = 0;
+  
+  for (;;)
+    {
+      n = read(worker->fds[0], buf, sizeof(buf));
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN)
+	    rc = -1;
+	  break;
+	}
+      if (n == 0)
+	{
+	  errno = EPIPE;
+	  rc = -1;
+	  break;
+	}
+      for (off = 0; off < (size_t)n; off += k)
+	{
+	  if (worker->mode == METER_MODE_HELLO)
+	    {
+	      r = passphrase_meter_parse_hello__(&(worker->reply), buf + off, (size_t)n - off, &k);
+	      if (r >= 0)
+		worker->mode = r ? METER_MODE_BINARY : METER_MODE_TEXT;
+	      continue;
+	    }
+	  if (worker->mode == METER_MODE_TEXT)
+	    k = passphrase_meter_parse__(&(worker->reply), buf + off, (size_t)n - off);
+	  else
+	    k = passphrase_meter_parse_frame__(&(worker->reply), buf + off, (size_t)n - off,
+					       METER_FRAME_REPLY, METER_MAX_PAYLOAD);
+	  if ((worker->mode == METER_MODE_BINARY) && (worker->reply.state == METER_PROTOCOL_ERROR))
+	    {
+	      rc = -1;
+	      goto out;
+	    }
+	  if (k == 0)
+	    break;
+	  if ((worker->count == 0) || ((worker->count == 1) && (worker->written >= 0)) ||
+	      ((worker->mode == METER_MODE_BINARY) && (worker->reply.id != (uint32_t)(worker->window[worker->head]))))
+	    {
+	      /* A score for a passphrase that has not been sent */
+	      rc = -1;
+	      goto out;
+	    }
+	  score = scores + worker->window[worker->head];
+	  score->score = worker->reply.value;
+	  score->tier = passphrase_meter_tier__(worker->reply.value, NULL, &(score->description));
+	  worker->head = (worker->head + 1) % PASSPHRASE_BATCH_WINDOW;
+	  worker->count--;
+	  (*done)++;
+	}
+    }
+  
+ out:
+  passphrase_wipe(buf, sizeof(buf));
+  return rc;
+}
+
+
+/**
+ * Rate the strength of many passphrases, without any user interaction.
+ * The passphrases are distributed over a number of strength meter
+ * processes, whenever a meter has room for more work, it takes the
+ * next passphrase that has not been scored.
+ * 
+ * @param   passphrases  The passphrases, may not contain line feeds
+ * @param   lengths      The length of each passphrase, `NULL` if they are NUL-terminated
+ * @param   n            The number of passphrases
+ * @param   scores       Output parameter for the score of each passphrase
+ * @param   workers      The number of meter processes to use, 0 for one per processor
+ * @return               Zero on success, -1 on error
+ */
+int passphrase_score_batch(const char* const* passphrases, const size_t* lengths, size_t n,
+			   struct passphrase_score* scores, size_t workers)
+{
+  struct worker* pool = NULL;
+  struct pollfd* pfds = NULL;
+  size_t* lens = NULL;
+  size_t* retry = NULL;
+  size_t nretry = 0, next = 0, done = 0, live = 0, restarts;
+  size_t i, index, window;
+  const char* command;
+  sigset_t sigpipe, oldmask, pending;
+  int had_sigpipe, saved_errno = 0;
+  long int cpus;
+  struct timespec nowait = { .tv_sec = 0, .tv_nsec = 0 };
+  
+  if (n == 0)
+    return 0;
+  
+  if (workers == 0)
+    {
+      cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      workers = cpus > 0 ? (size_t)cpus : 1;
+    }
+  if (workers > n)
+    workers = n;
+  
+  lens = malloc(n * sizeof(size_t));
+  pool = malloc(workers * sizeof(struct worker));
+  pfds = malloc(2 * workers * sizeof(struct pollfd));
+  retry = malloc(workers * PASSPHRASE_BATCH_WINDOW * sizeof(size_t));
+  if (!lens || !pool || !pfds || !retry)
+    goto fail;
+  
+  for (i = 0; i < n; i++)
+    {
+      lens[i] = lengths ? lengths[i] : strlen(passphrases[i]);
+      if (memchr(passphrases[i], '\n', lens[i]))
+	{
+	  errno = EINVAL;
+	  goto fail;
+	}
+    }
+  
+  /* A meter that dies while we are writing to it shall not kill us;
+     only this thread's mask is changed, the signal is thread-directed */
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  sigpending(&pending);
+  had_sigpipe = sigismember(&pending, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &oldmask);
+  
+  /* Replace meters that die, but give up if they keep dying */
+  restarts = workers;
+  command = passphrase_meter_command__();
+  for (i = 0; i < workers; i++)
+    if (worker_start(pool + i, command))
+      saved_errno = errno;
+    else
+      live++;
+  
+  while (done < n)
+    {
+      if (live == 0)
+	{
+	  errno = saved_errno ? saved_errno : EPIPE;
+	  goto stop;
+	}
+      
+      for (i = 0; i < workers; i++)
+	{
+	  struct worker* worker = pool + i;
+	  struct pollfd* in = pfds + 2 * i;
+	  struct pollfd* out = in + 1;
+	  in->fd = out->fd = -1;
+	  in->events = POLLIN;
+	  out->events = POLLOUT;
+	  if (worker->fds[0] < 0)
+	    continue;
+	  
+	  /* Give idle meters more work; a daemon only accepts one
+	     text query at a time from each client, and nothing is
+	     sent before it has replied to the hello */
+	  if (worker->mode == METER_MODE_HELLO)
+	    window = 0;
+	  else if ((worker->mode == METER_MODE_TEXT) && (worker->pid == -1))
+	    window = 1;
+	  else
+	    window = PASSPHRASE_BATCH_WINDOW;
+	  while ((worker->written < 0) && (worker->count < window) && (nretry || (next < n)))
+	    {
+	      index = nretry ? retry[--nretry] : next++;
+	      worker->window[(worker->head + worker->count++) % PASSPHRASE_BATCH_WINDOW] = index;
+	      worker->written = 0;
+	      if (worker_write(worker, passphrases, lens) &&
+		  worker_restart(worker, command, retry, &nretry, &restarts))
+		{
+		  saved_errno = errno;
+		  live--;
+		  break;
+		}
+	    }
+	  if (worker->fds[0] < 0)
+	    continue;
+	  
+	  if (worker->fds[0] == worker->fds[1])
+	    in->events |= (short)(worker->written >= 0 ? POLLOUT : 0);
+	  else if (worker->written >= 0)
+	    out->fd = worker->fds[1];
+	  in->fd = worker->fds[0];
+	}
+      
+      if (poll(pfds, (nfds_t)(2 * workers), -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  goto stop;
+	}
+      
+      for (i = 0; i < workers; i++)
+	{
+	  struct worker* worker = pool + i;
+	  short revents = (short)(pfds[2 * i].revents | pfds[2 * i + 1].revents);
+	  if ((worker->fds[0] < 0) || !revents)
+	    continue;
+	  if (((worker->written >= 0) && worker_write(worker, passphrases, lens)) ||
+	      worker_read(worker, scores, &done))
+	    if (worker_restart(worker, command, retry, &nretry, &restarts))
+	      {
+		saved_errno = errno;
+		live--;
+	      }
+	}
+    }
+  
+ stop:
+  saved_errno = done < n ? errno : 0;
+  for (i = 0; i < workers; i++)
+    worker_stop(pool + i, retry, &nretry);
+  if (!had_sigpipe)
+    while ((sigtimedwait(&sigpipe, NULL, &nowait) == -1) && (errno == EINTR));
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+  free(lens);
+  free(pool);
+  free(pfds);
+  free(retry);
+  errno = saved_errno;
+  return done < n ? -1 : 0;
+  
+ fail:
+  saved_errno = errno;
+  free(lens);
+  free(pool);
+  free(pfds);
+  free(retry);
+  errno = saved_errno;
+  return -1;
+}
+
@@ -0,0 +1,271 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <coroutine>
+#include <exception>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "passphrase_async.hpp"
+
+
+
+/*
+ * sessionbench — measure many concurrent passphrase prompts in one thread
+ * 
+ * Usage: sessionbench [PROMPTS]
+ * 
+ * Starts PROMPTS coroutines, 10000 by default, each reading a passphrase
+ * from its own socket with `passphrase::async_read` on one `epoll_reactor`,
+ * so that all of them are pending at the same time. Then each passphrase
+ * is sent in two parts, so that every coroutine is resumed once without
+ * completing and once with a complete passphrase. Datagram sockets, all
+ * sent to from one socket, are used rather than pseudoterminals, because
+ * the number of pseudoterminals is limited by the system and this only
+ * needs one file descriptor per prompt; so the prompts are read as
+ * non-terminal input.
+ */
+
+
+
+/**
+ * Coroutine that is started immediately and destroys itself when it returns
+ */
+struct detached
+{
+  struct promise_type
+  {
+    detached get_return_object() noexcept { return detached(); }
+    std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+    std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+
+/**
+ * The number of complete passphrases
+ */
+static std::size_t completed = 0;
+
+/**
+ * The number of failed prompts
+ */
+static std::size_t failed = 0;
+
+/**
+ * The total length of the passphrases
+ */
+static std::size_t total_length = 0;
+
+
+
+/**
+ * Get the current time
+ * 
+ * @return  The current time, in nanoseconds
+ */
+static long long int now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<long long int>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+
+/**
+ * Get the resident set size of the process
+ * 
+ * @return  The resident set size, in kilobytes
+ */
+static long int rss()
+{
+  long int pages = 0, resident = 0;
+  FILE* f = std::fopen("/proc/self/statm", "r");
+  if (f == nullptr)
+    return 0;
+  if (std::fscanf(f, "%li %li", &pages, &resident) != 2)
+    resident = 0;
+  std::fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/**
+ * Send a datagram to a prompt
+ * 
+ * Datagrams are charged to the sender until they are read, so
+ * when the sender is full, the prompts are run to make room
+ * 
+ * @param   reactor  The reactor the prompts are waiting in
+ * @param   sender   The socket to send from, it is non-blocking
+ * @param   address  The address of the prompt
+ * @param   data     The data to send
+ * @param   len      The length of `data`
+ * @throws           std::system_error  On error
+ */
+static void send(passphrase::epoll_reactor& reactor, int sender, const struct sockaddr_un* address,
+		 const char* data, std::size_t len)
+{
+  socklen_t addrlen = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + 1 +
+					     std::strlen(address->sun_path + 1));
+  while (sendto(sender, data, len, 0, reinterpret_cast<const struct sockaddr*>(address), addrlen) < 0)
+    {
+      if (errno != EAGAIN)
+	throw std::system_error(errno, std::generic_category(), "sendto");
+      reactor.run_once(0);
+    }
+}
+
+
+/**
+ * Read one passphrase
+ * 
+ * @param  reactor  The reactor
+ * @param  fd       The socket to read from
+ */
+static detached prompt(passphrase::reactor& reactor, int fd)
+{
+  try
+    {
+      passphrase::secure_string passphrase = co_await passphrase::async_read(reactor, fd);
+      total_length += passphrase.size();
+      completed++;
+    }
+  catch (const std::system_error&)
+    {
+      failed++;
+    }
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        0 on success, 1 on error
+ */
+int main(int argc, char** argv)
+{
+  std::size_t i, n = argc > 1 ? static_cast<std::size_t>(std::atol(argv[1])) : 10000;
+  std::vector<struct sockaddr_un> addresses(n);
+  struct rlimit limit;
+  long long int t0, t1, t2;
+  long int rss0, rss1;
+  char line[64];
+  socklen_t addrlen;
+  int fd, sender, saved_stderr;
+  
+  /* One socket per prompt */
+  if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur < n + 64))
+    {
+      limit.rlim_cur = n + 64;
+      if (limit.rlim_max < limit.rlim_cur)
+	limit.rlim_max = limit.rlim_cur;
+      if (setrlimit(RLIMIT_NOFILE, &limit))
+	{
+	  std::perror("setrlimit RLIMIT_NOFILE");
+	  return 1;
+	}
+    }
+  
+  /* A newline is printed to stderr for each passphrase
+     read from something other than a terminal */
+  saved_stderr = dup(STDERR_FILENO);
+  dup2(open("/dev/null", O_WRONLY | O_CLOEXEC), STDERR_FILENO);
+  
+  try
+    {
+      passphrase::epoll_reactor reactor;
+      
+      sender = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (sender < 0)
+	throw std::system_error(errno, std::generic_category(), "socket");
+      
+      rss0 = rss();
+      t0 = now();
+      for (i = 0; i < n; i++)
+	{
+	  /* Abstract address, unique to this process and prompt */
+	  std::memset(&addresses[i], 0, sizeof(addresses[i]));
+	  addresses[i].sun_family = AF_UNIX;
+	  addrlen = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + 1 +
+	    static_cast<std::size_t>(std::snprintf(addresses[i].sun_path + 1, sizeof(addresses[i].sun_path) - 1,
+						   "sessionbench-%li-%zu", static_cast<long int>(getpid()), i)));
+	  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	  if ((fd < 0) || bind(fd, reinterpret_cast<struct sockaddr*>(&addresses[i]), addrlen))
+	    throw std::system_error(errno, std::generic_category(), "socket");
+	  prompt(reactor, fd);
+	}
+      t1 = now();
+      rss1 = rss();
+      
+      std::fprintf(stdout, "pending prompts:  %zu\n", reactor.pending());
+      std::fprintf(stdout, "start:            %.2f us per prompt\n",
+		   static_cast<double>(t1 - t0) / 1000. / static_cast<double>(n));
+      std::fprintf(stdout, "memory:           %li kB, %.0f bytes per prompt\n", rss1 - rss0,
+		   static_cast<double>(rss1 - rss0) * 1024. / static_cast<double>(n));
+      std::fflush(stdout);
+      
+      /* First half of each passphrase */
+      t1 = now();
+      for (i = 0; i < n; i++)
+	send(reactor, sender, &addresses[i], "pass", 4);
+      while (reactor.run_once(0));
+      t2 = now();
+      std::fprintf(stdout, "partial input:    %.2f us per prompt, %zu still pending\n",
+		   static_cast<double>(t2 - t1) / 1000. / static_cast<double>(n), reactor.pending());
+      
+      /* The rest of each passphrase */
+      t1 = now();
+      for (i = 0; i < n; i++)
+	{
+	  int len = std::snprintf(line, sizeof(line), "word%zu\n", i);
+	  send(reactor, sender, &addresses[i], line, static_cast<std::size_t>(len));
+	}
+      reactor.run();
+      t2 = now();
+      std::fprintf(stdout, "completion:       %.2f us per prompt\n",
+		   static_cast<double>(t2 - t1) / 1000. / static_cast<double>(n));
+      std::fprintf(stdout, "completed:        %zu, %zu failed, %zu bytes\n", completed, failed, total_length);
+    }
+  catch (const std::system_error& e)
+    {
+      dup2(saved_stderr, STDERR_FILENO);
+      std::fprintf(stderr, "%s: %s\n", *argv, e.what());
+      return 1;
+    }
+  
+  dup2(saved_stderr, STDERR_FILENO);
+  return (completed == n) ? 0 : 1;
+}
+
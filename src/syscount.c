@@ -0,0 +1,520 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+
+#include "passphrase.h"
+
+
+
+/*
+ * syscount — system call budget for reading a passphrase
+ * 
+ * Usage: syscount [-v] BUDGET [OPTION]...
+ * 
+ * Reads a passphrase with `passphrase_read2` in a new pseudoterminal,
+ * typing a fixed sequence of keys, and counts the system calls the
+ * reading process makes, with ptrace(2), before the first key, for
+ * each key, and after Enter. Child processes, such as the strength
+ * meter, are not counted. The terminal answers the queries that
+ * libpassphrase sends, like a modern terminal would.
+ * 
+ * The counts are checked against the budget for the configuration
+ * the library was built with, whose options are given as OPTION, in
+ * the file BUDGET: each line is the largest number of system calls for
+ * the prompt, excluding the keys; the largest mean number of system
+ * calls per key; and the options the line applies to. The last line
+ * whose options are all used applies. The exit status is 1 if the
+ * budget is exceeded. With -v, the system calls are listed.
+ */
+
+
+
+/**
+ * The time without system calls after which the
+ * process is considered to wait for input, in microseconds
+ */
+#ifndef IDLE_TIME
+# define IDLE_TIME  30000LL
+#endif
+
+/**
+ * The longest time the process may take to exit after Enter, in microseconds
+ */
+#ifndef EXIT_TIME
+# define EXIT_TIME  5000000LL
+#endif
+
+/**
+ * The largest system call number that is tallied
+ */
+#define MAX_SYSCALL  512
+
+/**
+ * Signal delivered on system call stops, with `PTRACE_O_TRACESYSGOOD`
+ */
+#define SYSCALL_STOP  (SIGTRAP | 0x80)
+
+
+/**
+ * The keys that are typed, not including the final Enter
+ */
+static const char* keys[] =
+  {
+    "h", "u", "n", "t", "e", "r", "2", "\177", "x", "y", "z",
+    "c", "o", "r", "r", "e", "c", "t", " ", "h", "o", "r", "s", "e"
+  };
+
+/**
+ * The queries the terminal answers, and the answers
+ */
+static const char* queries[][2] =
+  {
+    { "\033[?2026$p", "\033[?2026;2$y" },
+    { "\033[?2004$p", "\033[?2004;2$y" },
+    { "\033[c",       "\033[?62;22c" },
+    { "\033[6n",      "\033[1;1R" }
+  };
+
+/**
+ * Names of system calls that are commonly made while reading a passphrase
+ */
+static const struct
+{
+  long nr;
+  const char* name;
+} syscall_names[] =
+  {
+#define X(NAME)  { SYS_##NAME, #NAME }
+    X(read), X(write), X(close), X(ioctl), X(poll), X(ppoll), X(fcntl),
+    X(mmap), X(munmap), X(mlock), X(munlock), X(brk), X(getpid), X(kill),
+    X(rt_sigaction), X(rt_sigprocmask), X(pipe2), X(clone), X(clone3),
+    X(wait4), X(timerfd_create), X(timerfd_settime), X(clock_gettime),
+    X(fstat), X(newfstatat), X(openat), X(readlink), X(getuid), X(getgid),
+    X(rt_sigpending), X(rt_sigtimedwait), X(pidfd_open), X(exit_group),
+#undef X
+  };
+
+
+
+/**
+ * `argv[0]` from `main`
+ */
+static const char* argv0;
+
+/**
+ * Whether to list the system calls
+ */
+static int verbose = 0;
+
+/**
+ * The reading process
+ */
+static pid_t pid;
+
+/**
+ * Whether the reading process has exited, and its wait status
+ */
+static int exited = 0;
+static int exit_status;
+
+/**
+ * The number of calls to each system call, in the current phase
+ */
+static unsigned long int tally[MAX_SYSCALL + 1];
+
+/**
+ * The output of the process that has not been searched for queries
+ */
+static char pending[64];
+static size_t pending_len = 0;
+
+
+
+/**
+ * Get the current time
+ * 
+ * @return  The current time, in microseconds
+ */
+static long long int now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long int)(ts.tv_sec) * 1000000LL + (long long int)(ts.tv_nsec / 1000L);
+}
+
+
+/**
+ * Write a complete string to the terminal
+ * 
+ * @param   master  The master side of the terminal
+ * @param   text    The string
+ * @return          Zero on success, -1 on error
+ */
+static int type(int master, const char* text)
+{
+  size_t n = strlen(text);
+  ssize_t r;
+  while (n)
+    {
+      r = write(master, text, n);
+      if (r < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      text += (size_t)r;
+      n -= (size_t)r;
+    }
+  return 0;
+}
+
+
+/**
+ * Read what the process has written to the terminal,
+ * and answer the queries in it
+ * 
+ * @param   master   The master side of the terminal
+ * @param   timeout  The number of milliseconds to wait for output
+ */
+static void drain(int master, int timeout)
+{
+  char buf[4096 + sizeof(pending)];
+  struct pollfd pfd;
+  size_t i, n, len;
+  ssize_t r;
+  char* at;
+  
+  pfd.fd = master;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, timeout) > 0)
+    {
+      memcpy(buf, pending, pending_len);
+      r = read(master, buf + pending_len, sizeof(buf) - pending_len);
+      if (r <= 0)
+	return;
+      n = pending_len + (size_t)r;
+      for (i = 0; i < sizeof(queries) / sizeof(*queries); i++)
+	{
+	  len = strlen(queries[i][0]);
+	  while ((at = memmem(buf, n, queries[i][0], len)))
+	    {
+	      *at = '\0';
+	      type(master, queries[i][1]);
+	    }
+	}
+      /* Keep the end, which may be the start of a query */
+      pending_len = n < sizeof(pending) ? n : sizeof(pending);
+      memcpy(pending, buf + n - pending_len, pending_len);
+      timeout = 0;
+    }
+}
+
+
+/**
+ * Let the process run until it has not made a system call
+ * for a while, or until it has exited, which sets `exited`
+ * 
+ * @param   master  The master side of the terminal
+ * @param   idle    The time without system calls after which the process
+ *                  is considered to wait for input, in microseconds
+ * @param   limit   The longest time to let it run, in microseconds
+ * @return          The number of system calls it made
+ */
+static long int run(int master, long long int idle, long long int limit)
+{
+  struct __ptrace_syscall_info info;
+  long long int start = now(), last = start;
+  long int count = 0;
+  int status, sig;
+  pid_t r;
+  
+  for (;;)
+    {
+      r = waitpid(pid, &status, __WALL | WNOHANG);
+      if (((r < 0) && (errno != EINTR)) || ((r == pid) && (WIFEXITED(status) || WIFSIGNALED(status))))
+	{
+	  exit_status = r < 0 ? -1 : status;
+	  exited = 1;
+	  return count;
+	}
+      if ((r == pid) && WIFSTOPPED(status))
+	{
+	  sig = WSTOPSIG(status);
+	  if (sig == SYSCALL_STOP)
+	    {
+	      /* Each system call stops on entry and on exit */
+	      if ((ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void*)sizeof(info), &info) > 0) &&
+		  (info.op == PTRACE_SYSCALL_INFO_ENTRY))
+		{
+		  count++;
+		  tally[info.entry.nr <= MAX_SYSCALL ? info.entry.nr : MAX_SYSCALL]++;
+		}
+	      sig = 0;
+	    }
+	  ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(long int)sig);
+	  last = now();
+	  continue;
+	}
+      if ((now() - last >= idle) || (now() - start >= limit))
+	return count;
+      drain(master, 1);
+    }
+}
+
+
+/**
+ * Print and reset the tally of system calls
+ * 
+ * @param  phase  The name of the phase the tally is for
+ */
+static void list(const char* phase)
+{
+  size_t i, j;
+  if (verbose)
+    {
+      fprintf(stderr, "%s:", phase);
+      for (i = 0; i <= MAX_SYSCALL; i++)
+	if (tally[i])
+	  {
+	    for (j = 0; j < sizeof(syscall_names) / sizeof(*syscall_names); j++)
+	      if ((size_t)(syscall_names[j].nr) == i)
+		break;
+	    if (j < sizeof(syscall_names) / sizeof(*syscall_names))
+	      fprintf(stderr, " %s=%lu", syscall_names[j].name, tally[i]);
+	    else
+	      fprintf(stderr, " #%zu=%lu", i, tally[i]);
+	  }
+      fprintf(stderr, "\n");
+    }
+  memset(tally, 0, sizeof(tally));
+}
+
+
+/**
+ * Start reading a passphrase in a new pseudoterminal, the
+ * process is stopped, and traced, before it starts reading
+ * 
+ * @return  The master side of the terminal, -1 on error
+ */
+static int spawn(void)
+{
+  struct winsize ws = { .ws_row = 24, .ws_col = 80, .ws_xpixel = 0, .ws_ypixel = 0 };
+  int master, slave, status;
+  const char* name;
+  char* passphrase;
+  
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if ((master == -1) || grantpt(master) || unlockpt(master) || !(name = ptsname(master)))
+    return -1;
+  ioctl(master, TIOCSWINSZ, &ws);
+  
+  pid = fork();
+  if (pid == -1)
+    return -1;
+  if (pid)
+    {
+      while (waitpid(pid, &status, __WALL) == -1)
+	if (errno != EINTR)
+	  return -1;
+      if (!WIFSTOPPED(status) ||
+	  ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL)) ||
+	  ptrace(PTRACE_SYSCALL, pid, NULL, NULL))
+	return -1;
+      return master;
+    }
+  
+  setsid();
+  slave = open(name, O_RDWR);
+  if (slave == -1)
+    _exit(127);
+  ioctl(slave, TIOCSCTTY, 0);
+  dup2(slave, STDIN_FILENO);
+  dup2(slave, STDOUT_FILENO);
+  dup2(slave, STDERR_FILENO);
+  if (slave > STDERR_FILENO)
+    close(slave);
+  if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) || raise(SIGSTOP))
+    _exit(127);
+  
+  passphrase_disable_echo1(STDIN_FILENO);
+  passphrase = passphrase_read2(STDIN_FILENO, PASSPHRASE_READ_NEW | PASSPHRASE_READ_SCREEN_FREE);
+  passphrase_reenable_echo1(STDIN_FILENO);
+  _exit(passphrase ? 0 : 3);
+}
+
+
+/**
+ * Look up the budget for the configuration
+ * 
+ * @param   path     The pathname of the budget file
+ * @param   options  The options the library was built with, `NULL`-terminated
+ * @param   prompt   Output parameter for the budget per prompt
+ * @param   key      Output parameter for the budget per key
+ * @return           Zero on success, -1 on error
+ */
+static int budget(const char* path, char** options, long int* prompt, long int* key)
+{
+  char line[1024];
+  char* word;
+  char* save;
+  long int p, k;
+  size_t i;
+  int found = 0, match;
+  FILE* f;
+  
+  f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f))
+    {
+      if ((*line == '#') || (sscanf(line, "%li %li", &p, &k) != 2))
+	continue;
+      strtok_r(line, " \t\n", &save);
+      strtok_r(NULL, " \t\n", &save);
+      match = 1;
+      while (match && (word = strtok_r(NULL, " \t\n", &save)))
+	{
+	  for (i = 0; options[i]; i++)
+	    if (!strcmp(options[i], word))
+	      break;
+	  match = options[i] != NULL;
+	}
+      if (match)
+	*prompt = p, *key = k, found = 1;
+    }
+  fclose(f);
+  if (!found)
+    return errno = ENOENT, -1;
+  return 0;
+}
+
+
+/**
+ * Print usage information and exit
+ */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+static void usage(void)
+{
+  fprintf(stderr, "usage: %s [-v] BUDGET [OPTION]...\n", argv0);
+  exit(2);
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        Zero if the budget is kept, 1 if it is exceeded, 2 on error
+ */
+int main(int argc, char** argv)
+{
+  long int prompt_budget, key_budget, startup, finish, count, keys_total = 0, key_max = 0;
+  char phase[32];
+  size_t i, n = sizeof(keys) / sizeof(*keys);
+  int master, opt, rc = 0;
+  
+  argv0 = argc ? *argv : "syscount";
+  while ((opt = getopt(argc, argv, "v")) != -1)
+    if (opt == 'v')
+      verbose = 1;
+    else
+      usage();
+  if (optind >= argc)
+    usage();
+  if (budget(argv[optind], argv + optind + 1, &prompt_budget, &key_budget))
+    {
+      fprintf(stderr, "%s: %s: %s\n", argv0, argv[optind], errno == ENOENT ? "no budget applies" : strerror(errno));
+      return 2;
+    }
+  
+  master = spawn();
+  if (master == -1)
+    {
+      perror(argv0);
+      return 2;
+    }
+  
+  startup = run(master, IDLE_TIME, IDLE_TIME * 20);
+  if (exited)
+    goto died;
+  list("prompt");
+  for (i = 0; i < n; i++)
+    {
+      if (type(master, keys[i]))
+	goto died;
+      count = run(master, IDLE_TIME, IDLE_TIME * 20);
+      if (exited)
+	goto died;
+      keys_total += count;
+      if (count > key_max)
+	key_max = count;
+      sprintf(phase, "key %zu", i + 1);
+      list(phase);
+    }
+  if (type(master, "\r"))
+    goto died;
+  finish = run(master, EXIT_TIME, EXIT_TIME);
+  list("enter");
+  close(master);
+  if (!exited)
+    {
+      kill(pid, SIGKILL);
+      goto died;
+    }
+  if ((exit_status == -1) || !WIFEXITED(exit_status) || WEXITSTATUS(exit_status))
+    goto died;
+  
+  printf("prompt: %li system calls (%li before the first key, %li after Enter), budget %li\n",
+	 startup + finish, startup, finish, prompt_budget);
+  printf("keys: %.1f system calls per key (at most %li), budget %li\n",
+	 (double)keys_total / (double)n, key_max, key_budget);
+  if (startup + finish > prompt_budget)
+    {
+      fprintf(stderr, "%s: the prompt exceeds its system call budget\n", argv0);
+      rc = 1;
+    }
+  if (keys_total > key_budget * (long int)n)
+    {
+      fprintf(stderr, "%s: the keys exceed their system call budget\n", argv0);
+      rc = 1;
+    }
+  return rc;
+  
+ died:
+  fprintf(stderr, "%s: the passphrase could not be read\n", argv0);
+  return 2;
+}
+
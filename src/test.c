@@ -16,16 +16,1694 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include "passphrase.h"
+#include "meter.h"
+#include "policy.h"
+#include "utf8.h"
+#include "agent.h"
+#include "output.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <signal.h>
 
 
 
 /**
- * Main test function
+ * The number of checks that have failed
+ */
+static int failures = 0;
+
+
+/**
+ * Report a check that failed
+ * 
+ * @param  expr  The expression that should have been true
+ * @param  line  The line of the check
+ */
+static void fail(const char* expr, int line)
+{
+  fprintf(stderr, "test.c:%i: check failed: %s\n", line, expr);
+  failures++;
+}
+
+#define CHECK(expr)  ((expr) ? (void)0 : fail(#expr, __LINE__))
+
+/**
+ * Check whether a string literal is valid UTF-8, without its NUL byte
+ */
+#define VALID(str)  passphrase_utf8_valid__(str, sizeof(str) - 1)
+
+
+/**
+ * Test `passphrase_utf8_valid__`
+ */
+static void test_utf8_valid(void)
+{
+  char buf[200];
+  
+  CHECK(VALID(""));
+  CHECK(VALID("passphrase"));
+  CHECK(VALID("\xC3\xA5\xE2\x82\xAC\xF0\x9F\x94\x91"));
+  
+  /* Overlong encodings, and the shortest encodings next to them */
+  CHECK(!VALID("\xC0\x80"));
+  CHECK(!VALID("\xC1\xBF"));
+  CHECK(VALID("\xC2\x80"));
+  CHECK(!VALID("\xE0\x80\x80"));
+  CHECK(!VALID("\xE0\x9F\xBF"));
+  CHECK(VALID("\xE0\xA0\x80"));
+  CHECK(!VALID("\xF0\x80\x80\x80"));
+  CHECK(!VALID("\xF0\x8F\xBF\xBF"));
+  CHECK(VALID("\xF0\x90\x80\x80"));
+  
+  /* Surrogates, and the code points around them */
+  CHECK(VALID("\xED\x9F\xBF"));
+  CHECK(!VALID("\xED\xA0\x80"));
+  CHECK(!VALID("\xED\xBF\xBF"));
+  CHECK(VALID("\xEE\x80\x80"));
+  
+  /* Code points above U+10FFFF */
+  CHECK(VALID("\xF4\x8F\xBF\xBF"));
+  CHECK(!VALID("\xF4\x90\x80\x80"));
+  CHECK(!VALID("\xF5\x80\x80\x80"));
+  CHECK(!VALID("\xF7\xBF\xBF\xBF"));
+  CHECK(!VALID("\xFF"));
+  
+  /* Stray and missing continuation bytes */
+  CHECK(!VALID("\x80"));
+  CHECK(!VALID("a\xBF" "b"));
+  CHECK(!VALID("\xE2\x28\xA1"));
+  CHECK(!VALID("\xF0\x9F\x94\x41"));
+  
+  /* Sequences truncated by the end of the buffer, even
+     if the bytes after the end would complete them */
+  CHECK(!VALID("\xC3"));
+  CHECK(!VALID("a\xE2\x82"));
+  CHECK(!VALID("\xF0\x9F\x94"));
+  CHECK(!passphrase_utf8_valid__("\xC3\xA5", 1));
+  CHECK(!passphrase_utf8_valid__("x\xF0\x9F\x94\x91", 4));
+  
+  /* Long ASCII runs are skipped a block at a time, so check
+     bytes that are not ASCII at and around block boundaries */
+  memset(buf, 'a', sizeof(buf));
+  CHECK(passphrase_utf8_valid__(buf, sizeof(buf)));
+  buf[64] = '\x80';
+  CHECK(!passphrase_utf8_valid__(buf, sizeof(buf)));
+  CHECK(passphrase_utf8_valid__(buf, 64));
+  buf[64] = 'a', buf[127] = '\xC3';
+  CHECK(!passphrase_utf8_valid__(buf, 128));
+  buf[128] = '\xA5';
+  CHECK(passphrase_utf8_valid__(buf, sizeof(buf)));
+  buf[199] = '\xE2';
+  CHECK(!passphrase_utf8_valid__(buf, sizeof(buf)));
+}
+
+
+
+/**
+ * Test `passphrase_meter_parse__`, the text protocol, where
+ * the score may be preceded by escape sequences that colour it
+ */
+static void test_meter_text(void)
+{
+  static const char coloured[] = "\033[1;32m42\033[m strong\n";
+  struct meter_reply r;
+  size_t i;
+  
+  memset(&r, 0, sizeof(r));
+  CHECK(passphrase_meter_parse__(&r, "123\n", 4) == 4 && r.value == 123);
+  CHECK(passphrase_meter_parse__(&r, "7 bits\n8\n", 9) == 7 && r.value == 7);
+  CHECK(passphrase_meter_parse__(&r, "8\n", 2) == 2 && r.value == 8);
+  CHECK(passphrase_meter_parse__(&r, "\n", 1) == 1 && r.value == 0);
+  CHECK(passphrase_meter_parse__(&r, "weak\n", 5) == 5 && r.value == 0);
+  CHECK(passphrase_meter_parse__(&r, "99999999999999999999999\n", 24) == 24 && r.value == ULLONG_MAX);
+  CHECK(passphrase_meter_parse__(&r, coloured, sizeof(coloured) - 1) == sizeof(coloured) - 1 && r.value == 42);
+  
+  /* The escape sequence and the score split over several reads */
+  for (i = 0; i + 1 < sizeof(coloured) - 1; i++)
+    CHECK(passphrase_meter_parse__(&r, coloured + i, 1) == 0);
+  CHECK(passphrase_meter_parse__(&r, coloured + i, 1) == 1 && r.value == 42);
+  CHECK(passphrase_meter_parse__(&r, "\0331", 2) == 0);
+  CHECK(passphrase_meter_parse__(&r, "m5", 2) == 0);
+  CHECK(passphrase_meter_parse__(&r, "1\n", 2) == 2 && r.value == 51);
+}
+
+
+/**
+ * Test `passphrase_meter_parse_hello__`
+ */
+static void test_meter_hello(void)
+{
+  static const char ack[] = METER_BINARY_ACK;
+  struct meter_reply r;
+  size_t used, i;
+  char buf[64];
+  
+  memset(&r, 0, sizeof(r));
+  CHECK(passphrase_meter_parse_hello__(&r, ack, sizeof(ack) - 1, &used) == 1 && used == sizeof(ack) - 1);
+  CHECK(passphrase_meter_parse_hello__(&r, "0\n", 2, &used) == 0 && used == 2);
+  
+  /* Only the line of the acknowledgement is consumed */
+  memcpy(buf, ack, sizeof(ack) - 1);
+  memcpy(buf + sizeof(ack) - 1, "\002\000", 2);
+  CHECK(passphrase_meter_parse_hello__(&r, buf, sizeof(ack) + 1, &used) == 1 && used == sizeof(ack) - 1);
+  
+  /* Split over several reads */
+  for (i = 0; i + 1 < sizeof(ack) - 1; i++)
+    CHECK(passphrase_meter_parse_hello__(&r, ack + i, 1, &used) == -1 && used == 1);
+  CHECK(passphrase_meter_parse_hello__(&r, ack + i, 1, &used) == 1 && used == 1);
+  
+  /* Lines that only start like the acknowledgement, or that
+     are longer than the parser keeps, are text replies */
+  CHECK(passphrase_meter_parse_hello__(&r, "binary 1 \n", 10, &used) == 0);
+  CHECK(passphrase_meter_parse_hello__(&r, "binary\n", 7, &used) == 0);
+  memset(buf, 'x', sizeof(buf));
+  for (i = 0; i < 4; i++)
+    CHECK(passphrase_meter_parse_hello__(&r, buf, sizeof(buf), &used) == -1 && used == sizeof(buf));
+  CHECK(passphrase_meter_parse_hello__(&r, ack, sizeof(ack) - 1, &used) == 0);
+  CHECK(passphrase_meter_parse_hello__(&r, ack, sizeof(ack) - 1, &used) == 1);
+}
+
+
+/**
+ * Redirect the standard error to a new temporary file
+ * 
+ * @return  The original standard error, -1 on error
+ */
+static int capture_stderr(void)
+{
+  char path[] = "/tmp/libpassphrase-test-XXXXXX";
+  int fd, saved;
+  
+  fflush(stderr);
+  if ((fd = mkstemp(path)) < 0)
+    return -1;
+  unlink(path);
+  saved = dup(STDERR_FILENO);
+  if ((saved < 0) || (dup2(fd, STDERR_FILENO) < 0))
+    {
+      if (saved >= 0)
+	close(saved);
+      saved = -1;
+    }
+  close(fd);
+  return saved;
+}
+
+
+/**
+ * Undo `capture_stderr`
+ * 
+ * @param   saved  The return value of `capture_stderr`
+ * @return         The number of bytes written to the standard
+ *                 error since `capture_stderr`, -1 on error
+ */
+static long int release_stderr(int saved)
+{
+  off_t n;
+  if (saved < 0)
+    return -1;
+  fflush(stderr);
+  n = lseek(STDERR_FILENO, 0, SEEK_END);
+  dup2(saved, STDERR_FILENO);
+  close(saved);
+  return (long int)n;
+}
+
+
+/**
+ * Check the passphrase read from a file descriptor that is not a terminal,
+ * and that nothing is written to the terminal while it is read
+ * 
+ * @param   fd        The file descriptor
+ * @param   expected  The expected passphrase
+ * @return            Whether the expected passphrase was read
+ */
+static int streamed(int fd, const char* expected)
+{
+  int saved = capture_stderr();
+  char* passphrase = passphrase_read2(fd, 0);
+  int ok = (release_stderr(saved) == 0) && passphrase && !strcmp(passphrase, expected);
+  if (passphrase)
+    {
+      passphrase_wipe1(passphrase);
+      free(passphrase);
+    }
+  return ok;
+}
+
+
+/**
+ * Test reading from pipes and files
+ */
+static void test_stream(void)
+{
+  char path[] = "/tmp/libpassphrase-test-XXXXXX";
+  char big[100000];
+  int fds[2], fd;
+  
+  /* The rest of a pipe cannot be put back, it is read and wiped */
+  if (pipe(fds) == 0)
+    {
+      CHECK(write(fds[1], "pipe\nrest\n", 10) == 10);
+      close(fds[1]);
+      CHECK(streamed(fds[0], "pipe"));
+      CHECK(read(fds[0], big, sizeof(big)) == 0);
+      close(fds[0]);
+    }
+  
+  /* The offset of a file is left just after the new line,
+     NUL bytes are removed, and the end of the file ends the
+     passphrase even without a new line */
+  fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0)
+    return;
+  unlink(path);
+  CHECK(write(fd, "first\nse\0cond\nthird", 19) == 19);
+  lseek(fd, 0, SEEK_SET);
+  CHECK(streamed(fd, "first"));
+  CHECK(lseek(fd, 0, SEEK_CUR) == 6);
+  CHECK(streamed(fd, "second"));
+  CHECK(lseek(fd, 0, SEEK_CUR) == 14);
+  CHECK(streamed(fd, "third"));
+  CHECK(streamed(fd, ""));
+  
+  /* A passphrase larger than the first allocation */
+  memset(big, 'b', sizeof(big));
+  big[sizeof(big) - 1] = '\0';
+  CHECK(ftruncate(fd, 0) == 0);
+  lseek(fd, 0, SEEK_SET);
+  CHECK(write(fd, big, sizeof(big) - 1) == (ssize_t)sizeof(big) - 1);
+  CHECK(write(fd, "\n", 1) == 1);
+  lseek(fd, 0, SEEK_SET);
+  CHECK(streamed(fd, big));
+  close(fd);
+}
+
+
+/**
+ * Encode a reply frame
+ * 
+ * @param   buf    Output buffer
+ * @param   flags  `METER_FLAG_*`
+ * @param   id     The request ID
+ * @param   score  The score
+ * @param   tier   The tier, only used with `METER_FLAG_TIER`
+ * @param   hint   The hint, only used with `METER_FLAG_HINT`
+ * @return         The length of the frame
+ */
+static size_t reply_frame(unsigned char* buf, int flags, uint32_t id,
+			  unsigned long long int score, int tier, const char* hint)
+{
+  size_t n = METER_FRAME_HEADER, i;
+  for (i = 0; i < 8; i++)
+    buf[n++] = (unsigned char)(score >> (56 - 8 * i));
+  if (flags & METER_FLAG_TIER)
+    buf[n++] = (unsigned char)tier;
+  if (flags & METER_FLAG_HINT)
+    for (i = 0; hint[i]; i++)
+      buf[n++] = (unsigned char)(hint[i]);
+  passphrase_meter_frame__(buf, METER_FRAME_REPLY, flags, id, n - METER_FRAME_HEADER);
+  return n;
+}
+
+
+/**
+ * Test `passphrase_meter_parse_frame__`
+ */
+static void test_meter_frame(void)
+{
+#define PARSE(buf, n)  passphrase_meter_parse_frame__(&r, (const char*)(buf), n, METER_FRAME_REPLY, 4096)
+  static unsigned char buf[8192];
+  char hint[300];
+  struct meter_reply r;
+  size_t n, m, i;
+  
+  /* A whole frame, control characters in the hint become spaces */
+  memset(&r, 0, sizeof(r));
+  n = reply_frame(buf, METER_FLAG_TIER | METER_FLAG_HINT, 7, 1234567890123ULL, 2, "ok\tgo");
+  CHECK(PARSE(buf, n) == n);
+  CHECK(r.id == 7 && r.value == 1234567890123ULL && r.tier == 2 && !strcmp(r.hint, "ok go"));
+  n = reply_frame(buf, 0, 8, 5, 0, NULL);
+  CHECK(PARSE(buf, n) == n && r.id == 8 && r.value == 5 && r.tier == -1 && !*(r.hint));
+  
+  /* A frame split at every byte */
+  n = reply_frame(buf, METER_FLAG_HINT, 9, 77, 0, "split");
+  for (i = 0; i + 1 < n; i++)
+    CHECK(PARSE(buf + i, 1) == 0);
+  CHECK(PARSE(buf + i, 1) == 1 && r.id == 9 && r.value == 77 && !strcmp(r.hint, "split"));
+  
+  /* Two frames in one read, and the second split */
+  n = reply_frame(buf, METER_FLAG_TIER, 10, 1, 0, NULL);
+  m = reply_frame(buf + n, METER_FLAG_TIER, 11, 2, 1, NULL);
+  CHECK(PARSE(buf, n + 5) == n && r.id == 10);
+  CHECK(PARSE(buf + n, 5) == 0);
+  CHECK(PARSE(buf + n + 5, m - 5) == m - 5 && r.id == 11 && r.tier == 1);
+  
+  /* A hint longer than is kept is truncated, and the rest
+     of it is skipped, even when it arrives in pieces */
+  memset(hint, 'h', sizeof(hint) - 1);
+  hint[sizeof(hint) - 1] = '\0';
+  n = reply_frame(buf, METER_FLAG_HINT, 12, 3, 0, hint);
+  m = reply_frame(buf + n, 0, 13, 4, 0, NULL);
+  CHECK(PARSE(buf, 100) == 0);
+  CHECK(PARSE(buf + 100, 100) == 0);
+  CHECK(PARSE(buf + 200, n + m - 200) == n - 200);
+  CHECK(r.id == 12 && strlen(r.hint) == METER_HINT_MAX);
+  CHECK(PARSE(buf + n, m) == m && r.id == 13 && r.value == 4);
+  
+  /* A payload longer than accepted */
+  memset(&r, 0, sizeof(r));
+  passphrase_meter_frame__(buf, METER_FRAME_REPLY, 0, 14, 4097);
+  CHECK(PARSE(buf, METER_FRAME_HEADER) == 0 && r.state == METER_PROTOCOL_ERROR);
+  n = reply_frame(buf, 0, 15, 1, 0, NULL);
+  CHECK(PARSE(buf, n) == 0);
+  
+  /* Malformed headers and payloads */
+  memset(&r, 0, sizeof(r));
+  n = reply_frame(buf, 0, 16, 1, 0, NULL);
+  buf[0] = METER_FRAME_QUERY;
+  CHECK(PARSE(buf, n) == 0 && r.state == METER_PROTOCOL_ERROR);
+  memset(&r, 0, sizeof(r));
+  n = reply_frame(buf, 0, 17, 1, 0, NULL);
+  buf[3] = 1;
+  CHECK(PARSE(buf, n) == 0 && r.state == METER_PROTOCOL_ERROR);
+  memset(&r, 0, sizeof(r));
+  passphrase_meter_frame__(buf, METER_FRAME_REPLY, 0, 18, 7);
+  CHECK(PARSE(buf, METER_FRAME_HEADER + 7) == 0 && r.state == METER_PROTOCOL_ERROR);
+  memset(&r, 0, sizeof(r));
+  passphrase_meter_frame__(buf, METER_FRAME_REPLY, METER_FLAG_TIER, 19, 8);
+  CHECK(PARSE(buf, METER_FRAME_HEADER + 8) == 0 && r.state == METER_PROTOCOL_ERROR);
+  
+  /* Frames of other types keep the ID, but not the payload */
+  memset(&r, 0, sizeof(r));
+  memset(buf, 'q', sizeof(buf));
+  passphrase_meter_frame__(buf, METER_FRAME_QUERY, 0, 20, 6000);
+  n = METER_FRAME_HEADER + 6000;
+  CHECK(passphrase_meter_parse_frame__(&r, (const char*)buf, n, METER_FRAME_QUERY, 8000) == n && r.id == 20);
+#undef PARSE
+}
+
+
+/**
+ * Append to a passphrase and update its policy evaluation
+ * 
+ * @param   state  The policy evaluation state
+ * @param   buf    The passphrase
+ * @param   len    The length of the passphrase, will be updated
+ * @param   keys   The bytes to append, each is evaluated separately,
+ *                 a 0x7F byte erases the last character instead
+ * @return         Whether the passphrase satisfies the policy afterwards
+ */
+static int policy_type(struct policy_state* state, char* buf, size_t* len, const char* keys)
+{
+  for (; *keys; keys++)
+    {
+      if (*keys == '\177')
+	{
+	  while (*len && ((buf[--*len] & 0xC0) == 0x80));
+	  passphrase_policy_update__(state, buf, *len, *len);
+	  continue;
+	}
+      buf[(*len)++] = *keys;
+      passphrase_policy_update__(state, buf, *len, *len - 1);
+    }
+  return passphrase_policy_passes__(state);
+}
+
+
+/**
+ * Test the incremental policy evaluation
+ */
+static void test_policy(void)
+{
+  static const char* const forbidden[] = { "abcd", "bce", NULL };
+  struct passphrase_policy policy = { 3, 0, 2, forbidden, PASSPHRASE_POLICY_ENFORCE };
+  struct policy_state state;
+  char buf[64];
+  size_t len = 0;
+  
+  CHECK(passphrase_set_policy(&policy) == 0);
+  CHECK(passphrase_policy_start__(&state, sizeof(buf)) == 0 && state.active);
+  CHECK(!passphrase_policy_passes__(&state) && passphrase_policy_refuse__(&state));
+  CHECK(!policy_type(&state, buf, &len, "xa"));
+  CHECK(strstr(passphrase_policy_describe__(&state), "3 characters") != NULL);
+  CHECK(policy_type(&state, buf, &len, "b"));
+  CHECK(!*passphrase_policy_describe__(&state) && !passphrase_policy_refuse__(&state));
+  
+  /* Substrings are found across keys, without case, and also
+     where a longer substring has been matched so far */
+  CHECK(policy_type(&state, buf, &len, "c"));
+  CHECK(!policy_type(&state, buf, &len, "d"));
+  CHECK(strstr(passphrase_policy_describe__(&state), "forbidden") != NULL);
+  CHECK(policy_type(&state, buf, &len, "\177"));
+  CHECK(!policy_type(&state, buf, &len, "E"));
+  CHECK(policy_type(&state, buf, &len, "\177"));
+  CHECK(policy_type(&state, buf, &len, "\177\177BC"));
+  CHECK(!policy_type(&state, buf, &len, "D"));
+  
+  /* The policy that was current when the evaluation
+     started is used even if it is removed */
+  CHECK(passphrase_set_policy(NULL) == 0);
+  CHECK(policy_type(&state, buf, &len, "\177\177zz"));
+  CHECK(!policy_type(&state, buf, &len, "z"));
+  CHECK(strstr(passphrase_policy_describe__(&state), "at most 2") != NULL);
+  CHECK(policy_type(&state, buf, &len, "\177y"));
+  
+  /* Runs of multibyte characters, which are
+     evaluated before all of their bytes are added */
+  CHECK(policy_type(&state, buf, &len, "\xC3\xA5\xC3\xA5"));
+  CHECK(!policy_type(&state, buf, &len, "\xC3\xA5"));
+  CHECK(policy_type(&state, buf, &len, "\177\xC3\xA4"));
+  
+  /* Edits in the middle of the passphrase */
+  memcpy(buf + 1, "bce", 3);
+  passphrase_policy_update__(&state, buf, len, 1);
+  CHECK(!passphrase_policy_passes__(&state));
+  memcpy(buf + 1, "zzz", 3);
+  passphrase_policy_update__(&state, buf, len, 1);
+  CHECK(!passphrase_policy_passes__(&state));
+  buf[2] = 'q';
+  passphrase_policy_update__(&state, buf, len, 2);
+  CHECK(passphrase_policy_passes__(&state));
+  passphrase_policy_stop__(&state);
+  
+  /* Without a policy */
+  CHECK(passphrase_policy_start__(&state, sizeof(buf)) == 0 && !state.active);
+  CHECK(passphrase_policy_passes__(&state) && !passphrase_policy_refuse__(&state));
+  passphrase_policy_stop__(&state);
+  
+  /* Character classes */
+  policy.min_length = 0;
+  policy.max_run = 0;
+  policy.forbidden = NULL;
+  policy.flags = 0;
+  policy.required_classes = PASSPHRASE_CLASS_UPPER | PASSPHRASE_CLASS_DIGIT | PASSPHRASE_CLASS_NON_ASCII;
+  CHECK(passphrase_set_policy(&policy) == 0);
+  CHECK(passphrase_policy_start__(&state, sizeof(buf)) == 0);
+  len = 0;
+  CHECK(!policy_type(&state, buf, &len, "aB"));
+  CHECK(strstr(passphrase_policy_describe__(&state), "digit") != NULL);
+  CHECK(!passphrase_policy_refuse__(&state));
+  CHECK(!policy_type(&state, buf, &len, "1"));
+  CHECK(policy_type(&state, buf, &len, "\xE2\x82\xAC"));
+  CHECK(!policy_type(&state, buf, &len, "\177"));
+  passphrase_policy_stop__(&state);
+  CHECK(passphrase_set_policy(NULL) == 0);
+}
+
+
+/**
+ * A pseudoterminal that keys are typed on
+ */
+struct pty
+{
+  /**
+   * What is written to it is typed
+   */
+  int master;
+  
+  /**
+   * The terminal the passphrase is read from
+   */
+  int slave;
+  
+  /**
+   * The standard error, which is sent to /dev/null while
+   * the pseudoterminal is open, as what is drawn is not checked
+   */
+  int saved;
+};
+
+
+/**
+ * Close a pseudoterminal, and restore the standard error
+ * 
+ * @param  pty  The pseudoterminal
+ */
+static void pty_close(struct pty* pty)
+{
+  if (pty->saved >= 0)
+    {
+      fflush(stderr);
+      dup2(pty->saved, STDERR_FILENO);
+      close(pty->saved);
+    }
+  if (pty->slave >= 0)
+    close(pty->slave);
+  if (pty->master >= 0)
+    close(pty->master);
+}
+
+
+/**
+ * Open a pseudoterminal, in the mode passphrases are read in
+ * 
+ * @param   pty  Output parameter for the pseudoterminal
+ * @return       Zero on success, -1 on error
+ */
+static int pty_open(struct pty* pty)
+{
+  struct termios attr;
+  int null;
+  
+  pty->slave = pty->saved = -1;
+  pty->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if ((pty->master < 0) || grantpt(pty->master) || unlockpt(pty->master))
+    goto fail;
+  pty->slave = open(ptsname(pty->master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if ((pty->slave < 0) || tcgetattr(pty->slave, &attr))
+    goto fail;
+  attr.c_iflag &= (tcflag_t)~(ICRNL | IXON);
+  attr.c_lflag &= (tcflag_t)~(ICANON | ECHO | ISIG | IEXTEN);
+  if (tcsetattr(pty->slave, TCSANOW, &attr))
+    goto fail;
+  
+  fflush(stderr);
+  if ((null = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0)
+    goto fail;
+  pty->saved = dup(STDERR_FILENO);
+  if ((pty->saved < 0) || (dup2(null, STDERR_FILENO) < 0))
+    {
+      close(null);
+      goto fail;
+    }
+  close(null);
+  return 0;
+  
+ fail:
+  pty_close(pty);
+  return -1;
+}
+
+
+/**
+ * Check a passphrase that has been read, and wipe and free it
+ * 
+ * @param   passphrase  The passphrase, `NULL` if it was not read
+ * @param   expected    The expected passphrase
+ * @return              Whether the expected passphrase was read
+ */
+static int is_passphrase(char* passphrase, const char* expected)
+{
+  int ok = passphrase && !strcmp(passphrase, expected);
+  if (passphrase)
+    {
+      passphrase_wipe1(passphrase);
+      free(passphrase);
+    }
+  return ok;
+}
+
+
+/**
+ * Type keys on a pseudoterminal, and read them with a session
+ * 
+ * @param   keys  The keys, `NULL`-terminated; each string is written at once,
+ *                and is read before the next is written, so keys can be split
+ * @return        The passphrase, `NULL` on error
+ */
+static char* type_keys(const char* const* keys)
+{
+  struct pollfd fds[PASSPHRASE_SESSION_FDS];
+  struct passphrase_session* s;
+  char* passphrase = NULL;
+  struct pty pty;
+  int r = 0;
+  
+  if (pty_open(&pty))
+    return NULL;
+  s = passphrase_session_start(pty.slave, 0);
+  for (; s && *keys && (r == 0); keys++)
+    {
+      if (write(pty.master, *keys, strlen(*keys)) < 0)
+	break;
+      /* Wait for Enter, otherwise until the keys have been read */
+      while ((r == 0) && (poll(fds, (nfds_t)passphrase_session_fds(s, fds), keys[1] ? 50 : 5000) > 0))
+	r = passphrase_session_step(s);
+    }
+  if (s)
+    passphrase = passphrase_session_finish(s);
+  pty_close(&pty);
+  return passphrase;
+}
+
+
+/**
+ * Check the passphrase read from a sequence of keys
+ * 
+ * @param   expected  The expected passphrase
+ * @param   ...       The keys, see `type_keys`
+ * @return            Whether the expected passphrase was read
+ */
+#define TYPED(expected, ...)  typed(expected, (const char* const[]){ __VA_ARGS__, NULL })
+
+static int typed(const char* expected, const char* const* keys)
+{
+  return is_passphrase(type_keys(keys), expected);
+}
+
+
+/* The keys that move the point, and what typing
+   a character in the middle of the passphrase does */
+#if defined(PASSPHRASE_DEDICATED)
+# define LEFT   "\033[D"
+# define RIGHT  "\033[C"
+# define HOME   "\033OH"
+# define END    "\033OF"
+# define DEL    "\033[3~"
+#elif defined(PASSPHRASE_CONTROL)
+# define LEFT   "\002"
+# define RIGHT  "\006"
+# define HOME   "\001"
+# define END    "\005"
+# define DEL    "\004"
+#endif
+#if defined(PASSPHRASE_INSERT) && (!defined(PASSPHRASE_OVERRIDE) || defined(DEFAULT_INSERT))
+# define EDITED(insert, override, neither)  insert
+#elif defined(PASSPHRASE_OVERRIDE)
+# define EDITED(insert, override, neither)  override
+#else
+# define EDITED(insert, override, neither)  neither
+#endif
+
+
+/**
+ * Test how keys are decoded and applied to the passphrase
+ */
+static void test_keys(void)
+{
+  CHECK(TYPED("abc", "abc\n"));
+  CHECK(TYPED("abc", "a", "b", "c", "\n"));
+  CHECK(TYPED("a\xC3\xA5" "b", "a\xC3", "\xA5" "b\n"));
+#if defined(PASSPHRASE_MOVE) || defined(PASSPHRASE_STAR) || defined(PASSPHRASE_TEXT)
+  CHECK(TYPED("abc", "abx\177c\n"));
+  CHECK(TYPED("", "a\b\177\n"));
+#else
+  CHECK(TYPED("abx\177c", "abx\177c\n"));
+#endif
+  
+#ifdef PASSPHRASE_MOVE
+  /* Erasing and moving over whole characters */
+  CHECK(TYPED("ab", "a\xC3\xA5\177" "b\n"));
+# ifdef LEFT
+  CHECK(TYPED(EDITED("abc", "ab", "ac"), "ac" LEFT "b\n"));
+  CHECK(TYPED(EDITED("x\xC3\xA5" "c", "xc", "\xC3\xA5" "c"), "\xC3\xA5" "c" LEFT LEFT "x\n"));
+  CHECK(TYPED(EDITED("abcd", "acd", "bcd"), "bc" HOME "a" END "d\n"));
+  CHECK(TYPED(EDITED("a\xC3\xA5" "b", "a\xC3\xA5", "ab"), "ab" LEFT "\xC3", "\xA5\n"));
+  CHECK(TYPED(EDITED("\xE2\x82\xAC\xC3\xA5" "b", "\xE2\x82\xAC" "b", "\xC3\xA5" "b"), "\xC3\xA5" "b" HOME "\xE2\x82\xAC\n"));
+  CHECK(TYPED(EDITED("abc", "ab", "ac"), "ac" LEFT LEFT LEFT RIGHT "b" END "\n"));
+  CHECK(TYPED("ab", "ab" LEFT "\177" RIGHT RIGHT "\177" "ab\n"));
+#  ifdef PASSPHRASE_DELETE
+  CHECK(TYPED("abc", "abxc" LEFT LEFT DEL "\n"));
+  CHECK(TYPED("a", "a\xC3\xA5" LEFT DEL DEL "\n"));
+#  else
+  CHECK(TYPED("abxc", "abxc" LEFT LEFT DEL "\n"));
+#  endif
+# endif
+# ifdef PASSPHRASE_DEDICATED
+  /* Keys split over several reads, and unknown keys */
+  CHECK(TYPED(EDITED("abc", "ab", "ac"), "ac\033", "[", "D", "b\n"));
+  CHECK(TYPED("ab", "a\033xb\n"));
+  CHECK(TYPED("ab", "a\033[Ab\n"));
+#  if defined(PASSPHRASE_INSERT) && defined(PASSPHRASE_OVERRIDE)
+  CHECK(TYPED(EDITED("ab", "abc", "ac"), "ac" LEFT "\033[2~b\n"));
+#  endif
+# endif
+# if defined(PASSPHRASE_CONTROL) && defined(PASSPHRASE_DEDICATED)
+  CHECK(TYPED(EDITED("abc", "ab", "ac"), "ac\002b\n"));
+# endif
+#endif
+}
+
+
+
+/**
+ * Test that keys are still read when the keystroke
+ * timings cannot be written to the trace file
+ */
+static void test_keytrace(void)
+{
+  char expected[2000], keys[sizeof(expected) + 1];
+  
+  memset(expected, 'k', sizeof(expected) - 1);
+  expected[sizeof(expected) - 1] = '\0';
+  strcpy(keys, expected);
+  strcat(keys, "\n");
+  setenv("LIBPASSPHRASE_KEYTRACE", "/nonexistent/keytrace", 1);
+  CHECK(TYPED(expected, keys));
+  unsetenv("LIBPASSPHRASE_KEYTRACE");
+}
+
+
+/**
+ * Create a memfd that holds a passphrase, as the agent does
+ * 
+ * @param   passphrase  The contents of the memfd
+ * @param   len         The length of `passphrase`
+ * @param   size        The size of the memfd
+ * @param   seals       The seals to add
+ * @return              The memfd, -1 on error
+ */
+static int agent_memfd(const char* passphrase, size_t len, off_t size, int seals)
+{
+  int fd = memfd_create("passphrase", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+  if ((write(fd, passphrase, len) != (ssize_t)len) || ftruncate(fd, size) ||
+      (seals && fcntl(fd, F_ADD_SEALS, seals)))
+    {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+/**
+ * Let `passphrase_agent_ask__` ask an agent that has already replied,
+ * or that never replies
+ * 
+ * @param   reply     The reply, `NULL` if the agent does not reply
+ * @param   n         The number of bytes of `reply` the agent sends
+ *                    before it stops writing
+ * @param   memfd     The memfd to send with the reply, -1 for none;
+ *                    it is closed
+ * @param   deadline  See `passphrase_agent_ask__`
+ * @param   cancelfd  See `passphrase_agent_ask__`
+ * @param   strength  See `passphrase_agent_ask__`
+ * @param   request   Output parameter for the request the agent received
+ * @return            The return value of `passphrase_agent_ask__`,
+ *                    `errno` is kept
+ */
+static int agent_ask(const unsigned char* reply, size_t n, int memfd, const struct timespec* deadline,
+		     int cancelfd, struct passphrase_strength* strength, unsigned char* request)
+{
+  union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  int fds[2], rc, saved_errno;
+  
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+    {
+      CHECK(!"socketpair");
+      return -1;
+    }
+  
+  if (reply)
+    {
+      memset(&msg, 0, sizeof(msg));
+      iov.iov_base = (void*)(size_t)reply;
+      iov.iov_len = n;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      if (memfd >= 0)
+	{
+	  msg.msg_control = control.buf;
+	  msg.msg_controllen = sizeof(control.buf);
+	  cmsg = CMSG_FIRSTHDR(&msg);
+	  cmsg->cmsg_level = SOL_SOCKET;
+	  cmsg->cmsg_type = SCM_RIGHTS;
+	  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	}
+      CHECK(sendmsg(fds[1], &msg, 0) == (ssize_t)n);
+      /* The agent can still receive the request */
+      shutdown(fds[1], SHUT_WR);
+    }
+  if (memfd >= 0)
+    close(memfd);
+  
+  rc = passphrase_agent_ask__(fds[0], PASSPHRASE_READ_NEW, deadline, cancelfd, strength);
+  saved_errno = errno;
+  CHECK(read(fds[1], request, AGENT_REQUEST_SIZE + 1) == AGENT_REQUEST_SIZE);
+  close(fds[1]);
+  errno = saved_errno;
+  return rc;
+}
+
+
+/**
+ * Test the agent protocol, and that passphrases are
+ * read locally when the agent cannot be reached
+ */
+static void test_agent(void)
+{
+  struct passphrase_strength strength, want;
+  unsigned char reply[AGENT_REPLY_SIZE], request[AGENT_REQUEST_SIZE + 1];
+  char path[200], *passphrase;
+  struct timespec deadline;
+  size_t len, size;
+  int memfd, cancel[2];
+  struct pty pty;
+  
+  /* The reply is encoded big-endian, and errors carry no strength */
+  want.current = 5;
+  want.rating.tier = 1;
+  want.rating.score = 0x0102030405060708ULL;
+  passphrase_agent_reply__(reply, 0, &want);
+  CHECK(!memcmp(reply, "\0\0\0\0" "\0\0\0\1" "\0\0\0\1" "\1\2\3\4\5\6\7\10", AGENT_REPLY_SIZE));
+  passphrase_agent_reply__(reply, EPERM, NULL);
+  CHECK(passphrase_meter_get_be__(reply, 4) == EPERM);
+  CHECK(!memcmp(reply + 4, "\0\0\0\0" "\377\377\377\377" "\0\0\0\0\0\0\0\0", 16));
+  
+  /* A passphrase, with its strength */
+  passphrase_agent_reply__(reply, 0, &want);
+  memfd = agent_memfd("secret", 6, 6, AGENT_SEALS);
+  memset(&strength, 0, sizeof(strength));
+  memfd = agent_ask(reply, AGENT_REPLY_SIZE, memfd, NULL, -1, &strength, request);
+  CHECK(memfd >= 0);
+  CHECK(!memcmp(request, AGENT_MAGIC "\0\0\0", 7));
+  CHECK(request[7] == (PASSPHRASE_READ_NEW | PASSPHRASE_READ_STRENGTH));
+  CHECK(strength.current == 1);
+  CHECK(strength.rating.tier == 1 && strength.rating.description);
+  CHECK(strength.rating.score == want.rating.score);
+  passphrase = memfd < 0 ? NULL : passphrase_agent_take__(memfd, &len, &size);
+  CHECK(passphrase && (len == 6) && (size > len) && !strcmp(passphrase, "secret"));
+  free(passphrase);
+  
+  /* Bytes after a NUL byte are not part of the passphrase */
+  memfd = agent_memfd("sec\0ret", 7, 7, AGENT_SEALS);
+  passphrase = memfd < 0 ? NULL : passphrase_agent_take__(memfd, &len, &size);
+  CHECK(passphrase && (len == 3) && !strcmp(passphrase, "sec"));
+  free(passphrase);
+  
+  /* The agent failed */
+  passphrase_agent_reply__(reply, EPERM, NULL);
+  errno = 0;
+  CHECK(agent_ask(reply, AGENT_REPLY_SIZE, -1, NULL, -1, NULL, request) == -1 && errno == EPERM);
+  CHECK(request[7] == PASSPHRASE_READ_NEW);
+  
+  /* A memfd that is missing, that could be changed, or is too large */
+  passphrase_agent_reply__(reply, 0, &want);
+  errno = 0;
+  CHECK(agent_ask(reply, AGENT_REPLY_SIZE, -1, NULL, -1, NULL, request) == -1 && errno == EBADMSG);
+  memfd = agent_memfd("secret", 6, 6, 0);
+  errno = 0;
+  CHECK(agent_ask(reply, AGENT_REPLY_SIZE, memfd, NULL, -1, NULL, request) == -1 && errno == EBADMSG);
+  memfd = agent_memfd("secret", 6, AGENT_MAX_LENGTH + 1, AGENT_SEALS);
+  errno = 0;
+  CHECK(agent_ask(reply, AGENT_REPLY_SIZE, memfd, NULL, -1, NULL, request) == -1 && errno == EBADMSG);
+  
+  /* The agent hung up in the middle of the reply */
+  errno = 0;
+  CHECK(agent_ask(reply, 10, -1, NULL, -1, NULL, request) == -1 && errno == EPIPE);
+  
+  /* The agent did not reply before the deadline, or reading was cancelled */
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  errno = 0;
+  CHECK(agent_ask(NULL, 0, -1, &deadline, -1, NULL, request) == -1 && errno == ETIMEDOUT);
+  if (pipe(cancel) == 0)
+    {
+      CHECK(write(cancel[1], "", 1) == 1);
+      errno = 0;
+      CHECK(agent_ask(NULL, 0, -1, NULL, cancel[0], NULL, request) == -1 && errno == ECANCELED);
+      close(cancel[0]);
+      close(cancel[1]);
+    }
+  
+  /* An agent that cannot be reached is not used */
+  if (pty_open(&pty) == 0)
+    {
+      memset(path, 'a', sizeof(path) - 1);
+      path[0] = '/';
+      path[sizeof(path) - 1] = '\0';
+      setenv("LIBPASSPHRASE_AGENT", path, 1);
+      CHECK(write(pty.master, "typed\n", 6) == 6);
+      passphrase = passphrase_read2(pty.slave, 0);
+      CHECK(passphrase && !strcmp(passphrase, "typed"));
+      if (passphrase)
+	{
+	  passphrase_wipe1(passphrase);
+	  free(passphrase);
+	}
+      unsetenv("LIBPASSPHRASE_AGENT");
+      pty_close(&pty);
+    }
+}
+
+
+/**
+ * Test that reading gives up at the deadline, or when cancelled,
+ * and that neither stops a passphrase from being read in time
+ */
+static void test_deadline(void)
+{
+  struct timespec deadline;
+  struct pty pty;
+  int cancel[2];
+  char c;
+  
+  if (pipe(cancel))
+    {
+      CHECK(!"pipe");
+      return;
+    }
+  
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += 10;
+  if (pty_open(&pty) == 0)
+    {
+      CHECK(write(pty.master, "in time\n", 8) == 8);
+      CHECK(is_passphrase(passphrase_read3(pty.slave, 0, &deadline, cancel[0]), "in time"));
+      pty_close(&pty);
+    }
+  
+  deadline.tv_sec -= 10;
+  deadline.tv_nsec += 50000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  if (pty_open(&pty) == 0)
+    {
+      CHECK(write(pty.master, "too late", 8) == 8);
+      errno = 0;
+      CHECK(!passphrase_read3(pty.slave, 0, &deadline, -1) && (errno == ETIMEDOUT));
+      pty_close(&pty);
+    }
+  if (pty_open(&pty) == 0)
+    {
+      errno = 0;
+      CHECK(!passphrase_read4(pty.slave, PASSPHRASE_READ_NEW, &deadline, -1, NULL) && (errno == ETIMEDOUT));
+      pty_close(&pty);
+    }
+  
+  CHECK(write(cancel[1], "", 1) == 1);
+  if (pty_open(&pty) == 0)
+    {
+      CHECK(write(pty.master, "cancelled", 9) == 9);
+      errno = 0;
+      CHECK(!passphrase_read3(pty.slave, 0, NULL, cancel[0]) && (errno == ECANCELED));
+      pty_close(&pty);
+    }
+  /* The cancellation can be shared, so it is not consumed */
+  CHECK(read(cancel[0], &c, 1) == 1);
+  
+  close(cancel[0]);
+  close(cancel[1]);
+}
+
+
+/**
+ * What `sink` collects
+ */
+struct sink
+{
+  /**
+   * The passphrase, as far as it has been given
+   */
+  char buf[64];
+  
+  /**
+   * The length of `buf`
+   */
+  size_t len;
+  
+  /**
+   * The number of segments that are accepted, before
+   * `sink` fails with `ENOSPC`
+   */
+  int accept;
+};
+
+
+/**
+ * Collect a segment of a passphrase from `passphrase_read_sink`
+ * 
+ * @param   data     The `struct sink`
+ * @param   segment  The segment
+ * @param   len      The length of `segment`
+ * @return           Zero on success, -1 on error
+ */
+static int sink(void* data, const char* segment, size_t len)
+{
+  struct sink* sink_ = data;
+  if (!sink_->accept--)
+    return errno = ENOSPC, -1;
+  if (len > sizeof(sink_->buf) - 1 - sink_->len)
+    return errno = EMSGSIZE, -1;
+  memcpy(sink_->buf + sink_->len, segment, len);
+  sink_->buf[sink_->len += len] = '\0';
+  return 0;
+}
+
+
+/**
+ * Test that `passphrase_read_sink` gives the whole passphrase,
+ * and fails with the error of the function it gives it to
+ */
+static void test_sink(void)
+{
+  struct sink data;
+  struct pty pty;
+  
+  if (pty_open(&pty) == 0)
+    {
+      memset(&data, 0, sizeof(data));
+      data.accept = INT_MAX;
+      CHECK(write(pty.master, "sunk\n", 5) == 5);
+      CHECK(passphrase_read_sink(pty.slave, 0, sink, &data) == 0);
+      CHECK(!strcmp(data.buf, "sunk"));
+      pty_close(&pty);
+    }
+  
+  if (pty_open(&pty) == 0)
+    {
+      memset(&data, 0, sizeof(data));
+      CHECK(write(pty.master, "refused\n", 8) == 8);
+      errno = 0;
+      CHECK((passphrase_read_sink(pty.slave, 0, sink, &data) == -1) && (errno == ENOSPC));
+      CHECK(data.len == 0);
+      pty_close(&pty);
+    }
+}
+
+
+/**
+ * Keys to type on a pseudoterminal once it is being read from
+ */
+struct typist
+{
+  /**
+   * The pseudoterminal
+   */
+  struct pty* pty;
+  
+  /**
+   * The keys
+   */
+  const char* keys;
+};
+
+
+/**
+ * Type keys on a pseudoterminal once echo has been disabled on it;
+ * input typed before that would be discarded
+ * 
+ * @param   data  The `struct typist`
+ * @return        `NULL`
+ */
+static void* type_later(void* data)
+{
+  struct typist* typist = data;
+  struct termios attr;
+  int i;
+  
+  for (i = 0; i < 5000; i++)
+    {
+      if (tcgetattr(typist->pty->slave, &attr) || !(attr.c_lflag & ECHO))
+	break;
+      usleep(1000);
+    }
+  CHECK(write(typist->pty->master, typist->keys, strlen(typist->keys)) == (ssize_t)strlen(typist->keys));
+  return NULL;
+}
+
+
+/**
+ * Test that `passphrase_read_any` reads from the terminal on which
+ * Enter is pressed first, and gives up when all of them hang up
+ * 
+ * @param  hangup  Whether the first terminal hangs up, rather than
+ *                 having something typed on it without Enter
+ * @param  typed   Whether a passphrase is entered on the second terminal
+ */
+static void test_read_any(int hangup, int typed)
+{
+  const char* keys[2] = { hangup ? NULL : "loser", typed ? "winner\n" : NULL };
+  struct typist typists[2];
+  pthread_t threads[2];
+  struct termios attr;
+  struct pty pty[2];
+  int i, fds[2], started[2];
+  size_t winner = 2;
+  char* passphrase;
+  
+  if (pty_open(pty + 0))
+    return;
+  if (pty_open(pty + 1))
+    {
+      pty_close(pty + 0);
+      return;
+    }
+  
+  for (i = 0; i < 2; i++)
+    {
+      fds[i] = pty[i].slave;
+      /* `passphrase_read_any` disables echo itself */
+      if (!tcgetattr(pty[i].slave, &attr))
+	{
+	  attr.c_lflag |= ECHO;
+	  tcsetattr(pty[i].slave, TCSANOW, &attr);
+	}
+      typists[i].pty = pty + i;
+      typists[i].keys = keys[i];
+      started[i] = keys[i] && !pthread_create(threads + i, NULL, type_later, typists + i);
+      if (keys[i] == NULL)
+	{
+	  close(pty[i].master);
+	  pty[i].master = -1;
+	}
+    }
+  
+  errno = 0;
+  passphrase = passphrase_read_any(fds, 2, 0, &winner);
+  if (typed)
+    CHECK((winner == 1) && is_passphrase(passphrase, "winner"));
+  else
+    CHECK(!passphrase && (errno == EIO) && (winner == 2));
+  
+  for (i = 0; i < 2; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  pty_close(pty + 1);
+  pty_close(pty + 0);
+}
+
+/**
+ * Redraw function for `test_output_queue`, that draws an R
+ * 
+ * @param  data  The output queue
+ * @param  from  Not used
+ */
+static void output_redrawn(void* data, size_t from)
+{
+  struct output_queue* queue = data;
+  (void) from;
+  fprintf(queue->stream, "R");
+}
+
+
+/**
+ * Read what has been drawn on a pseudoterminal
+ * 
+ * @param   fd    The master side of the pseudoterminal
+ * @param   buf   Output buffer for what has been drawn, NUL-terminated
+ * @param   size  The size of `buf`
+ * @return        The number of bytes read
+ */
+static size_t drawn_on(int fd, char* buf, size_t size)
+{
+  struct pollfd pfd;
+  size_t got = 0;
+  ssize_t r;
+  
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while ((got + 1 < size) && (poll(&pfd, 1, 200) > 0))
+    {
+      if ((r = read(fd, buf + got, size - got - 1)) <= 0)
+	break;
+      got += (size_t)r;
+    }
+  buf[got] = '\0';
+  return got;
+}
+
+
+/**
+ * Test that output that is stalled by flow control does not block,
+ * whether or not the display can be redrawn
+ */
+static void test_output_queue(void)
+{
+  struct output_queue queue;
+  struct pty pty;
+  FILE* tty;
+  char drawn[256];
+  int i;
+  
+  if (pty_open(&pty))
+    {
+      CHECK(!"pty");
+      return;
+    }
+  
+  /* Frames that nothing has been written of are replaced by a redraw */
+  tty = fdopen(dup(pty.slave), "w");
+  CHECK(tty != NULL);
+  if (tty == NULL)
+    goto out;
+  tcflow(pty.slave, TCOOFF);
+  passphrase_output_start__(&queue, tty, output_redrawn, &queue);
+  CHECK(queue.fd >= 0);
+  for (i = 0; i < 40; i++)
+    {
+      fprintf(queue.stream, "x");
+      passphrase_output_frame__(&queue, (size_t)i);
+    }
+  CHECK(queue.frames == 1);
+  CHECK(passphrase_output_retract__(&queue, "R", 1) == 0);
+  tcflow(pty.slave, TCOON);
+  passphrase_output_stop__(&queue);
+  drawn_on(pty.master, drawn, sizeof(drawn));
+  CHECK(!strcmp(drawn, "R"));
+  
+  /* Otherwise they are merged, rather than waiting for the terminal,
+     and a star that is erased before it is written is taken back */
+  tcflow(pty.slave, TCOOFF);
+  passphrase_output_start__(&queue, tty, NULL, NULL);
+  CHECK(queue.fd >= 0);
+  alarm(10);
+  for (i = 0; i < 40; i++)
+    {
+      fprintf(queue.stream, "x");
+      passphrase_output_frame__(&queue, (size_t)i);
+    }
+  fprintf(queue.stream, "*");
+  CHECK(passphrase_output_retract__(&queue, "y", 1) == 0);
+  CHECK(passphrase_output_retract__(&queue, "*", 1) == 1);
+  passphrase_output_frame__(&queue, (size_t)i);
+  alarm(0);
+  CHECK(queue.tail - queue.head == 40);
+  tcflow(pty.slave, TCOON);
+  passphrase_output_stop__(&queue);
+  CHECK(drawn_on(pty.master, drawn, sizeof(drawn)) == 40);
+  CHECK(strspn(drawn, "x") == 40);
+  
+  fclose(tty);
+ out:
+  pty_close(&pty);
+}
+
+
+/* Passphrases are scrolled in a viewport, see passphrase_helper.h */
+#if (defined(PASSPHRASE_STAR) || (defined(PASSPHRASE_ECHO) && defined(PASSPHRASE_MOVE))) && \
+    !defined(PASSPHRASE_NO_VIEWPORT)
+# ifdef PASSPHRASE_STAR
+#  define SHOWN  '*'
+# else
+#  define SHOWN  'a'
+# endif
+# define FORTY  "aaaaaaaaaa" "aaaaaaaaaa" "aaaaaaaaaa" "aaaaaaaaaa"
+/* The passphrase starts in the first of 20 columns, so 19 are used, and
+   the last is left empty; the point is moved back to the start if it can */
+# ifdef HOME
+#  define VIEWPORT_KEYS  "\033[1;1R" FORTY HOME "\n"
+# else
+#  define VIEWPORT_KEYS  "\033[1;1R" FORTY "\n"
+# endif
+
+/**
+ * Test that a passphrase wider than the terminal is clipped to
+ * the viewport, with markers at the edges where it is hidden
+ */
+static void test_viewport(void)
+{
+  struct pollfd fds[PASSPHRASE_SESSION_FDS];
+  struct passphrase_session* s;
+  struct winsize ws;
+  struct pty pty;
+  char drawn[1 << 12];
+  char* passphrase = NULL;
+  size_t i, run, longest, len = 0;
+  const char* keys = VIEWPORT_KEYS;
+  ssize_t got;
+  int r = 0;
+  
+  if (pty_open(&pty))
+    {
+      CHECK(!"pty");
+      return;
+    }
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_row = 24;
+  ws.ws_col = 20;
+  CHECK(ioctl(pty.slave, TIOCSWINSZ, &ws) == 0);
+  fcntl(pty.master, F_SETFL, fcntl(pty.master, F_GETFL) | O_NONBLOCK);
+  dup2(pty.slave, STDERR_FILENO);
+  setenv("LIBPASSPHRASE_QUERY", "0", 1);
+  s = passphrase_session_start(pty.slave, 0);
+  CHECK(s != NULL);
+  CHECK(write(pty.master, keys, strlen(keys)) == (ssize_t)strlen(keys));
+  while (s && (r == 0) && (poll(fds, (nfds_t)passphrase_session_fds(s, fds), 5000) > 0))
+    {
+      r = passphrase_session_step(s);
+      while ((got = read(pty.master, drawn + len, sizeof(drawn) - 1 - len)) > 0)
+	len += (size_t)got;
+    }
+  if (s)
+    passphrase = passphrase_session_finish(s);
+  while ((got = read(pty.master, drawn + len, sizeof(drawn) - 1 - len)) > 0)
+    len += (size_t)got;
+  drawn[len] = '\0';
+  unsetenv("LIBPASSPHRASE_QUERY");
+  pty_close(&pty);
+  
+  CHECK(is_passphrase(passphrase, FORTY));
+  for (i = run = longest = 0; i < len; i++)
+    {
+      run = drawn[i] == SHOWN ? run + 1 : 0;
+      longest = run > longest ? run : longest;
+    }
+  CHECK(longest <= 19);
+  CHECK(strchr(drawn, '<') != NULL);
+# ifdef HOME
+  CHECK(strchr(drawn, '>') != NULL);
+# endif
+}
+# undef SHOWN
+# undef FORTY
+# undef VIEWPORT_KEYS
+#endif
+
+
+/**
+ * Score passphrases with `passphrase_score_batch`, and check that
+ * each got its own score; `meterstub` rates with the estimate
+ * 
+ * @param   n        The number of passphrases, at most 64
+ * @param   workers  The number of meters
+ * @return           1 if all passphrases got their own score,
+ *                   0 if not, -1 if scoring failed
+ */
+static int batch_scored(size_t n, size_t workers)
+{
+  char buf[64][32];
+  const char* passphrases[64];
+  struct passphrase_score scores[64];
+  size_t i;
+  
+  for (i = 0; i < n; i++)
+    {
+      snprintf(buf[i], sizeof(buf[i]), "%zu%.*s", i, (int)(i % 17), "xY9!kq2#Lm4$Rt7&Z");
+      passphrases[i] = buf[i];
+    }
+  if (passphrase_score_batch(passphrases, NULL, n, scores, workers))
+    return -1;
+  for (i = 0; i < n; i++)
+    if ((scores[i].score != passphrase_meter_estimate__(buf[i], strlen(buf[i]))) ||
+	(scores[i].tier != passphrase_meter_tier__(scores[i].score, NULL, NULL)))
+      return 0;
+  return 1;
+}
+
+
+/**
+ * Test that `passphrase_score_batch` gives each passphrase its own
+ * score, when spread over meters, when meters crash, when falling
+ * back from a daemon that is not running, and from a daemon
+ */
+static void test_score_batch(void)
+{
+  char meterstub[PATH_MAX], passcheckd[PATH_MAX], dir[] = "/tmp/libpassphrase-test.XXXXXX";
+  char passcheck[sizeof(dir) + 16], sock[sizeof(dir) + 16], meter[sizeof(sock) + 8];
+  char path[4096];
+  const char* old_path = getenv("PATH");
+  pid_t pid;
+  int i, fd, null;
+  
+  if (!realpath("bin/meterstub", meterstub) || !realpath("bin/passcheckd", passcheckd))
+    {
+      fprintf(stderr, "test.c: bin/meterstub or bin/passcheckd is missing, scoring is not tested\n");
+      return;
+    }
+  
+  /* The passphrases are spread over the meters, and many are in flight */
+  setenv("LIBPASSPHRASE_METER", meterstub, 1);
+  setenv("METERSTUB_LATENCY", "uniform:0:2", 1);
+  CHECK(batch_scored(64, 4) == 1);
+  CHECK(batch_scored(64, 1) == 1);
+  unsetenv("METERSTUB_LATENCY");
+  
+  /* A meter that crashes is replaced, and its passphrases are scored
+     again, but scoring fails if the meters keep crashing */
+  setenv("METERSTUB_CRASH_AFTER", "6", 1);
+  CHECK(batch_scored(10, 1) == 1);
+  setenv("METERSTUB_CRASH_AFTER", "2", 1);
+  CHECK(batch_scored(10, 1) == -1);
+  unsetenv("METERSTUB_CRASH_AFTER");
+  
+  if (!mkdtemp(dir))
+    {
+      CHECK(!"mkdtemp");
+      unsetenv("LIBPASSPHRASE_METER");
+      return;
+    }
+  snprintf(passcheck, sizeof(passcheck), "%s/passcheck", dir);
+  snprintf(sock, sizeof(sock), "%s/socket", dir);
+  snprintf(meter, sizeof(meter), "unix:%s", sock);
+  snprintf(path, sizeof(path), "%s:%s", dir, old_path ? old_path : "/bin:/usr/bin");
+  
+  /* Without a daemon, the default meter is started */
+  CHECK(symlink(meterstub, passcheck) == 0);
+  setenv("PATH", path, 1);
+  setenv("LIBPASSPHRASE_METER", meter, 1);
+  CHECK(batch_scored(16, 2) == 1);
+  if (old_path)
+    setenv("PATH", old_path, 1);
+  unlink(passcheck);
+  
+  /* The daemon takes many queries at a time with binary framing */
+  pid = fork();
+  if (pid == 0)
+    {
+      if ((null = open("/dev/null", O_WRONLY)) >= 0)
+	dup2(null, STDERR_FILENO);
+      execl(passcheckd, passcheckd, "-m", meterstub, sock, NULL);
+      _exit(1);
+    }
+  /* The socket exists before the daemon listens on it */
+  for (i = 0, fd = -1; (pid > 0) && (i < 5000) && (fd < 0); i++)
+    if ((fd = passphrase_meter_connect__(sock)) < 0)
+      usleep(1000);
+  if (fd >= 0)
+    {
+      close(fd);
+      CHECK(batch_scored(64, 2) == 1);
+      CHECK(batch_scored(1, 1) == 1);
+    }
+  else
+    CHECK(!"passcheckd");
+  if (pid > 0)
+    {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+    }
+  
+  unlink(sock);
+  rmdir(dir);
+  unsetenv("LIBPASSPHRASE_METER");
+}
+
+
+#ifdef PASSPHRASE_METER
+/**
+ * Type keys on a pseudoterminal, with pauses, and read them with
+ * a session that draws on the pseudoterminal and rates the passphrase
+ * 
+ * @param   keys      The keys, `NULL`-terminated; the last shall end with Enter
+ * @param   pause     The number of milliseconds to wait after each but the last
+ * @param   drawn     Output buffer for what was drawn, NUL-terminated
+ * @param   size      The size of `drawn`
+ * @param   strength  Output parameter for the strength of the passphrase
+ * @return            The passphrase, `NULL` on error
+ */
+static char* rate_keys(const char* const* keys, int pause, char* drawn, size_t size,
+		       struct passphrase_strength* strength)
+{
+  struct pollfd fds[PASSPHRASE_SESSION_FDS];
+  struct passphrase_session* s;
+  struct timespec now, until;
+  char* passphrase = NULL;
+  size_t len = 0;
+  ssize_t got;
+  long int left;
+  struct pty pty;
+  int r = 0;
+  
+  *drawn = '\0';
+  if (pty_open(&pty))
+    return NULL;
+  fcntl(pty.master, F_SETFL, fcntl(pty.master, F_GETFL) | O_NONBLOCK);
+  dup2(pty.slave, STDERR_FILENO);
+  s = passphrase_session_start(pty.slave, PASSPHRASE_READ_NEW | PASSPHRASE_READ_SCREEN_FREE | PASSPHRASE_READ_STRENGTH);
+  for (; s && *keys && (r == 0); keys++)
+    {
+      if (write(pty.master, *keys, strlen(*keys)) < 0)
+	break;
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      until.tv_sec += keys[1] ? pause / 1000 : 5;
+      until.tv_nsec += keys[1] ? pause % 1000 * 1000000L : 0;
+      if (until.tv_nsec >= 1000000000L)
+	{
+	  until.tv_sec += 1;
+	  until.tv_nsec -= 1000000000L;
+	}
+      for (;;)
+	{
+	  clock_gettime(CLOCK_MONOTONIC, &now);
+	  left = (until.tv_sec - now.tv_sec) * 1000L + (until.tv_nsec - now.tv_nsec) / 1000000L;
+	  if ((r != 0) || (left <= 0))
+	    break;
+	  if (poll(fds, (nfds_t)passphrase_session_fds(s, fds), (int)left) > 0)
+	    r = passphrase_session_step(s);
+	  /* Keep the pseudoterminal from filling up */
+	  while ((got = read(pty.master, drawn + len, size - 1 - len)) > 0)
+	    len += (size_t)got;
+	  drawn[len] = '\0';
+	}
+    }
+  if (s)
+    passphrase = passphrase_session_finish2(s, strength);
+  while ((got = read(pty.master, drawn + len, size - 1 - len)) > 0)
+    len += (size_t)got;
+  drawn[len] = '\0';
+  pty_close(&pty);
+  return passphrase;
+}
+
+
+/**
+ * Test that a strength meter that is slow is stood in for
+ * by an estimate, and that a meter that crashes is restarted
+ */
+static void test_meter_hedging(void)
+{
+  struct passphrase_strength strength;
+  char drawn[1 << 14], meterstub[PATH_MAX], estimated[64], rated[64];
+  char* at;
+  
+  if (!realpath("bin/meterstub", meterstub))
+    return;
+  setenv("LIBPASSPHRASE_METER", meterstub, 1);
+  
+  /* The estimate is displayed once the budget has been spent,
+     and is replaced by the meter's score when it arrives */
+  snprintf(estimated, sizeof(estimated), "(%llu, " PASSPHRASE_TEXT_PROVISIONAL ")",
+	   passphrase_meter_estimate__("abc", 3));
+  snprintf(rated, sizeof(rated), "(%llu)", passphrase_meter_estimate__("abc", 3));
+  setenv("METERSTUB_LATENCY", "fixed:400", 1);
+  setenv("LIBPASSPHRASE_METER_BUDGET", "50", 1);
+  memset(&strength, 0, sizeof(strength));
+  CHECK(is_passphrase(rate_keys((const char* const[]){ "abc", "\n", NULL }, 200, drawn, sizeof(drawn), &strength), "abc"));
+  CHECK((at = strstr(drawn, estimated)) && strstr(at, rated));
+  CHECK(strength.current && (strength.rating.score == passphrase_meter_estimate__("abc", 3)));
+  unsetenv("LIBPASSPHRASE_METER_BUDGET");
+  unsetenv("METERSTUB_LATENCY");
+  
+  /* The meter crashes at the second passphrase, after the hello, and
+     is restarted to rate the passphrase rather than being turned off */
+  snprintf(rated, sizeof(rated), "(%llu)", passphrase_meter_estimate__("ab", 2));
+  setenv("METERSTUB_CRASH_AFTER", "3", 1);
+  memset(&strength, 0, sizeof(strength));
+  CHECK(is_passphrase(rate_keys((const char* const[]){ "a", "b", "\n", NULL }, 400, drawn, sizeof(drawn), &strength), "ab"));
+  CHECK(strstr(drawn, rated) != NULL);
+  CHECK(strength.current && (strength.rating.score == passphrase_meter_estimate__("ab", 2)));
+  unsetenv("METERSTUB_CRASH_AFTER");
+  
+  unsetenv("LIBPASSPHRASE_METER");
+}
+
+
+/**
+ * Test that stopping a strength meter when as many stopped meters
+ * as can be kept are still running, does not wait for their grace
+ * period, but makes room by killing the oldest
+ */
+static void test_meter_eviction(void)
+{
+  struct passphrase_strength strength;
+  struct timespec before, after;
+  char drawn[1 << 12], meterstub[PATH_MAX];
+  long int took, slowest = 0;
+  int i;
+  
+  if (!realpath("bin/meterstub", meterstub))
+    return;
+  setenv("LIBPASSPHRASE_METER", meterstub, 1);
+  setenv("METERSTUB_EXIT_DELAY", "5000", 1);
+  passphrase_reap_meters(1);
+  
+  /* The grace period is a second, and eight stopped meters are kept */
+  for (i = 0; i < 12; i++)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &before);
+      CHECK(is_passphrase(rate_keys((const char* const[]){ "a\n", NULL }, 0, drawn, sizeof(drawn), &strength), "a"));
+      clock_gettime(CLOCK_MONOTONIC, &after);
+      took = (after.tv_sec - before.tv_sec) * 1000L + (after.tv_nsec - before.tv_nsec) / 1000000L;
+      slowest = took > slowest ? took : slowest;
+    }
+  CHECK(slowest < 500);
+  
+  passphrase_reap_meters(1);
+  unsetenv("METERSTUB_EXIT_DELAY");
+  unsetenv("LIBPASSPHRASE_METER");
+}
+#endif /* PASSPHRASE_METER */
+
+
+/**
+ * Run the tests of the internal functions, and of the
+ * key handling, on a pseudoterminal of its own, so
+ * that they do not need a terminal
+ * 
+ * @return  Zero if all tests passed, 1 otherwise
+ */
+static int run_checks(void)
+{
+  int fd;
+  
+  test_utf8_valid();
+  test_meter_text();
+  test_meter_hello();
+  test_meter_frame();
+  test_policy();
+  test_stream();
+  test_score_batch();
+  
+  fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0)
+    fprintf(stderr, "test.c: no pseudoterminal, the terminal is not tested\n");
+  else
+    {
+      close(fd);
+      test_keys();
+      test_keytrace();
+      test_deadline();
+      test_sink();
+      test_read_any(0, 1);
+      test_read_any(1, 1);
+      test_read_any(1, 0);
+      test_output_queue();
+#if (defined(PASSPHRASE_STAR) || (defined(PASSPHRASE_ECHO) && defined(PASSPHRASE_MOVE))) && \
+    !defined(PASSPHRASE_NO_VIEWPORT)
+      test_viewport();
+#endif
+#ifdef PASSPHRASE_METER
+      test_meter_hedging();
+      test_meter_eviction();
+#endif /* PASSPHRASE_METER */
+      test_agent();
+    }
+  
+  if (failures)
+    fprintf(stderr, "%i checks failed\n", failures);
+  return !!failures;
+}
+
+
+/**
+ * Main test function, reads a passphrase from the terminal,
+ * or runs the tests of the internal functions if the only
+ * argument is `--check`
  * 
  * @param   argc  Number of elements in `argv`
  * @param   argv  Command line arguments
@@ -35,9 +1713,13 @@ int main(int argc, char** argv)
 {
   /* Variables for the passphrase */
   char* passphrase;
+  int fd;
+  
+  if ((argc == 2) && !strcmp(argv[1], "--check"))
+    return run_checks();
   
   /* Get file descriptor to the terminal */
-  int fd = open("/dev/tty", O_RDONLY);
+  fd = open("/dev/tty", O_RDONLY);
   if (fd == -1)
     {
       perror(*argv);
@@ -76,8 +1758,5 @@ int main(int argc, char** argv)
   /* End of program */
   close(fd);
   return 0;
-  
-  /* `argc` was never used */
-  (void) argc;
 }
 
@@ -0,0 +1,242 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/mman.h>
+
+#include "passphrase.h"
+#include "passphrase_helper.h"
+#include "meter.h"
+
+
+
+/* The minimal build, see `make tiny`, for prompts in early boot
+ * and initramfs, where start up time and size matter. It only
+ * provides `passphrase_read_static`, and the functions in echoes.c
+ * and wipe.c; it uses neither stdio nor the heap, and never starts
+ * a strength meter, the strength is estimated instead. Output is
+ * written to the standard error with write(2). */
+
+
+
+/**
+ * The size of the buffer the strength is formatted in
+ */
+#define TINY_LINE_MAX  256
+
+/**
+ * Write a string literal to the standard error
+ * 
+ * @param  TEXT  The string literal
+ */
+#define PUT(TEXT)  put(TEXT, sizeof(TEXT) - 1)
+
+
+
+/**
+ * The passphrase, it is locked into memory on first use
+ */
+static char buffer[PASSPHRASE_STATIC_MAX];
+static int locked = 0;
+
+
+
+/**
+ * Write to the standard error, ignoring errors
+ * 
+ * @param  text  The text to write
+ * @param  n     The length of `text`
+ */
+static void put(const char* text, size_t n)
+{
+  ssize_t wrote;
+  while (n)
+    {
+      wrote = write(STDERR_FILENO, text, n);
+      if (wrote < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return;
+	}
+      text += (size_t)wrote;
+      n -= (size_t)wrote;
+    }
+}
+
+
+/**
+ * Append a string to a line being formatted
+ * 
+ * @param   line  The line
+ * @param   n     The length of the line
+ * @param   text  The string to append, truncated if the line is full
+ * @return        The new length of the line
+ */
+static size_t append(char* line, size_t n, const char* text)
+{
+  while (*text && (n < TINY_LINE_MAX))
+    line[n++] = *text++;
+  return n;
+}
+
+
+/**
+ * Display the estimated strength of the passphrase
+ * 
+ * @param  placement  `PASSPHRASE_READ_SCREEN_FREE` or `PASSPHRASE_READ_BELOW_FREE`
+ * @param  label      The label of the strength
+ * @param  len        The length of the passphrase
+ */
+static void render(int placement, const char* label, size_t len)
+{
+  char line[TINY_LINE_MAX];
+  char digits[24];
+  char* p = digits + sizeof(digits);
+  unsigned long long int score = passphrase_meter_estimate__(buffer, len);
+  const char* colour;
+  const char* desc;
+  size_t n = 0;
+  
+  passphrase_meter_tier__(score, &colour, &desc);
+  *--p = '\0';
+  do
+    *--p = (char)('0' + score % 10);
+  while (score /= 10);
+  
+  if (placement & PASSPHRASE_READ_SCREEN_FREE)
+    {
+      n = append(line, n, "\033[s\033[E\033[0K");
+      n = append(line, n, label);
+      n = append(line, n, " \033[");
+    }
+  else
+    n = append(line, n, "\033[B\033[s\033[0K\033[");
+  n = append(line, n, colour);
+  n = append(line, n, "m");
+  n = append(line, n, desc);
+  n = append(line, n, "\033[m (");
+  n = append(line, n, p);
+  n = append(line, n, ", " PASSPHRASE_TEXT_PROVISIONAL ")\033[u");
+  if (!(placement & PASSPHRASE_READ_SCREEN_FREE))
+    n = append(line, n, "\033[A");
+  put(line, n);
+}
+
+
+/**
+ * Reads the passphrase into a static buffer
+ * 
+ * @param   fdin   File descriptor for input
+ * @param   flags  Settings, see `passphrase_read2`
+ * @return         The passphrase, should be wiped but not `free`:ed,
+ *                 `NULL` on error; it is overwritten by the next call
+ */
+char* passphrase_read_static(int fdin, int flags)
+{
+  const char* label;
+  unsigned char c;
+  size_t len = 0;
+  ssize_t got;
+  int tty = isatty(fdin), placement = 0, overflow = 0, saved_errno;
+  
+  if (!locked)
+    locked = !mlock(buffer, sizeof(buffer));
+  
+  if (tty && (flags & PASSPHRASE_READ_NEW))
+    placement = flags & (PASSPHRASE_READ_SCREEN_FREE | PASSPHRASE_READ_BELOW_FREE);
+  if (placement & PASSPHRASE_READ_BELOW_FREE)
+    placement &= ~PASSPHRASE_READ_SCREEN_FREE;
+  label = getenv("LIBPASSPHRASE_STRENGTH_LABEL");
+  if (!label || !*label)
+    label = PASSPHRASE_TEXT_STRENGTH;
+  
+  /* Make room for the strength below the prompt */
+  if (placement & PASSPHRASE_READ_SCREEN_FREE)
+    {
+      struct termios stty;
+      struct termios saved_stty;
+      tcgetattr(STDERR_FILENO, &stty);
+      saved_stty = stty;
+      stty.c_oflag &= (tcflag_t)~ONLCR;
+      tcsetattr(STDERR_FILENO, TCSAFLUSH, &stty);
+      PUT("\n\033[A");
+      tcsetattr(STDERR_FILENO, TCSAFLUSH, &saved_stty);
+    }
+  
+  /* The input is read byte by byte, so that input typed
+     after Enter is left for whoever reads it next */
+  for (;;)
+    {
+      got = read(fdin, &c, sizeof(c));
+      if (got < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  goto fail;
+	}
+      if ((got == 0) || (c == '\n'))
+	break;
+      if (c == 0)
+	continue;
+      if (tty && ((c == 127) || (c == 8)))
+	{
+	  /* Erase the last character, rather than the last byte */
+	  while (len && ((buffer[--len] & 0xC0) == 0x80));
+	  buffer[len] = 0;
+	}
+      else if (len + 1 < sizeof(buffer))
+	buffer[len++] = (char)c;
+      else
+	{
+	  /* The passphrase is rejected once it has been entered */
+	  if (tty)
+	    PUT("\a");
+	  overflow = 1;
+	  continue;
+	}
+      if (placement)
+	render(placement, label, len);
+    }
+  passphrase_wipe((char*)&c, sizeof(c));
+  
+  if (placement & PASSPHRASE_READ_SCREEN_FREE)
+    PUT("\033[s\033[E\033[0K\033[u");
+  else if (placement)
+    PUT("\033[B\033[0K\033[A");
+  PUT("\n");
+  
+  if (overflow)
+    {
+      errno = ENOBUFS;
+      goto fail;
+    }
+  buffer[len] = '\0';
+  return buffer;
+  
+ fail:
+  saved_errno = errno;
+  passphrase_wipe(buffer, len);
+  errno = saved_errno;
+  return NULL;
+}
+
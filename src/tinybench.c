@@ -0,0 +1,181 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+
+
+/*
+ * tinybench — compare the size and start up time of builds
+ * 
+ * Usage: tinybench [-n RUNS] FILE...
+ * 
+ * Prints the size of each FILE, and for each FILE that is
+ * executable, the mean and the fastest time, over RUNS runs, 200 by
+ * default, from starting it until it has exited, with a passphrase
+ * on its standard input. `make tinybench` runs it on the full and
+ * the minimal library, and on `tinyprompt` linked statically with
+ * each of them.
+ */
+
+
+
+static const char* argv0;
+
+
+
+/**
+ * Get the current time
+ * 
+ * @return  The current time on `CLOCK_MONOTONIC`, in nanoseconds
+ */
+static long long int now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long int)(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+
+/**
+ * Run a program once, with a passphrase on its standard input
+ * 
+ * @param   path  The program
+ * @return        The number of nanoseconds it ran, -1 on error
+ */
+static long long int run(const char* path)
+{
+  long long int start;
+  int fds[2], status;
+  pid_t pid;
+  
+  if (pipe(fds))
+    return -1;
+  if (write(fds[1], "passphrase\n", 11) != 11)
+    return -1;
+  close(fds[1]);
+  
+  start = now();
+  pid = fork();
+  if (pid == -1)
+    return -1;
+  if (pid == 0)
+    {
+      dup2(fds[0], STDIN_FILENO);
+      close(fds[0]);
+      close(STDERR_FILENO);
+      open("/dev/null", O_WRONLY);
+      execl(path, path, NULL);
+      _exit(127);
+    }
+  close(fds[0]);
+  while (waitpid(pid, &status, 0) == -1)
+    if (errno != EINTR)
+      return -1;
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    return errno = ENOEXEC, -1;
+  return now() - start;
+}
+
+
+/**
+ * Print usage information and exit
+ */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+static void usage(void)
+{
+  fprintf(stderr, "usage: %s [-n RUNS] FILE...\n", argv0);
+  exit(2);
+}
+
+
+/**
+ * Main function
+ * 
+ * @param   argc  Number of elements in `argv`
+ * @param   argv  Command line arguments
+ * @return        Zero on success
+ */
+int main(int argc, char** argv)
+{
+  long long int t, sum, best;
+  long int runs = 200, i;
+  struct stat attr;
+  int opt, rc = 0;
+  
+  argv0 = argc ? *argv : "tinybench";
+  while ((opt = getopt(argc, argv, "n:")) != -1)
+    switch (opt)
+      {
+      case 'n':
+	runs = atol(optarg);
+	break;
+      default:
+	usage();
+      }
+  if ((optind == argc) || (runs <= 0))
+    usage();
+  
+  printf("%-32s %10s %12s %12s\n", "file", "bytes", "mean start", "best start");
+  for (; optind < argc; optind++)
+    {
+      if (stat(argv[optind], &attr))
+	{
+	  perror(argv[optind]);
+	  rc = 1;
+	  continue;
+	}
+      printf("%-32s %10lli", argv[optind], (long long int)(attr.st_size));
+      if (!S_ISREG(attr.st_mode) || access(argv[optind], X_OK))
+	{
+	  printf("\n");
+	  continue;
+	}
+      /* Warm the page cache, so that the disk is not measured */
+      run(argv[optind]);
+      for (i = 0, sum = 0, best = -1; i < runs; i++)
+	{
+	  if ((t = run(argv[optind])) < 0)
+	    break;
+	  sum += t;
+	  if ((best < 0) || (t < best))
+	    best = t;
+	}
+      if (i < runs)
+	{
+	  printf("\n");
+	  perror(argv[optind]);
+	  rc = 1;
+	  continue;
+	}
+      printf(" %10.1fus %10.1fus\n", (double)sum / (double)runs / 1000, (double)best / 1000);
+    }
+  return rc;
+}
+
@@ -0,0 +1,55 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <unistd.h>
+
+#include "passphrase.h"
+
+
+
+/*
+ * tinyprompt — the smallest useful program that reads a passphrase
+ * 
+ * Usage: tinyprompt
+ * 
+ * Reads a passphrase from the standard input, as a disk-unlock prompt
+ * in an initramfs would, and exits with 0 if a passphrase was read.
+ * It is linked statically with both the full and the minimal library,
+ * for `make tinybench`, which compares their size and start up time.
+ */
+
+
+
+/**
+ * Main function
+ * 
+ * @return  Zero on success
+ */
+int main(void)
+{
+  char* passphrase;
+  
+  passphrase_disable_echo1(STDIN_FILENO);
+  passphrase = passphrase_read_static(STDIN_FILENO, PASSPHRASE_READ_NEW | PASSPHRASE_READ_SCREEN_FREE);
+  passphrase_reenable_echo1(STDIN_FILENO);
+  if (passphrase == NULL)
+    return 1;
+  passphrase_wipe1(passphrase);
+  return 0;
+}
+
@@ -0,0 +1,331 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#ifdef PASSPHRASE_NORMALISE
+# include <uninorm.h>
+#endif /* PASSPHRASE_NORMALISE */
+
+#define PASSPHRASE_USE_DEPRECATED
+#include "passphrase.h"
+#include "passphrase_helper.h"
+#include "utf8.h"
+#include "wipe.h"
+
+
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# define HAVE_AVX2_DISPATCH
+#endif
+
+
+
+#ifdef __GNUC__
+/**
+ * A 16-byte vector, the widest vector every
+ * supported x86-64 processor can handle natively
+ */
+typedef uint64_t v2u64 __attribute__((vector_size(16)));
+#endif /* __GNUC__ */
+
+
+/**
+ * Get the number of leading bytes in a buffer that are ASCII,
+ * in whole 64-byte blocks
+ * 
+ * @param   s  The buffer
+ * @param   n  The number of bytes in `s`
+ * @return     The number of leading ASCII bytes, rounded down to a
+ *             multiple of 64; may be smaller than the actual number
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+static size_t ascii_blocks_generic(const unsigned char* s, size_t n)
+{
+  size_t i;
+#ifdef __GNUC__
+  v2u64 a, b, c, d;
+  const v2u64 high = { 0x8080808080808080ULL, 0x8080808080808080ULL };
+  for (i = 0; i + 64 <= n; i += 64)
+    {
+      memcpy(&a, s + i +  0, 16);
+      memcpy(&b, s + i + 16, 16);
+      memcpy(&c, s + i + 32, 16);
+      memcpy(&d, s + i + 48, 16);
+      a = (a | b | c | d) & high;
+      if (a[0] | a[1])
+	break;
+    }
+#else /* __GNUC__ */
+  uint64_t w[8];
+  size_t j;
+  for (i = 0; i + 64 <= n; i += 64)
+    {
+      memcpy(w, s + i, 64);
+      for (j = 1; j < 8; j++)
+	w[0] |= w[j];
+      if (w[0] & 0x8080808080808080ULL)
+	break;
+    }
+#endif /* __GNUC__ */
+  return i;
+}
+
+
+#ifdef HAVE_AVX2_DISPATCH
+/**
+ * Variant of `ascii_blocks_generic` for processors with AVX2
+ * 
+ * @param   s  The buffer
+ * @param   n  The number of bytes in `s`
+ * @return     The number of leading ASCII bytes, rounded down to a
+ *             multiple of 64; may be smaller than the actual number
+ */
+__attribute__((pure, target("avx2")))
+static size_t ascii_blocks_avx2(const unsigned char* s, size_t n)
+{
+  typedef uint64_t v4u64 __attribute__((vector_size(32)));
+  v4u64 a, b;
+  const v4u64 high = { 0x8080808080808080ULL, 0x8080808080808080ULL,
+		       0x8080808080808080ULL, 0x8080808080808080ULL };
+  size_t i;
+  for (i = 0; i + 64 <= n; i += 64)
+    {
+      memcpy(&a, s + i +  0, 32);
+      memcpy(&b, s + i + 32, 32);
+      a = (a | b) & high;
+      if (a[0] | a[1] | a[2] | a[3])
+	break;
+    }
+  return i;
+}
+#endif /* HAVE_AVX2_DISPATCH */
+
+
+/**
+ * Get the number of leading bytes in a buffer that are ASCII,
+ * in whole 64-byte blocks, using the widest vectors available
+ * 
+ * @param   s  The buffer
+ * @param   n  The number of bytes in `s`
+ * @return     The number of leading ASCII bytes, rounded down to a
+ *             multiple of 64; may be smaller than the actual number
+ */
+static size_t ascii_blocks(const unsigned char* s, size_t n)
+{
+#ifdef HAVE_AVX2_DISPATCH
+  static int have_avx2 = -1;
+  if (n < 64)
+    return 0;
+  if (have_avx2 < 0)
+    {
+      __builtin_cpu_init();
+      have_avx2 = !!__builtin_cpu_supports("avx2");
+    }
+  if (have_avx2)
+    return ascii_blocks_avx2(s, n);
+#endif /* HAVE_AVX2_DISPATCH */
+  return ascii_blocks_generic(s, n);
+}
+
+
+/**
+ * Check whether a buffer is pure ASCII
+ * 
+ * @param   s  The buffer
+ * @param   n  The number of bytes in `s`
+ * @return     1 if `s` is pure ASCII, 0 otherwise
+ */
+static int is_ascii(const unsigned char* s, size_t n)
+{
+  size_t i = ascii_blocks(s, n);
+  for (; i < n; i++)
+    if (s[i] & 0x80)
+      return 0;
+  return 1;
+}
+
+
+/**
+ * Check whether a buffer is valid UTF-8
+ * 
+ * @param   str  The buffer
+ * @param   n    The number of bytes in `str`
+ * @return       1 if `str` is valid UTF-8, 0 otherwise
+ */
+int passphrase_utf8_valid__(const char* str, size_t n)
+{
+  const unsigned char* s = (const unsigned char*)str;
+  unsigned char c, lo, hi;
+  size_t i = 0, j, need, k;
+  
+  while (i < n)
+    {
+      c = s[i];
+      if (c < 0x80)
+	{
+	  /* Skip ASCII text a block at a time */
+	  k = ascii_blocks(s + i, n - i);
+	  i += k ? k : 1;
+	  continue;
+	}
+      
+      /* Reject continuation bytes without a leading byte, overlong
+	 encodings, surrogates, and code points above U+10FFFF */
+      lo = 0x80, hi = 0xBF;
+      if      (c < 0xC2)  return 0;
+      else if (c < 0xE0)  need = 1;
+      else if (c < 0xF0)  need = 2, lo = c == 0xE0 ? 0xA0 : 0x80, hi = c == 0xED ? 0x9F : 0xBF;
+      else if (c < 0xF5)  need = 3, lo = c == 0xF0 ? 0x90 : 0x80, hi = c == 0xF4 ? 0x8F : 0xBF;
+      else                return 0;
+      
+      if (n - i - 1 < need)
+	return 0;
+      if ((s[i + 1] < lo) || (s[i + 1] > hi))
+	return 0;
+      for (j = 2; j <= need; j++)
+	if ((s[i + j] & 0xC0) != 0x80)
+	  return 0;
+      i += need + 1;
+    }
+  return 1;
+}
+
+
+#ifdef PASSPHRASE_NORMALISE
+/**
+ * Normalise a valid UTF-8 passphrase, that is not pure ASCII
+ * 
+ * u8_normalize decomposes and composes the passphrase in memory
+ * it allocates itself, and does not wipe, so only the result
+ * is protected; normalising in place would need our own copy
+ * of the Unicode composition tables
+ * 
+ * @param   rcp    The passphrase, it may be replaced by a new allocation,
+ *                 in which case the old allocation is wiped and freed
+ * @param   lenp   The length of the passphrase, will be updated
+ * @param   sizep  The allocation size of the passphrase, will be updated
+ * @param   nf     The normalisation form
+ * @return         Zero on success, -1 on error
+ */
+static int normalise(char** rcp, size_t* lenp, size_t* sizep, uninorm_t nf)
+{
+  size_t size = *lenp * 3 + 1;
+  size_t n = size - 1;
+  uint8_t* buf;
+  uint8_t* r;
+  int saved_errno;
+  
+  /* Normalise into locked memory, that is large enough for
+     all but pathological cases, and copy back if it fits */
+  buf = passphrase_secret_alloc__(size);
+  if (buf == NULL)
+    return -1;
+  
+  r = u8_normalize(nf, (const uint8_t*)*rcp, *lenp, buf, &n);
+  if (r == NULL)
+    goto fail;
+  if (r != buf)
+    {
+      /* The result did not fit, and was allocated by libunistring */
+      passphrase_secret_free__(buf, size);
+      size = n + 1;
+      buf = passphrase_secret_alloc__(size);
+      if (buf == NULL)
+	{
+	  saved_errno = errno;
+	  passphrase_wipe((char*)r, n);
+	  free(r);
+	  errno = saved_errno;
+	  return -1;
+	}
+      memcpy(buf, r, n);
+      passphrase_wipe((char*)r, n);
+      free(r);
+    }
+  
+  if (n < *sizep)
+    {
+      memcpy(*rcp, buf, n);
+      if (n < *lenp)
+	passphrase_wipe(*rcp + n, *lenp - n);
+      passphrase_secret_free__(buf, size);
+    }
+  else
+    {
+      /* The passphrase may have been moved by `realloc`, so
+         its pages are not unlocked, they may not be its own */
+      passphrase_wipe(*rcp, *sizep);
+      free(*rcp);
+      *rcp = (char*)buf;
+      *sizep = size;
+    }
+  (*rcp)[n] = '\0';
+  *lenp = n;
+  return 0;
+  
+ fail:
+  saved_errno = errno;
+  passphrase_secret_free__(buf, size);
+  errno = saved_errno;
+  return -1;
+}
+#endif /* PASSPHRASE_NORMALISE */
+
+
+/**
+ * Validate and normalise a passphrase as requested
+ * with the flags given to `passphrase_read2`
+ * 
+ * @param   rcp    The passphrase, it may be replaced by a new allocation,
+ *                 in which case the old allocation is wiped and freed
+ * @param   lenp   The length of the passphrase, will be updated
+ * @param   sizep  The allocation size of the passphrase, will be updated
+ * @param   flags  The flags given to `passphrase_read2`
+ * @return         Zero on success, -1 on error; the passphrase
+ *                 must be wiped and freed by the caller in either case
+ */
+int passphrase_utf8_finalise__(char** rcp, size_t* lenp, size_t* sizep, int flags)
+{
+  int normalise_to = flags & (PASSPHRASE_READ_NFC | PASSPHRASE_READ_NFKC);
+  
+  if (!(flags & PASSPHRASE_READ_VALIDATE) && !normalise_to)
+    return 0;
+  
+  /* ASCII is valid UTF-8 and is not changed by normalisation */
+  if (is_ascii((const unsigned char*)*rcp, *lenp))
+    return 0;
+  
+  if (!passphrase_utf8_valid__(*rcp, *lenp))
+    return errno = EILSEQ, -1;
+  
+  if (!normalise_to)
+    return 0;
+#ifdef PASSPHRASE_NORMALISE
+  return normalise(rcp, lenp, sizep, (normalise_to & PASSPHRASE_READ_NFKC) ? UNINORM_NFKC : UNINORM_NFC);
+#else /* PASSPHRASE_NORMALISE */
+  return errno = ENOTSUP, -1;
+  (void) sizep;
+#endif /* PASSPHRASE_NORMALISE */
+}
+
@@ -0,0 +1,60 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+#include "meter.h"
+
+
+
+/**
+ * Check whether a buffer is valid UTF-8
+ * 
+ * @param   str  The buffer
+ * @param   n    The number of bytes in `str`
+ * @return       1 if `str` is valid UTF-8, 0 otherwise
+ */
+METER_INTERNAL
+int passphrase_utf8_valid__(const char* str, size_t n);
+
+/**
+ * Validate and normalise a passphrase as requested
+ * with the flags given to `passphrase_read2`
+ * 
+ * The result is normalised into locked memory, but libunistring's
+ * working memory, which holds the passphrase decomposed, is
+ * neither locked nor wiped
+ * 
+ * @param   rcp    The passphrase, it may be replaced by a new allocation,
+ *                 in which case the old allocation is wiped and freed
+ * @param   lenp   The length of the passphrase, will be updated
+ * @param   sizep  The allocation size of the passphrase, will be updated
+ * @param   flags  The flags given to `passphrase_read2`
+ * @return         Zero on success, -1 on error; the passphrase
+ *                 must be wiped and freed by the caller in either case
+ */
+METER_INTERNAL
+int passphrase_utf8_finalise__(char** rcp, size_t* lenp, size_t* sizep, int flags);
+
+
+
+#endif
+
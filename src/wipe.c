@@ -17,10 +17,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #define PASSPHRASE_USE_DEPRECATED
 #include "passphrase.h"
 #include "passphrase_helper.h"
+#include "wipe.h"
 
 
 
@@ -73,3 +78,63 @@ void passphrase_wipe1(char* ptr)
 # pragma GCC diagnostic pop
 #endif
 
+
+
+/**
+ * Round an allocation size up to whole pages
+ * 
+ * @param   size  The number of bytes
+ * @return        The number of bytes in the pages
+ *                needed, at least one page
+ */
+static size_t secret_size(size_t size)
+{
+  static size_t page = 0;
+  long int n;
+  if (page == 0)
+    {
+      n = sysconf(_SC_PAGESIZE);
+      page = n > 0 ? (size_t)n : 4096;
+    }
+  return size ? (size + page - 1) / page * page : page;
+}
+
+
+/**
+ * Allocate memory for a secret, in whole pages that nothing else
+ * uses, and try to lock it into memory so it cannot be swapped out;
+ * failure to lock is ignored as `RLIMIT_MEMLOCK` may be very small
+ * 
+ * @param   size  The number of bytes to allocate
+ * @return        The allocation, `NULL` on error
+ */
+void* passphrase_secret_alloc__(size_t size)
+{
+  size_t pages = secret_size(size);
+  void* ptr;
+  int error = posix_memalign(&ptr, secret_size(1), pages);
+  if (error)
+    {
+      errno = error;
+      return NULL;
+    }
+  mlock(ptr, pages);
+  return ptr;
+}
+
+
+/**
+ * Wipe, unlock, and free memory allocated with `passphrase_secret_alloc__`
+ * 
+ * @param  ptr   The allocation, may be `NULL`
+ * @param  size  The number of bytes that were requested
+ */
+void passphrase_secret_free__(void* ptr, size_t size)
+{
+  size_t pages = secret_size(size);
+  if (ptr == NULL)
+    return;
+  passphrase_wipe(ptr, pages);
+  munlock(ptr, pages);
+  free(ptr);
+}
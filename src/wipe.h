@@ -0,0 +1,53 @@
+/**
+ * libpassphrase – Personalisable library for TTY passphrase reading
+ * 
+ * Copyright © 2013, 2014, 2015  Mattias Andrée (maandree@member.fsf.org)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WIPE_H
+#define WIPE_H
+
+#include <stddef.h>
+
+#include "meter.h"
+
+
+
+/**
+ * Allocate memory for a secret, in whole pages that nothing else
+ * uses, and try to lock it into memory so it cannot be swapped out;
+ * failure to lock is ignored as `RLIMIT_MEMLOCK` may be very small
+ * 
+ * Because the pages are not shared, they can be unlocked when
+ * the secret is freed without unlocking another allocation
+ * 
+ * @param   size  The number of bytes to allocate
+ * @return        The allocation, `NULL` on error
+ */
+METER_INTERNAL
+void* passphrase_secret_alloc__(size_t size);
+
+/**
+ * Wipe, unlock, and free memory allocated with `passphrase_secret_alloc__`
+ * 
+ * @param  ptr   The allocation, may be `NULL`
+ * @param  size  The number of bytes that were requested
+ */
+METER_INTERNAL
+void passphrase_secret_free__(void* ptr, size_t size);
+
+
+
+#endif
@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# Builds the library with every combination of options, or with
+# arguments, makes those targets, for example `syscalls`, instead
+
 for a in PASSPHRASE_ECHO PASSPHRASE_STAR PASSPHRASE_TEXT ""; do
     for b in PASSPHRASE_REALLOC ""; do
 	for c in PASSPHRASE_MOVE ""; do
@@ -10,7 +13,7 @@ for a in PASSPHRASE_ECHO PASSPHRASE_STAR PASSPHRASE_TEXT ""; do
 			    for h in PASSPHRASE_DEDICATED ""; do
 				for i in DEFAULT_INSERT ""; do
 				    for j in PASSPHRASE_METER ""; do
-					make libpassphrase -B OPTIONS="$a $b $c $d $e $f $g $h $i $j" || exit 1
+					make "${@:-libpassphrase}" -B OPTIONS="$a $b $c $d $e $f $g $h $i $j" || exit 1
 				    done
 				done
 			    done